@@ -37,14 +37,18 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
+#include <time.h>
 #include <netinet/in.h>
 
 #define __STDC_FORMAT_MACROS
 #include <inttypes.h>
 
 #include <infiniband/mad.h>
+#include <infiniband/ibnetdisc.h>
 
 #include "ibdiag_common.h"
+#include "ibdiag_pipeline.h"
 
 static struct ibmad_port *srcport;
 static struct ibmad_ports_pair *srcports;
@@ -336,12 +340,342 @@ static const char *timestamp_dump(ib_portid_t *dest, char **argv, int argc)
 	return NULL;
 }
 
+/*
+ * --fabric mode: collect the CC state and PortXmitWait of every switch and
+ * CA port with a window of outstanding queries and print one JSON snapshot.
+ */
+struct cc_result {
+	int status;		/* -1 until answered, then 0 or an errno */
+	int offs;
+	uint8_t data[IB_MAD_SIZE];
+};
+
+struct cc_target {
+	ibnd_node_t *node;
+	int port;		/* CA port, 0 for a switch */
+	ib_portid_t portid;
+	struct cc_result info;
+	struct cc_result setting;
+	struct cc_result cct;
+	struct cc_result pma_cpi;
+	struct cc_result *port_setting;	/* switches: 48 ports per block */
+	int num_blocks;
+	struct cc_result *counters;	/* indexed by port number */
+};
+
+static struct {
+	struct cc_target *targets;
+	unsigned num, max;
+} cc_fabric;
+
+static int outstanding = 32;
+
+static void cc_result_done(void *context, int status, uint8_t *mad)
+{
+	struct cc_result *r = context;
+
+	r->status = status;
+	if (!status)
+		memcpy(r->data, mad + r->offs, IB_MAD_SIZE - r->offs);
+}
+
+static void post_cc(struct ibd_pipeline *pipe, struct cc_target *t,
+		    unsigned attr, unsigned mod, struct cc_result *r)
+{
+	ib_rpc_cc_t rpc;
+
+	r->status = -1;
+	r->offs = IB_CC_DATA_OFFS;
+	cc_rpc_init(&rpc, &t->portid, IB_MAD_METHOD_GET, attr, mod,
+		    ibd_timeout, cckey);
+	if (ibd_pipeline_post(pipe, (ib_rpc_t *)&rpc, &t->portid, NULL,
+			      cc_result_done, r))
+		r->status = ENOMEM;
+}
+
+static void post_pma(struct ibd_pipeline *pipe, struct cc_target *t,
+		     unsigned attr, int port, struct cc_result *r)
+{
+	uint8_t data[IB_PC_DATA_SZ] = { 0 };
+	ib_rpc_t rpc = { 0 };
+
+	r->status = -1;
+	r->offs = IB_PC_DATA_OFFS;
+	rpc.mgtclass = IB_PERFORMANCE_CLASS;
+	rpc.method = IB_MAD_METHOD_GET;
+	rpc.attr.id = attr;
+	rpc.timeout = ibd_timeout;
+	rpc.datasz = IB_PC_DATA_SZ;
+	rpc.dataoffs = IB_PC_DATA_OFFS;
+	mad_set_field(data, 0, IB_PC_PORT_SELECT_F, port);
+	if (ibd_pipeline_post(pipe, &rpc, &t->portid, data, cc_result_done, r))
+		r->status = ENOMEM;
+}
+
+static struct cc_target *add_target(ibnd_node_t *node, int port, int lid)
+{
+	struct cc_target *t;
+
+	if (cc_fabric.num == cc_fabric.max) {
+		cc_fabric.max = cc_fabric.max ? cc_fabric.max * 2 : 64;
+		cc_fabric.targets = realloc(cc_fabric.targets, cc_fabric.max *
+					    sizeof(*cc_fabric.targets));
+		if (!cc_fabric.targets)
+			IBEXIT("out of memory");
+	}
+	t = &cc_fabric.targets[cc_fabric.num++];
+	memset(t, 0, sizeof(*t));
+	t->node = node;
+	t->port = port;
+	ib_portid_set(&t->portid, lid, 1, IB_DEFAULT_QP1_QKEY);
+	return t;
+}
+
+static int port_is_up(ibnd_port_t *port)
+{
+	return port && mad_get_field(port->info, 0, IB_PORT_STATE_F) !=
+	    IB_LINK_DOWN;
+}
+
+static void add_fabric_node(ibnd_node_t *node, void *user_data)
+{
+	struct cc_target *t;
+	int i;
+
+	if (node->type == IB_NODE_SWITCH) {
+		if (!node->smalid)
+			return;
+		t = add_target(node, 0, node->smalid);
+		t->num_blocks = node->numports / 48 + 1;
+		t->port_setting = calloc(t->num_blocks,
+					 sizeof(*t->port_setting));
+		t->counters = calloc(node->numports + 1, sizeof(*t->counters));
+		if (!t->port_setting || !t->counters)
+			IBEXIT("out of memory");
+		return;
+	}
+
+	for (i = 1; i <= node->numports; i++) {
+		if (!port_is_up(node->ports[i]) || !node->ports[i]->base_lid)
+			continue;
+		t = add_target(node, i, node->ports[i]->base_lid);
+		t->counters = calloc(i + 1, sizeof(*t->counters));
+		if (!t->counters)
+			IBEXIT("out of memory");
+	}
+}
+
+static void post_target(struct ibd_pipeline *pipe, struct cc_target *t)
+{
+	ibnd_node_t *node = t->node;
+	int i;
+
+	post_cc(pipe, t, IB_CC_ATTR_CONGESTION_INFO, 0, &t->info);
+	post_pma(pipe, t, CLASS_PORT_INFO, 0, &t->pma_cpi);
+
+	if (node->type == IB_NODE_SWITCH) {
+		post_cc(pipe, t, IB_CC_ATTR_SWITCH_CONGESTION_SETTING, 0,
+			&t->setting);
+		for (i = 0; i < t->num_blocks; i++)
+			post_cc(pipe, t,
+				IB_CC_ATTR_SWITCH_PORT_CONGESTION_SETTING, i,
+				&t->port_setting[i]);
+		for (i = 1; i <= node->numports; i++)
+			if (port_is_up(node->ports[i]))
+				post_pma(pipe, t, IB_GSI_PORT_COUNTERS, i,
+					 &t->counters[i]);
+	} else {
+		post_cc(pipe, t, IB_CC_ATTR_CA_CONGESTION_SETTING, 0,
+			&t->setting);
+		post_cc(pipe, t, IB_CC_ATTR_CONGESTION_CONTROL_TABLE, 0,
+			&t->cct);
+		post_pma(pipe, t, IB_GSI_PORT_COUNTERS, t->port,
+			 &t->counters[t->port]);
+	}
+}
+
+static void json_string(const char *s)
+{
+	putchar('"');
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\')
+			printf("\\%c", *s);
+		else if ((unsigned char)*s < 0x20)
+			printf("\\u%04x", *s);
+		else
+			putchar(*s);
+	}
+	putchar('"');
+}
+
+/* prints the fields [first, last) of data as a JSON object */
+static void json_fields(const char *name, struct cc_result *r, uint8_t *data,
+			enum MAD_FIELDS first, enum MAD_FIELDS last)
+{
+	enum MAD_FIELDS f;
+	uint8_t mask[32];
+	unsigned i;
+
+	printf(", \"%s\": ", name);
+	if (r->status) {
+		printf("null");
+		return;
+	}
+
+	printf("{");
+	for (f = first; f < last; f++) {
+		printf("%s\"%s\": ", f == first ? "" : ", ", mad_field_name(f));
+		if (f == IB_CC_SWITCH_CONGESTION_SETTING_VICTIM_MASK_F ||
+		    f == IB_CC_SWITCH_CONGESTION_SETTING_CREDIT_MASK_F) {
+			mad_decode_field(data, f, mask);
+			printf("\"0x");
+			for (i = 0; i < sizeof(mask); i++)
+				printf("%02x", mask[i]);
+			printf("\"");
+		} else
+			printf("%u", mad_get_field(data, 0, f));
+	}
+	printf("}");
+}
+
+static void json_xmit_wait(struct cc_target *t, int port)
+{
+	__be16 cap_mask;
+
+	memcpy(&cap_mask, t->pma_cpi.data + 2, sizeof(cap_mask));
+	if (t->pma_cpi.status || t->counters[port].status ||
+	    !(cap_mask & IB_PM_PC_XMIT_WAIT_SUP))
+		printf(", \"PortXmitWait\": null");
+	else
+		printf(", \"PortXmitWait\": %u",
+		       mad_get_field(t->counters[port].data, 0,
+				     IB_PC_XMT_WAIT_F));
+}
+
+static void print_switch(struct cc_target *t)
+{
+	ibnd_node_t *node = t->node;
+	struct cc_result *r;
+	int i, first = 1;
+
+	json_fields("SwitchCongestionSetting", &t->setting, t->setting.data,
+		    IB_CC_SWITCH_CONGESTION_SETTING_FIRST_F,
+		    IB_CC_SWITCH_CONGESTION_SETTING_LAST_F);
+
+	printf(", \"ports\": [");
+	for (i = 1; i <= node->numports; i++) {
+		if (!port_is_up(node->ports[i]))
+			continue;
+		printf("%s{\"port\": %d", first ? "" : ", ", i);
+		first = 0;
+		json_xmit_wait(t, i);
+		r = &t->port_setting[i / 48];
+		json_fields("SwitchPortCongestionSetting", r,
+			    r->data + (i % 48) * 4,
+			    IB_CC_SWITCH_PORT_CONGESTION_SETTING_ELEMENT_FIRST_F,
+			    IB_CC_SWITCH_PORT_CONGESTION_SETTING_ELEMENT_LAST_F);
+		printf("}");
+	}
+	printf("]");
+}
+
+static void print_ca(struct cc_target *t)
+{
+	struct cc_result sl = { 0 };
+	int i;
+
+	printf(", \"port\": %d", t->port);
+	json_xmit_wait(t, t->port);
+	json_fields("CACongestionSetting", &t->setting, t->setting.data,
+		    IB_CC_CA_CONGESTION_SETTING_FIRST_F,
+		    IB_CC_CA_CONGESTION_SETTING_LAST_F);
+	if (!t->setting.status) {
+		printf(", \"CACongestionEntries\": [");
+		for (i = 0; i < 16; i++) {
+			printf("%s{\"SL\": %d", i ? ", " : "", i);
+			json_fields("Entry", &sl, t->setting.data + 4 + i * 8,
+				    IB_CC_CA_CONGESTION_ENTRY_FIRST_F,
+				    IB_CC_CA_CONGESTION_ENTRY_LAST_F);
+			printf("}");
+		}
+		printf("]");
+	}
+	json_fields("CongestionControlTable", &t->cct, t->cct.data,
+		    IB_CC_CONGESTION_CONTROL_TABLE_FIRST_F,
+		    IB_CC_CONGESTION_CONTROL_TABLE_LAST_F);
+}
+
+static void cc_fabric_collect(void)
+{
+	struct ibnd_config config = { 0 };
+	struct ibd_pipeline *pipe;
+	ibnd_fabric_t *fabric;
+	uint64_t sent, failed;
+	struct cc_target *t;
+	unsigned i;
+	int rc;
+
+	config.mkey = ibd_mkey;
+	config.timeout_ms = ibd_timeout;
+	config.flags = ibd_ibnetdisc_flags;
+	fabric = ibnd_discover_fabric(ibd_ca, ibd_ca_port, NULL, &config);
+	if (!fabric)
+		IBEXIT("discover failed");
+	ibnd_iter_nodes(fabric, add_fabric_node, NULL);
+
+	pipe = ibd_pipeline_create(srcport, outstanding, ibd_timeout);
+	if (!pipe)
+		IBEXIT("cannot create MAD pipeline: %s", strerror(errno));
+	for (i = 0; i < cc_fabric.num; i++)
+		post_target(pipe, &cc_fabric.targets[i]);
+	if ((rc = ibd_pipeline_flush(pipe)))
+		IBEXIT("cannot receive MADs: %s", strerror(rc));
+	ibd_pipeline_stats(pipe, &sent, &failed);
+	ibd_pipeline_destroy(pipe);
+
+	printf("{\"timestamp\": %ld, \"queries\": %" PRIu64
+	       ", \"failed\": %" PRIu64 ", \"nodes\": [\n",
+	       (long)time(NULL), sent, failed);
+	for (i = 0; i < cc_fabric.num; i++) {
+		t = &cc_fabric.targets[i];
+		printf("  {\"type\": \"%s\", \"guid\": \"0x%016" PRIx64
+		       "\", \"lid\": %d, \"description\": ",
+		       t->node->type == IB_NODE_SWITCH ? "switch" : "ca",
+		       t->node->guid, t->portid.lid);
+		json_string((char *)t->node->nodedesc);
+		json_fields("CongestionInfo", &t->info, t->info.data,
+			    IB_CC_CONGESTION_INFO_FIRST_F,
+			    IB_CC_CONGESTION_INFO_LAST_F);
+		if (t->node->type == IB_NODE_SWITCH)
+			print_switch(t);
+		else
+			print_ca(t);
+		printf("}%s\n", i + 1 < cc_fabric.num ? "," : "");
+		free(t->port_setting);
+		free(t->counters);
+	}
+	printf("]}\n");
+
+	free(cc_fabric.targets);
+	ibnd_destroy_fabric(fabric);
+}
+
+static int fabric_mode;
+
 static int process_opt(void *context, int ch)
 {
 	switch (ch) {
 	case 'c':
 		cckey = (uint64_t) strtoull(optarg, NULL, 0);
 		break;
+	case 1:
+		fabric_mode = 1;
+		break;
+	case 2:
+		outstanding = strtol(optarg, NULL, 0);
+		if (outstanding <= 0 || outstanding > UINT16_MAX)
+			return -1;
+		break;
 	default:
 		return -1;
 	}
@@ -351,21 +685,25 @@ static int process_opt(void *context, int ch)
 int main(int argc, char **argv)
 {
 	char usage_args[1024];
-	int mgmt_classes[3] = { IB_SMI_CLASS, IB_SA_CLASS, IB_CC_CLASS };
+	int mgmt_classes[4] = { IB_SMI_CLASS, IB_SA_CLASS, IB_CC_CLASS,
+				IB_PERFORMANCE_CLASS };
 	ib_portid_t portid = { 0 };
 	const char *err;
-	op_fn_t *fn;
+	op_fn_t *fn = NULL;
 	const match_rec_t *r;
 	int n;
 
 	const struct ibdiag_opt opts[] = {
 		{"cckey", 'c', 1, "<key>", "CC key"},
+		{"fabric", 1, 0, NULL, "collect CC state of all switches and CAs as JSON"},
+		{"outstanding_mads", 2, 1, "<n>", "number of outstanding queries with --fabric (default 32)"},
 		{}
 	};
 	const char *usage_examples[] = {
 		"CongestionInfo 3\t\t\t# Congestion Info by lid",
 		"SwitchPortCongestionSetting 3\t# Query all Switch Port Congestion Settings",
 		"SwitchPortCongestionSetting 3 1\t# Query Switch Port Congestion Setting for port 1",
+		"--fabric\t\t\t\t# Snapshot CC state and PortXmitWait of the fabric",
 		NULL
 	};
 
@@ -386,13 +724,13 @@ int main(int argc, char **argv)
 	argc -= optind;
 	argv += optind;
 
-	if (argc < 2)
+	if (fabric_mode ? argc != 0 : argc < 2)
 		ibdiag_show_usage();
 
-	if (!(fn = match_op(match_tbl, argv[0])))
+	if (!fabric_mode && !(fn = match_op(match_tbl, argv[0])))
 		IBEXIT("operation '%s' not supported", argv[0]);
 
-	srcports = mad_rpc_open_port2(ibd_ca, ibd_ca_port, mgmt_classes, 3, 0);
+	srcports = mad_rpc_open_port2(ibd_ca, ibd_ca_port, mgmt_classes, 4, 0);
 	if (!srcports)
 		IBEXIT("Failed to open '%s' port '%d'", ibd_ca, ibd_ca_port);
 
@@ -402,12 +740,18 @@ int main(int argc, char **argv)
 
 	smp_mkey_set(srcports->smi.port, ibd_mkey);
 
+	if (fabric_mode) {
+		cc_fabric_collect();
+		goto done;
+	}
+
 	if (resolve_portid_str(srcports->gsi.ca_name, ibd_ca_port, &portid, argv[1],
 			       ibd_dest_type, ibd_sm_id, srcport) < 0)
 		IBEXIT("can't resolve destination %s", argv[1]);
 	if ((err = fn(&portid, argv + 2, argc - 2)))
 		IBEXIT("operation %s: %s", argv[0], err);
 
+done:
 	mad_rpc_close_port2(srcports);
 	exit(0);
 }
@@ -58,6 +58,7 @@
 #include <infiniband/umad.h>
 #include <infiniband/mad.h>
 #include <ibdiag_common.h>
+#include <ibdiag_daemon.h>
 
 int ibverbose;
 enum MAD_DEST ibd_dest_type = IB_DEST_LID;
@@ -167,6 +168,10 @@ static void read_ibdiag_config(const char *file)
 			if (ibd_nd_format)
 				free(ibd_nd_format);
 			ibd_nd_format = strdup(val_str);
+		} else if (strncmp(name, "daemon_socket",
+				   strlen("daemon_socket")) == 0) {
+			free(ibd_daemon_socket);
+			ibd_daemon_socket = strdup(val_str);
 		}
 	}
 
@@ -506,7 +511,7 @@ int is_port_info_extended_supported(ib_portid_t * dest, int port,
 	uint16_t cap_mask2;
 	int type, portnum;
 
-	if (!smp_query_via(data, dest, IB_ATTR_NODE_INFO, 0, 0, srcport))
+	if (!ibd_smp_query(data, dest, IB_ATTR_NODE_INFO, 0, 0, srcport))
 		IBEXIT("node info query failed");
 
 	mad_decode_field(data, IB_NODE_TYPE_F, &type);
@@ -515,7 +520,7 @@ int is_port_info_extended_supported(ib_portid_t * dest, int port,
 	else
 		portnum = port;
 
-	if (!smp_query_via(data, dest, IB_ATTR_PORT_INFO, portnum, 0, srcport))
+	if (!ibd_smp_query(data, dest, IB_ATTR_PORT_INFO, portnum, 0, srcport))
 		IBEXIT("port info query failed");
 
 	mad_decode_field(data, IB_PORT_CAPMASK_F, &cap_mask);
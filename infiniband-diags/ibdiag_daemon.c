@@ -0,0 +1,230 @@
+/*
+ * Copyright (c) 2025 SuperLinear Lab.  All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * OpenIB.org BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+
+/*
+ * Client side of ibdiagd, the optional daemon which caches and coalesces
+ * the MAD queries of the diag tools.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <infiniband/umad.h>
+#include <infiniband/mad.h>
+
+#include "ibdiag_common.h"
+#include "ibdiag_daemon.h"
+
+/* Slack for the daemon's own queueing on top of the MAD timeouts */
+#define DAEMON_REPLY_MARGIN_MS 1000
+
+char *ibd_daemon_socket = NULL;
+
+static int daemon_fd = -1;
+static int daemon_down;
+static uint32_t daemon_tag;
+
+static int daemon_connect(void)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+	if (daemon_fd >= 0)
+		return 0;
+	if (daemon_down || !ibd_daemon_socket)
+		return -1;
+
+	if (strlen(ibd_daemon_socket) >= sizeof(addr.sun_path)) {
+		IBWARN("daemon socket path too long: %s", ibd_daemon_socket);
+		goto err;
+	}
+	strcpy(addr.sun_path, ibd_daemon_socket);
+
+	daemon_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (daemon_fd < 0)
+		goto err;
+
+	if (connect(daemon_fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		if (ibverbose)
+			IBWARN("ibdiagd not reachable at %s: %m; "
+			       "querying directly", ibd_daemon_socket);
+		close(daemon_fd);
+		daemon_fd = -1;
+		goto err;
+	}
+	return 0;
+err:
+	daemon_down = 1;
+	return -1;
+}
+
+/*
+ * Returns 0 when the daemon answered (the query result is in resp->status),
+ * -1 if the query must be sent directly.
+ */
+static int daemon_query(struct ibdiagd_req *req, struct ibdiagd_resp *resp,
+			const struct ibmad_port *srcport)
+{
+	struct pollfd pfd;
+	int wait_ms, rc;
+	ssize_t n;
+
+	if (daemon_connect())
+		return -1;
+
+	req->version = IBDIAGD_VERSION;
+	req->tag = ++daemon_tag;
+	req->ca_port = ibd_ca_port;
+	if (ibd_ca)
+		strncpy(req->ca_name, ibd_ca, sizeof(req->ca_name) - 1);
+
+	if (send(daemon_fd, req, sizeof(*req), MSG_NOSIGNAL) != sizeof(*req))
+		goto err;
+
+	/*
+	 * The daemon drops replies it cannot send, so never wait longer
+	 * than it could take to answer; go direct instead.
+	 */
+	wait_ms = mad_get_timeout(srcport, req->timeout) *
+		  (MAD_DEF_RETRIES + 1) + DAEMON_REPLY_MARGIN_MS;
+	pfd.fd = daemon_fd;
+	pfd.events = POLLIN;
+	do {
+		rc = poll(&pfd, 1, wait_ms);
+	} while (rc < 0 && errno == EINTR);
+	if (rc <= 0) {
+		if (!rc)
+			IBWARN("no reply from ibdiagd in %d ms", wait_ms);
+		goto err;
+	}
+
+	do {
+		n = recv(daemon_fd, resp, sizeof(*resp), MSG_DONTWAIT);
+	} while (n < 0 && errno == EINTR);
+	if (n != sizeof(*resp) || resp->version != IBDIAGD_VERSION ||
+	    resp->tag != req->tag)
+		goto err;
+
+	if (resp->flags & IBDIAGD_F_REJECTED)
+		return -1;
+	return 0;
+err:
+	IBWARN("lost connection to ibdiagd; querying directly");
+	close(daemon_fd);
+	daemon_fd = -1;
+	daemon_down = 1;
+	return -1;
+}
+
+static void portid_to_key(const ib_portid_t *portid, struct ibdiagd_key *key)
+{
+	key->lid = portid->lid > 0 ? portid->lid : 0;
+	key->drslid = portid->drpath.drslid;
+	key->drdlid = portid->drpath.drdlid;
+	key->drcnt = portid->drpath.cnt;
+	memcpy(key->drpath, portid->drpath.p, sizeof(key->drpath));
+}
+
+uint8_t *ibd_smp_query(void *rcvbuf, ib_portid_t *portid, unsigned attrid,
+		       unsigned mod, unsigned timeout,
+		       const struct ibmad_port *srcport)
+{
+	struct ibdiagd_req req = {};
+	struct ibdiagd_resp resp;
+
+	if (!ibd_daemon_socket || !srcport || smp_mkey_get(srcport))
+		return smp_query_via(rcvbuf, portid, attrid, mod, timeout,
+				     srcport);
+
+	if ((portid->lid <= 0) ||
+	    (portid->drpath.drslid == 0xffff) ||
+	    (portid->drpath.drdlid == 0xffff))
+		req.key.mgmt_class = IB_SMI_DIRECT_CLASS;
+	else
+		req.key.mgmt_class = IB_SMI_CLASS;
+	req.key.attr_id = attrid;
+	req.key.attr_mod = mod;
+	req.timeout = timeout;
+	portid_to_key(portid, &req.key);
+
+	if (daemon_query(&req, &resp, srcport))
+		return smp_query_via(rcvbuf, portid, attrid, mod, timeout,
+				     srcport);
+
+	portid->sl = 0;
+	portid->qp = 0;
+	if (resp.status) {
+		errno = resp.status;
+		return NULL;
+	}
+	memcpy(rcvbuf, resp.mad + IB_SMP_DATA_OFFS, IB_SMP_DATA_SIZE);
+	return rcvbuf;
+}
+
+uint8_t *ibd_pma_query(void *rcvbuf, ib_portid_t *dest, int port,
+		       unsigned timeout, unsigned id,
+		       const struct ibmad_port *srcport)
+{
+	struct ibdiagd_req req = {};
+	struct ibdiagd_resp resp;
+
+	if (!ibd_daemon_socket || !srcport || dest->lid <= 0)
+		return pma_query_via(rcvbuf, dest, port, timeout, id, srcport);
+
+	req.key.mgmt_class = IB_PERFORMANCE_CLASS;
+	req.key.attr_id = id;
+	req.key.attr_mod = port;
+	req.key.lid = dest->lid;
+	req.timeout = timeout;
+
+	if (daemon_query(&req, &resp, srcport))
+		return pma_query_via(rcvbuf, dest, port, timeout, id, srcport);
+
+	if (!dest->qp)
+		dest->qp = 1;
+	if (!dest->qkey)
+		dest->qkey = IB_DEFAULT_QP1_QKEY;
+	if (resp.status) {
+		errno = resp.status;
+		return NULL;
+	}
+	memcpy(rcvbuf, resp.mad + IB_PC_DATA_OFFS, IB_PC_DATA_SZ);
+	return rcvbuf;
+}
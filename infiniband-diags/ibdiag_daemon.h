@@ -0,0 +1,103 @@
+/*
+ * Copyright (c) 2025 SuperLinear Lab.  All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * OpenIB.org BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+
+#ifndef _IBDIAG_DAEMON_H_
+#define _IBDIAG_DAEMON_H_
+
+#include <stdint.h>
+#include <infiniband/umad.h>
+#include <infiniband/mad.h>
+
+/*
+ * Protocol spoken over the ibdiagd UNIX (SOCK_SEQPACKET) socket.  Every
+ * request is answered by exactly one response carrying the same tag.
+ * Only GET queries are served; everything else goes to the wire directly.
+ * SMPs are sent with the daemon's own M_Key, clients that need another
+ * one query directly.
+ */
+#define IBDIAGD_VERSION 2
+
+/* identifies a query; identical keys are coalesced and cached */
+struct ibdiagd_key {
+	uint8_t mgmt_class;
+	uint8_t drcnt;
+	uint16_t attr_id;
+	uint32_t attr_mod;	/* PortSelect for IB_PERFORMANCE_CLASS */
+	uint16_t lid;
+	uint16_t drslid;
+	uint16_t drdlid;
+	uint16_t rsvd;
+	uint8_t drpath[IB_SUBNET_PATH_HOPS_MAX];
+};
+
+struct ibdiagd_req {
+	uint8_t version;
+	uint8_t ca_port;	/* 0 for the daemon's port */
+	uint16_t rsvd;
+	uint32_t tag;
+	uint32_t timeout;	/* ms, 0 for the daemon's default */
+	uint32_t rsvd2;
+	char ca_name[UMAD_CA_NAME_LEN];	/* empty for the daemon's CA */
+	struct ibdiagd_key key;
+};
+
+#define IBDIAGD_F_CACHED	(1 << 0)	/* served from the cache */
+#define IBDIAGD_F_REJECTED	(1 << 1)	/* not served, query directly */
+
+struct ibdiagd_resp {
+	uint8_t version;
+	uint8_t flags;
+	uint16_t rsvd;
+	uint32_t tag;
+	int32_t status;		/* 0 or errno of the query */
+	uint32_t rsvd2;
+	uint8_t mad[IB_MAD_SIZE];
+};
+
+/* path of the daemon socket; NULL when the daemon is not used */
+extern char *ibd_daemon_socket;
+
+/*
+ * Drop in replacements for smp_query_via and pma_query_via which are
+ * answered by ibdiagd when ibd_daemon_socket is set and fall back to
+ * querying through srcport otherwise.
+ */
+uint8_t *ibd_smp_query(void *rcvbuf, ib_portid_t *portid, unsigned attrid,
+		       unsigned mod, unsigned timeout,
+		       const struct ibmad_port *srcport);
+uint8_t *ibd_pma_query(void *rcvbuf, ib_portid_t *dest, int port,
+		       unsigned timeout, unsigned id,
+		       const struct ibmad_port *srcport);
+
+#endif				/* _IBDIAG_DAEMON_H_ */
@@ -0,0 +1,272 @@
+/*
+ * Copyright (c) 2025 SuperLinear Lab.  All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * OpenIB.org BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <infiniband/umad.h>
+#include <infiniband/mad.h>
+#include <ccan/list.h>
+
+#include "ibdiag_common.h"
+#include "ibdiag_pipeline.h"
+
+#define PIPE_UMAD_SIZE (sizeof(struct ib_user_mad) + IB_MAD_SIZE)
+
+struct pipe_req {
+	struct list_node entry;
+	int agent;
+	uint32_t trid;
+	ibd_pipeline_cb_t cb;
+	void *context;
+	uint8_t umad[PIPE_UMAD_SIZE];
+};
+
+struct ibd_pipeline {
+	struct ibmad_port *port;
+	int fd;
+	int timeout;
+	int retries;
+	unsigned window;
+	unsigned inflight;
+	uint16_t generation;
+	struct list_head queue;
+	/* in flight requests, indexed by the low 16 bits of their TID */
+	struct pipe_req **slots;
+	unsigned *free_slots;
+	unsigned nfree;
+	uint64_t sent;
+	uint64_t failed;
+	uint8_t *recv_umad;
+};
+
+struct ibd_pipeline *ibd_pipeline_create(struct ibmad_port *port,
+					 unsigned window, int timeout)
+{
+	struct ibd_pipeline *pipe;
+	unsigned i;
+
+	if (!window || window > UINT16_MAX + 1) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	pipe = calloc(1, sizeof(*pipe));
+	if (!pipe)
+		return NULL;
+
+	pipe->slots = calloc(window, sizeof(*pipe->slots));
+	pipe->free_slots = calloc(window, sizeof(*pipe->free_slots));
+	pipe->recv_umad = calloc(1, PIPE_UMAD_SIZE);
+	if (!pipe->slots || !pipe->free_slots || !pipe->recv_umad) {
+		ibd_pipeline_destroy(pipe);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	pipe->port = port;
+	pipe->fd = mad_rpc_portid(port);
+	pipe->timeout = timeout > 0 ? timeout : MAD_DEF_TIMEOUT_MS;
+	pipe->retries = mad_get_retries(port);
+	pipe->window = window;
+	list_head_init(&pipe->queue);
+	for (i = 0; i < window; i++)
+		pipe->free_slots[pipe->nfree++] = window - 1 - i;
+	return pipe;
+}
+
+void ibd_pipeline_destroy(struct ibd_pipeline *pipe)
+{
+	struct pipe_req *req;
+	unsigned i;
+
+	if (!pipe)
+		return;
+
+	while ((req = list_pop(&pipe->queue, struct pipe_req, entry)))
+		free(req);
+	if (pipe->slots)
+		for (i = 0; i < pipe->window; i++)
+			free(pipe->slots[i]);
+	free(pipe->slots);
+	free(pipe->free_slots);
+	free(pipe->recv_umad);
+	free(pipe);
+}
+
+static void complete_req(struct ibd_pipeline *pipe, struct pipe_req *req,
+			 int status, uint8_t *mad)
+{
+	if (status)
+		pipe->failed++;
+	req->cb(req->context, status, mad);
+	free(req);
+}
+
+static void send_queued(struct ibd_pipeline *pipe)
+{
+	struct pipe_req *req;
+	unsigned slot;
+
+	while (pipe->nfree &&
+	       (req = list_pop(&pipe->queue, struct pipe_req, entry))) {
+		slot = pipe->free_slots[--pipe->nfree];
+		/* the kernel owns the upper 32 bits of the TID */
+		req->trid = (uint32_t)pipe->generation++ << 16 | slot;
+		mad_set_field64(umad_get_mad(req->umad), 0, IB_MAD_TRID_F,
+				req->trid);
+
+		if (umad_send(pipe->fd, req->agent, req->umad, IB_MAD_SIZE,
+			      pipe->timeout, pipe->retries) < 0) {
+			IBWARN("umad_send failed: %s", strerror(errno));
+			pipe->free_slots[pipe->nfree++] = slot;
+			complete_req(pipe, req, EIO, NULL);
+			continue;
+		}
+		pipe->slots[slot] = req;
+		pipe->inflight++;
+		pipe->sent++;
+	}
+}
+
+int ibd_pipeline_post(struct ibd_pipeline *pipe, ib_rpc_t *rpc,
+		      ib_portid_t *portid, void *data, ibd_pipeline_cb_t cb,
+		      void *context)
+{
+	struct pipe_req *req;
+
+	req = calloc(1, sizeof(*req));
+	if (!req)
+		return ENOMEM;
+
+	req->agent = mad_rpc_class_agent(pipe->port, rpc->mgtclass & 0xff);
+	if (req->agent < 0) {
+		free(req);
+		return EINVAL;
+	}
+	if (mad_build_pkt(req->umad, rpc, portid, NULL, data) < 0) {
+		free(req);
+		return EINVAL;
+	}
+	req->cb = cb;
+	req->context = context;
+
+	list_add_tail(&pipe->queue, &req->entry);
+	send_queued(pipe);
+	return 0;
+}
+
+/* Returns 0 or the errno of a receive failure other than EINTR */
+static int recv_one(struct ibd_pipeline *pipe)
+{
+	struct pipe_req *req;
+	uint8_t *mad;
+	uint32_t trid;
+	unsigned slot;
+	int length = IB_MAD_SIZE;
+	int status;
+
+	if (umad_recv(pipe->fd, pipe->recv_umad, &length, -1) < 0) {
+		if (errno == EINTR)
+			return 0;
+		IBWARN("umad_recv failed: %s", strerror(errno));
+		return errno ? errno : EIO;
+	}
+
+	mad = umad_get_mad(pipe->recv_umad);
+	trid = (uint32_t)mad_get_field64(mad, 0, IB_MAD_TRID_F);
+	slot = trid & 0xffff;
+	if (slot >= pipe->window || !pipe->slots[slot] ||
+	    pipe->slots[slot]->trid != trid) {
+		DEBUG("dropping stale response trid 0x%x", trid);
+		return 0;
+	}
+
+	req = pipe->slots[slot];
+	pipe->slots[slot] = NULL;
+	pipe->free_slots[pipe->nfree++] = slot;
+	pipe->inflight--;
+
+	status = umad_status(pipe->recv_umad);
+	if (status)
+		/* timed out after all retries */
+		complete_req(pipe, req, ETIMEDOUT, NULL);
+	else if (mad_get_field(mad, 0, IB_MAD_STATUS_F))
+		complete_req(pipe, req, EREMOTEIO, mad);
+	else
+		complete_req(pipe, req, 0, mad);
+	return 0;
+}
+
+/* The port is unusable, complete everything posted with status */
+static void fail_all(struct ibd_pipeline *pipe, int status)
+{
+	struct pipe_req *req;
+	unsigned slot;
+
+	for (slot = 0; slot < pipe->window; slot++) {
+		req = pipe->slots[slot];
+		if (!req)
+			continue;
+		pipe->slots[slot] = NULL;
+		pipe->free_slots[pipe->nfree++] = slot;
+		pipe->inflight--;
+		complete_req(pipe, req, status, NULL);
+	}
+	while ((req = list_pop(&pipe->queue, struct pipe_req, entry)))
+		complete_req(pipe, req, status, NULL);
+}
+
+int ibd_pipeline_flush(struct ibd_pipeline *pipe)
+{
+	int ret;
+
+	while (pipe->inflight) {
+		ret = recv_one(pipe);
+		if (ret) {
+			fail_all(pipe, ret);
+			return ret;
+		}
+		send_queued(pipe);
+	}
+	return 0;
+}
+
+void ibd_pipeline_stats(const struct ibd_pipeline *pipe, uint64_t *sent,
+			uint64_t *failed)
+{
+	*sent = pipe->sent;
+	*failed = pipe->failed;
+}
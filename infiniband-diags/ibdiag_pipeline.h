@@ -0,0 +1,72 @@
+/*
+ * Copyright (c) 2025 SuperLinear Lab.  All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * OpenIB.org BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+#ifndef _IBDIAG_PIPELINE_H_
+#define _IBDIAG_PIPELINE_H_
+
+#include <stdint.h>
+#include <infiniband/mad.h>
+
+/*
+ * Keep up to "window" GET requests outstanding on one ibmad port instead
+ * of issuing them one mad_rpc() at a time.  Requests beyond the window are
+ * queued and sent as responses come back.  Not thread safe.
+ */
+struct ibd_pipeline;
+
+/* status is 0 or an errno value; mad is the response MAD or NULL */
+typedef void (*ibd_pipeline_cb_t)(void *context, int status, uint8_t *mad);
+
+struct ibd_pipeline *ibd_pipeline_create(struct ibmad_port *port,
+					 unsigned window, int timeout);
+void ibd_pipeline_destroy(struct ibd_pipeline *pipe);
+
+/*
+ * rpc may be an ib_rpc_cc_t cast to ib_rpc_t, as libibmad does itself.
+ * data (may be NULL) is copied into the request at rpc->dataoffs.  cb runs
+ * from ibd_pipeline_post() or ibd_pipeline_flush().
+ */
+int ibd_pipeline_post(struct ibd_pipeline *pipe, ib_rpc_t *rpc,
+		      ib_portid_t *portid, void *data, ibd_pipeline_cb_t cb,
+		      void *context);
+
+/*
+ * Wait until every posted request has completed.  If receiving fails, every
+ * request still posted completes with that errno, which is returned.
+ */
+int ibd_pipeline_flush(struct ibd_pipeline *pipe);
+
+void ibd_pipeline_stats(const struct ibd_pipeline *pipe, uint64_t *sent,
+			uint64_t *failed);
+
+#endif				/* _IBDIAG_PIPELINE_H_ */
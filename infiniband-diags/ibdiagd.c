@@ -0,0 +1,693 @@
+/*
+ * Copyright (c) 2025 SuperLinear Lab.  All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * OpenIB.org BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+
+/*
+ * ibdiagd: owns the umad port on behalf of the diag tools, coalesces
+ * identical in-flight GET queries and caches the responses for a short
+ * time.  Tools talk to it through the socket named by "daemon_socket" in
+ * ibdiag.conf, see ibdiag_daemon.h.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <grp.h>
+#include <pwd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <config.h>
+
+#include <infiniband/umad.h>
+#include <infiniband/mad.h>
+#include <ccan/list.h>
+
+#include "ibdiag_common.h"
+#include "ibdiag_daemon.h"
+
+#define HASH_SIZE 4096
+
+struct waiter {
+	struct list_node entry;
+	int fd;
+	uint32_t tag;
+};
+
+struct query {
+	struct query *htnext;	/* key hash chain */
+	struct query *trnext;	/* trid hash chain, while pending */
+	struct ibdiagd_key key;
+	uint32_t trid;
+	unsigned timeout;
+	int pending;
+	uint64_t expires;
+	int32_t status;
+	uint8_t mad[IB_MAD_SIZE];
+	struct list_head waiters;
+};
+
+static struct ibmad_ports_pair *srcports;
+static int daemon_port;
+static const char *socket_path = IBDIAGD_SERVER_PATH;
+static unsigned smp_ttl_ms = 5000;
+static unsigned pma_ttl_ms = 0;
+static unsigned max_entries = 65536;
+static const char *socket_group;
+static gid_t socket_gid;
+
+static struct query *keytbl[HASH_SIZE];
+static struct query *tridtbl[HASH_SIZE];
+static unsigned nentries;
+static uint32_t next_trid;
+static volatile sig_atomic_t stop;
+
+static struct pollfd *pfds;
+static unsigned npfds, max_pfds;
+
+static struct {
+	uint64_t requests;
+	uint64_t hits;
+	uint64_t coalesced;
+	uint64_t sent;
+	uint64_t errors;
+} stats;
+
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static unsigned hash_key(const struct ibdiagd_key *key)
+{
+	const uint8_t *p = (const uint8_t *)key;
+	uint32_t h = 2166136261u;
+	size_t len = sizeof(*key);
+
+	/* FNV-1a */
+	while (len--)
+		h = (h ^ *p++) * 16777619u;
+	return h % HASH_SIZE;
+}
+
+static int key_equal(const struct ibdiagd_key *a, const struct ibdiagd_key *b)
+{
+	return !memcmp(a, b, sizeof(*a));
+}
+
+static void unlink_query(struct query *q)
+{
+	struct query **pp;
+
+	for (pp = &keytbl[hash_key(&q->key)]; *pp; pp = &(*pp)->htnext)
+		if (*pp == q) {
+			*pp = q->htnext;
+			break;
+		}
+	nentries--;
+}
+
+static void unlink_trid(struct query *q)
+{
+	struct query **pp;
+
+	for (pp = &tridtbl[q->trid % HASH_SIZE]; *pp; pp = &(*pp)->trnext)
+		if (*pp == q) {
+			*pp = q->trnext;
+			break;
+		}
+}
+
+static struct query *find_query(const struct ibdiagd_key *key)
+{
+	struct query *q;
+
+	for (q = keytbl[hash_key(key)]; q; q = q->htnext)
+		if (key_equal(&q->key, key))
+			return q;
+	return NULL;
+}
+
+static struct query *find_trid(uint32_t trid)
+{
+	struct query *q;
+
+	for (q = tridtbl[trid % HASH_SIZE]; q; q = q->trnext)
+		if (q->trid == trid)
+			return q;
+	return NULL;
+}
+
+static void expire_queries(uint64_t now)
+{
+	struct query *q, **pp;
+	unsigned i;
+
+	for (i = 0; i < HASH_SIZE; i++) {
+		pp = &keytbl[i];
+		while ((q = *pp)) {
+			if (!q->pending && q->expires <= now) {
+				*pp = q->htnext;
+				nentries--;
+				free(q);
+			} else
+				pp = &q->htnext;
+		}
+	}
+}
+
+static void send_resp(int fd, uint32_t tag, uint8_t flags, int32_t status,
+		      const uint8_t *mad)
+{
+	struct ibdiagd_resp resp = {
+		.version = IBDIAGD_VERSION,
+		.flags = flags,
+		.tag = tag,
+		.status = status,
+	};
+
+	if (mad)
+		memcpy(resp.mad, mad, sizeof(resp.mad));
+	if (send(fd, &resp, sizeof(resp), MSG_NOSIGNAL | MSG_DONTWAIT) < 0)
+		DEBUG("response to fd %d dropped: %m", fd);
+}
+
+static int add_waiter(struct query *q, int fd, uint32_t tag)
+{
+	struct waiter *w = malloc(sizeof(*w));
+
+	if (!w)
+		return -ENOMEM;
+	w->fd = fd;
+	w->tag = tag;
+	list_add_tail(&q->waiters, &w->entry);
+	return 0;
+}
+
+static int send_query(struct query *q)
+{
+	uint8_t umad[sizeof(struct ib_user_mad) + IB_MAD_SIZE];
+	uint8_t data[IB_MAD_SIZE] = {};
+	const struct ibmad_port *port;
+	ib_portid_t portid = {};
+	ib_rpc_t rpc = {};
+	int timeout = q->timeout;
+	int agent;
+
+	if (!timeout)
+		timeout = ibd_timeout ? ibd_timeout : MAD_DEF_TIMEOUT_MS;
+
+	rpc.mgtclass = q->key.mgmt_class;
+	rpc.method = IB_MAD_METHOD_GET;
+	rpc.attr.id = q->key.attr_id;
+	rpc.timeout = timeout;
+	/* the kernel owns the upper 32 bits of the TID */
+	rpc.trid = q->trid;
+
+	portid.lid = q->key.lid;
+	if (q->key.mgmt_class == IB_PERFORMANCE_CLASS) {
+		port = srcports->gsi.port;
+		rpc.datasz = IB_PC_DATA_SZ;
+		rpc.dataoffs = IB_PC_DATA_OFFS;
+		mad_set_field(data, 0, IB_PC_PORT_SELECT_F, q->key.attr_mod);
+		portid.qp = 1;
+		portid.qkey = IB_DEFAULT_QP1_QKEY;
+	} else {
+		port = srcports->smi.port;
+		rpc.attr.mod = q->key.attr_mod;
+		rpc.datasz = IB_SMP_DATA_SIZE;
+		rpc.dataoffs = IB_SMP_DATA_OFFS;
+		/* never a client's key, see mask_mkey() */
+		rpc.mkey = ibd_mkey;
+		portid.drpath.cnt = q->key.drcnt;
+		portid.drpath.drslid = q->key.drslid;
+		portid.drpath.drdlid = q->key.drdlid;
+		memcpy(portid.drpath.p, q->key.drpath, sizeof(portid.drpath.p));
+	}
+
+	agent = mad_rpc_class_agent((struct ibmad_port *)port,
+				    q->key.mgmt_class);
+	if (agent < 0)
+		return -EPROTONOSUPPORT;
+
+	memset(umad, 0, sizeof(umad));
+	if (mad_build_pkt(umad, &rpc, &portid, NULL, data) < 0)
+		return -EINVAL;
+	if (umad_send(mad_rpc_portid((struct ibmad_port *)port), agent, umad,
+		      IB_MAD_SIZE, timeout, MAD_DEF_RETRIES) < 0)
+		return -errno;
+
+	stats.sent++;
+	return 0;
+}
+
+/*
+ * With the daemon's M_Key a PortInfo response carries the real key, which
+ * must not be handed out to the clients.
+ */
+static void mask_mkey(struct query *q, uint8_t *mad)
+{
+	if (!ibd_mkey || q->key.mgmt_class == IB_PERFORMANCE_CLASS ||
+	    q->key.attr_id != IB_ATTR_PORT_INFO)
+		return;
+	mad_set_field64(mad + IB_SMP_DATA_OFFS, 0, IB_PORT_MKEY_F, 0);
+}
+
+static void complete_query(struct query *q, int32_t status, uint8_t *mad)
+{
+	struct waiter *w, *next;
+	unsigned ttl;
+
+	q->pending = 0;
+	q->status = status;
+	if (mad) {
+		mask_mkey(q, mad);
+		memcpy(q->mad, mad, sizeof(q->mad));
+	}
+
+	list_for_each_safe(&q->waiters, w, next, entry) {
+		send_resp(w->fd, w->tag, 0, status, mad);
+		list_del(&w->entry);
+		free(w);
+	}
+
+	ttl = q->key.mgmt_class == IB_PERFORMANCE_CLASS ? pma_ttl_ms :
+							   smp_ttl_ms;
+	if (status || !ttl) {
+		unlink_query(q);
+		free(q);
+		return;
+	}
+	q->expires = now_ms() + ttl;
+}
+
+static void reject(int fd, uint32_t tag)
+{
+	send_resp(fd, tag, IBDIAGD_F_REJECTED, 0, NULL);
+}
+
+static int port_matches(const struct ibdiagd_req *req)
+{
+	if (req->ca_port && req->ca_port != daemon_port)
+		return 0;
+	if (!req->ca_name[0])
+		return 1;
+	return !strncmp(req->ca_name, srcports->smi.ca_name,
+			sizeof(req->ca_name)) ||
+	       !strncmp(req->ca_name, srcports->gsi.ca_name,
+			sizeof(req->ca_name));
+}
+
+static void handle_request(int fd, struct ibdiagd_req *req)
+{
+	struct query *q;
+	unsigned h;
+	int rc;
+
+	stats.requests++;
+	if (req->version != IBDIAGD_VERSION || !port_matches(req) ||
+	    req->key.drcnt >= IB_SUBNET_PATH_HOPS_MAX ||
+	    (req->key.mgmt_class != IB_SMI_CLASS &&
+	     req->key.mgmt_class != IB_SMI_DIRECT_CLASS &&
+	     req->key.mgmt_class != IB_PERFORMANCE_CLASS)) {
+		reject(fd, req->tag);
+		return;
+	}
+
+	q = find_query(&req->key);
+	if (q && !q->pending && q->expires <= now_ms()) {
+		unlink_query(q);
+		free(q);
+		q = NULL;
+	}
+
+	if (q && !q->pending) {
+		stats.hits++;
+		send_resp(fd, req->tag, IBDIAGD_F_CACHED, q->status, q->mad);
+		return;
+	}
+
+	if (q) {
+		stats.coalesced++;
+		if (add_waiter(q, fd, req->tag))
+			reject(fd, req->tag);
+		return;
+	}
+
+	if (nentries >= max_entries) {
+		expire_queries(now_ms());
+		if (nentries >= max_entries) {
+			reject(fd, req->tag);
+			return;
+		}
+	}
+
+	q = calloc(1, sizeof(*q));
+	if (!q) {
+		reject(fd, req->tag);
+		return;
+	}
+	q->key = req->key;
+	q->timeout = req->timeout;
+	q->pending = 1;
+	q->trid = ++next_trid;
+	list_head_init(&q->waiters);
+	if (add_waiter(q, fd, req->tag)) {
+		free(q);
+		reject(fd, req->tag);
+		return;
+	}
+
+	h = hash_key(&q->key);
+	q->htnext = keytbl[h];
+	keytbl[h] = q;
+	nentries++;
+
+	if ((rc = send_query(q))) {
+		stats.errors++;
+		complete_query(q, -rc, NULL);
+		return;
+	}
+	q->trnext = tridtbl[q->trid % HASH_SIZE];
+	tridtbl[q->trid % HASH_SIZE] = q;
+}
+
+static void handle_mad(int fd)
+{
+	uint8_t umad[sizeof(struct ib_user_mad) + IB_MAD_SIZE];
+	int length = IB_MAD_SIZE;
+	int32_t status;
+	struct query *q;
+	uint8_t *mad;
+	uint32_t trid;
+
+	if (umad_recv(fd, umad, &length, 0) < 0)
+		return;
+
+	mad = umad_get_mad(umad);
+	trid = (uint32_t)mad_get_field64(mad, 0, IB_MAD_TRID_F);
+	q = find_trid(trid);
+	if (!q || !q->pending) {
+		DEBUG("unexpected MAD trid 0x%x", trid);
+		return;
+	}
+	unlink_trid(q);
+
+	if ((status = umad_status(umad)))
+		stats.errors++;
+	else if (mad_get_field(mad, 0,
+			       q->key.mgmt_class == IB_SMI_DIRECT_CLASS ?
+			       IB_DRSMP_STATUS_F : IB_MAD_STATUS_F)) {
+		stats.errors++;
+		status = EIO;
+	}
+	complete_query(q, status, status ? NULL : mad);
+}
+
+/* forget the waiters of a client which went away */
+static void drop_client(unsigned idx)
+{
+	struct waiter *w, *next;
+	struct query *q;
+	unsigned i;
+	int fd = pfds[idx].fd;
+
+	for (i = 0; i < HASH_SIZE; i++)
+		for (q = keytbl[i]; q; q = q->htnext)
+			list_for_each_safe(&q->waiters, w, next, entry)
+				if (w->fd == fd) {
+					list_del(&w->entry);
+					free(w);
+				}
+	close(fd);
+	pfds[idx] = pfds[--npfds];
+}
+
+static int add_pollfd(int fd)
+{
+	if (npfds == max_pfds) {
+		unsigned n = max_pfds ? max_pfds * 2 : 16;
+		struct pollfd *p = realloc(pfds, n * sizeof(*p));
+
+		if (!p)
+			return -1;
+		pfds = p;
+		max_pfds = n;
+	}
+	pfds[npfds].fd = fd;
+	pfds[npfds].events = POLLIN;
+	pfds[npfds].revents = 0;
+	npfds++;
+	return 0;
+}
+
+static int open_socket(void)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	mode_t mask;
+	int fd;
+
+	if (strlen(socket_path) >= sizeof(addr.sun_path))
+		IBEXIT("socket path too long: %s", socket_path);
+	strcpy(addr.sun_path, socket_path);
+
+	fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		IBEXIT("socket: %m");
+
+	/*
+	 * Clients can send SMPs with any DR path through the daemon, so the
+	 * socket is limited to the daemon's user, and optionally a group.
+	 * Bind with a restrictive umask so it is never accessible to others.
+	 */
+	unlink(socket_path);
+	mask = umask(0177);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)))
+		IBEXIT("bind %s: %m", socket_path);
+	umask(mask);
+	if (socket_group &&
+	    (chown(socket_path, -1, socket_gid) || chmod(socket_path, 0660)))
+		IBEXIT("setting group of %s: %m", socket_path);
+	if (listen(fd, 128))
+		IBEXIT("listen: %m");
+	return fd;
+}
+
+/* the socket permissions are checked again for the connecting process */
+static int peer_allowed(int fd)
+{
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+	gid_t groups[64];
+	int ngroups = 64, i;
+	struct passwd *pw;
+
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len))
+		return 0;
+	if (cred.uid == 0 || cred.uid == geteuid())
+		return 1;
+	if (!socket_group)
+		return 0;
+	if (cred.gid == socket_gid)
+		return 1;
+
+	pw = getpwuid(cred.uid);
+	if (!pw || getgrouplist(pw->pw_name, pw->pw_gid, groups, &ngroups) < 0)
+		return 0;
+	for (i = 0; i < ngroups; i++)
+		if (groups[i] == socket_gid)
+			return 1;
+	return 0;
+}
+
+static void report(void)
+{
+	printf("requests %" PRIu64 " cache hits %" PRIu64 " coalesced %"
+	       PRIu64 " MADs sent %" PRIu64 " errors %" PRIu64
+	       " entries %u\n", stats.requests, stats.hits, stats.coalesced,
+	       stats.sent, stats.errors, nentries);
+	fflush(stdout);
+}
+
+static void sig_stop(int sig)
+{
+	stop = 1;
+}
+
+static int process_opt(void *context, int ch)
+{
+	switch (ch) {
+	case 1:
+		socket_path = optarg;
+		break;
+	case 2:
+		smp_ttl_ms = strtoul(optarg, NULL, 0);
+		break;
+	case 3:
+		pma_ttl_ms = strtoul(optarg, NULL, 0);
+		break;
+	case 4:
+		max_entries = strtoul(optarg, NULL, 0);
+		break;
+	case 5:
+		socket_group = optarg;
+		break;
+	default:
+		return -1;
+	}
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	int mgmt_classes[3] = { IB_SMI_CLASS, IB_SMI_DIRECT_CLASS,
+				IB_PERFORMANCE_CLASS };
+	unsigned nfixed, i;
+	uint64_t last_sweep;
+	int lfd, smi_fd, gsi_fd;
+
+	const struct ibdiag_opt opts[] = {
+		{"socket", 1, 1, "<path>",
+		 "listen on <path>, default: " IBDIAGD_SERVER_PATH},
+		{"smp-ttl", 2, 1, "<ms>",
+		 "cache SMP responses for <ms>, default 5000"},
+		{"pma-ttl", 3, 1, "<ms>",
+		 "cache PMA responses for <ms>, default 0 (coalesce only)"},
+		{"max-entries", 4, 1, "<num>",
+		 "maximum number of cached responses, default 65536"},
+		{"group", 5, 1, "<group>",
+		 "also allow members of <group> to use the daemon"},
+		{}
+	};
+	char usage_args[] = "";
+
+	ibdiag_process_opts(argc, argv, NULL, "DGKLs", opts, process_opt,
+			    usage_args, NULL);
+
+	if (socket_group) {
+		struct group *gr = getgrnam(socket_group);
+
+		if (!gr)
+			IBEXIT("unknown group %s", socket_group);
+		socket_gid = gr->gr_gid;
+	}
+
+	srcports = mad_rpc_open_port2(ibd_ca, ibd_ca_port, mgmt_classes, 3, 0);
+	if (!srcports)
+		IBEXIT("Failed to open '%s' port '%d'", ibd_ca, ibd_ca_port);
+	smp_mkey_set(srcports->smi.port, ibd_mkey);
+
+	daemon_port = ibd_ca_port;
+	if (!daemon_port) {
+		umad_port_t port;
+
+		if (!umad_get_port(srcports->gsi.ca_name, 0, &port)) {
+			daemon_port = port.portnum;
+			umad_release_port(&port);
+		}
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGINT, sig_stop);
+	signal(SIGTERM, sig_stop);
+
+	lfd = open_socket();
+	smi_fd = mad_rpc_portid(srcports->smi.port);
+	gsi_fd = mad_rpc_portid(srcports->gsi.port);
+	if (add_pollfd(lfd) || add_pollfd(smi_fd) ||
+	    (gsi_fd != smi_fd && add_pollfd(gsi_fd)))
+		IBEXIT("out of memory");
+	nfixed = npfds;
+
+	last_sweep = now_ms();
+	while (!stop) {
+		uint64_t now;
+
+		if (poll(pfds, npfds, 1000) < 0) {
+			if (errno == EINTR)
+				continue;
+			IBEXIT("poll: %m");
+		}
+
+		for (i = 1; i < nfixed; i++)
+			if (pfds[i].revents & POLLIN)
+				handle_mad(pfds[i].fd);
+
+		for (i = nfixed; i < npfds; i++) {
+			struct ibdiagd_req req;
+			ssize_t n;
+
+			if (!pfds[i].revents)
+				continue;
+			n = recv(pfds[i].fd, &req, sizeof(req), MSG_DONTWAIT);
+			if (n == sizeof(req))
+				handle_request(pfds[i].fd, &req);
+			else if (n < 0 && (errno == EAGAIN || errno == EINTR))
+				continue;
+			else
+				drop_client(i--);
+		}
+
+		if (pfds[0].revents & POLLIN) {
+			int fd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+
+			if (fd >= 0 && !peer_allowed(fd)) {
+				DEBUG("connection from unauthorized peer refused");
+				close(fd);
+			} else if (fd >= 0 && add_pollfd(fd))
+				close(fd);
+		}
+
+		now = now_ms();
+		if (now - last_sweep >= 1000) {
+			expire_queries(now);
+			last_sweep = now;
+			if (ibverbose)
+				report();
+		}
+	}
+
+	report();
+	unlink(socket_path);
+	mad_rpc_close_port2(srcports);
+	exit(0);
+}
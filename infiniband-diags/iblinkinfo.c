@@ -76,6 +76,18 @@ static int line_mode = 0;
 static int add_sw_settings = 0;
 static int only_flag = 0;
 static int only_type = 0;
+static unsigned watch_interval_ms = 0;
+static unsigned watch_count = 0;
+
+struct link_snapshot {
+	ibnd_port_t *port;
+	int state;
+	int physstate;
+	int width;
+	int speed;
+	int espeed;
+	int fdr10;
+};
 
 static int filterdownport_check(ibnd_node_t *node, ibnd_port_t *port)
 {
@@ -101,6 +113,47 @@ static int filterdownport_check(ibnd_node_t *node, ibnd_port_t *port)
 	return (fistate == IB_LINK_DOWN) ? 1 : 0;
 }
 
+static void get_link_snapshot(ibnd_port_t *port, struct link_snapshot *snap)
+{
+	uint8_t *info = NULL;
+
+	snap->port = port;
+	snap->state = mad_get_field(port->info, 0, IB_PORT_STATE_F);
+	snap->physstate = mad_get_field(port->info, 0, IB_PORT_PHYS_STATE_F);
+	snap->width = mad_get_field(port->info, 0, IB_PORT_LINK_WIDTH_ACTIVE_F);
+	snap->speed = mad_get_field(port->info, 0, IB_PORT_LINK_SPEED_ACTIVE_F);
+	snap->fdr10 = mad_get_field(port->ext_info, 0,
+				    IB_MLNX_EXT_PORT_LINK_SPEED_ACTIVE_F) & FDR10;
+
+	if (port->node->type == IB_NODE_SWITCH) {
+		if (port->node->ports[0])
+			info = (uint8_t *)&port->node->ports[0]->info;
+	} else
+		info = (uint8_t *)&port->info;
+
+	if (info)
+		snap->espeed = ibnd_get_agg_linkspeedext(info, port->info);
+	else {
+		snap->speed = 0;
+		snap->width = 0;
+		snap->espeed = 0;
+	}
+}
+
+static char *link_speed_str(const struct link_snapshot *snap, char *buf,
+			    int size)
+{
+	int ispeed = snap->speed;
+
+	if (snap->espeed)
+		ibnd_dump_agg_linkspeedext(buf, size, snap->espeed);
+	else if (snap->fdr10)
+		snprintf(buf, size, "10.0 Gbps (FDR10)");
+	else
+		mad_dump_val(IB_PORT_LINK_SPEED_ACTIVE_F, buf, size, &ispeed);
+	return buf;
+}
+
 static void print_port(ibnd_node_t *node, ibnd_port_t *port,
 		       const char *out_prefix)
 {
@@ -111,36 +164,18 @@ static void print_port(ibnd_node_t *node, ibnd_port_t *port,
 	char width_msg[256];
 	char speed_msg[256];
 	char ext_port_str[256];
-	int iwidth, ispeed, fdr10, espeed, istate, iphystate;
+	struct link_snapshot snap;
+	int iwidth, istate, iphystate;
 	int n = 0;
-	uint8_t *info = NULL;
 	int rc;
 
 	if (!port)
 		return;
 
-	iwidth = mad_get_field(port->info, 0, IB_PORT_LINK_WIDTH_ACTIVE_F);
-	ispeed = mad_get_field(port->info, 0, IB_PORT_LINK_SPEED_ACTIVE_F);
-	fdr10 = mad_get_field(port->ext_info, 0,
-			      IB_MLNX_EXT_PORT_LINK_SPEED_ACTIVE_F) & FDR10;
-
-	if (port->node->type == IB_NODE_SWITCH) {
-		if (port->node->ports[0])
-			info = (uint8_t *)&port->node->ports[0]->info;
-	}
-	else
-		info = (uint8_t *)&port->info;
-
-	if (info) {
-		espeed = ibnd_get_agg_linkspeedext(info, port->info);
-	} else {
-		ispeed = 0;
-		iwidth = 0;
-		espeed = 0;
-	}
-
-	istate = mad_get_field(port->info, 0, IB_PORT_STATE_F);
-	iphystate = mad_get_field(port->info, 0, IB_PORT_PHYS_STATE_F);
+	get_link_snapshot(port, &snap);
+	iwidth = snap.width;
+	istate = snap.state;
+	iphystate = snap.physstate;
 
 	remote_guid_str[0] = '\0';
 	remote_str[0] = '\0';
@@ -157,14 +192,7 @@ static void print_port(ibnd_node_t *node, ibnd_port_t *port,
 	 * returned for all PortInfo components except PortState and
 	 * PortPhysicalState */
 	if (istate != IB_LINK_DOWN) {
-		if (!espeed) {
-			if (fdr10)
-				sprintf(speed, "10.0 Gbps (FDR10)");
-			else
-				mad_dump_val(IB_PORT_LINK_SPEED_ACTIVE_F, speed,
-					     64, &ispeed);
-		} else
-			ibnd_dump_agg_linkspeedext(speed, 64, espeed);
+		link_speed_str(&snap, speed, sizeof(speed));
 
 		n = snprintf(link_str, 256, "(%3s %18s %6s/%8s)",
 		     mad_dump_val(IB_PORT_LINK_WIDTH_ACTIVE_F, width, 64,
@@ -502,6 +530,154 @@ static int diff_node(ibnd_node_t *node, ibnd_fabric_t *orig_fabric,
 	return 0;
 }
 
+static void count_node_ports(ibnd_node_t *node, void *user_data)
+{
+	int *nports = user_data;
+
+	*nports += node->numports;
+}
+
+static void snapshot_node_ports(ibnd_node_t *node, void *user_data)
+{
+	struct link_snapshot **next = user_data;
+	int i;
+
+	for (i = 1; i <= node->numports; i++) {
+		if (!node->ports[i])
+			continue;
+		get_link_snapshot(node->ports[i], *next);
+		(*next)++;
+	}
+}
+
+static void print_link_change(const struct link_snapshot *old,
+			      const struct link_snapshot *new,
+			      const char *timestamp)
+{
+	ibnd_port_t *port = new->port;
+	char *remap = remap_node_name(node_name_map, port->node->guid,
+				      port->node->nodedesc);
+	char val1[64], val2[64];
+	int v1, v2;
+
+	printf("%s 0x%016" PRIx64 " \"%s\" %d[%d]:", timestamp,
+	       port->guid, remap, port->node->type == IB_NODE_SWITCH ?
+	       port->node->smalid : port->base_lid, port->portnum);
+	free(remap);
+
+	if (old->state != new->state) {
+		v1 = old->state;
+		v2 = new->state;
+		printf(" State %s->%s",
+		       mad_dump_val(IB_PORT_STATE_F, val1, 64, &v1),
+		       mad_dump_val(IB_PORT_STATE_F, val2, 64, &v2));
+	}
+	if (old->physstate != new->physstate) {
+		v1 = old->physstate;
+		v2 = new->physstate;
+		printf(" PhysState %s->%s",
+		       mad_dump_val(IB_PORT_PHYS_STATE_F, val1, 64, &v1),
+		       mad_dump_val(IB_PORT_PHYS_STATE_F, val2, 64, &v2));
+	}
+	/* C14-24.2.1: width and speed are only valid on ports which are up */
+	if (new->state != IB_LINK_DOWN && old->state != IB_LINK_DOWN) {
+		if (old->width != new->width) {
+			v1 = old->width;
+			v2 = new->width;
+			printf(" Width %s->%s",
+			       mad_dump_val(IB_PORT_LINK_WIDTH_ACTIVE_F, val1,
+					    64, &v1),
+			       mad_dump_val(IB_PORT_LINK_WIDTH_ACTIVE_F, val2,
+					    64, &v2));
+		}
+		if (old->speed != new->speed || old->espeed != new->espeed)
+			printf(" Speed %s->%s",
+			       link_speed_str(old, val1, sizeof(val1)),
+			       link_speed_str(new, val2, sizeof(val2)));
+	}
+	printf("\n");
+}
+
+static int link_changed(const struct link_snapshot *old,
+			const struct link_snapshot *new)
+{
+	if (old->state != new->state || old->physstate != new->physstate)
+		return 1;
+	if (new->state == IB_LINK_DOWN || old->state == IB_LINK_DOWN)
+		return 0;
+	return old->width != new->width || old->speed != new->speed ||
+	       old->espeed != new->espeed;
+}
+
+static int watch_links(ibnd_fabric_t *fabric, struct ibnd_config *config)
+{
+	struct link_snapshot *snaps, *next;
+	unsigned iteration = 0;
+	int nports = 0;
+	int i, rc;
+
+	if (only_flag)
+		ibnd_iter_nodes_type(fabric, count_node_ports, only_type,
+				     &nports);
+	else
+		ibnd_iter_nodes(fabric, count_node_ports, &nports);
+
+	snaps = calloc(nports ? nports : 1, sizeof(*snaps));
+	if (!snaps) {
+		IBWARN("out of memory for %d port snapshots", nports);
+		return -1;
+	}
+
+	next = snaps;
+	if (only_flag)
+		ibnd_iter_nodes_type(fabric, snapshot_node_ports, only_type,
+				     &next);
+	else
+		ibnd_iter_nodes(fabric, snapshot_node_ports, &next);
+	nports = next - snaps;
+
+	while (!watch_count || iteration++ < watch_count) {
+		struct timespec now;
+		struct tm tm;
+		char timestamp[64];
+		size_t len;
+
+		usleep(watch_interval_ms * 1000);
+
+		rc = ibnd_refresh_port_info(fabric, ibd_ca, ibd_ca_port,
+					    config);
+		if (rc < 0) {
+			IBWARN("PortInfo refresh failed: %s", strerror(-rc));
+			continue;
+		}
+		if (rc > 0 && ibverbose)
+			IBWARN("%d ports did not respond to PortInfo", rc);
+
+		clock_gettime(CLOCK_REALTIME, &now);
+		localtime_r(&now.tv_sec, &tm);
+		len = strftime(timestamp, sizeof(timestamp), "%F %T", &tm);
+		snprintf(timestamp + len, sizeof(timestamp) - len, ".%03ld",
+			 now.tv_nsec / 1000000);
+
+		for (i = 0; i < nports; i++) {
+			struct link_snapshot cur;
+
+			get_link_snapshot(snaps[i].port, &cur);
+			if (!link_changed(&snaps[i], &cur))
+				continue;
+			if (down_links_only && cur.state != IB_LINK_DOWN &&
+			    snaps[i].state != IB_LINK_DOWN)
+				continue;
+			print_link_change(&snaps[i], &cur, timestamp);
+			snaps[i] = cur;
+		}
+		fflush(stdout);
+	}
+
+	free(snaps);
+	return 0;
+}
+
 static int process_opt(void *context, int ch)
 {
 	struct ibnd_config *cfg = context;
@@ -550,6 +726,17 @@ static int process_opt(void *context, int ch)
 		only_flag = 1;
 		only_type = IB_NODE_CA;
 		break;
+	case 8:
+		watch_interval_ms = strtoul(optarg, NULL, 0);
+		if (!watch_interval_ms) {
+			fprintf(stderr, "invalid watch interval: %s\n",
+				optarg);
+			return -1;
+		}
+		break;
+	case 9:
+		watch_count = strtoul(optarg, NULL, 0);
+		break;
 	case 'S':
 	case 'G':
 		node_label.guid_str = optarg;
@@ -631,6 +818,11 @@ int main(int argc, char **argv)
 		 "Output only switches"},
 		{"cas-only", 7, 0, NULL,
 		 "Output only CAs"},
+		{"watch", 8, 1, "<ms>",
+		 "after printing, refresh PortInfo every <ms> milliseconds "
+		 "and print link state/width/speed changes"},
+		{"count", 9, 1, "<count>",
+		 "number of --watch refreshes (default: until interrupted)"},
 		{}
 	};
 	char usage_args[] = "";
@@ -667,6 +859,12 @@ int main(int argc, char **argv)
 
 	node_name_map = open_node_name_map(node_name_map_file);
 
+	if (watch_interval_ms && (load_cache_file || diff_cache_file)) {
+		mad_rpc_close_port2(ibmad_ports);
+		fprintf(stderr, "Cannot use --watch with cached fabrics\n");
+		exit(1);
+	}
+
 	if (dr_path && load_cache_file) {
 		mad_rpc_close_port2(ibmad_ports);
 		fprintf(stderr, "Cannot specify cache and direct route path\n");
@@ -766,6 +964,9 @@ int main(int argc, char **argv)
 		}
 	}
 
+	if (watch_interval_ms && watch_links(fabric, &config))
+		rc = 1;
+
 	ibnd_destroy_fabric(fabric);
 	if (diff_fabric)
 		ibnd_destroy_fabric(diff_fabric);
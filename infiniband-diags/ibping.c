@@ -37,6 +37,8 @@
 #include <string.h>
 #include <signal.h>
 #include <time.h>
+#include <errno.h>
+#include <inttypes.h>
 
 #include <infiniband/umad.h>
 #include <infiniband/mad.h>
@@ -168,6 +170,245 @@ static void report(int sig)
 	exit(0);
 }
 
+/*
+ * Pipelined mode: keep several pings in flight and record the round trip
+ * time of each one in a log-linear histogram (16 sub buckets per power of
+ * two, ~6% precision) so tail latencies can be reported.
+ */
+#define HIST_SUB_BITS		4
+#define HIST_SUB_BUCKETS	(1 << HIST_SUB_BITS)
+#define HIST_BUCKETS		((64 - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS)
+
+struct ping_slot {
+	uint32_t seq;
+	int busy;
+	uint64_t sent_ns;
+};
+
+static uint64_t hist[HIST_BUCKETS];
+static unsigned pipeline_depth;
+static int print_hist;
+static volatile sig_atomic_t stop_pipeline;
+
+static uint64_t time_stamp_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+	return (uint64_t)ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+static unsigned hist_index(uint64_t v)
+{
+	unsigned msb;
+
+	if (v < HIST_SUB_BUCKETS)
+		return v;
+	msb = 63 - __builtin_clzll(v);
+	return (msb - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS +
+	       ((v >> (msb - HIST_SUB_BITS)) & (HIST_SUB_BUCKETS - 1));
+}
+
+/* highest value which falls into bucket idx */
+static uint64_t hist_value(unsigned idx)
+{
+	unsigned shift;
+
+	if (idx < HIST_SUB_BUCKETS)
+		return idx;
+	shift = idx / HIST_SUB_BUCKETS - 1;
+	return (((uint64_t)(idx % HIST_SUB_BUCKETS + HIST_SUB_BUCKETS) + 1)
+		<< shift) - 1;
+}
+
+static uint64_t hist_percentile(uint64_t total, double pct)
+{
+	uint64_t want = (uint64_t)(total * pct / 100.0 + 0.5);
+	uint64_t seen = 0;
+	unsigned i;
+
+	if (!want)
+		want = 1;
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += hist[i];
+		if (seen >= want)
+			return hist_value(i);
+	}
+	return 0;
+}
+
+static void print_usec(const char *name, uint64_t ns)
+{
+	printf(" %s %" PRIu64 ".%03" PRIu64, name, ns / 1000, ns % 1000);
+}
+
+static void pipeline_report(uint64_t elapsed_ns, uint64_t sent,
+			    uint64_t received, uint64_t min_ns,
+			    uint64_t max_ns, uint64_t sum_ns)
+{
+	uint64_t seen;
+	unsigned i;
+
+	printf("\n--- %s (%s) ibping statistics ---\n", last_host,
+	       portid2str(&portid));
+	printf("%" PRIu64 " packets transmitted, %" PRIu64 " received, %"
+	       PRIu64 "%% packet loss, time %" PRIu64 " ms, %" PRIu64
+	       " pings/s, depth %u\n", sent, received,
+	       sent ? (sent - received) * 100 / sent : 0,
+	       elapsed_ns / 1000000,
+	       elapsed_ns ? received * UINT64_C(1000000000) / elapsed_ns : 0,
+	       pipeline_depth);
+	if (!received)
+		return;
+
+	printf("rtt (us):");
+	print_usec("min", min_ns);
+	print_usec("avg", sum_ns / received);
+	print_usec("p50", hist_percentile(received, 50));
+	print_usec("p90", hist_percentile(received, 90));
+	print_usec("p99", hist_percentile(received, 99));
+	print_usec("p99.9", hist_percentile(received, 99.9));
+	print_usec("max", max_ns);
+	printf("\n");
+
+	if (!print_hist)
+		return;
+
+	printf("%14s %12s %8s\n", "<= us", "count", "cum %");
+	for (i = 0, seen = 0; i < HIST_BUCKETS; i++) {
+		uint64_t v = hist_value(i);
+
+		if (!hist[i])
+			continue;
+		seen += hist[i];
+		printf("%10" PRIu64 ".%03" PRIu64 " %12" PRIu64 " %8.3f\n",
+		       v / 1000, v % 1000, hist[i],
+		       (double)seen * 100.0 / received);
+	}
+}
+
+static void pipeline_stop(int sig)
+{
+	stop_pipeline = 1;
+}
+
+static int send_ping(int fd, int agent, struct ping_slot *slot, uint32_t seq,
+		     int timeout)
+{
+	uint8_t umad[sizeof(struct ib_user_mad) + IB_MAD_SIZE];
+	ib_rpc_t rpc = { 0 };
+
+	memset(umad, 0, sizeof(umad));
+	rpc.mgtclass = IB_VENDOR_OPENIB_PING_CLASS;
+	rpc.method = IB_MAD_METHOD_GET;
+	rpc.datasz = IB_VENDOR_RANGE2_DATA_SIZE;
+	rpc.dataoffs = IB_VENDOR_RANGE2_DATA_OFFS;
+	rpc.oui = oui;
+	/* the kernel owns the upper 32 bits of the TID */
+	rpc.trid = seq;
+
+	if (mad_build_pkt(umad, &rpc, &portid, NULL, NULL) < 0)
+		return -1;
+
+	slot->seq = seq;
+	slot->busy = 1;
+	slot->sent_ns = time_stamp_ns();
+	if (umad_send(fd, agent, umad, IB_MAD_SIZE, timeout, 0) < 0) {
+		slot->busy = 0;
+		return -1;
+	}
+	return 0;
+}
+
+static int ibping_pipeline(unsigned nping)
+{
+	uint8_t umad[sizeof(struct ib_user_mad) + IB_MAD_SIZE];
+	uint64_t sent = 0, received = 0, inflight = 0;
+	uint64_t min_ns = ~0ull, max_ns = 0, sum_ns = 0;
+	int timeout = ibd_timeout ? ibd_timeout : MAD_DEF_TIMEOUT_MS;
+	struct ping_slot *slots;
+	uint64_t begin;
+	int fd, agent;
+
+	fd = mad_rpc_portid(srcport);
+	agent = mad_rpc_class_agent(srcport, IB_VENDOR_OPENIB_PING_CLASS);
+	if (fd < 0 || agent < 0)
+		IBEXIT("ping class agent is not registered");
+
+	slots = calloc(pipeline_depth, sizeof(*slots));
+	if (!slots)
+		IBEXIT("out of memory for %u ping slots", pipeline_depth);
+
+	portid.qp = 1;
+	if (!portid.qkey)
+		portid.qkey = IB_DEFAULT_QP1_QKEY;
+
+	signal(SIGINT, pipeline_stop);
+	signal(SIGTERM, pipeline_stop);
+
+	begin = time_stamp_ns();
+	while (!stop_pipeline && (sent < nping || inflight)) {
+		struct ping_slot *slot;
+		int length = IB_MAD_SIZE;
+		uint64_t now, rtt;
+		uint32_t seq;
+		uint8_t *mad;
+
+		while (!stop_pipeline && sent < nping &&
+		       inflight < pipeline_depth) {
+			slot = &slots[sent % pipeline_depth];
+			if (slot->busy)
+				break;
+			if (send_ping(fd, agent, slot, (uint32_t)sent,
+				      timeout) < 0)
+				IBEXIT("send ping failed");
+			sent++;
+			inflight++;
+		}
+
+		if (umad_recv(fd, umad, &length, timeout * 2) < 0) {
+			if (errno == EINTR || errno == ETIMEDOUT)
+				continue;
+			IBEXIT("receive ping failed");
+		}
+		now = time_stamp_ns();
+
+		mad = umad_get_mad(umad);
+		seq = (uint32_t)mad_get_field64(mad, 0, IB_MAD_TRID_F);
+		slot = &slots[seq % pipeline_depth];
+		if (!slot->busy || slot->seq != seq) {
+			DEBUG("stale pong trid 0x%x", seq);
+			continue;
+		}
+		slot->busy = 0;
+		inflight--;
+
+		if (umad_status(umad)) {
+			DEBUG("ping %u lost: status %d", seq, umad_status(umad));
+			continue;
+		}
+
+		if (!last_host[0])
+			memcpy(last_host, mad + IB_VENDOR_RANGE2_DATA_OFFS,
+			       sizeof(last_host) - 1);
+
+		rtt = now - slot->sent_ns;
+		hist[hist_index(rtt)]++;
+		if (rtt < min_ns)
+			min_ns = rtt;
+		if (rtt > max_ns)
+			max_ns = rtt;
+		sum_ns += rtt;
+		received++;
+	}
+
+	/* whatever is still on the wire at interrupt counts as lost */
+	pipeline_report(time_stamp_ns() - begin, sent, received, min_ns,
+			max_ns, sum_ns);
+	free(slots);
+	return 0;
+}
+
 static int server = 0, flood = 0;
 static unsigned count = ~0;
 
@@ -186,6 +427,14 @@ static int process_opt(void *context, int ch)
 	case 'S':
 		server++;
 		break;
+	case 1:
+		pipeline_depth = strtoul(optarg, NULL, 0);
+		if (!pipeline_depth)
+			return -1;
+		break;
+	case 2:
+		print_hist = 1;
+		break;
 	default:
 		return -1;
 	}
@@ -204,6 +453,10 @@ int main(int argc, char **argv)
 		{"flood", 'f', 0, NULL, "flood destination"},
 		{"oui", 'o', 1, NULL, "use specified OUI number"},
 		{"Server", 'S', 0, NULL, "start in server mode"},
+		{"pipeline", 1, 1, "<depth>",
+		 "keep <depth> pings in flight and report latency percentiles"},
+		{"histogram", 2, 0, NULL,
+		 "print the latency histogram (with --pipeline)"},
 		{}
 	};
 	char usage_args[] = "<dest lid|guid>";
@@ -245,6 +498,12 @@ int main(int argc, char **argv)
 			       ibd_dest_type, ibd_sm_id, srcport) < 0)
 		IBEXIT("can't resolve destination port %s", argv[0]);
 
+	if (pipeline_depth) {
+		ibping_pipeline(count);
+		mad_rpc_close_port2(srcports);
+		exit(0);
+	}
+
 	signal(SIGINT, report);
 	signal(SIGTERM, report);
 
@@ -52,6 +52,7 @@
 #include <infiniband/mad.h>
 
 #include "ibdiag_common.h"
+#include "ibdiag_daemon.h"
 #include "ibdiag_sa.h"
 
 static struct ibmad_port *ibmad_port;
@@ -371,7 +372,7 @@ static int query_and_dump(char *buf, size_t size, ib_portid_t * portid,
 
 	memset(pc, 0, sizeof(pc));
 
-	if (!pma_query_via(pc, portid, portnum, ibd_timeout, attr_id,
+	if (!ibd_pma_query(pc, portid, portnum, ibd_timeout, attr_id,
 			   ibmad_port)) {
 		IBWARN("%s query failed on %s, %s port %d", attr_name,
 		       node_name, portid2str(portid), portnum);
@@ -541,7 +542,7 @@ static int query_cap_mask(ib_portid_t * portid, char *node_name, int portnum,
 	portid->sl = lid2sl_table[portid->lid];
 
 	/* PerfMgt ClassPortInfo is a required attribute */
-	if (!pma_query_via(pc, portid, portnum, ibd_timeout, CLASS_PORT_INFO,
+	if (!ibd_pma_query(pc, portid, portnum, ibd_timeout, CLASS_PORT_INFO,
 			   ibmad_port)) {
 		IBWARN("classportinfo query failed on %s, %s port %d",
 		       node_name, portid2str(portid), portnum);
@@ -572,7 +573,7 @@ static int print_data_cnts(ib_portid_t * portid, __be16 cap_mask,
 	portid->sl = lid2sl_table[portid->lid];
 
 	if (cap_mask & (IB_PM_EXT_WIDTH_SUPPORTED | IB_PM_EXT_WIDTH_NOIETF_SUP)) {
-		if (!pma_query_via(pc, portid, portnum, ibd_timeout,
+		if (!ibd_pma_query(pc, portid, portnum, ibd_timeout,
 				   IB_GSI_PORT_COUNTERS_EXT, ibmad_port)) {
 			IBWARN("IB_GSI_PORT_COUNTERS_EXT query failed on %s, %s port %d",
 			       node_name, portid2str(portid), portnum);
@@ -585,7 +586,7 @@ static int print_data_cnts(ib_portid_t * portid, __be16 cap_mask,
 		else
 			end_field = IB_PC_EXT_RCV_PKTS_F;
 	} else {
-		if (!pma_query_via(pc, portid, portnum, ibd_timeout,
+		if (!ibd_pma_query(pc, portid, portnum, ibd_timeout,
 				   IB_GSI_PORT_COUNTERS, ibmad_port)) {
 			IBWARN("IB_GSI_PORT_COUNTERS query failed on %s, %s port %d",
 			       node_name, portid2str(portid), portnum);
@@ -642,7 +643,7 @@ static int print_errors(ib_portid_t * portid, __be16 cap_mask, uint32_t cap_mask
 
 	portid->sl = lid2sl_table[portid->lid];
 
-	if (!pma_query_via(pc, portid, portnum, ibd_timeout,
+	if (!ibd_pma_query(pc, portid, portnum, ibd_timeout,
 			   IB_GSI_PORT_COUNTERS, ibmad_port)) {
 		IBWARN("IB_GSI_PORT_COUNTERS query failed on %s, %s port %d",
 		       node_name, portid2str(portid), portnum);
@@ -651,7 +652,7 @@ static int print_errors(ib_portid_t * portid, __be16 cap_mask, uint32_t cap_mask
 	}
 
 	if (cap_mask & (IB_PM_EXT_WIDTH_SUPPORTED | IB_PM_EXT_WIDTH_NOIETF_SUP)) {
-		if (!pma_query_via(pce, portid, portnum, ibd_timeout,
+		if (!ibd_pma_query(pce, portid, portnum, ibd_timeout,
 		    IB_GSI_PORT_COUNTERS_EXT, ibmad_port)) {
 			IBWARN("IB_GSI_PORT_COUNTERS_EXT query failed on %s, %s port %d",
 			       node_name, portid2str(portid), portnum);
@@ -1140,7 +1141,7 @@ int main(int argc, char **argv)
 		ibnd_port_t *ndport;
 
 		uint8_t ni[IB_SMP_DATA_SIZE] = { 0 };
-		if (!smp_query_via(ni, &portid, IB_ATTR_NODE_INFO, 0,
+		if (!ibd_smp_query(ni, &portid, IB_ATTR_NODE_INFO, 0,
 			   ibd_timeout, ibmad_port)) {
 				fprintf(stderr, "Failed to query local Node Info\n");
 				goto close_port;
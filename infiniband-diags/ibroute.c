@@ -44,6 +44,7 @@
 #include <util/node_name_map.h>
 
 #include "ibdiag_common.h"
+#include "ibdiag_daemon.h"
 
 static struct ibmad_port *srcport;
 static struct ibmad_ports_pair *srcports;
@@ -62,12 +63,12 @@ static const char *check_switch(ib_portid_t *portid, unsigned int *nports,
 	int type;
 
 	DEBUG("checking node type");
-	if (!smp_query_via(ni, portid, IB_ATTR_NODE_INFO, 0, 0, srcport)) {
+	if (!ibd_smp_query(ni, portid, IB_ATTR_NODE_INFO, 0, 0, srcport)) {
 		xdump(stderr, "nodeinfo\n", ni, sizeof ni);
 		return "node info failed: valid addr?";
 	}
 
-	if (!smp_query_via(nd, portid, IB_ATTR_NODE_DESC, 0, 0, srcport))
+	if (!ibd_smp_query(nd, portid, IB_ATTR_NODE_DESC, 0, 0, srcport))
 		return "node desc failed";
 
 	mad_decode_field(ni, IB_NODE_TYPE_F, &type);
@@ -78,7 +79,7 @@ static const char *check_switch(ib_portid_t *portid, unsigned int *nports,
 	mad_decode_field(ni, IB_NODE_NPORTS_F, nports);
 	mad_decode_field(ni, IB_NODE_GUID_F, guid);
 
-	if (!smp_query_via(sw, portid, IB_ATTR_SWITCH_INFO, 0, 0, srcport))
+	if (!ibd_smp_query(sw, portid, IB_ATTR_SWITCH_INFO, 0, 0, srcport))
 		return "switch info failed: is a switch node?";
 
 	return NULL;
@@ -289,9 +290,9 @@ static int dump_lid(char *str, int strlen, int lid, int valid)
 	portguid = 0;
 	lidport.lid = lid;
 
-	if (!smp_query_via(nd, &lidport, IB_ATTR_NODE_DESC, 0, 100, srcport) ||
-	    !smp_query_via(pi, &lidport, IB_ATTR_PORT_INFO, 0, 100, srcport) ||
-	    !smp_query_via(ni, &lidport, IB_ATTR_NODE_INFO, 0, 100, srcport))
+	if (!ibd_smp_query(nd, &lidport, IB_ATTR_NODE_DESC, 0, 100, srcport) ||
+	    !ibd_smp_query(pi, &lidport, IB_ATTR_PORT_INFO, 0, 100, srcport) ||
+	    !ibd_smp_query(ni, &lidport, IB_ATTR_NODE_INFO, 0, 100, srcport))
 		return snprintf(str, strlen, ": (unknown node and type)");
 
 	mad_decode_field(ni, IB_NODE_GUID_F, &nodeguid);
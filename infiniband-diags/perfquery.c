@@ -37,12 +37,18 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <errno.h>
+#include <time.h>
 #include <netinet/in.h>
 
 #include <infiniband/umad.h>
 #include <infiniband/mad.h>
+#include <infiniband/ibnetdisc.h>
+#include <ccan/array_size.h>
 
 #include "ibdiag_common.h"
+#include "ibdiag_daemon.h"
+#include "ibdiag_pipeline.h"
 
 static struct ibmad_port *srcport;
 static struct ibmad_ports_pair *srcports;
@@ -406,7 +412,7 @@ static void dump_perfcounters(int extended, int timeout, __be16 cap_mask,
 
 	if (extended != 1) {
 		memset(pc, 0, sizeof(pc));
-		if (!pma_query_via(pc, portid, port, timeout,
+		if (!ibd_pma_query(pc, portid, port, timeout,
 				   IB_GSI_PORT_COUNTERS, srcport))
 			IBEXIT("perfquery");
 		if (!(cap_mask & IB_PM_PC_XMIT_WAIT_SUP)) {
@@ -433,7 +439,7 @@ static void dump_perfcounters(int extended, int timeout, __be16 cap_mask,
 			     ntohs(cap_mask));
 
 		memset(pc, 0, sizeof(pc));
-		if (!pma_query_via(pc, portid, port, timeout,
+		if (!ibd_pma_query(pc, portid, port, timeout,
 				   IB_GSI_PORT_COUNTERS_EXT, srcport))
 			IBEXIT("perfextquery");
 		if (aggregate)
@@ -480,7 +486,12 @@ static struct
 		slrcvfecn, slrcvbecn, xmitcc, vlxmittimecc;
 	int ports[MAX_PORTS];
 	int ports_count;
-} info;
+	char *sweep;
+	int interval, iterations, outstanding;
+} info = {
+	.interval = 10,
+	.outstanding = 32,
+};
 
 static void common_func(ib_portid_t * portid, int port_num, int mask,
 			unsigned query, unsigned reset,
@@ -491,7 +502,7 @@ static void common_func(ib_portid_t * portid, int port_num, int mask,
 
 	if (query) {
 		memset(pc, 0, sizeof(pc));
-		if (!pma_query_via(pc, portid, port_num, ibd_timeout, attr,
+		if (!ibd_pma_query(pc, portid, port_num, ibd_timeout, attr,
 				   srcport))
 			IBEXIT("cannot query %s", name);
 
@@ -585,7 +596,7 @@ static uint8_t is_rsfec_mode_active(ib_portid_t * portid, int port,
 			return 0;
 		}
 
-		if (!smp_query_via(data, portid, IB_ATTR_PORT_INFO_EXT, port, 0,
+		if (!ibd_smp_query(data, portid, IB_ATTR_PORT_INFO_EXT, port, 0,
 				   srcports->smi.port))
 			IBEXIT("smp query portinfo extended failed");
 
@@ -725,7 +736,7 @@ static void dump_portsamples_control(ib_portid_t *portid, int port)
 	char buf[1280];
 
 	memset(pc, 0, sizeof(pc));
-	if (!pma_query_via(pc, portid, port, ibd_timeout,
+	if (!ibd_pma_query(pc, portid, port, ibd_timeout,
 			   IB_GSI_PORT_SAMPLES_CONTROL, srcport))
 		IBEXIT("sampctlquery");
 
@@ -734,6 +745,391 @@ static void dump_portsamples_control(ib_portid_t *portid, int port)
 	       port, buf);
 }
 
+/*
+ * --sweep mode: read the counters of many ports with a window of
+ * outstanding PMA queries and print what changed since the previous sweep.
+ */
+#define SWEEP_MAX_FIELDS 32
+
+static const enum MAD_FIELDS sweep_fields[] = {
+	IB_PC_ERR_SYM_F, IB_PC_LINK_RECOVERS_F, IB_PC_LINK_DOWNED_F,
+	IB_PC_ERR_RCV_F, IB_PC_ERR_PHYSRCV_F, IB_PC_ERR_SWITCH_REL_F,
+	IB_PC_XMT_DISCARDS_F, IB_PC_ERR_XMTCONSTR_F, IB_PC_ERR_RCVCONSTR_F,
+	IB_PC_ERR_LOCALINTEG_F, IB_PC_ERR_EXCESS_OVR_F, IB_PC_VL15_DROPPED_F,
+	IB_PC_XMT_BYTES_F, IB_PC_RCV_BYTES_F, IB_PC_XMT_PKTS_F,
+	IB_PC_RCV_PKTS_F, IB_PC_XMT_WAIT_F,
+};
+
+static const enum MAD_FIELDS sweep_ext_fields[] = {
+	IB_PC_EXT_XMT_BYTES_F, IB_PC_EXT_RCV_BYTES_F, IB_PC_EXT_XMT_PKTS_F,
+	IB_PC_EXT_RCV_PKTS_F, IB_PC_EXT_XMT_UPKTS_F, IB_PC_EXT_RCV_UPKTS_F,
+	IB_PC_EXT_XMT_MPKTS_F, IB_PC_EXT_RCV_MPKTS_F, IB_PC_EXT_ERR_SYM_F,
+	IB_PC_EXT_LINK_RECOVERS_F, IB_PC_EXT_LINK_DOWNED_F,
+	IB_PC_EXT_ERR_RCV_F, IB_PC_EXT_ERR_PHYSRCV_F,
+	IB_PC_EXT_ERR_SWITCH_REL_F, IB_PC_EXT_XMT_DISCARDS_F,
+	IB_PC_EXT_ERR_XMTCONSTR_F, IB_PC_EXT_ERR_RCVCONSTR_F,
+	IB_PC_EXT_ERR_LOCALINTEG_F, IB_PC_EXT_ERR_EXCESS_OVR_F,
+	IB_PC_EXT_VL15_DROPPED_F, IB_PC_EXT_XMT_WAIT_F, IB_PC_EXT_QP1_DROP_F,
+};
+
+enum sweep_state {
+	SWEEP_PENDING,
+	SWEEP_OK,
+	SWEEP_FAILED,
+};
+
+struct sweep_node {
+	ib_portid_t portid;
+	__be16 cap_mask;
+	uint32_t cap_mask2;
+	int cpi_ok;
+};
+
+struct sweep_port {
+	unsigned node;
+	int port;
+	enum sweep_state state;
+	int baseline;
+	uint64_t prev[SWEEP_MAX_FIELDS];
+	uint64_t cur[SWEEP_MAX_FIELDS];
+};
+
+static struct {
+	struct sweep_node *nodes;
+	unsigned num_nodes, max_nodes;
+	struct sweep_port *ports;
+	unsigned num_ports, max_ports;
+	const enum MAD_FIELDS *fields;
+	unsigned num_fields;
+} sweep;
+
+static unsigned sweep_add_node(ib_portid_t *portid)
+{
+	if (sweep.num_nodes == sweep.max_nodes) {
+		sweep.max_nodes = sweep.max_nodes ? sweep.max_nodes * 2 : 64;
+		sweep.nodes = realloc(sweep.nodes,
+				      sweep.max_nodes * sizeof(*sweep.nodes));
+		if (!sweep.nodes)
+			IBEXIT("out of memory");
+	}
+	memset(&sweep.nodes[sweep.num_nodes], 0, sizeof(*sweep.nodes));
+	sweep.nodes[sweep.num_nodes].portid = *portid;
+	return sweep.num_nodes++;
+}
+
+static void sweep_add_port(unsigned node, int port)
+{
+	if (sweep.num_ports == sweep.max_ports) {
+		sweep.max_ports = sweep.max_ports ? sweep.max_ports * 2 : 256;
+		sweep.ports = realloc(sweep.ports,
+				      sweep.max_ports * sizeof(*sweep.ports));
+		if (!sweep.ports)
+			IBEXIT("out of memory");
+	}
+	memset(&sweep.ports[sweep.num_ports], 0, sizeof(*sweep.ports));
+	sweep.ports[sweep.num_ports].node = node;
+	sweep.ports[sweep.num_ports].port = port;
+	sweep.num_ports++;
+}
+
+static void sweep_add_fabric_node(ibnd_node_t *node, void *user_data)
+{
+	ib_portid_t portid = { 0 };
+	unsigned idx = 0;
+	int have_node = 0;
+	int i;
+
+	for (i = 1; i <= node->numports; i++) {
+		ibnd_port_t *port = node->ports[i];
+
+		if (!port || mad_get_field(port->info, 0, IB_PORT_STATE_F) ==
+		    IB_LINK_DOWN)
+			continue;
+
+		/* switch ports share the PMA at port 0, CA ports have their own */
+		if (node->type != IB_NODE_SWITCH || !have_node) {
+			ib_portid_set(&portid, node->type == IB_NODE_SWITCH ?
+				      node->smalid : port->base_lid, 0, 0);
+			if (!portid.lid)
+				continue;
+			idx = sweep_add_node(&portid);
+			have_node = 1;
+		}
+		sweep_add_port(idx, i);
+	}
+}
+
+static void sweep_load_fabric(void)
+{
+	struct ibnd_config config = { 0 };
+	ibnd_fabric_t *fabric;
+
+	config.mkey = ibd_mkey;
+	config.timeout_ms = ibd_timeout;
+	config.flags = ibd_ibnetdisc_flags;
+	fabric = ibnd_discover_fabric(ibd_ca, ibd_ca_port, NULL, &config);
+	if (!fabric)
+		IBEXIT("discover failed");
+
+	ibnd_iter_nodes(fabric, sweep_add_fabric_node, NULL);
+	ibnd_destroy_fabric(fabric);
+}
+
+/* Each line is "<lid|guid> [port]"; without a port all ports are read */
+static void sweep_load_file(const char *file)
+{
+	uint8_t data[IB_SMP_DATA_SIZE];
+	ib_portid_t portid;
+	char line[256];
+	char *dest, *port;
+	unsigned idx;
+	int num_ports, i;
+	FILE *f;
+
+	f = fopen(file, "r");
+	if (!f)
+		IBEXIT("cannot open %s: %s", file, strerror(errno));
+
+	while (fgets(line, sizeof(line), f)) {
+		if ((dest = strchr(line, '#')))
+			*dest = '\0';
+		dest = strtok(line, " \t\n");
+		if (!dest)
+			continue;
+		port = strtok(NULL, " \t\n");
+
+		memset(&portid, 0, sizeof(portid));
+		if (resolve_portid_str(srcports->gsi.ca_name, ibd_ca_port,
+				       &portid, dest, ibd_dest_type, ibd_sm_id,
+				       srcport) < 0) {
+			IBWARN("can't resolve destination port %s", dest);
+			continue;
+		}
+		idx = sweep_add_node(&portid);
+
+		if (port) {
+			sweep_add_port(idx, strtoul(port, NULL, 0));
+			continue;
+		}
+
+		memset(data, 0, sizeof(data));
+		if (!ibd_smp_query(data, &portid, IB_ATTR_NODE_INFO, 0, 0,
+				   srcports->smi.port)) {
+			IBWARN("smp query nodeinfo failed for %s", dest);
+			continue;
+		}
+		if (mad_get_field(data, 0, IB_NODE_TYPE_F) == IB_NODE_SWITCH) {
+			num_ports = mad_get_field(data, 0, IB_NODE_NPORTS_F);
+			for (i = 1; i <= num_ports; i++)
+				sweep_add_port(idx, i);
+		} else
+			sweep_add_port(idx, mad_get_field(data, 0,
+							  IB_NODE_LOCAL_PORT_F));
+	}
+	fclose(f);
+}
+
+static int sweep_post(struct ibd_pipeline *pipe, struct sweep_node *node,
+		      int port, unsigned attr, ibd_pipeline_cb_t cb,
+		      void *context)
+{
+	uint8_t data[IB_PC_DATA_SZ] = { 0 };
+	ib_rpc_t rpc = { 0 };
+
+	rpc.mgtclass = IB_PERFORMANCE_CLASS;
+	rpc.method = IB_MAD_METHOD_GET;
+	rpc.attr.id = attr;
+	rpc.timeout = ibd_timeout;
+	rpc.datasz = IB_PC_DATA_SZ;
+	rpc.dataoffs = IB_PC_DATA_OFFS;
+	mad_set_field(data, 0, IB_PC_PORT_SELECT_F, port);
+
+	if (!node->portid.qp)
+		node->portid.qp = 1;
+	if (!node->portid.qkey)
+		node->portid.qkey = IB_DEFAULT_QP1_QKEY;
+
+	return ibd_pipeline_post(pipe, &rpc, &node->portid, data, cb,
+				 context);
+}
+
+static void sweep_cpi_done(void *context, int status, uint8_t *mad)
+{
+	struct sweep_node *node = context;
+	__be32 cap_mask2_be;
+
+	if (status) {
+		IBWARN("%s: ClassPortInfo query failed: %s",
+		       portid2str(&node->portid), strerror(status));
+		return;
+	}
+
+	memcpy(&node->cap_mask, mad + IB_PC_DATA_OFFS + 2,
+	       sizeof(node->cap_mask));
+	memcpy(&cap_mask2_be, mad + IB_PC_DATA_OFFS + 4, sizeof(cap_mask2_be));
+	node->cap_mask2 = ntohl(cap_mask2_be) >> 5;
+	node->cpi_ok = 1;
+}
+
+static void sweep_counters_done(void *context, int status, uint8_t *mad)
+{
+	struct sweep_port *p = context;
+	uint8_t *data;
+	unsigned i;
+
+	if (status) {
+		DEBUG("%s port %d: %s", portid2str(&sweep.nodes[p->node].portid),
+		      p->port, strerror(status));
+		p->state = SWEEP_FAILED;
+		return;
+	}
+
+	data = mad + IB_PC_DATA_OFFS;
+	for (i = 0; i < sweep.num_fields; i++)
+		p->cur[i] = info.extended ?
+		    mad_get_field64(data, 0, sweep.fields[i]) :
+		    mad_get_field(data, 0, sweep.fields[i]);
+	p->state = SWEEP_OK;
+}
+
+static int sweep_field_supported(struct sweep_node *node,
+				 enum MAD_FIELDS field)
+{
+	if (field == IB_PC_XMT_WAIT_F)
+		return !!(node->cap_mask & IB_PM_PC_XMIT_WAIT_SUP);
+	if (field >= IB_PC_EXT_XMT_UPKTS_F && field <= IB_PC_EXT_RCV_MPKTS_F)
+		return !!(node->cap_mask & IB_PM_EXT_WIDTH_SUPPORTED);
+	if (field >= IB_PC_EXT_ERR_SYM_F && field <= IB_PC_EXT_QP1_DROP_F)
+		return !!(htonl(node->cap_mask2) &
+			  IB_PM_IS_ADDL_PORT_CTRS_EXT_SUP);
+	return 1;
+}
+
+static void sweep_report(int iteration, double elapsed)
+{
+	unsigned answered = 0, failed = 0, i, f;
+	char tbuf[64];
+	time_t now;
+
+	for (i = 0; i < sweep.num_ports; i++) {
+		if (sweep.ports[i].state == SWEEP_OK)
+			answered++;
+		else
+			failed++;
+	}
+
+	now = time(NULL);
+	strftime(tbuf, sizeof(tbuf), "%Y-%m-%d %H:%M:%S", localtime(&now));
+	printf("# %s %d at %s: %u ports, %u answered, %u failed (%.3f s)\n",
+	       iteration ? "Sweep" : "Baseline", iteration, tbuf,
+	       sweep.num_ports, answered, failed, elapsed);
+
+	for (i = 0; i < sweep.num_ports; i++) {
+		struct sweep_port *p = &sweep.ports[i];
+		struct sweep_node *node = &sweep.nodes[p->node];
+		int printed = 0;
+
+		if (p->state != SWEEP_OK)
+			continue;
+
+		for (f = 0; p->baseline && f < sweep.num_fields; f++) {
+			uint64_t delta;
+
+			if (!sweep_field_supported(node, sweep.fields[f]))
+				continue;
+			/* a counter going backwards was reset in between */
+			delta = p->cur[f] >= p->prev[f] ?
+			    p->cur[f] - p->prev[f] : p->cur[f];
+			if (!delta)
+				continue;
+			if (!printed++)
+				printf("%s port %d:", portid2str(&node->portid),
+				       p->port);
+			printf(" %s=%" PRIu64, mad_field_name(sweep.fields[f]),
+			       delta);
+		}
+		if (printed)
+			printf("\n");
+
+		memcpy(p->prev, p->cur, sizeof(p->prev));
+		p->baseline = 1;
+	}
+	fflush(stdout);
+}
+
+static void perf_sweep(void)
+{
+	struct timespec start, end, deadline;
+	struct ibd_pipeline *pipe;
+	unsigned attr, i;
+	int iteration, rc;
+
+	if (!strcmp(info.sweep, "fabric"))
+		sweep_load_fabric();
+	else
+		sweep_load_file(info.sweep);
+	if (!sweep.num_ports)
+		IBEXIT("no ports to sweep");
+
+	if (info.extended) {
+		sweep.fields = sweep_ext_fields;
+		sweep.num_fields = ARRAY_SIZE(sweep_ext_fields);
+		attr = IB_GSI_PORT_COUNTERS_EXT;
+	} else {
+		sweep.fields = sweep_fields;
+		sweep.num_fields = ARRAY_SIZE(sweep_fields);
+		attr = IB_GSI_PORT_COUNTERS;
+	}
+
+	pipe = ibd_pipeline_create(srcport, info.outstanding, ibd_timeout);
+	if (!pipe)
+		IBEXIT("cannot create MAD pipeline: %s", strerror(errno));
+
+	/* PerfMgt ClassPortInfo is a required attribute */
+	for (i = 0; i < sweep.num_nodes; i++)
+		if (sweep_post(pipe, &sweep.nodes[i], 0, CLASS_PORT_INFO,
+			       sweep_cpi_done, &sweep.nodes[i]))
+			IBEXIT("cannot post ClassPortInfo query");
+	if ((rc = ibd_pipeline_flush(pipe)))
+		IBEXIT("cannot receive MADs: %s", strerror(rc));
+
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	for (iteration = 0;; iteration++) {
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (i = 0; i < sweep.num_ports; i++) {
+			struct sweep_port *p = &sweep.ports[i];
+			struct sweep_node *node = &sweep.nodes[p->node];
+
+			p->state = SWEEP_FAILED;
+			if (!node->cpi_ok)
+				continue;
+			p->state = SWEEP_PENDING;
+			if (sweep_post(pipe, node, p->port, attr,
+				       sweep_counters_done, p))
+				p->state = SWEEP_FAILED;
+		}
+		if ((rc = ibd_pipeline_flush(pipe)))
+			IBEXIT("cannot receive MADs: %s", strerror(rc));
+		clock_gettime(CLOCK_MONOTONIC, &end);
+
+		sweep_report(iteration, (end.tv_sec - start.tv_sec) +
+			     (end.tv_nsec - start.tv_nsec) / 1e9);
+
+		if (info.iterations && iteration >= info.iterations)
+			break;
+
+		/* keep a fixed cadence regardless of how long a sweep took */
+		deadline.tv_sec += info.interval;
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+				       &deadline, NULL) == EINTR)
+			;
+	}
+
+	ibd_pipeline_destroy(pipe);
+	free(sweep.ports);
+	free(sweep.nodes);
+}
+
 static int process_opt(void *context, int ch)
 {
 	switch (ch) {
@@ -794,6 +1190,24 @@ static int process_opt(void *context, int ch)
 	case 12:
 		info.vlxmittimecc = 1;
 		break;
+	case 13:
+		info.sweep = optarg;
+		break;
+	case 14:
+		info.interval = strtol(optarg, NULL, 0);
+		if (info.interval <= 0)
+			return -1;
+		break;
+	case 15:
+		info.iterations = strtol(optarg, NULL, 0);
+		if (info.iterations < 0)
+			return -1;
+		break;
+	case 16:
+		info.outstanding = strtol(optarg, NULL, 0);
+		if (info.outstanding <= 0 || info.outstanding > UINT16_MAX)
+			return -1;
+		break;
 	case 'a':
 		info.all_ports++;
 		info.port = ALL_PORTS;
@@ -854,6 +1268,10 @@ int main(int argc, char **argv)
 		{"loop_ports", 'l', 0, NULL, "iterate through each port"},
 		{"reset_after_read", 'r', 0, NULL, "reset counters after read"},
 		{"Reset_only", 'R', 0, NULL, "only reset counters"},
+		{"sweep", 13, 1, "<file|fabric>", "read ports listed in file, or all active ports of the fabric, and print deltas"},
+		{"interval", 14, 1, "<sec>", "seconds between sweeps (default 10)"},
+		{"iterations", 15, 1, "<n>", "stop after n delta reports (default: run forever)"},
+		{"outstanding_mads", 16, 1, "<n>", "number of outstanding queries during a sweep (default 32)"},
 		{}
 	};
 	char usage_args[] = " [<lid|guid> [[port(s)] [reset_mask]]]";
@@ -873,6 +1291,7 @@ int main(int argc, char **argv)
 		"-l 32 1-10\t# read performance counters from lid 32, port 1-10, output each port",
 		"-a 32 1,4,8\t# read performance counters from lid 32, port 1, 4, and 8, aggregate output",
 		"-l 32 1,4,8\t# read performance counters from lid 32, port 1, 4, and 8, output each port",
+		"-x --sweep fabric --interval 60\t# print extended counter deltas of the whole fabric every minute",
 		NULL,
 	};
 
@@ -925,6 +1344,14 @@ int main(int argc, char **argv)
 
 	smp_mkey_set(srcports->smi.port, ibd_mkey);
 
+	if (info.sweep) {
+		if (argc || info.reset || info.reset_only || info.all_ports ||
+		    info.loop_ports)
+			IBEXIT("--sweep can only be combined with -x");
+		perf_sweep();
+		goto done;
+	}
+
 	if (argc) {
 		if (resolve_portid_str(srcports->gsi.ca_name, ibd_ca_port, &portid, argv[0],
 				       ibd_dest_type, ibd_sm_id, srcport) < 0)
@@ -937,7 +1364,7 @@ int main(int argc, char **argv)
 
 	/* PerfMgt ClassPortInfo is a required attribute */
 	memset(pc, 0, sizeof(pc));
-	if (!pma_query_via(pc, &portid, info.port, ibd_timeout, CLASS_PORT_INFO,
+	if (!ibd_pma_query(pc, &portid, info.port, ibd_timeout, CLASS_PORT_INFO,
 			   srcport))
 		IBEXIT("classportinfo query");
 	/* ClassPortInfo should be supported as part of libibmad */
@@ -1044,7 +1471,7 @@ int main(int argc, char **argv)
 
 	if (all_ports_loop ||
 	    (info.loop_ports && (info.all_ports || info.port == ALL_PORTS))) {
-		if (!smp_query_via(data, &portid, IB_ATTR_NODE_INFO, 0, 0,
+		if (!ibd_smp_query(data, &portid, IB_ATTR_NODE_INFO, 0, 0,
 				   srcports->smi.port))
 			IBEXIT("smp query nodeinfo failed");
 		node_type = mad_get_field(data, 0, IB_NODE_TYPE_F);
@@ -1053,7 +1480,7 @@ int main(int argc, char **argv)
 			IBEXIT("smp query nodeinfo: num ports invalid");
 
 		if (node_type == IB_NODE_SWITCH) {
-			if (!smp_query_via(data, &portid, IB_ATTR_SWITCH_INFO,
+			if (!ibd_smp_query(data, &portid, IB_ATTR_SWITCH_INFO,
 					   0, 0, srcports->smi.port))
 				IBEXIT("smp query nodeinfo failed");
 			enhancedport0 =
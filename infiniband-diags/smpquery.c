@@ -46,6 +46,7 @@
 #include <util/node_name_map.h>
 
 #include "ibdiag_common.h"
+#include "ibdiag_daemon.h"
 
 static struct ibmad_port *srcport;
 static struct ibmad_ports_pair *srcports;
@@ -81,13 +82,13 @@ static const char *node_desc(ib_portid_t *dest, char **argv, int argc)
 	char dots[128];
 	char *nodename = NULL;
 
-	if (!smp_query_via(data, dest, IB_ATTR_NODE_INFO, 0, 0, srcport))
+	if (!ibd_smp_query(data, dest, IB_ATTR_NODE_INFO, 0, 0, srcport))
 		return "node info query failed";
 
 	mad_decode_field(data, IB_NODE_TYPE_F, &node_type);
 	mad_decode_field(data, IB_NODE_GUID_F, &node_guid);
 
-	if (!smp_query_via(nd, dest, IB_ATTR_NODE_DESC, 0, 0, srcport))
+	if (!ibd_smp_query(nd, dest, IB_ATTR_NODE_DESC, 0, 0, srcport))
 		return "node desc query failed";
 
 	nodename = remap_node_name(node_name_map, node_guid, nd);
@@ -111,7 +112,7 @@ static const char *node_info(ib_portid_t * dest, char **argv, int argc)
 	char buf[2048];
 	char data[IB_SMP_DATA_SIZE] = { 0 };
 
-	if (!smp_query_via(data, dest, IB_ATTR_NODE_INFO, 0, 0, srcport))
+	if (!ibd_smp_query(data, dest, IB_ATTR_NODE_INFO, 0, 0, srcport))
 		return "node info query failed";
 
 	mad_dump_nodeinfo(buf, sizeof buf, data, sizeof data);
@@ -132,7 +133,7 @@ static const char *port_info_extended(ib_portid_t *dest, char **argv, int argc)
 	if (!is_port_info_extended_supported(dest, portnum, srcport))
 		return "port info extended not supported";
 
-	if (!smp_query_via(data, dest, IB_ATTR_PORT_INFO_EXT, portnum, 0,
+	if (!ibd_smp_query(data, dest, IB_ATTR_PORT_INFO_EXT, portnum, 0,
 			   srcport))
 		return "port info extended query failed";
 
@@ -153,7 +154,7 @@ static const char *port_info(ib_portid_t *dest, char **argv, int argc)
 	if (extended_speeds)
 		portnum |= (1U) << 31;
 
-	if (!smp_query_via(data, dest, IB_ATTR_PORT_INFO, portnum, 0, srcport))
+	if (!ibd_smp_query(data, dest, IB_ATTR_PORT_INFO, portnum, 0, srcport))
 		return "port info query failed";
 
 	printf("# Port info: %s port %d\n", portid2str(dest), orig_portnum);
@@ -170,7 +171,7 @@ static const char *mlnx_ext_port_info(ib_portid_t *dest, char **argv, int argc)
 	if (argc > 0)
 		portnum = strtol(argv[0], NULL, 0);
 
-	if (!smp_query_via(data, dest, IB_ATTR_MLNX_EXT_PORT_INFO, portnum, 0, srcport))
+	if (!ibd_smp_query(data, dest, IB_ATTR_MLNX_EXT_PORT_INFO, portnum, 0, srcport))
 		return "Mellanox ext port info query failed";
 
 	mad_dump_mlnx_ext_port_info(buf, sizeof buf, data, sizeof data);
@@ -184,7 +185,7 @@ static const char *switch_info(ib_portid_t *dest, char **argv, int argc)
 	char buf[2048];
 	char data[IB_SMP_DATA_SIZE] = { 0 };
 
-	if (!smp_query_via(data, dest, IB_ATTR_SWITCH_INFO, 0, 0, srcport))
+	if (!ibd_smp_query(data, dest, IB_ATTR_SWITCH_INFO, 0, 0, srcport))
 		return "switch info query failed";
 
 	mad_dump_switchinfo(buf, sizeof buf, data, sizeof data);
@@ -206,7 +207,7 @@ static const char *pkey_table(ib_portid_t *dest, char **argv, int argc)
 		portnum = strtol(argv[0], NULL, 0);
 
 	/* Get the partition capacity */
-	if (!smp_query_via(data, dest, IB_ATTR_NODE_INFO, 0, 0, srcport))
+	if (!ibd_smp_query(data, dest, IB_ATTR_NODE_INFO, 0, 0, srcport))
 		return "node info query failed";
 
 	mad_decode_field(data, IB_NODE_TYPE_F, &t);
@@ -215,7 +216,7 @@ static const char *pkey_table(ib_portid_t *dest, char **argv, int argc)
 		return "invalid port number";
 
 	if ((t == IB_NODE_SWITCH) && (portnum != 0)) {
-		if (!smp_query_via(data, dest, IB_ATTR_SWITCH_INFO, 0, 0,
+		if (!ibd_smp_query(data, dest, IB_ATTR_SWITCH_INFO, 0, 0,
 				   srcport))
 			return "switch info failed";
 		mad_decode_field(data, IB_SW_PARTITION_ENFORCE_CAP_F, &n);
@@ -224,7 +225,7 @@ static const char *pkey_table(ib_portid_t *dest, char **argv, int argc)
 
 	for (i = 0; i < (n + 31) / 32; i++) {
 		mod = i | (portnum << 16);
-		if (!smp_query_via(data, dest, IB_ATTR_PKEY_TBL, mod, 0,
+		if (!ibd_smp_query(data, dest, IB_ATTR_PKEY_TBL, mod, 0,
 				   srcport))
 			return "pkey table query failed";
 		if (i + 1 == (n + 31) / 32)
@@ -251,7 +252,7 @@ static const char *sl2vl_dump_table_entry(ib_portid_t *dest, int in, int out)
 	char data[IB_SMP_DATA_SIZE] = { 0 };
 	int portnum = (in << 8) | out;
 
-	if (!smp_query_via(data, dest, IB_ATTR_SLVL_TABLE, portnum, 0, srcport))
+	if (!ibd_smp_query(data, dest, IB_ATTR_SLVL_TABLE, portnum, 0, srcport))
 		return "slvl query failed";
 
 	mad_dump_sltovl(buf, sizeof buf, data, sizeof data);
@@ -270,7 +271,7 @@ static const char *sl2vl_table(ib_portid_t *dest, char **argv, int argc)
 	if (argc > 0)
 		portnum = strtol(argv[0], NULL, 0);
 
-	if (!smp_query_via(data, dest, IB_ATTR_NODE_INFO, 0, 0, srcport))
+	if (!ibd_smp_query(data, dest, IB_ATTR_NODE_INFO, 0, 0, srcport))
 		return "node info query failed";
 
 	mad_decode_field(data, IB_NODE_TYPE_F, &type);
@@ -301,7 +302,7 @@ static const char *vlarb_dump_table_entry(ib_portid_t *dest, int portnum,
 	char buf[2048];
 	char data[IB_SMP_DATA_SIZE] = { 0 };
 
-	if (!smp_query_via(data, dest, IB_ATTR_VL_ARBITRATION,
+	if (!ibd_smp_query(data, dest, IB_ATTR_VL_ARBITRATION,
 			   (offset << 16) | portnum, 0, srcport))
 		return "vl arb query failed";
 	mad_dump_vlarbitration(buf, sizeof(buf), data, cap * 2);
@@ -335,14 +336,14 @@ static const char *vlarb_table(ib_portid_t *dest, char **argv, int argc)
 
 	/* port number of 0 could mean SP0 or port MAD arrives on */
 	if (portnum == 0) {
-		if (!smp_query_via(data, dest, IB_ATTR_NODE_INFO, 0, 0,
+		if (!ibd_smp_query(data, dest, IB_ATTR_NODE_INFO, 0, 0,
 				   srcport))
 			return "node info query failed";
 
 		mad_decode_field(data, IB_NODE_TYPE_F, &type);
 		if (type == IB_NODE_SWITCH) {
 			memset(data, 0, sizeof(data));
-			if (!smp_query_via(data, dest, IB_ATTR_SWITCH_INFO, 0,
+			if (!ibd_smp_query(data, dest, IB_ATTR_SWITCH_INFO, 0,
 					   0, srcport))
 				return "switch info query failed";
 			mad_decode_field(data, IB_SW_ENHANCED_PORT0_F, &enhsp0);
@@ -356,7 +357,7 @@ static const char *vlarb_table(ib_portid_t *dest, char **argv, int argc)
 		}
 	}
 
-	if (!smp_query_via(data, dest, IB_ATTR_PORT_INFO, portnum, 0, srcport))
+	if (!ibd_smp_query(data, dest, IB_ATTR_PORT_INFO, portnum, 0, srcport))
 		return "port info query failed";
 
 	mad_decode_field(data, IB_PORT_VL_ARBITRATION_LOW_CAP_F, &lowcap);
@@ -383,13 +384,13 @@ static const char *guid_info(ib_portid_t *dest, char **argv, int argc)
 	int n;
 
 	/* Get the guid capacity */
-	if (!smp_query_via(data, dest, IB_ATTR_PORT_INFO, 0, 0, srcport))
+	if (!ibd_smp_query(data, dest, IB_ATTR_PORT_INFO, 0, 0, srcport))
 		return "port info failed";
 	mad_decode_field(data, IB_PORT_GUID_CAP_F, &n);
 
 	for (i = 0; i < (n + 7) / 8; i++) {
 		mod = i;
-		if (!smp_query_via(data, dest, IB_ATTR_GUID_INFO, mod, 0,
+		if (!ibd_smp_query(data, dest, IB_ATTR_GUID_INFO, mod, 0,
 				   srcport))
 			return "guid info query failed";
 		if (i + 1 == (n + 7) / 8)
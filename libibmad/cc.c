@@ -41,33 +41,41 @@
 #undef DEBUG
 #define DEBUG 	if (ibdebug)	IBWARN
 
-void *cc_query_status_via(void *rcvbuf, ib_portid_t * portid,
-			  unsigned attrid, unsigned mod, unsigned timeout,
-			  int *rstatus, const struct ibmad_port * srcport,
-			  uint64_t cckey)
+void cc_rpc_init(ib_rpc_cc_t *rpc, ib_portid_t *portid, unsigned method,
+		 unsigned attrid, unsigned mod, unsigned timeout, uint64_t cckey)
 {
-	ib_rpc_cc_t rpc = { 0 };
-	void *res;
-
-	DEBUG("attr 0x%x mod 0x%x route %s", attrid, mod, portid2str(portid));
-	rpc.method = IB_MAD_METHOD_GET;
-	rpc.attr.id = attrid;
-	rpc.attr.mod = mod;
-	rpc.timeout = timeout;
+	memset(rpc, 0, sizeof(*rpc));
+	rpc->method = method;
+	rpc->attr.id = attrid;
+	rpc->attr.mod = mod;
+	rpc->timeout = timeout;
 	if (attrid == IB_CC_ATTR_CONGESTION_LOG) {
-		rpc.datasz = IB_CC_LOG_DATA_SZ;
-		rpc.dataoffs = IB_CC_LOG_DATA_OFFS;
+		rpc->datasz = IB_CC_LOG_DATA_SZ;
+		rpc->dataoffs = IB_CC_LOG_DATA_OFFS;
 	}
 	else {
-		rpc.datasz = IB_CC_DATA_SZ;
-		rpc.dataoffs = IB_CC_DATA_OFFS;
+		rpc->datasz = IB_CC_DATA_SZ;
+		rpc->dataoffs = IB_CC_DATA_OFFS;
 	}
-	rpc.mgtclass = IB_CC_CLASS;
-	rpc.cckey = cckey;
+	rpc->mgtclass = IB_CC_CLASS;
+	rpc->cckey = cckey;
 
 	portid->qp = 1;
 	if (!portid->qkey)
 		portid->qkey = IB_DEFAULT_QP1_QKEY;
+}
+
+void *cc_query_status_via(void *rcvbuf, ib_portid_t * portid,
+			  unsigned attrid, unsigned mod, unsigned timeout,
+			  int *rstatus, const struct ibmad_port * srcport,
+			  uint64_t cckey)
+{
+	ib_rpc_cc_t rpc;
+	void *res;
+
+	DEBUG("attr 0x%x mod 0x%x route %s", attrid, mod, portid2str(portid));
+	cc_rpc_init(&rpc, portid, IB_MAD_METHOD_GET, attrid, mod, timeout,
+		    cckey);
 
 	res = mad_rpc(srcport, (ib_rpc_t *)&rpc, portid, rcvbuf, rcvbuf);
 	if (rstatus)
@@ -81,28 +89,12 @@ void *cc_config_status_via(void *payload, void *rcvbuf, ib_portid_t * portid,
                            int *rstatus, const struct ibmad_port * srcport,
                            uint64_t cckey)
 {
-	ib_rpc_cc_t rpc = { 0 };
+	ib_rpc_cc_t rpc;
 	void *res;
 
 	DEBUG("attr 0x%x mod 0x%x route %s", attrid, mod, portid2str(portid));
-	rpc.method = IB_MAD_METHOD_SET;
-	rpc.attr.id = attrid;
-	rpc.attr.mod = mod;
-	rpc.timeout = timeout;
-	if (attrid == IB_CC_ATTR_CONGESTION_LOG) {
-		rpc.datasz = IB_CC_LOG_DATA_SZ;
-		rpc.dataoffs = IB_CC_LOG_DATA_OFFS;
-	}
-	else {
-		rpc.datasz = IB_CC_DATA_SZ;
-		rpc.dataoffs = IB_CC_DATA_OFFS;
-	}
-	rpc.mgtclass = IB_CC_CLASS;
-	rpc.cckey = cckey;
-
-	portid->qp = 1;
-	if (!portid->qkey)
-		portid->qkey = IB_DEFAULT_QP1_QKEY;
+	cc_rpc_init(&rpc, portid, IB_MAD_METHOD_SET, attrid, mod, timeout,
+		    cckey);
 
 	res = mad_rpc(srcport, (ib_rpc_t *)&rpc, portid, payload, rcvbuf);
 	if (rstatus)
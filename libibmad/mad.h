@@ -1596,6 +1596,10 @@ void smp_mkey_set(struct ibmad_port *srcport, uint64_t mkey);
 uint64_t smp_mkey_get(const struct ibmad_port *srcport);
 
 /* cc.c */
+void cc_rpc_init(ib_rpc_cc_t *rpc, ib_portid_t *portid, unsigned method,
+		 unsigned attrid, unsigned mod, unsigned timeout,
+		 uint64_t cckey);
+
 void *cc_query_status_via(void *rcvbuf, ib_portid_t *portid, unsigned attrid,
 			  unsigned mod, unsigned timeout, int *rstatus,
 			  const struct ibmad_port *srcport, uint64_t cckey);
@@ -848,6 +848,100 @@ error_int:
 	return NULL;
 }
 
+static int recv_port_info_refresh(smp_engine_t * engine, ibnd_smp_t * smp,
+				  uint8_t * mad, void *cb_data)
+{
+	unsigned *refreshed = engine->user_data;
+	ibnd_port_t *port = cb_data;
+	ibnd_node_t *node = port->node;
+
+	memcpy(port->info, mad + IB_SMP_DATA_OFFS, sizeof(port->info));
+
+	if (port->portnum == 0) {
+		node->smalid = (uint16_t) mad_get_field(port->info, 0,
+							 IB_PORT_LID_F);
+		node->smalmc = (uint8_t) mad_get_field(port->info, 0,
+							IB_PORT_LMC_F);
+		port->base_lid = node->smalid;
+		port->lmc = node->smalmc;
+	} else if (node->type != IB_NODE_SWITCH) {
+		port->base_lid = (uint16_t) mad_get_field(port->info, 0,
+							   IB_PORT_LID_F);
+		port->lmc = (uint8_t) mad_get_field(port->info, 0,
+						     IB_PORT_LMC_F);
+	}
+
+	(*refreshed)++;
+	return 0;
+}
+
+int ibnd_refresh_port_info(ibnd_fabric_t * fabric, char * ca_name,
+			   int ca_port, struct ibnd_config *cfg)
+{
+	struct ibnd_config config = { 0 };
+	char fixed_ca_name[UMAD_CA_NAME_LEN];
+	struct ibmad_ports_pair *ibmad_ports;
+	int mc[2] = { IB_SMI_CLASS, IB_SMI_DIRECT_CLASS };
+	smp_engine_t engine;
+	ibnd_node_t *node;
+	unsigned refreshed = 0;
+	int expected = 0;
+	int i, rc;
+
+	if (!fabric) {
+		IBND_DEBUG("fabric parameter NULL\n");
+		return -EINVAL;
+	}
+
+	if (set_config(&config, cfg)) {
+		IBND_ERROR("Invalid ibnd_config\n");
+		return -EINVAL;
+	}
+
+	/* in case of smi/gsi separation make sure we take the smi name */
+	ibmad_ports = mad_rpc_open_port2(ca_name, ca_port, mc, 2, 1);
+	if (!ibmad_ports || !ibmad_ports->smi.port) {
+		IBND_ERROR("can't open MAD port (%s:%d)\n", ca_name, ca_port);
+		if (ibmad_ports)
+			mad_rpc_close_port2(ibmad_ports);
+		return -EIO;
+	}
+	memset(fixed_ca_name, 0, UMAD_CA_NAME_LEN);
+	strncpy(fixed_ca_name, ibmad_ports->smi.ca_name, UMAD_CA_NAME_LEN);
+	mad_rpc_close_port2(ibmad_ports);
+
+	if (smp_engine_init(&engine, fixed_ca_name, ca_port, &refreshed,
+			    &config))
+		return -EIO;
+
+	/* Issue PortInfo for every known port; the engine keeps at most
+	 * config.max_smps of them on the wire and queues the rest.
+	 */
+	for (node = fabric->nodes; node; node = node->next) {
+		if (!node->ports)
+			continue;
+		for (i = 0; i <= node->numports; i++) {
+			ibnd_port_t *port = node->ports[i];
+			if (!port)
+				continue;
+			if ((rc = issue_smp(&engine, &node->path_portid,
+					    IB_ATTR_PORT_INFO, i,
+					    recv_port_info_refresh, port)) != 0)
+				goto out;
+			expected++;
+		}
+	}
+
+	rc = process_mads(&engine);
+out:
+	fabric->total_mads_used += engine.total_smps;
+	smp_engine_destroy(&engine);
+	if (rc)
+		return rc;
+
+	return expected - (int)refreshed;
+}
+
 void destroy_node(ibnd_node_t * node)
 {
 	int p = 0;
@@ -196,6 +196,18 @@ ibnd_fabric_t *ibnd_discover_fabric(char *ca_name, int ca_port,
 	 * config: (optional) additional config options for the scan
 	 */
 void ibnd_destroy_fabric(ibnd_fabric_t *fabric);
+int ibnd_refresh_port_info(ibnd_fabric_t *fabric, char *ca_name, int ca_port,
+			   struct ibnd_config *config);
+	/**
+	 * Re-read PortInfo for every port already known in fabric, keeping
+	 * up to config->max_smps SMPs outstanding.  The fabric topology is
+	 * not changed; only port info (state, width, speed, lids) is
+	 * updated in place.  fabric must come from ibnd_discover_fabric, a
+	 * fabric loaded from a cache file has no valid paths.
+	 *
+	 * Returns < 0 on failure, otherwise the number of ports which did
+	 * not respond (their info is left untouched).
+	 */
 
 ibnd_fabric_t *ibnd_load_fabric(const char *file, unsigned int flags);
 
@@ -63,6 +63,11 @@ static int use_ts;
 static int validate_buf;
 static int use_dm;
 static int use_new_send;
+static int use_cq_ex;
+static int use_hist;
+static unsigned int burst = 1;
+static unsigned int cq_mod_count;
+static unsigned int cq_mod_period;
 
 struct pingpong_context {
 	struct ibv_context	*context;
@@ -81,16 +86,30 @@ struct pingpong_context {
 	int			 send_flags;
 	int			 rx_depth;
 	int			 pending;
+	unsigned int		 burst_rcnt;
+	struct ibv_sge		 sge;
+	struct ibv_send_wr	*wr;		/* chain of burst sends */
+	uint64_t		 round_start;
+	uint64_t		*lat;
+	unsigned int		 nlat;
 	struct ibv_port_attr     portinfo;
 	uint64_t		 completion_timestamp_mask;
 };
 
 static struct ibv_cq *pp_cq(struct pingpong_context *ctx)
 {
-	return use_ts ? ibv_cq_ex_to_cq(ctx->cq_s.cq_ex) :
+	return use_cq_ex ? ibv_cq_ex_to_cq(ctx->cq_s.cq_ex) :
 		ctx->cq_s.cq;
 }
 
+static uint64_t pp_gettime_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
 struct pingpong_dest {
 	int lid;
 	int qpn;
@@ -331,7 +350,7 @@ out:
 
 static struct pingpong_context *pp_init_ctx(struct ibv_device *ib_dev, int size,
 					    int rx_depth, int port,
-					    int use_event)
+					    int use_event, unsigned int iters)
 {
 	struct pingpong_context *ctx;
 	int access_flags = IBV_ACCESS_LOCAL_WRITE;
@@ -375,6 +394,20 @@ static struct pingpong_context *pp_init_ctx(struct ibv_device *ib_dev, int size,
 		goto clean_comp_channel;
 	}
 
+	if (burst > 1) {
+		struct ibv_device_attr dev_attr;
+
+		if (ibv_query_device(ctx->context, &dev_attr)) {
+			fprintf(stderr, "Couldn't query device attributes\n");
+			goto clean_pd;
+		}
+		if (burst > dev_attr.max_qp_wr) {
+			fprintf(stderr, "Burst size %u exceeds the device limit of %d send WRs\n",
+				burst, dev_attr.max_qp_wr);
+			goto clean_pd;
+		}
+	}
+
 	if (use_odp || use_ts || use_dm) {
 		const uint32_t rc_caps_mask = IBV_ODP_SUPPORT_SEND |
 					      IBV_ODP_SUPPORT_RECV;
@@ -460,13 +493,14 @@ static struct pingpong_context *pp_init_ctx(struct ibv_device *ib_dev, int size,
 			fprintf(stderr, "Couldn't prefetch MR(%d). Continue anyway\n", ret);
 	}
 
-	if (use_ts) {
+	if (use_cq_ex) {
 		struct ibv_cq_init_attr_ex attr_ex = {
 			.cqe = rx_depth + 1,
 			.cq_context = NULL,
 			.channel = ctx->channel,
 			.comp_vector = 0,
-			.wc_flags = IBV_WC_EX_WITH_COMPLETION_TIMESTAMP
+			.wc_flags = use_ts ?
+				IBV_WC_EX_WITH_COMPLETION_TIMESTAMP : 0
 		};
 
 		ctx->cq_s.cq_ex = ibv_create_cq_ex(ctx->context, &attr_ex);
@@ -480,13 +514,36 @@ static struct pingpong_context *pp_init_ctx(struct ibv_device *ib_dev, int size,
 		goto clean_mr;
 	}
 
+	if (cq_mod_count) {
+		struct ibv_modify_cq_attr attr = {
+			.attr_mask = IBV_CQ_ATTR_MODERATE,
+			.moderate = {
+				.cq_count  = cq_mod_count,
+				.cq_period = cq_mod_period
+			}
+		};
+
+		if (ibv_modify_cq(pp_cq(ctx), &attr)) {
+			fprintf(stderr, "Couldn't set CQ moderation\n");
+			goto clean_cq;
+		}
+	}
+
+	if (use_hist) {
+		ctx->lat = calloc(iters, sizeof(*ctx->lat));
+		if (!ctx->lat) {
+			fprintf(stderr, "Couldn't allocate latency samples\n");
+			goto clean_cq;
+		}
+	}
+
 	{
 		struct ibv_qp_attr attr;
 		struct ibv_qp_init_attr init_attr = {
 			.send_cq = pp_cq(ctx),
 			.recv_cq = pp_cq(ctx),
 			.cap     = {
-				.max_send_wr  = 1,
+				.max_send_wr  = burst,
 				.max_recv_wr  = rx_depth,
 				.max_send_sge = 1,
 				.max_recv_sge = 1
@@ -499,7 +556,7 @@ static struct pingpong_context *pp_init_ctx(struct ibv_device *ib_dev, int size,
 
 			init_attr_ex.send_cq = pp_cq(ctx);
 			init_attr_ex.recv_cq = pp_cq(ctx);
-			init_attr_ex.cap.max_send_wr = 1;
+			init_attr_ex.cap.max_send_wr = burst;
 			init_attr_ex.cap.max_recv_wr = rx_depth;
 			init_attr_ex.cap.max_send_sge = 1;
 			init_attr_ex.cap.max_recv_sge = 1;
@@ -528,6 +585,32 @@ static struct pingpong_context *pp_init_ctx(struct ibv_device *ib_dev, int size,
 			ctx->send_flags |= IBV_SEND_INLINE;
 	}
 
+	ctx->sge.addr = use_dm ? 0 : (uintptr_t) ctx->buf;
+	ctx->sge.length = size;
+	ctx->sge.lkey = ctx->mr->lkey;
+
+	if (!use_new_send) {
+		unsigned int i;
+
+		ctx->wr = calloc(burst, sizeof(*ctx->wr));
+		if (!ctx->wr) {
+			fprintf(stderr, "Couldn't allocate send WRs\n");
+			goto clean_qp;
+		}
+
+		for (i = 0; i < burst; i++) {
+			ctx->wr[i] = (struct ibv_send_wr) {
+				.wr_id	    = PINGPONG_SEND_WRID,
+				.next	    = i == burst - 1 ? NULL : &ctx->wr[i + 1],
+				.sg_list    = &ctx->sge,
+				.num_sge    = 1,
+				.opcode     = IBV_WR_SEND,
+				.send_flags = i == burst - 1 ? ctx->send_flags :
+					ctx->send_flags & ~IBV_SEND_SIGNALED,
+			};
+		}
+	}
+
 	{
 		struct ibv_qp_attr attr = {
 			.qp_state        = IBV_QPS_INIT,
@@ -549,9 +632,11 @@ static struct pingpong_context *pp_init_ctx(struct ibv_device *ib_dev, int size,
 	return ctx;
 
 clean_qp:
+	free(ctx->wr);
 	ibv_destroy_qp(ctx->qp);
 
 clean_cq:
+	free(ctx->lat);
 	ibv_destroy_cq(pp_cq(ctx));
 
 clean_mr:
@@ -621,6 +706,8 @@ static int pp_close_ctx(struct pingpong_context *ctx)
 		return 1;
 	}
 
+	free(ctx->wr);
+	free(ctx->lat);
 	free(ctx->buf);
 	free(ctx);
 
@@ -649,35 +736,35 @@ static int pp_post_recv(struct pingpong_context *ctx, int n)
 	return i;
 }
 
+/*
+ * Post a burst of sends in one call.  Only the last send is signaled, so
+ * each burst generates a single send completion.
+ */
 static int pp_post_send(struct pingpong_context *ctx)
 {
-	struct ibv_sge list = {
-		.addr	= use_dm ? 0 : (uintptr_t) ctx->buf,
-		.length = ctx->size,
-		.lkey	= ctx->mr->lkey
-	};
-	struct ibv_send_wr wr = {
-		.wr_id	    = PINGPONG_SEND_WRID,
-		.sg_list    = &list,
-		.num_sge    = 1,
-		.opcode     = IBV_WR_SEND,
-		.send_flags = ctx->send_flags,
-	};
 	struct ibv_send_wr *bad_wr;
+	unsigned int i;
+
+	if (use_hist)
+		ctx->round_start = pp_gettime_ns();
 
 	if (use_new_send) {
 		ibv_wr_start(ctx->qpx);
 
-		ctx->qpx->wr_id = PINGPONG_SEND_WRID;
-		ctx->qpx->wr_flags = ctx->send_flags;
+		for (i = 0; i < burst; i++) {
+			ctx->qpx->wr_id = PINGPONG_SEND_WRID;
+			ctx->qpx->wr_flags = i == burst - 1 ? ctx->send_flags :
+				ctx->send_flags & ~IBV_SEND_SIGNALED;
 
-		ibv_wr_send(ctx->qpx);
-		ibv_wr_set_sge(ctx->qpx, list.lkey, list.addr, list.length);
+			ibv_wr_send(ctx->qpx);
+			ibv_wr_set_sge(ctx->qpx, ctx->sge.lkey, ctx->sge.addr,
+				       ctx->sge.length);
+		}
 
 		return ibv_wr_complete(ctx->qpx);
-	} else {
-		return ibv_post_send(ctx->qp, &wr, &bad_wr);
 	}
+
+	return ibv_post_send(ctx->qp, ctx->wr, &bad_wr);
 }
 
 struct ts_params {
@@ -708,7 +795,7 @@ static inline int parse_single_wc(struct pingpong_context *ctx, int *scnt,
 		break;
 
 	case PINGPONG_RECV_WRID:
-		if (--(*routs) <= 1) {
+		if (--(*routs) <= burst) {
 			*routs += pp_post_recv(ctx, ctx->rx_depth - *routs);
 			if (*routs < ctx->rx_depth) {
 				fprintf(stderr,
@@ -718,7 +805,6 @@ static inline int parse_single_wc(struct pingpong_context *ctx, int *scnt,
 			}
 		}
 
-		++(*rcnt);
 		if (use_ts) {
 			if (ts->last_comp_with_ts) {
 				uint64_t delta;
@@ -742,6 +828,11 @@ static inline int parse_single_wc(struct pingpong_context *ctx, int *scnt,
 			ts->last_comp_with_ts = 0;
 		}
 
+		/* An exchange is complete once the whole burst arrived */
+		if (++ctx->burst_rcnt < burst)
+			return 0;
+		ctx->burst_rcnt = 0;
+		++(*rcnt);
 		break;
 
 	default:
@@ -751,6 +842,13 @@ static inline int parse_single_wc(struct pingpong_context *ctx, int *scnt,
 	}
 
 	ctx->pending &= ~(int)wr_id;
+	if (!ctx->pending && ctx->round_start) {
+		if (ctx->nlat < iters)
+			ctx->lat[ctx->nlat++] = pp_gettime_ns() -
+						ctx->round_start;
+		ctx->round_start = 0;
+	}
+
 	if (*scnt < iters && !ctx->pending) {
 		if (pp_post_send(ctx)) {
 			fprintf(stderr, "Couldn't post send\n");
@@ -787,6 +885,59 @@ static void usage(const char *argv0)
 	printf("  -c, --chk	            validate received buffer\n");
 	printf("  -j, --dm	            use device memory\n");
 	printf("  -N, --new_send            use new post send WR API\n");
+	printf("  -B, --burst=<n>        messages posted at once per exchange (default 1)\n");
+	printf("  -x, --cq-ex            poll with the extended CQ API\n");
+	printf("  -M, --cq-mod=<count>[,<usec>] set CQ moderation\n");
+	printf("  -H, --hist             print a latency histogram of the exchanges\n");
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a;
+	uint64_t y = *(const uint64_t *) b;
+
+	return (x > y) - (x < y);
+}
+
+/* Nearest-rank percentile of sorted samples, in usec */
+static double pp_percentile(const uint64_t *lat, unsigned int cnt,
+			    unsigned int permille)
+{
+	uint64_t rank = ((uint64_t) cnt * permille + 999) / 1000;
+
+	return lat[rank ? rank - 1 : 0] / 1000.;
+}
+
+static void pp_print_hist(struct pingpong_context *ctx)
+{
+	unsigned int hist[64] = {};
+	unsigned int i, b, lo = 63, hi = 0;
+
+	if (!ctx->nlat)
+		return;
+
+	qsort(ctx->lat, ctx->nlat, sizeof(*ctx->lat), cmp_u64);
+	printf("latency usec/iter: min %.2f p50 %.2f p90 %.2f p99 %.2f "
+	       "p99.9 %.2f max %.2f\n", ctx->lat[0] / 1000.,
+	       pp_percentile(ctx->lat, ctx->nlat, 500),
+	       pp_percentile(ctx->lat, ctx->nlat, 900),
+	       pp_percentile(ctx->lat, ctx->nlat, 990),
+	       pp_percentile(ctx->lat, ctx->nlat, 999),
+	       ctx->lat[ctx->nlat - 1] / 1000.);
+
+	/* Power of two buckets, bucket b holds [2^(b-1), 2^b) nsec */
+	for (i = 0; i < ctx->nlat; i++) {
+		b = ctx->lat[i] ? 64 - __builtin_clzll(ctx->lat[i]) : 0;
+		b = min(b, 63U);
+		hist[b]++;
+		lo = min(lo, b);
+		hi = max(hi, b);
+	}
+
+	for (b = lo; b <= hi; b++)
+		printf("  %10.3f - %10.3f usec: %u\n",
+		       b ? (1ULL << (b - 1)) / 1000. : 0.,
+		       (1ULL << b) / 1000., hist[b]);
 }
 
 int main(int argc, char *argv[])
@@ -837,10 +988,14 @@ int main(int argc, char *argv[])
 			{ .name = "chk",      .has_arg = 0, .val = 'c' },
 			{ .name = "dm",       .has_arg = 0, .val = 'j' },
 			{ .name = "new_send", .has_arg = 0, .val = 'N' },
+			{ .name = "burst",    .has_arg = 1, .val = 'B' },
+			{ .name = "cq-ex",    .has_arg = 0, .val = 'x' },
+			{ .name = "cq-mod",   .has_arg = 1, .val = 'M' },
+			{ .name = "hist",     .has_arg = 0, .val = 'H' },
 			{}
 		};
 
-		c = getopt_long(argc, argv, "p:d:i:s:m:r:n:l:eg:oOPtcjN",
+		c = getopt_long(argc, argv, "p:d:i:s:m:r:n:l:eg:oOPtcjNB:xM:H",
 				long_options, NULL);
 
 		if (c == -1)
@@ -924,6 +1079,30 @@ int main(int argc, char *argv[])
 			use_new_send = 1;
 			break;
 
+		case 'B':
+			burst = strtoul(optarg, NULL, 0);
+			if (!burst) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+
+		case 'x':
+			use_cq_ex = 1;
+			break;
+
+		case 'M':
+			if (sscanf(optarg, "%u,%u", &cq_mod_count,
+				   &cq_mod_period) < 1 || !cq_mod_count) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+
+		case 'H':
+			use_hist = 1;
+			break;
+
 		default:
 			usage(argv[0]);
 			return 1;
@@ -947,7 +1126,13 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
+	if (rx_depth <= burst) {
+		fprintf(stderr, "rx depth must be larger than the burst size\n");
+		return 1;
+	}
+
 	if (use_ts) {
+		use_cq_ex = 1;
 		ts.comp_recv_max_time_delta = 0;
 		ts.comp_recv_min_time_delta = 0xffffffff;
 		ts.comp_recv_total_time_delta = 0;
@@ -982,7 +1167,7 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	ctx = pp_init_ctx(ib_dev, size, rx_depth, ib_port, use_event);
+	ctx = pp_init_ctx(ib_dev, size, rx_depth, ib_port, use_event, iters);
 	if (!ctx)
 		return 1;
 
@@ -1095,7 +1280,7 @@ int main(int argc, char *argv[])
 			}
 		}
 
-		if (use_ts) {
+		if (use_cq_ex) {
 			struct ibv_poll_cq_attr attr = {};
 
 			do {
@@ -1106,26 +1291,23 @@ int main(int argc, char *argv[])
 				fprintf(stderr, "poll CQ failed %d\n", ret);
 				return ret;
 			}
-			ret = parse_single_wc(ctx, &scnt, &rcnt, &routs,
-					      iters,
-					      ctx->cq_s.cq_ex->wr_id,
-					      ctx->cq_s.cq_ex->status,
-					      ibv_wc_read_completion_ts(ctx->cq_s.cq_ex),
-					      &ts);
-			if (ret) {
-				ibv_end_poll(ctx->cq_s.cq_ex);
-				return ret;
-			}
-			ret = ibv_next_poll(ctx->cq_s.cq_ex);
-			if (!ret)
+
+			/* Drain everything available within one poll cycle */
+			do {
 				ret = parse_single_wc(ctx, &scnt, &rcnt, &routs,
 						      iters,
 						      ctx->cq_s.cq_ex->wr_id,
 						      ctx->cq_s.cq_ex->status,
-						      ibv_wc_read_completion_ts(ctx->cq_s.cq_ex),
+						      use_ts ? ibv_wc_read_completion_ts(ctx->cq_s.cq_ex) : 0,
 						      &ts);
+				if (ret) {
+					ibv_end_poll(ctx->cq_s.cq_ex);
+					return ret;
+				}
+				ret = ibv_next_poll(ctx->cq_s.cq_ex);
+			} while (!ret);
 			ibv_end_poll(ctx->cq_s.cq_ex);
-			if (ret && ret != ENOENT) {
+			if (ret != ENOENT) {
 				fprintf(stderr, "poll CQ failed %d\n", ret);
 				return ret;
 			}
@@ -1163,13 +1345,16 @@ int main(int argc, char *argv[])
 	{
 		float usec = (end.tv_sec - start.tv_sec) * 1000000 +
 			(end.tv_usec - start.tv_usec);
-		long long bytes = (long long) size * iters * 2;
+		long long bytes = (long long) size * iters * burst * 2;
 
 		printf("%lld bytes in %.2f seconds = %.2f Mbit/sec\n",
 		       bytes, usec / 1000000., bytes * 8. / usec);
 		printf("%d iters in %.2f seconds = %.2f usec/iter\n",
 		       iters, usec / 1000000., usec / iters);
 
+		if (use_hist)
+			pp_print_hist(ctx);
+
 		if (use_ts && ts.comp_with_time_iters) {
 			printf("Max receive completion clock cycles = %" PRIu64 "\n",
 			       ts.comp_recv_max_time_delta);
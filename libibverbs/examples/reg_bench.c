@@ -0,0 +1,429 @@
+/*
+ * Copyright (c) 2005 Topspin Communications.  All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * OpenIB.org BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#define _GNU_SOURCE
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <infiniband/verbs.h>
+#include <infiniband/driver.h>
+
+#define MAX_THREAD_COUNTS 32
+
+struct bench_ctx {
+	struct ibv_pd *pd;
+	size_t size;
+	unsigned int iters;
+	unsigned int outstanding;
+	int fork_only;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int state;		/* 0 waiting, 1 running, -1 aborted */
+};
+
+struct bench_thread {
+	pthread_t thread;
+	struct bench_ctx *ctx;
+	char *buf;
+	int failed;
+};
+
+static uint64_t bench_gettime_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int bench_reg(struct bench_ctx *ctx, char *addr, struct ibv_mr **mr)
+{
+	if (ctx->fork_only)
+		return ibv_dontfork_range(addr, ctx->size);
+
+	*mr = ibv_reg_mr(ctx->pd, addr, ctx->size, IBV_ACCESS_LOCAL_WRITE);
+	return *mr ? 0 : -1;
+}
+
+static int bench_dereg(struct bench_ctx *ctx, char *addr, struct ibv_mr *mr)
+{
+	if (ctx->fork_only)
+		return ibv_dofork_range(addr, ctx->size);
+
+	return ibv_dereg_mr(mr);
+}
+
+static void *bench_thread(void *arg)
+{
+	struct bench_thread *t = arg;
+	struct bench_ctx *ctx = t->ctx;
+	struct ibv_mr **mrs;
+	unsigned int i, slot;
+	char *addr;
+
+	mrs = calloc(ctx->outstanding, sizeof(*mrs));
+	if (!mrs)
+		t->failed = 1;
+
+	pthread_mutex_lock(&ctx->lock);
+	while (!ctx->state)
+		pthread_cond_wait(&ctx->cond, &ctx->lock);
+	if (ctx->state < 0)
+		t->failed = 1;
+	pthread_mutex_unlock(&ctx->lock);
+	if (t->failed) {
+		free(mrs);
+		return NULL;
+	}
+
+	/*
+	 * Keep up to outstanding registrations alive per thread, so that
+	 * every registration but the first few also retires an older one.
+	 */
+	for (i = 0; i < ctx->iters + ctx->outstanding; i++) {
+		slot = i % ctx->outstanding;
+		addr = t->buf + (size_t) slot * ctx->size;
+
+		if (i >= ctx->outstanding &&
+		    bench_dereg(ctx, addr, mrs[slot])) {
+			fprintf(stderr, "Couldn't deregister memory\n");
+			t->failed = 1;
+			break;
+		}
+		if (i >= ctx->iters)
+			continue;
+		if (bench_reg(ctx, addr, &mrs[slot])) {
+			fprintf(stderr, "Couldn't register memory\n");
+			t->failed = 1;
+			break;
+		}
+	}
+
+	free(mrs);
+	return NULL;
+}
+
+static int run_bench(struct bench_ctx *ctx, unsigned int num_threads)
+{
+	struct bench_thread *threads;
+	long page_size = sysconf(_SC_PAGESIZE);
+	uint64_t start, elapsed, ops;
+	unsigned int i, started;
+	int ret = 1;
+
+	threads = calloc(num_threads, sizeof(*threads));
+	if (!threads)
+		return 1;
+
+	if (ctx->size > SIZE_MAX / ctx->outstanding) {
+		fprintf(stderr, "Work buf size overflows.\n");
+		goto out;
+	}
+
+	for (i = 0; i < num_threads; i++) {
+		threads[i].ctx = ctx;
+		if (posix_memalign((void **) &threads[i].buf, page_size,
+				   ctx->size * ctx->outstanding)) {
+			fprintf(stderr, "Couldn't allocate work buf.\n");
+			goto out;
+		}
+		memset(threads[i].buf, 0, ctx->size * ctx->outstanding);
+	}
+
+	/* Threads are held until all are created, so that setup is not timed */
+	ctx->state = 0;
+	for (started = 0; started < num_threads; started++) {
+		if (pthread_create(&threads[started].thread, NULL,
+				   bench_thread, &threads[started])) {
+			fprintf(stderr, "Couldn't create thread\n");
+			break;
+		}
+	}
+
+	pthread_mutex_lock(&ctx->lock);
+	ctx->state = started == num_threads ? 1 : -1;
+	pthread_cond_broadcast(&ctx->cond);
+	pthread_mutex_unlock(&ctx->lock);
+
+	start = bench_gettime_ns();
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i].thread, NULL);
+	elapsed = bench_gettime_ns() - start;
+
+	if (started < num_threads)
+		goto out;
+	for (i = 0; i < num_threads; i++)
+		if (threads[i].failed)
+			goto out;
+
+	ops = (uint64_t) ctx->iters * num_threads;
+	printf("%7u %14.0f %12.3f\n", num_threads,
+	       ops * 1e9 / (elapsed ? elapsed : 1),
+	       elapsed / 1e3 / ops * num_threads);
+	ret = 0;
+
+out:
+	for (i = 0; i < num_threads; i++)
+		free(threads[i].buf);
+	free(threads);
+	return ret;
+}
+
+static int parse_threads(char *str, unsigned int *counts)
+{
+	char *tok, *save, *end;
+	unsigned long val;
+	int num = 0;
+
+	for (tok = strtok_r(str, ",", &save); tok;
+	     tok = strtok_r(NULL, ",", &save)) {
+		val = strtoul(tok, &end, 0);
+		if (*end || !val || val > 4096 || num == MAX_THREAD_COUNTS)
+			return -1;
+		counts[num++] = val;
+	}
+	return num;
+}
+
+/* Parse a byte count with an optional K, M or G suffix */
+static int parse_size(const char *str, size_t *size)
+{
+	unsigned long long val;
+	unsigned int shift;
+	char *end;
+
+	val = strtoull(str, &end, 0);
+	switch (*end) {
+	case 'k':
+	case 'K':
+		shift = 10;
+		break;
+	case 'm':
+	case 'M':
+		shift = 20;
+		break;
+	case 'g':
+	case 'G':
+		shift = 30;
+		break;
+	case '\0':
+		shift = 0;
+		break;
+	default:
+		return -1;
+	}
+	if (shift && *++end)
+		return -1;
+	if (!val || val > SIZE_MAX >> shift)
+		return -1;
+
+	*size = (size_t) val << shift;
+	return 0;
+}
+
+static void usage(const char *argv0)
+{
+	printf("Usage:\n");
+	printf("  %s            measure memory registration throughput\n", argv0);
+	printf("\n");
+	printf("Options:\n");
+	printf("  -d, --ib-dev=<dev>     use IB device <dev> (default first device found)\n");
+	printf("  -s, --size=<size>      size of each registration, K/M/G suffixes allowed\n");
+	printf("                         (default 4096)\n");
+	printf("  -n, --iters=<iters>    registrations per thread (default 10000)\n");
+	printf("  -t, --threads=<list>   comma separated thread counts to run (default 1,2,4,8)\n");
+	printf("  -o, --outstanding=<n>  registrations kept alive per thread (default 1)\n");
+	printf("  -f, --fork             call ibv_fork_init() first\n");
+	printf("  -F, --fork-only        time only the fork protection, no device needed\n");
+}
+
+int main(int argc, char *argv[])
+{
+	struct ibv_device **dev_list = NULL;
+	struct ibv_device *ib_dev = NULL;
+	struct ibv_context *context = NULL;
+	struct bench_ctx ctx = {
+		.size = 4096,
+		.iters = 10000,
+		.outstanding = 1,
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.cond = PTHREAD_COND_INITIALIZER,
+	};
+	unsigned int counts[MAX_THREAD_COUNTS] = { 1, 2, 4, 8 };
+	int num_counts = 4;
+	char *ib_devname = NULL;
+	int use_fork = 0;
+	int i, ret = 1;
+
+	while (1) {
+		int c;
+
+		static struct option long_options[] = {
+			{ .name = "ib-dev",      .has_arg = 1, .val = 'd' },
+			{ .name = "size",        .has_arg = 1, .val = 's' },
+			{ .name = "iters",       .has_arg = 1, .val = 'n' },
+			{ .name = "threads",     .has_arg = 1, .val = 't' },
+			{ .name = "outstanding", .has_arg = 1, .val = 'o' },
+			{ .name = "fork",        .has_arg = 0, .val = 'f' },
+			{ .name = "fork-only",   .has_arg = 0, .val = 'F' },
+			{}
+		};
+
+		c = getopt_long(argc, argv, "d:s:n:t:o:fF", long_options,
+				NULL);
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 'd':
+			ib_devname = optarg;
+			break;
+
+		case 's':
+			if (parse_size(optarg, &ctx.size)) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+
+		case 'n':
+			ctx.iters = strtoul(optarg, NULL, 0);
+			break;
+
+		case 't':
+			num_counts = parse_threads(optarg, counts);
+			if (num_counts <= 0) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+
+		case 'o':
+			ctx.outstanding = strtoul(optarg, NULL, 0);
+			break;
+
+		case 'f':
+			use_fork = 1;
+			break;
+
+		case 'F':
+			ctx.fork_only = 1;
+			break;
+
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (optind < argc || !ctx.iters || !ctx.outstanding) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (use_fork || ctx.fork_only) {
+		ret = ibv_fork_init();
+		if (ret) {
+			fprintf(stderr, "Couldn't initialize fork support: %s\n",
+				strerror(ret));
+			return 1;
+		}
+		if (ibv_is_fork_initialized() != IBV_FORK_ENABLED)
+			printf("Fork protection is not needed on this kernel, "
+			       "the fork range map is not exercised\n");
+	}
+
+	if (!ctx.fork_only) {
+		dev_list = ibv_get_device_list(NULL);
+		if (!dev_list) {
+			perror("Failed to get IB devices list");
+			return 1;
+		}
+
+		if (!ib_devname) {
+			ib_dev = *dev_list;
+			if (!ib_dev) {
+				fprintf(stderr, "No IB devices found\n");
+				goto out;
+			}
+		} else {
+			for (i = 0; dev_list[i]; ++i)
+				if (!strcmp(ibv_get_device_name(dev_list[i]),
+					    ib_devname))
+					break;
+			ib_dev = dev_list[i];
+			if (!ib_dev) {
+				fprintf(stderr, "IB device %s not found\n",
+					ib_devname);
+				goto out;
+			}
+		}
+
+		context = ibv_open_device(ib_dev);
+		if (!context) {
+			fprintf(stderr, "Couldn't get context for %s\n",
+				ibv_get_device_name(ib_dev));
+			goto out;
+		}
+
+		ctx.pd = ibv_alloc_pd(context);
+		if (!ctx.pd) {
+			fprintf(stderr, "Couldn't allocate PD\n");
+			goto out;
+		}
+	}
+
+	printf("%7s %14s %12s\n", "threads", "regs/sec", "usec/reg");
+	ret = 0;
+	for (i = 0; i < num_counts && !ret; i++)
+		ret = run_bench(&ctx, counts[i]);
+
+out:
+	if (ctx.pd && ibv_dealloc_pd(ctx.pd)) {
+		fprintf(stderr, "Couldn't deallocate PD\n");
+		ret = 1;
+	}
+	if (context && ibv_close_device(context)) {
+		fprintf(stderr, "Couldn't release context\n");
+		ret = 1;
+	}
+	if (dev_list)
+		ibv_free_device_list(dev_list);
+
+	return ret;
+}
@@ -43,24 +43,55 @@
 #include <dirent.h>
 #include <limits.h>
 #include <inttypes.h>
+#include <stdbool.h>
+
+#include <ccan/ilog.h>
+#include <ccan/list.h>
+#include <ccan/minmax.h>
 
 #include "ibverbs.h"
 #include "util/rdma_nl.h"
 
-struct ibv_mem_node {
-	enum {
-		IBV_RED,
-		IBV_BLACK
-	}			color;
-	struct ibv_mem_node    *parent;
-	struct ibv_mem_node    *left, *right;
-	uintptr_t		start, end;
-	int			refcnt;
+/*
+ * Fork protection is tracked with a reference count per page.  A page is
+ * marked MADV_DONTFORK when its count goes from 0 to 1 and MADV_DOFORK when
+ * it drops back to 0.
+ *
+ * Counts live in blocks of MM_BLOCK_PAGES pages, found through a hash
+ * table with a lock per bucket.  Each block has its own lock, which also
+ * serializes the madvise() calls for its pages.  A range locks all of its
+ * blocks in ascending address order, so concurrent calls on unrelated
+ * memory never contend.
+ *
+ * While all pages of a block have the same count, the block keeps just
+ * that count and a range covering the whole block updates it at once.
+ * Only a range ending inside a block gives it a per-page array, which is
+ * dropped again once the counts are equal.
+ */
+#define MM_BLOCK_SHIFT 9
+#define MM_BLOCK_PAGES (1 << MM_BLOCK_SHIFT)
+#define MM_BUCKETS 256
+#define MM_STACK_BLOCKS 8
+
+struct ibv_mem_block {
+	struct list_node	entry;
+	uintptr_t		blkno;
+	unsigned int		users;		/* protected by the bucket lock */
+	unsigned int		nr_used;	/* pages with a non-zero count */
+	pthread_mutex_t		lock;
+	uint32_t		count;		/* of every page, if !refcnt */
+	uint32_t		*refcnt;
 };
 
-static struct ibv_mem_node *mm_root;
-static pthread_mutex_t mm_mutex = PTHREAD_MUTEX_INITIALIZER;
+struct ibv_mem_bucket {
+	pthread_mutex_t		lock;
+	struct list_head	blocks;
+} __attribute__((aligned(64)));
+
+static struct ibv_mem_bucket mm_buckets[MM_BUCKETS];
+static bool mm_enabled;
 static int page_size;
+static int page_shift;
 static int huge_page_enabled;
 static int too_late;
 
@@ -125,13 +156,13 @@ out:
 int ibv_fork_init(void)
 {
 	void *tmp, *tmp_aligned;
-	int ret;
+	int i, ret;
 	unsigned long size;
 
 	if (getenv("RDMAV_HUGEPAGES_SAFE"))
 		huge_page_enabled = 1;
 
-	if (mm_root)
+	if (mm_enabled)
 		return 0;
 
 	if (ibv_is_fork_initialized() == IBV_FORK_UNNEEDED)
@@ -163,17 +194,12 @@ int ibv_fork_init(void)
 	if (ret)
 		return ENOSYS;
 
-	mm_root = malloc(sizeof *mm_root);
-	if (!mm_root)
-		return ENOMEM;
-
-	mm_root->parent = NULL;
-	mm_root->left   = NULL;
-	mm_root->right  = NULL;
-	mm_root->color  = IBV_BLACK;
-	mm_root->start  = 0;
-	mm_root->end    = UINTPTR_MAX;
-	mm_root->refcnt = 0;
+	for (i = 0; i < MM_BUCKETS; i++) {
+		pthread_mutex_init(&mm_buckets[i].lock, NULL);
+		list_head_init(&mm_buckets[i].blocks);
+	}
+	page_shift = ilog32(page_size) - 1;
+	mm_enabled = true;
 
 	return 0;
 }
@@ -183,420 +209,115 @@ enum ibv_fork_status ibv_is_fork_initialized(void)
 	if (get_copy_on_fork())
 		return IBV_FORK_UNNEEDED;
 
-	return mm_root ? IBV_FORK_ENABLED : IBV_FORK_DISABLED;
+	return mm_enabled ? IBV_FORK_ENABLED : IBV_FORK_DISABLED;
 }
 
-static struct ibv_mem_node *__mm_prev(struct ibv_mem_node *node)
+static struct ibv_mem_block *get_block(uintptr_t blkno)
 {
-	if (node->left) {
-		node = node->left;
-		while (node->right)
-			node = node->right;
-	} else {
-		while (node->parent && node == node->parent->left)
-			node = node->parent;
+	struct ibv_mem_bucket *bucket = &mm_buckets[blkno % MM_BUCKETS];
+	struct ibv_mem_block *blk;
 
-		node = node->parent;
-	}
+	pthread_mutex_lock(&bucket->lock);
+	list_for_each(&bucket->blocks, blk, entry)
+		if (blk->blkno == blkno)
+			goto found;
 
-	return node;
+	blk = calloc(1, sizeof(*blk));
+	if (!blk)
+		goto out;
+	blk->blkno = blkno;
+	pthread_mutex_init(&blk->lock, NULL);
+	list_add(&bucket->blocks, &blk->entry);
+found:
+	blk->users++;
+out:
+	pthread_mutex_unlock(&bucket->lock);
+	return blk;
 }
 
-static struct ibv_mem_node *__mm_next(struct ibv_mem_node *node)
+/* nr_used can't change here, no one else can have the block locked */
+static void put_block(struct ibv_mem_block *blk)
 {
-	if (node->right) {
-		node = node->right;
-		while (node->left)
-			node = node->left;
-	} else {
-		while (node->parent && node == node->parent->right)
-			node = node->parent;
+	struct ibv_mem_bucket *bucket = &mm_buckets[blk->blkno % MM_BUCKETS];
 
-		node = node->parent;
+	pthread_mutex_lock(&bucket->lock);
+	if (--blk->users || blk->nr_used) {
+		pthread_mutex_unlock(&bucket->lock);
+		return;
 	}
+	list_del(&blk->entry);
+	pthread_mutex_unlock(&bucket->lock);
 
-	return node;
-}
-
-static void __mm_rotate_right(struct ibv_mem_node *node)
-{
-	struct ibv_mem_node *tmp;
-
-	tmp = node->left;
-
-	node->left = tmp->right;
-	if (node->left)
-		node->left->parent = node;
-
-	if (node->parent) {
-		if (node->parent->right == node)
-			node->parent->right = tmp;
-		else
-			node->parent->left = tmp;
-	} else
-		mm_root = tmp;
-
-	tmp->parent = node->parent;
-
-	tmp->right = node;
-	node->parent = tmp;
+	pthread_mutex_destroy(&blk->lock);
+	free(blk->refcnt);
+	free(blk);
 }
 
-static void __mm_rotate_left(struct ibv_mem_node *node)
+static uintptr_t addr_blkno(uintptr_t addr)
 {
-	struct ibv_mem_node *tmp;
-
-	tmp = node->right;
-
-	node->right = tmp->left;
-	if (node->right)
-		node->right->parent = node;
-
-	if (node->parent) {
-		if (node->parent->right == node)
-			node->parent->right = tmp;
-		else
-			node->parent->left = tmp;
-	} else
-		mm_root = tmp;
-
-	tmp->parent = node->parent;
-
-	tmp->left = node;
-	node->parent = tmp;
+	return addr >> page_shift >> MM_BLOCK_SHIFT;
 }
 
-#if 0
-static int verify(struct ibv_mem_node *node)
+static uintptr_t block_start(struct ibv_mem_block *blk)
 {
-	int hl, hr;
-
-	if (!node)
-		return 1;
-
-	hl = verify(node->left);
-	hr = verify(node->left);
-
-	if (!hl || !hr)
-		return 0;
-	if (hl != hr)
-		return 0;
-
-	if (node->color == IBV_RED) {
-		if (node->left && node->left->color != IBV_BLACK)
-			return 0;
-		if (node->right && node->right->color != IBV_BLACK)
-			return 0;
-		return hl;
-	}
-
-	return hl + 1;
+	return blk->blkno << MM_BLOCK_SHIFT << page_shift;
 }
-#endif
 
-static void __mm_add_rebalance(struct ibv_mem_node *node)
+static uintptr_t block_end(struct ibv_mem_block *blk)
 {
-	struct ibv_mem_node *parent, *gp, *uncle;
-
-	while (node->parent && node->parent->color == IBV_RED) {
-		parent = node->parent;
-		gp     = node->parent->parent;
-
-		if (parent == gp->left) {
-			uncle = gp->right;
-
-			if (uncle && uncle->color == IBV_RED) {
-				parent->color = IBV_BLACK;
-				uncle->color  = IBV_BLACK;
-				gp->color     = IBV_RED;
-
-				node = gp;
-			} else {
-				if (node == parent->right) {
-					__mm_rotate_left(parent);
-					node   = parent;
-					parent = node->parent;
-				}
-
-				parent->color = IBV_BLACK;
-				gp->color     = IBV_RED;
-
-				__mm_rotate_right(gp);
-			}
-		} else {
-			uncle = gp->left;
-
-			if (uncle && uncle->color == IBV_RED) {
-				parent->color = IBV_BLACK;
-				uncle->color  = IBV_BLACK;
-				gp->color     = IBV_RED;
-
-				node = gp;
-			} else {
-				if (node == parent->left) {
-					__mm_rotate_right(parent);
-					node   = parent;
-					parent = node->parent;
-				}
-
-				parent->color = IBV_BLACK;
-				gp->color     = IBV_RED;
-
-				__mm_rotate_left(gp);
-			}
-		}
-	}
-
-	mm_root->color = IBV_BLACK;
+	return (blk->blkno + 1) << MM_BLOCK_SHIFT << page_shift;
 }
 
-static void __mm_add(struct ibv_mem_node *new)
+static unsigned int page_index(uintptr_t addr)
 {
-	struct ibv_mem_node *node, *parent = NULL;
-
-	node = mm_root;
-	while (node) {
-		parent = node;
-		if (node->start < new->start)
-			node = node->right;
-		else
-			node = node->left;
-	}
-
-	if (parent->start < new->start)
-		parent->right = new;
-	else
-		parent->left = new;
-
-	new->parent = parent;
-	new->left   = NULL;
-	new->right  = NULL;
-
-	new->color = IBV_RED;
-	__mm_add_rebalance(new);
+	return (addr >> page_shift) & (MM_BLOCK_PAGES - 1);
 }
 
-static void __mm_remove(struct ibv_mem_node *node)
+/* blks holds the blocks of a range starting at start, in order */
+static struct ibv_mem_block *addr_block(struct ibv_mem_block **blks,
+					uintptr_t start, uintptr_t addr)
 {
-	struct ibv_mem_node *child, *parent, *sib, *tmp;
-	int nodecol;
-
-	if (node->left && node->right) {
-		tmp = node->left;
-		while (tmp->right)
-			tmp = tmp->right;
-
-		nodecol    = tmp->color;
-		child      = tmp->left;
-		tmp->color = node->color;
-
-		if (tmp->parent != node) {
-			parent        = tmp->parent;
-			parent->right = tmp->left;
-			if (tmp->left)
-				tmp->left->parent = parent;
-
-			tmp->left   	   = node->left;
-			node->left->parent = tmp;
-		} else
-			parent = tmp;
-
-		tmp->right          = node->right;
-		node->right->parent = tmp;
-
-		tmp->parent = node->parent;
-		if (node->parent) {
-			if (node->parent->left == node)
-				node->parent->left = tmp;
-			else
-				node->parent->right = tmp;
-		} else
-			mm_root = tmp;
-	} else {
-		nodecol = node->color;
-
-		child  = node->left ? node->left : node->right;
-		parent = node->parent;
-
-		if (child)
-			child->parent = parent;
-		if (parent) {
-			if (parent->left == node)
-				parent->left = child;
-			else
-				parent->right = child;
-		} else
-			mm_root = child;
-	}
-
-	free(node);
-
-	if (nodecol == IBV_RED)
-		return;
-
-	while ((!child || child->color == IBV_BLACK) && child != mm_root) {
-		if (parent->left == child) {
-			sib = parent->right;
-
-			if (sib->color == IBV_RED) {
-				parent->color = IBV_RED;
-				sib->color    = IBV_BLACK;
-				__mm_rotate_left(parent);
-				sib = parent->right;
-			}
-
-			if ((!sib->left  || sib->left->color  == IBV_BLACK) &&
-			    (!sib->right || sib->right->color == IBV_BLACK)) {
-				sib->color = IBV_RED;
-				child  = parent;
-				parent = child->parent;
-			} else {
-				if (!sib->right || sib->right->color == IBV_BLACK) {
-					if (sib->left)
-						sib->left->color = IBV_BLACK;
-					sib->color = IBV_RED;
-					__mm_rotate_right(sib);
-					sib = parent->right;
-				}
-
-				sib->color    = parent->color;
-				parent->color = IBV_BLACK;
-				if (sib->right)
-					sib->right->color = IBV_BLACK;
-				__mm_rotate_left(parent);
-				child = mm_root;
-				break;
-			}
-		} else {
-			sib = parent->left;
-
-			if (sib->color == IBV_RED) {
-				parent->color = IBV_RED;
-				sib->color    = IBV_BLACK;
-				__mm_rotate_right(parent);
-				sib = parent->left;
-			}
-
-			if ((!sib->left  || sib->left->color  == IBV_BLACK) &&
-			    (!sib->right || sib->right->color == IBV_BLACK)) {
-				sib->color = IBV_RED;
-				child  = parent;
-				parent = child->parent;
-			} else {
-				if (!sib->left || sib->left->color == IBV_BLACK) {
-					if (sib->right)
-						sib->right->color = IBV_BLACK;
-					sib->color = IBV_RED;
-					__mm_rotate_left(sib);
-					sib = parent->left;
-				}
-
-				sib->color    = parent->color;
-				parent->color = IBV_BLACK;
-				if (sib->left)
-					sib->left->color = IBV_BLACK;
-				__mm_rotate_right(parent);
-				child = mm_root;
-				break;
-			}
-		}
-	}
-
-	if (child)
-		child->color = IBV_BLACK;
+	return blks[addr_blkno(addr) - addr_blkno(start)];
 }
 
-static struct ibv_mem_node *__mm_find_start(uintptr_t start, uintptr_t end)
+/* Give a block a count per page, for a range that covers only part of it */
+static int split_block(struct ibv_mem_block *blk)
 {
-	struct ibv_mem_node *node = mm_root;
+	unsigned int i;
 
-	while (node) {
-		if (node->start <= start && node->end >= start)
-			break;
+	if (blk->refcnt)
+		return 0;
 
-		if (node->start < start)
-			node = node->right;
-		else
-			node = node->left;
+	if (!blk->count) {
+		blk->refcnt = calloc(MM_BLOCK_PAGES, sizeof(*blk->refcnt));
+		return blk->refcnt ? 0 : -1;
 	}
 
-	return node;
-}
-
-static struct ibv_mem_node *merge_ranges(struct ibv_mem_node *node,
-					 struct ibv_mem_node *prev)
-{
-	prev->end = node->end;
-	prev->refcnt = node->refcnt;
-	__mm_remove(node);
-
-	return prev;
-}
-
-static struct ibv_mem_node *split_range(struct ibv_mem_node *node,
-					uintptr_t cut_line)
-{
-	struct ibv_mem_node *new_node = NULL;
-
-	new_node = malloc(sizeof *new_node);
-	if (!new_node)
-		return NULL;
-	new_node->start  = cut_line;
-	new_node->end    = node->end;
-	new_node->refcnt = node->refcnt;
-	node->end  = cut_line - 1;
-	__mm_add(new_node);
-
-	return new_node;
-}
-
-static struct ibv_mem_node *get_start_node(uintptr_t start, uintptr_t end,
-					   int inc)
-{
-	struct ibv_mem_node *node, *tmp = NULL;
-
-	node = __mm_find_start(start, end);
-	if (node->start < start)
-		node = split_range(node, start);
-	else {
-		tmp = __mm_prev(node);
-		if (tmp && tmp->refcnt == node->refcnt + inc)
-			node = merge_ranges(node, tmp);
-	}
-	return node;
+	blk->refcnt = malloc(sizeof(*blk->refcnt) * MM_BLOCK_PAGES);
+	if (!blk->refcnt)
+		return -1;
+	for (i = 0; i < MM_BLOCK_PAGES; i++)
+		blk->refcnt[i] = blk->count;
+	return 0;
 }
 
-/*
- * This function is called if madvise() fails to undo merging/splitting
- * operations performed on the node.
- */
-static struct ibv_mem_node *undo_node(struct ibv_mem_node *node,
-				      uintptr_t start, int inc)
+/* Drop the per-page counts of a block once they are all equal */
+static void merge_block(struct ibv_mem_block *blk)
 {
-	struct ibv_mem_node *tmp = NULL;
-
-	/*
-	 * This condition can be true only if we merged this
-	 * node with the previous one, so we need to split them.
-	*/
-	if (start > node->start) {
-		tmp = split_range(node, start);
-		if (tmp) {
-			node->refcnt += inc;
-			node = tmp;
-		} else
-			return NULL;
+	unsigned int i;
+
+	/* Counts can only be equal if all or none of them are zero */
+	if (blk->nr_used == MM_BLOCK_PAGES) {
+		for (i = 1; i < MM_BLOCK_PAGES; i++)
+			if (blk->refcnt[i] != blk->refcnt[0])
+				return;
+	} else if (blk->nr_used) {
+		return;
 	}
 
-	tmp  =  __mm_prev(node);
-	if (tmp && tmp->refcnt == node->refcnt)
-		node = merge_ranges(node, tmp);
-
-	tmp  =  __mm_next(node);
-	if (tmp && tmp->refcnt == node->refcnt)
-		node = merge_ranges(tmp, node);
-
-	return node;
+	blk->count = blk->refcnt[0];
+	free(blk->refcnt);
+	blk->refcnt = NULL;
 }
 
 static int do_madvise(void *addr, size_t length, int advice,
@@ -621,14 +342,92 @@ static int do_madvise(void *addr, size_t length, int advice,
 	return 0;
 }
 
+/*
+ * Call madvise() on each run of pages in [start, end) whose count is cnt,
+ * that is the pages whose fork state changes.  On failure *fail is set to
+ * the start of the run that failed.
+ */
+static int madvise_runs(struct ibv_mem_block **blks, uintptr_t start,
+			uintptr_t end, uint32_t cnt, int advice,
+			unsigned long range_page_size, uintptr_t *fail)
+{
+	uintptr_t addr, next, run = end;
+	struct ibv_mem_block *blk;
+	bool match;
+	int ret;
+
+	for (addr = start; ; addr = next) {
+		match = false;
+		if (addr < end) {
+			blk = addr_block(blks, start, addr);
+			if (blk->refcnt) {
+				next = addr + page_size;
+				match = blk->refcnt[page_index(addr)] == cnt;
+			} else {
+				next = min(block_end(blk), end);
+				match = blk->count == cnt;
+			}
+		}
+
+		if (match) {
+			if (run == end)
+				run = addr;
+			continue;
+		}
+
+		if (run != end) {
+			ret = do_madvise((void *) run, addr - run, advice,
+					 range_page_size);
+			if (ret) {
+				*fail = run;
+				return ret;
+			}
+			run = end;
+		}
+
+		if (addr >= end)
+			return 0;
+	}
+}
+
+/* Apply inc to the counts of the pages of blk in [start, end) */
+static void update_block(struct ibv_mem_block *blk, uintptr_t start,
+			 uintptr_t end, int inc)
+{
+	uintptr_t addr;
+	uint32_t *refcnt;
+
+	if (!blk->refcnt) {
+		if (inc == -1 && !blk->count)
+			return;
+		blk->count += inc;
+		blk->nr_used = blk->count ? MM_BLOCK_PAGES : 0;
+		return;
+	}
+
+	start = max(start, block_start(blk));
+	end = min(end, block_end(blk));
+	for (addr = start; addr < end; addr += page_size) {
+		refcnt = &blk->refcnt[page_index(addr)];
+		if (inc == -1 && !*refcnt)
+			continue;
+
+		*refcnt += inc;
+		if (*refcnt == (inc == 1 ? 1 : 0))
+			blk->nr_used += inc;
+	}
+	merge_block(blk);
+}
+
 static int ibv_madvise_range(void *base, size_t size, int advice)
 {
-	uintptr_t start, end;
-	struct ibv_mem_node *node, *tmp;
+	struct ibv_mem_block *stack_blks[MM_STACK_BLOCKS] = {};
+	struct ibv_mem_block **blks = stack_blks;
+	uintptr_t start, end, fail;
+	unsigned long range_page_size;
+	size_t i, nblks;
 	int inc;
-	int rolling_back = 0;
 	int ret = 0;
-	unsigned long range_page_size;
 
 	if (!size || !base)
 		return 0;
@@ -640,84 +439,60 @@ static int ibv_madvise_range(void *base, size_t size, int advice)
 
 	start = (uintptr_t) base & ~(range_page_size - 1);
 	end   = ((uintptr_t) (base + size + range_page_size - 1) &
-		 ~(range_page_size - 1)) - 1;
-
-	pthread_mutex_lock(&mm_mutex);
-again:
-	inc = advice == MADV_DONTFORK ? 1 : -1;
+		 ~(range_page_size - 1));
 
-	node = get_start_node(start, end, inc);
-	if (!node) {
-		ret = -1;
-		goto out;
+	nblks = addr_blkno(end - 1) - addr_blkno(start) + 1;
+	if (nblks > MM_STACK_BLOCKS) {
+		blks = calloc(nblks, sizeof(*blks));
+		if (!blks)
+			return -1;
 	}
 
-	while (node && node->start <= end) {
-		if (node->end > end) {
-			if (!split_range(node, end + 1)) {
-				ret = -1;
-				goto out;
-			}
-		}
-
-		if ((inc == -1 && node->refcnt == 1) ||
-		    (inc ==  1 && node->refcnt == 0)) {
-			/*
-			 * If this is the first time through the loop,
-			 * and we merged this node with the previous
-			 * one, then we only want to do the madvise()
-			 * on start ... node->end (rather than
-			 * starting at node->start).
-			 *
-			 * Otherwise we end up doing madvise() on
-			 * bigger region than we're being asked to,
-			 * and that may lead to a spurious failure.
-			 */
-			if (start > node->start)
-				ret = do_madvise((void *) start,
-						 node->end - start + 1,
-						 advice, range_page_size);
-			else
-				ret = do_madvise((void *) node->start,
-						 node->end - node->start + 1,
-						 advice, range_page_size);
-			if (ret) {
-				node = undo_node(node, start, inc);
-
-				if (rolling_back || !node)
-					goto out;
-
-				/* madvise failed, roll back previous changes */
-				rolling_back = 1;
-				advice = advice == MADV_DONTFORK ?
-					MADV_DOFORK : MADV_DONTFORK;
-				end = node->end;
-				goto again;
-			}
+	for (i = 0; i < nblks; i++) {
+		blks[i] = get_block(addr_blkno(start) + i);
+		if (!blks[i]) {
+			ret = -1;
+			goto out;
 		}
-
-		node->refcnt += inc;
-		node = __mm_next(node);
+		pthread_mutex_lock(&blks[i]->lock);
 	}
 
-	if (node) {
-		tmp = __mm_prev(node);
-		if (tmp && node->refcnt == tmp->refcnt)
-			node = merge_ranges(node, tmp);
+	/* Only the first and last blocks can be partly covered */
+	if ((start != block_start(blks[0]) && split_block(blks[0])) ||
+	    (end != block_end(blks[nblks - 1]) &&
+	     split_block(blks[nblks - 1]))) {
+		ret = -1;
+		goto out;
 	}
 
-out:
-	if (rolling_back)
+	inc = advice == MADV_DONTFORK ? 1 : -1;
+	ret = madvise_runs(blks, start, end, inc == 1 ? 0 : 1, advice,
+			   range_page_size, &fail);
+	if (ret) {
+		/* Only MADV_DONTFORK can fail, put back what it changed */
+		madvise_runs(blks, start, fail, 0, MADV_DOFORK,
+			     range_page_size, &fail);
 		ret = -1;
+		goto out;
+	}
+
+	for (i = 0; i < nblks; i++)
+		update_block(blks[i], start, end, inc);
 
-	pthread_mutex_unlock(&mm_mutex);
+out:
+	for (i = 0; i < nblks && blks[i]; i++) {
+		pthread_mutex_unlock(&blks[i]->lock);
+		put_block(blks[i]);
+	}
+	if (blks != stack_blks)
+		free(blks);
 
 	return ret;
 }
 
 int ibv_dontfork_range(void *base, size_t size)
 {
-	if (mm_root)
+	if (mm_enabled)
 		return ibv_madvise_range(base, size, MADV_DONTFORK);
 	else {
 		too_late = 1;
@@ -727,7 +502,7 @@ int ibv_dontfork_range(void *base, size_t size)
 
 int ibv_dofork_range(void *base, size_t size)
 {
-	if (mm_root)
+	if (mm_enabled)
 		return ibv_madvise_range(base, size, MADV_DOFORK);
 	else {
 		too_late = 1;
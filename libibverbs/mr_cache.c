@@ -0,0 +1,338 @@
+/* GPLv2 or OpenIB.org BSD (MIT) See COPYING file */
+
+#include <config.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <ccan/list.h>
+#include <ccan/minmax.h>
+#include <util/util.h>
+
+#include "ibverbs.h"
+
+/*
+ * A registration cache hands out MRs that cover a requested range, and
+ * keeps them registered after the last user is done with them so that the
+ * next request for the same memory does not go to the kernel.
+ *
+ * Cached ranges are kept disjoint: a miss that overlaps or touches cached
+ * ranges registers their union and retires the old MRs.  This keeps the
+ * index a sorted array, where finding the range that covers an address is
+ * a binary search for its predecessor.
+ *
+ * An entry is on exactly one list, depending on its state:
+ *   indexed, idle - cache->lru, least recently used first
+ *   indexed, busy - no list
+ *   retired, busy - cache->stale, deregistered by the last put
+ *   retired, idle - deregistered and freed immediately
+ */
+struct mr_cache_entry {
+	struct ibv_mr *mr;
+	uintptr_t start;
+	uintptr_t end;
+	unsigned int refcnt;
+	bool indexed;
+	struct list_node entry;
+};
+
+struct ibv_mr_cache {
+	struct ibv_pd *pd;
+	unsigned int access;
+	size_t max_bytes;
+	size_t bytes;
+	pthread_mutex_t lock;
+	struct mr_cache_entry **index;
+	unsigned int cnt;
+	unsigned int max;
+	struct list_head lru;
+	struct list_head stale;
+};
+
+/* Position of the last entry starting at or below addr, or -1 */
+static int index_find(struct ibv_mr_cache *cache, uintptr_t addr)
+{
+	int lo = 0, hi = cache->cnt - 1, mid;
+
+	while (lo <= hi) {
+		mid = lo + (hi - lo) / 2;
+		if (cache->index[mid]->start <= addr)
+			lo = mid + 1;
+		else
+			hi = mid - 1;
+	}
+	return hi;
+}
+
+static int index_insert(struct ibv_mr_cache *cache, struct mr_cache_entry *e)
+{
+	struct mr_cache_entry **index;
+	int pos;
+
+	if (cache->cnt == cache->max) {
+		index = realloc(cache->index, sizeof(*index) *
+				max(cache->max * 2, 16U));
+		if (!index)
+			return ENOMEM;
+		cache->index = index;
+		cache->max = max(cache->max * 2, 16U);
+	}
+
+	pos = index_find(cache, e->start) + 1;
+	memmove(&cache->index[pos + 1], &cache->index[pos],
+		sizeof(*cache->index) * (cache->cnt - pos));
+	cache->index[pos] = e;
+	cache->cnt++;
+	e->indexed = true;
+	return 0;
+}
+
+static void index_remove(struct ibv_mr_cache *cache, int pos)
+{
+	cache->index[pos]->indexed = false;
+	cache->cnt--;
+	memmove(&cache->index[pos], &cache->index[pos + 1],
+		sizeof(*cache->index) * (cache->cnt - pos));
+}
+
+static int entry_free(struct ibv_mr_cache *cache, struct mr_cache_entry *e)
+{
+	int ret;
+
+	cache->bytes -= e->end - e->start;
+	ret = ibv_dereg_mr(e->mr);
+	free(e);
+	return ret;
+}
+
+/* Take an entry out of the index; it goes away once it is idle */
+static int entry_retire(struct ibv_mr_cache *cache, int pos)
+{
+	struct mr_cache_entry *e = cache->index[pos];
+
+	index_remove(cache, pos);
+	if (e->refcnt) {
+		list_add_tail(&cache->stale, &e->entry);
+		return 0;
+	}
+
+	list_del(&e->entry);
+	return entry_free(cache, e);
+}
+
+static void cache_evict(struct ibv_mr_cache *cache)
+{
+	struct mr_cache_entry *e;
+
+	if (!cache->max_bytes)
+		return;
+
+	while (cache->bytes > cache->max_bytes) {
+		e = list_top(&cache->lru, struct mr_cache_entry, entry);
+		if (!e)
+			break;
+		entry_retire(cache, index_find(cache, e->start));
+	}
+}
+
+struct ibv_mr_cache *ibv_create_mr_cache(struct ibv_pd *pd,
+					 struct ibv_mr_cache_init_attr *attr)
+{
+	struct ibv_mr_cache *cache;
+
+	if (attr->comp_mask & ~IBV_MR_CACHE_INIT_ATTR_MAX_BYTES) {
+		errno = EOPNOTSUPP;
+		return NULL;
+	}
+
+	cache = calloc(1, sizeof(*cache));
+	if (!cache) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	cache->pd = pd;
+	cache->access = attr->access;
+	if (attr->comp_mask & IBV_MR_CACHE_INIT_ATTR_MAX_BYTES)
+		cache->max_bytes = attr->max_bytes;
+	pthread_mutex_init(&cache->lock, NULL);
+	list_head_init(&cache->lru);
+	list_head_init(&cache->stale);
+	return cache;
+}
+
+int ibv_destroy_mr_cache(struct ibv_mr_cache *cache)
+{
+	unsigned int i;
+	int err, ret = 0;
+
+	pthread_mutex_lock(&cache->lock);
+	for (i = 0; i < cache->cnt; i++) {
+		if (cache->index[i]->refcnt) {
+			pthread_mutex_unlock(&cache->lock);
+			return EBUSY;
+		}
+	}
+	if (!list_empty(&cache->stale)) {
+		pthread_mutex_unlock(&cache->lock);
+		return EBUSY;
+	}
+
+	for (i = 0; i < cache->cnt; i++) {
+		err = entry_free(cache, cache->index[i]);
+		if (err)
+			ret = err;
+	}
+	pthread_mutex_unlock(&cache->lock);
+
+	pthread_mutex_destroy(&cache->lock);
+	free(cache->index);
+	free(cache);
+	return ret;
+}
+
+struct ibv_mr *ibv_mr_cache_get(struct ibv_mr_cache *cache, void *addr,
+				size_t length)
+{
+	uintptr_t start, end, page_size = sysconf(_SC_PAGESIZE);
+	struct mr_cache_entry *e;
+	int pos, first, last;
+	bool merge = true;
+
+	if (!length) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	pthread_mutex_lock(&cache->lock);
+	pos = index_find(cache, (uintptr_t) addr);
+	if (pos >= 0) {
+		e = cache->index[pos];
+		if (e->end >= (uintptr_t) addr + length) {
+			if (!e->refcnt++)
+				list_del(&e->entry);
+			pthread_mutex_unlock(&cache->lock);
+			return e->mr;
+		}
+	}
+
+	/* Miss: grow the range to cover every cached range it touches */
+	start = align_down((uintptr_t) addr, page_size);
+	end = align((uintptr_t) addr + length, page_size);
+	first = (pos >= 0 && cache->index[pos]->end >= start) ? pos : pos + 1;
+	for (last = first; last < cache->cnt &&
+	     cache->index[last]->start <= end; last++) {
+		start = min(start, cache->index[last]->start);
+		end = max(end, cache->index[last]->end);
+	}
+
+	e = calloc(1, sizeof(*e));
+	if (!e) {
+		errno = ENOMEM;
+		goto err;
+	}
+
+	/*
+	 * A union larger than the whole budget would evict everything else.
+	 * Register just the request instead and do not cache it.
+	 */
+	if (cache->max_bytes && end - start > cache->max_bytes &&
+	    last > first) {
+		start = align_down((uintptr_t) addr, page_size);
+		end = align((uintptr_t) addr + length, page_size);
+		merge = false;
+	}
+
+	e->mr = ibv_reg_mr_iova2(cache->pd, (void *) start, end - start,
+				 start, cache->access);
+	if (!e->mr)
+		goto err_free;
+
+	e->start = start;
+	e->end = end;
+	e->refcnt = 1;
+	cache->bytes += end - start;
+
+	if (!merge) {
+		list_add_tail(&cache->stale, &e->entry);
+		goto out;
+	}
+
+	while (last-- > first)
+		entry_retire(cache, last);
+
+	if (index_insert(cache, e)) {
+		list_add_tail(&cache->stale, &e->entry);
+		goto out;
+	}
+	cache_evict(cache);
+out:
+	pthread_mutex_unlock(&cache->lock);
+	return e->mr;
+
+err_free:
+	free(e);
+err:
+	pthread_mutex_unlock(&cache->lock);
+	return NULL;
+}
+
+int ibv_mr_cache_put(struct ibv_mr_cache *cache, struct ibv_mr *mr)
+{
+	struct mr_cache_entry *e = NULL, *iter;
+	int pos, ret = 0;
+
+	pthread_mutex_lock(&cache->lock);
+	pos = index_find(cache, (uintptr_t) mr->addr);
+	if (pos >= 0 && cache->index[pos]->mr == mr) {
+		e = cache->index[pos];
+	} else {
+		list_for_each(&cache->stale, iter, entry) {
+			if (iter->mr == mr) {
+				e = iter;
+				break;
+			}
+		}
+	}
+
+	if (!e || !e->refcnt) {
+		pthread_mutex_unlock(&cache->lock);
+		return EINVAL;
+	}
+
+	if (!--e->refcnt) {
+		if (e->indexed) {
+			list_add_tail(&cache->lru, &e->entry);
+			cache_evict(cache);
+		} else {
+			list_del(&e->entry);
+			ret = entry_free(cache, e);
+		}
+	}
+	pthread_mutex_unlock(&cache->lock);
+	return ret;
+}
+
+int ibv_mr_cache_invalidate(struct ibv_mr_cache *cache, void *addr,
+			    size_t length)
+{
+	uintptr_t start = (uintptr_t) addr, end = start + length;
+	int pos, err, ret = 0;
+
+	pthread_mutex_lock(&cache->lock);
+	pos = index_find(cache, start);
+	if (pos < 0 || cache->index[pos]->end <= start)
+		pos++;
+
+	while (pos < cache->cnt && cache->index[pos]->start < end) {
+		err = entry_retire(cache, pos);
+		if (err)
+			ret = err;
+	}
+	pthread_mutex_unlock(&cache->lock);
+	return ret;
+}
@@ -2704,6 +2704,50 @@ int ibv_rereg_mr(struct ibv_mr *mr, int flags,
  */
 int ibv_dereg_mr(struct ibv_mr *mr);
 
+struct ibv_mr_cache;
+
+enum ibv_mr_cache_init_attr_mask {
+	IBV_MR_CACHE_INIT_ATTR_MAX_BYTES = 1 << 0,
+};
+
+struct ibv_mr_cache_init_attr {
+	uint32_t comp_mask; /* From ibv_mr_cache_init_attr_mask */
+	unsigned int access; /* Access flags of every cached MR */
+	size_t max_bytes; /* Budget of registered bytes */
+};
+
+/**
+ * ibv_create_mr_cache - Create a memory registration cache on a PD
+ */
+struct ibv_mr_cache *ibv_create_mr_cache(struct ibv_pd *pd,
+					 struct ibv_mr_cache_init_attr *attr);
+
+/**
+ * ibv_destroy_mr_cache - Deregister all cached MRs and free the cache
+ */
+int ibv_destroy_mr_cache(struct ibv_mr_cache *cache);
+
+/**
+ * ibv_mr_cache_get - Get an MR covering [addr, addr + length)
+ * The returned MR may be larger than the requested range, and must be
+ * released with ibv_mr_cache_put().
+ */
+struct ibv_mr *ibv_mr_cache_get(struct ibv_mr_cache *cache, void *addr,
+				size_t length);
+
+/**
+ * ibv_mr_cache_put - Release an MR returned by ibv_mr_cache_get()
+ */
+int ibv_mr_cache_put(struct ibv_mr_cache *cache, struct ibv_mr *mr);
+
+/**
+ * ibv_mr_cache_invalidate - Drop cached MRs overlapping a range
+ * Must be called before the range is unmapped, unless the cache uses
+ * IBV_ACCESS_ON_DEMAND.
+ */
+int ibv_mr_cache_invalidate(struct ibv_mr_cache *cache, void *addr,
+			    size_t length);
+
 /**
  * ibv_alloc_mw - Allocate a memory window
  */
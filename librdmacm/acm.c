@@ -30,15 +30,20 @@
  * SOFTWARE.
  */
 
+#define _GNU_SOURCE
 #include <config.h>
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <inttypes.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <netdb.h>
 #include <unistd.h>
+#include <poll.h>
+#include <search.h>
+#include <time.h>
 
 #include "cma.h"
 #include "acm.h"
@@ -50,6 +55,32 @@ static pthread_mutex_t acm_lock = PTHREAD_MUTEX_INITIALIZER;
 static int sock = -1;
 static uint16_t server_port;
 
+/*
+ * Responses from ibacm are cached in the process, so that applications
+ * resolving the same destinations repeatedly, e.g. every rank of a job
+ * connecting to every other rank, do not each wait on ibacm.  Successful
+ * resolutions are kept for RDMACM_ACM_CACHE_TTL seconds and failures for
+ * RDMACM_ACM_CACHE_NEG_TTL seconds.  A TTL of 0 disables caching.  The
+ * cache is flushed when the rdma_cm reports an address change, device
+ * removal or unreachable destination, or the device list changes.
+ */
+#define ACM_CACHE_TTL		60
+#define ACM_CACHE_NEG_TTL	2
+#define ACM_CACHE_MAX		8192
+#define ACM_BATCH_SOCKS		16
+
+struct acm_cache_entry {
+	struct acm_msg	req;	/* must be first, used as the key */
+	struct acm_msg	resp;
+	uint64_t	expire;
+};
+
+static pthread_mutex_t acm_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static void *acm_cache;
+static int acm_cache_cnt;
+static unsigned int acm_cache_ttl = ACM_CACHE_TTL;
+static unsigned int acm_cache_neg_ttl = ACM_CACHE_NEG_TTL;
+
 static int ucma_set_server_port(void)
 {
 	FILE *f;
@@ -64,54 +95,71 @@ static int ucma_set_server_port(void)
 	return server_port;
 }
 
-void ucma_ib_init(void)
+/* Returns a socket connected to ibacm, or -1 */
+static int ucma_acm_connect(void)
 {
 	union {
 		struct sockaddr any;
 		struct sockaddr_in inet;
 		struct sockaddr_un unx;
 	} addr;
-	static int init;
-	int ret;
-
-	if (init)
-		return;
-
-	pthread_mutex_lock(&acm_lock);
-	if (init)
-		goto unlock;
+	int s, ret;
 
-	if (ucma_set_server_port()) {
-		sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_TCP);
-		if (sock < 0)
-			goto out;
+	if (server_port) {
+		s = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_TCP);
+		if (s < 0)
+			return -1;
 
 		memset(&addr, 0, sizeof(addr));
 		addr.any.sa_family = AF_INET;
 		addr.inet.sin_addr.s_addr = htobe32(INADDR_LOOPBACK);
 		addr.inet.sin_port = htobe16(server_port);
-		ret = connect(sock, &addr.any, sizeof(addr.inet));
-		if (ret) {
-			close(sock);
-			sock = -1;
-		}
+		ret = connect(s, &addr.any, sizeof(addr.inet));
 	} else {
-		sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
-		if (sock < 0)
-			goto out;
+		s = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (s < 0)
+			return -1;
 
 		memset(&addr, 0, sizeof(addr));
 		addr.any.sa_family = AF_UNIX;
 		BUILD_ASSERT(sizeof(IBACM_SERVER_PATH) <=
 			     sizeof(addr.unx.sun_path));
 		strcpy(addr.unx.sun_path, IBACM_SERVER_PATH);
-		ret = connect(sock, &addr.any, sizeof(addr.unx));
-		if (ret) {
-			close(sock);
-			sock = -1;
-		}
+		ret = connect(s, &addr.any, sizeof(addr.unx));
 	}
-out:
+	if (ret) {
+		close(s);
+		return -1;
+	}
+	return s;
+}
+
+static void ucma_acm_cache_init(void)
+{
+	char *var;
+
+	var = getenv("RDMACM_ACM_CACHE_TTL");
+	if (var)
+		acm_cache_ttl = strtoul(var, NULL, 0);
+	var = getenv("RDMACM_ACM_CACHE_NEG_TTL");
+	if (var)
+		acm_cache_neg_ttl = strtoul(var, NULL, 0);
+}
+
+void ucma_ib_init(void)
+{
+	static int init;
+
+	if (init)
+		return;
+
+	pthread_mutex_lock(&acm_lock);
+	if (init)
+		goto unlock;
+
+	ucma_acm_cache_init();
+	ucma_set_server_port();
+	sock = ucma_acm_connect();
 	init = 1;
 unlock:
 	pthread_mutex_unlock(&acm_lock);
@@ -123,6 +171,95 @@ void ucma_ib_cleanup(void)
 		shutdown(sock, SHUT_RDWR);
 		close(sock);
 	}
+	ucma_ib_flush_cache();
+}
+
+static uint64_t ucma_acm_time(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec;
+}
+
+static int ucma_acm_cache_compare(const void *a, const void *b)
+{
+	const struct acm_msg *req1 = a, *req2 = b;
+
+	if (req1->hdr.length != req2->hdr.length)
+		return req1->hdr.length < req2->hdr.length ? -1 : 1;
+
+	return memcmp(req1->data, req2->data,
+		      req1->hdr.length - ACM_MSG_HDR_LENGTH);
+}
+
+void ucma_ib_flush_cache(void)
+{
+	pthread_mutex_lock(&acm_cache_lock);
+	tdestroy(acm_cache, free);
+	acm_cache = NULL;
+	acm_cache_cnt = 0;
+	pthread_mutex_unlock(&acm_cache_lock);
+}
+
+/* Copies a cached response for req into resp, returns 0 if none is found */
+static int ucma_acm_cache_lookup(struct acm_msg *req, struct acm_msg *resp)
+{
+	struct acm_cache_entry **node, *entry;
+	int found = 0;
+
+	pthread_mutex_lock(&acm_cache_lock);
+	node = tfind(req, &acm_cache, ucma_acm_cache_compare);
+	if (node) {
+		entry = *node;
+		if (entry->expire > ucma_acm_time()) {
+			memcpy(resp, &entry->resp, entry->resp.hdr.length);
+			found = 1;
+		} else {
+			tdelete(req, &acm_cache, ucma_acm_cache_compare);
+			free(entry);
+			acm_cache_cnt--;
+		}
+	}
+	pthread_mutex_unlock(&acm_cache_lock);
+	return found;
+}
+
+static void ucma_acm_cache_insert(struct acm_msg *req, struct acm_msg *resp)
+{
+	struct acm_cache_entry *entry, **node, *old;
+	unsigned int ttl;
+
+	ttl = resp->hdr.status ? acm_cache_neg_ttl : acm_cache_ttl;
+	if (!ttl)
+		return;
+
+	entry = malloc(sizeof(*entry));
+	if (!entry)
+		return;
+
+	memcpy(&entry->req, req, req->hdr.length);
+	memcpy(&entry->resp, resp, resp->hdr.length);
+	entry->expire = ucma_acm_time() + ttl;
+
+	pthread_mutex_lock(&acm_cache_lock);
+	node = tfind(req, &acm_cache, ucma_acm_cache_compare);
+	if (node) {
+		old = *node;
+		tdelete(req, &acm_cache, ucma_acm_cache_compare);
+		free(old);
+		acm_cache_cnt--;
+	} else if (acm_cache_cnt >= ACM_CACHE_MAX) {
+		/* entries are cheap to recreate, so simply start over */
+		tdestroy(acm_cache, free);
+		acm_cache = NULL;
+		acm_cache_cnt = 0;
+	}
+	if (tsearch(entry, &acm_cache, ucma_acm_cache_compare))
+		acm_cache_cnt++;
+	else
+		free(entry);
+	pthread_mutex_unlock(&acm_cache_lock);
 }
 
 static int ucma_ib_set_addr(struct rdma_addrinfo *ib_rai,
@@ -319,42 +456,41 @@ static int ucma_ib_addr(struct sockaddr *addr, socklen_t len)
 	return len && addr && (addr->sa_family == AF_IB);
 }
 
-void ucma_ib_resolve(struct rdma_addrinfo **rai,
-		     const struct rdma_addrinfo *hints)
+/*
+ * Formats the ACM resolve request for rai.  Returns 1 if the response may
+ * be cached, which is the case unless the request carries path data.
+ */
+static int ucma_ib_format_req(struct acm_msg *msg, struct rdma_addrinfo *rai,
+			      const struct rdma_addrinfo *hints)
 {
-	struct acm_msg msg;
 	struct acm_ep_addr_data *data;
-	int ret;
-
-	ucma_ib_init();
-	if (sock < 0)
-		return;
+	int cacheable = 1;
 
-	memset(&msg, 0, sizeof msg);
-	msg.hdr.version = ACM_VERSION;
-	msg.hdr.opcode = ACM_OP_RESOLVE;
-	msg.hdr.length = ACM_MSG_HDR_LENGTH;
+	memset(msg, 0, sizeof *msg);
+	msg->hdr.version = ACM_VERSION;
+	msg->hdr.opcode = ACM_OP_RESOLVE;
+	msg->hdr.length = ACM_MSG_HDR_LENGTH;
 
-	data = &msg.resolve_data[0];
-	if (ucma_inet_addr((*rai)->ai_src_addr, (*rai)->ai_src_len)) {
+	data = &msg->resolve_data[0];
+	if (ucma_inet_addr(rai->ai_src_addr, rai->ai_src_len)) {
 		data->flags = ACM_EP_FLAG_SOURCE;
-		ucma_set_ep_addr(data, (*rai)->ai_src_addr);
+		ucma_set_ep_addr(data, rai->ai_src_addr);
 		data++;
-		msg.hdr.length += ACM_MSG_EP_LENGTH;
+		msg->hdr.length += ACM_MSG_EP_LENGTH;
 	}
 
-	if (ucma_inet_addr((*rai)->ai_dst_addr, (*rai)->ai_dst_len)) {
+	if (ucma_inet_addr(rai->ai_dst_addr, rai->ai_dst_len)) {
 		data->flags = ACM_EP_FLAG_DEST;
 		if (hints->ai_flags & (RAI_NUMERICHOST | RAI_NOROUTE))
 			data->flags |= ACM_FLAGS_NODELAY;
-		ucma_set_ep_addr(data, (*rai)->ai_dst_addr);
+		ucma_set_ep_addr(data, rai->ai_dst_addr);
 		data++;
-		msg.hdr.length += ACM_MSG_EP_LENGTH;
+		msg->hdr.length += ACM_MSG_EP_LENGTH;
 	}
 
 	if (hints->ai_route_len ||
-	    ucma_ib_addr((*rai)->ai_src_addr, (*rai)->ai_src_len) ||
-	    ucma_ib_addr((*rai)->ai_dst_addr, (*rai)->ai_dst_len)) {
+	    ucma_ib_addr(rai->ai_src_addr, rai->ai_src_len) ||
+	    ucma_ib_addr(rai->ai_dst_addr, rai->ai_dst_len)) {
 		struct ibv_path_record *path;
 
 		if (hints->ai_route_len == sizeof(struct ibv_path_record))
@@ -367,33 +503,175 @@ void ucma_ib_resolve(struct rdma_addrinfo **rai,
 		if (path)
 			memcpy(&data->info.path, path, sizeof(*path));
 
-		if (ucma_ib_addr((*rai)->ai_src_addr, (*rai)->ai_src_len)) {
+		if (ucma_ib_addr(rai->ai_src_addr, rai->ai_src_len)) {
 			memcpy(&data->info.path.sgid,
-			       &((struct sockaddr_ib *) (*rai)->ai_src_addr)->sib_addr, 16);
+			       &((struct sockaddr_ib *) rai->ai_src_addr)->sib_addr, 16);
 		}
-		if (ucma_ib_addr((*rai)->ai_dst_addr, (*rai)->ai_dst_len)) {
+		if (ucma_ib_addr(rai->ai_dst_addr, rai->ai_dst_len)) {
 			memcpy(&data->info.path.dgid,
-			       &((struct sockaddr_ib *) (*rai)->ai_dst_addr)->sib_addr, 16);
+			       &((struct sockaddr_ib *) rai->ai_dst_addr)->sib_addr, 16);
 		}
 		data->type = ACM_EP_INFO_PATH;
 		data++;
-		msg.hdr.length += ACM_MSG_EP_LENGTH;
+		msg->hdr.length += ACM_MSG_EP_LENGTH;
+		cacheable = 0;
 	}
 
-	pthread_mutex_lock(&acm_lock);
-	ret = send(sock, (char *) &msg, msg.hdr.length, 0);
-	if (ret != msg.hdr.length) {
-		pthread_mutex_unlock(&acm_lock);
-		return;
-	}
+	return cacheable;
+}
 
-	ret = recv(sock, (char *) &msg, sizeof msg, 0);
-	pthread_mutex_unlock(&acm_lock);
-	if (ret < ACM_MSG_HDR_LENGTH || ret != msg.hdr.length || msg.hdr.status)
+static int ucma_acm_send(int s, struct acm_msg *msg)
+{
+	return send(s, (char *) msg, msg->hdr.length, 0) == msg->hdr.length ?
+	       0 : -1;
+}
+
+/* Returns 0 if a well formed response, successful or not, was received */
+static int ucma_acm_recv(int s, struct acm_msg *msg)
+{
+	int ret;
+
+	ret = recv(s, (char *) msg, sizeof *msg, 0);
+	return (ret < ACM_MSG_HDR_LENGTH || ret != msg->hdr.length) ? -1 : 0;
+}
+
+static void ucma_ib_save(struct rdma_addrinfo **rai,
+			 const struct rdma_addrinfo *hints,
+			 struct acm_msg *resp)
+{
+	if (resp->hdr.status)
 		return;
 
-	ucma_ib_save_resp(*rai, &msg);
+	ucma_ib_save_resp(*rai, resp);
 
 	if (af_ib_support && !(hints->ai_flags & RAI_ROUTEONLY) && (*rai)->ai_route_len)
 		ucma_resolve_af_ib(rai);
 }
+
+void ucma_ib_resolve(struct rdma_addrinfo **rai,
+		     const struct rdma_addrinfo *hints)
+{
+	struct acm_msg req, resp;
+	int cacheable, ret;
+
+	ucma_ib_init();
+	if (sock < 0)
+		return;
+
+	cacheable = ucma_ib_format_req(&req, *rai, hints);
+	if (cacheable && ucma_acm_cache_lookup(&req, &resp))
+		goto save;
+
+	pthread_mutex_lock(&acm_lock);
+	ret = ucma_acm_send(sock, &req);
+	if (!ret)
+		ret = ucma_acm_recv(sock, &resp);
+	pthread_mutex_unlock(&acm_lock);
+	if (ret)
+		return;
+
+	if (cacheable)
+		ucma_acm_cache_insert(&req, &resp);
+save:
+	ucma_ib_save(rai, hints, &resp);
+}
+
+/*
+ * ibacm reads a single request per recv() call, so requests cannot be
+ * pipelined over one connection.  Instead, the requests that miss the
+ * cache are spread over up to ACM_BATCH_SOCKS connections, each with one
+ * request outstanding, so that ibacm resolves them concurrently and a
+ * batch costs about one round-trip per ACM_BATCH_SOCKS destinations.
+ */
+void ucma_ib_resolve_batch(struct rdma_addrinfo **rai[], int cnt,
+			   const struct rdma_addrinfo *hints)
+{
+	struct pollfd fds[ACM_BATCH_SOCKS];
+	int pending[ACM_BATCH_SOCKS];
+	struct acm_msg *req, resp;
+	int *cacheable;
+	int i, j, nfds, next, active;
+
+	ucma_ib_init();
+	if (sock < 0 || cnt <= 0)
+		return;
+
+	req = malloc(sizeof(*req) * cnt);
+	cacheable = malloc(sizeof(*cacheable) * cnt);
+	if (!req || !cacheable)
+		goto out;
+
+	/* answer what we can from the cache, queue the rest */
+	for (i = 0, next = cnt; i < cnt; i++) {
+		cacheable[i] = ucma_ib_format_req(&req[i], *rai[i], hints);
+		if (cacheable[i] && ucma_acm_cache_lookup(&req[i], &resp)) {
+			ucma_ib_save(rai[i], hints, &resp);
+			req[i].hdr.length = 0;
+		} else if (next == cnt) {
+			next = i;
+		}
+	}
+
+	for (nfds = 0; nfds < ACM_BATCH_SOCKS && nfds < cnt; nfds++) {
+		fds[nfds].fd = ucma_acm_connect();
+		if (fds[nfds].fd < 0)
+			break;
+		fds[nfds].events = POLLIN;
+		pending[nfds] = -1;
+	}
+
+	for (active = 0;;) {
+		for (j = 0; j < nfds; j++) {
+			if (pending[j] >= 0 || fds[j].fd < 0)
+				continue;
+			while (next < cnt && !req[next].hdr.length)
+				next++;
+			if (next == cnt)
+				break;
+			if (ucma_acm_send(fds[j].fd, &req[next])) {
+				close(fds[j].fd);
+				fds[j].fd = -1;
+				continue;
+			}
+			pending[j] = next++;
+			active++;
+		}
+		if (!active)
+			break;
+
+		if (poll(fds, nfds, -1) < 0)
+			break;
+
+		for (j = 0; j < nfds; j++) {
+			if (pending[j] < 0 || !fds[j].revents)
+				continue;
+
+			i = pending[j];
+			pending[j] = -1;
+			active--;
+			if (ucma_acm_recv(fds[j].fd, &resp)) {
+				close(fds[j].fd);
+				fds[j].fd = -1;
+				continue;
+			}
+			if (cacheable[i])
+				ucma_acm_cache_insert(&req[i], &resp);
+			ucma_ib_save(rai[i], hints, &resp);
+			req[i].hdr.length = 0;
+		}
+	}
+
+	for (j = 0; j < nfds; j++) {
+		if (fds[j].fd >= 0)
+			close(fds[j].fd);
+	}
+
+	/* anything left over goes through the shared connection */
+	for (i = 0; i < cnt; i++) {
+		if (req[i].hdr.length)
+			ucma_ib_resolve(rai[i], hints);
+	}
+out:
+	free(cacheable);
+	free(req);
+}
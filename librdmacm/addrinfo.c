@@ -234,27 +234,18 @@ static int ucma_getaddrinfo(const char *node, const char *service,
 	return ret;
 }
 
-int rdma_getaddrinfo(const char *node, const char *service,
-		     const struct rdma_addrinfo *hints,
-		     struct rdma_addrinfo **res)
+/* Builds the rdma_addrinfo for node and service, without querying ibacm */
+static int ucma_get_rai(const char *node, const char *service,
+			const struct rdma_addrinfo *hints,
+			struct rdma_addrinfo **res)
 {
 	struct rdma_addrinfo *rai;
-	int ret;
-
-	if (!service && !node && !hints)
-		return ERR(EINVAL);
-
-	ret = ucma_init();
-	if (ret)
-		return ret;
+	int ret = 0;
 
 	rai = calloc(1, sizeof(*rai));
 	if (!rai)
 		return ERR(ENOMEM);
 
-	if (!hints)
-		hints = &nohints;
-
 	if (node || service) {
 		ret = ucma_getaddrinfo(node, service, hints, rai);
 	} else {
@@ -277,9 +268,6 @@ int rdma_getaddrinfo(const char *node, const char *service,
 			goto err;
 	}
 
-	if (!(rai->ai_flags & RAI_PASSIVE))
-		ucma_ib_resolve(&rai, hints);
-
 	*res = rai;
 	return 0;
 
@@ -288,6 +276,73 @@ err:
 	return ret;
 }
 
+int rdma_getaddrinfo(const char *node, const char *service,
+		     const struct rdma_addrinfo *hints,
+		     struct rdma_addrinfo **res)
+{
+	struct rdma_addrinfo *rai;
+	int ret;
+
+	if (!service && !node && !hints)
+		return ERR(EINVAL);
+
+	ret = ucma_init();
+	if (ret)
+		return ret;
+
+	if (!hints)
+		hints = &nohints;
+
+	ret = ucma_get_rai(node, service, hints, &rai);
+	if (ret)
+		return ret;
+
+	if (!(rai->ai_flags & RAI_PASSIVE))
+		ucma_ib_resolve(&rai, hints);
+
+	*res = rai;
+	return 0;
+}
+
+int rdma_getaddrinfo_batch(const char *node[], const char *service,
+			   const struct rdma_addrinfo *hints,
+			   struct rdma_addrinfo *res[], int cnt)
+{
+	struct rdma_addrinfo ***rai;
+	int i, n, ret, err = 0;
+
+	if (!node || !res || cnt <= 0)
+		return ERR(EINVAL);
+
+	ret = ucma_init();
+	if (ret)
+		return ret;
+
+	if (!hints)
+		hints = &nohints;
+
+	rai = malloc(sizeof(*rai) * cnt);
+	if (!rai)
+		return ERR(ENOMEM);
+
+	for (i = 0, n = 0; i < cnt; i++) {
+		ret = ucma_get_rai(node[i], service, hints, &res[i]);
+		if (ret) {
+			res[i] = NULL;
+			if (!err)
+				err = ret;
+			continue;
+		}
+
+		if (!(res[i]->ai_flags & RAI_PASSIVE))
+			rai[n++] = &res[i];
+	}
+
+	ucma_ib_resolve_batch(rai, n, hints);
+	free(rai);
+	return err;
+}
+
 void rdma_freeaddrinfo(struct rdma_addrinfo *res)
 {
 	struct rdma_addrinfo *rai;
@@ -90,11 +90,14 @@ struct cma_device {
 	struct cma_port    *port;
 	__be64		    guid;
 	int		    port_cnt;
-	int		    refcnt;
+	_Atomic(int)	    refcnt;
 	int		    max_qpsize;
+	int		    max_sge;
 	uint8_t		    max_initiator_depth;
 	uint8_t		    max_responder_resources;
 	int		    ibv_idx;
+	pthread_mutex_t	    qp_pools_lock;
+	struct list_head    qp_pools;
 	uint8_t		    is_device_dead : 1;
 };
 
@@ -115,6 +118,10 @@ struct cma_id_private {
 	uint8_t			responder_resources;
 	struct ibv_ece		local_ece;
 	struct ibv_ece		remote_ece;
+	/* Set on a new id while its connection request is processed */
+	struct cma_id_private	*listen;
+	/* On a listening id, a referenced device that requests arrive on */
+	_Atomic(struct cma_device *) child_dev;
 };
 
 struct cma_multicast {
@@ -145,8 +152,19 @@ static int abi_ver = -1;
 static char dev_name[64] = "rdma_cm";
 static dev_t dev_cdev;
 int af_ib_support;
-static struct index_map ucma_idm;
-static fastlock_t idm_lock;
+
+/*
+ * cm_ids are spread over several index maps by the low bits of their
+ * kernel handle, so that threads creating and destroying ids rarely
+ * contend on the same update lock.  Lookups do not take a lock.
+ */
+#define UCMA_ID_SHARD_BITS 4
+#define UCMA_ID_SHARDS (1 << UCMA_ID_SHARD_BITS)
+
+static struct ucma_id_shard {
+	fastlock_t lock;
+	struct index_map idm;
+} __attribute__((aligned(64))) ucma_id_shards[UCMA_ID_SHARDS];
 
 static int check_abi_version_nl_cb(struct nl_msg *msg, void *data)
 {
@@ -273,6 +291,8 @@ static struct cma_device *insert_cma_dev(struct ibv_device *dev)
 	cma_dev->guid = ibv_get_device_guid(dev);
 	cma_dev->ibv_idx = ibv_get_device_index(dev);
 	cma_dev->dev = dev;
+	pthread_mutex_init(&cma_dev->qp_pools_lock, NULL);
+	list_head_init(&cma_dev->qp_pools);
 
 	/* reverse iteration, optimized to ibv_idx which is growing */
 	list_for_each_rev(&cma_dev_list, p, entry) {
@@ -305,6 +325,7 @@ static void remove_cma_dev(struct cma_device *cma_dev)
 	if (cma_dev->verbs)
 		ibv_close_device(cma_dev->verbs);
 	free(cma_dev->port);
+	pthread_mutex_destroy(&cma_dev->qp_pools_lock);
 	list_del_from(&cma_dev_list, &cma_dev->entry);
 	free(cma_dev);
 }
@@ -318,6 +339,7 @@ static int sync_devices_list(void)
 {
 	struct ibv_device **new_list;
 	int i, j, numb_dev;
+	bool changed = false;
 
 	new_list = ibv_get_device_list(&numb_dev);
 	if (!new_list)
@@ -354,6 +376,7 @@ static int sync_devices_list(void)
 		if ((dev_list[i] > new_list[j] && new_list[j]) ||
 		    (!dev_list[i] && new_list[j])) {
 			insert_cma_dev(new_list[j++]);
+			changed = true;
 			continue;
 		}
 		if ((dev_list[i] < new_list[j] && dev_list[i]) ||
@@ -370,10 +393,14 @@ static int sync_devices_list(void)
 					remove_cma_dev(c);
 			}
 			i++;
+			changed = true;
 		}
 	}
 
 	ibv_free_device_list(dev_list);
+	/* cached routes may refer to ports that have come or gone */
+	if (changed)
+		ucma_ib_flush_cache();
 out:
 	dev_list = new_list;
 	return 0;
@@ -381,7 +408,7 @@ out:
 
 int ucma_init(void)
 {
-	int ret;
+	int i, ret;
 
 	/*
 	 * ucma_set_af_ib_support() below recursively calls to this function
@@ -397,7 +424,8 @@ int ucma_init(void)
 		return 0;
 	}
 
-	fastlock_init(&idm_lock);
+	for (i = 0; i < UCMA_ID_SHARDS; i++)
+		fastlock_init(&ucma_id_shards[i].lock);
 	ret = check_abi_version();
 	if (ret) {
 		ret = ERR(EPERM);
@@ -413,7 +441,8 @@ int ucma_init(void)
 	return 0;
 
 err1:
-	fastlock_destroy(&idm_lock);
+	for (i = 0; i < UCMA_ID_SHARDS; i++)
+		fastlock_destroy(&ucma_id_shards[i].lock);
 	pthread_mutex_unlock(&mut);
 	return ret;
 }
@@ -461,6 +490,7 @@ static int ucma_init_device(struct cma_device *cma_dev)
 
 	cma_dev->port_cnt = attr.phys_port_cnt;
 	cma_dev->max_qpsize = attr.max_qp_wr;
+	cma_dev->max_sge = attr.max_sge;
 	cma_dev->max_initiator_depth = (uint8_t) attr.max_qp_init_rd_atom;
 	cma_dev->max_responder_resources = (uint8_t) attr.max_qp_rd_atom;
 	return 0;
@@ -615,12 +645,56 @@ match:
 	return cma_dev;
 }
 
+/*
+ * Connection requests on a listening id nearly always arrive on the same
+ * device.  The listening id keeps a reference on that device, so new ids
+ * can take their own reference without the global lock.
+ */
+static struct cma_device *ucma_get_child_device(struct cma_id_private *id_priv,
+						__be64 guid, uint32_t idx)
+{
+	struct cma_device *cma_dev;
+
+	if (!id_priv->listen)
+		return NULL;
+
+	cma_dev = atomic_load(&id_priv->listen->child_dev);
+	if (!cma_dev || cma_dev->is_device_dead || !match(cma_dev, guid, idx))
+		return NULL;
+
+	atomic_fetch_add(&cma_dev->refcnt, 1);
+	return cma_dev;
+}
+
+static void ucma_set_child_device(struct cma_id_private *id_priv,
+				  struct cma_device *cma_dev)
+{
+	struct cma_device *expected = NULL;
+
+	if (!id_priv->listen || atomic_load(&id_priv->listen->child_dev))
+		return;
+
+	/* Called with mut held */
+	cma_dev->refcnt++;
+	if (!atomic_compare_exchange_strong(&id_priv->listen->child_dev,
+					    &expected, cma_dev))
+		cma_dev->refcnt--;
+}
+
 static int ucma_get_device(struct cma_id_private *id_priv, __be64 guid,
 			   uint32_t idx)
 {
 	struct cma_device *cma_dev;
 	int ret;
 
+	cma_dev = ucma_get_child_device(id_priv, guid, idx);
+	if (cma_dev) {
+		id_priv->cma_dev = cma_dev;
+		id_priv->id.verbs = cma_dev->verbs;
+		id_priv->id.pd = cma_dev->pd;
+		return 0;
+	}
+
 	pthread_mutex_lock(&mut);
 	cma_dev = ucma_get_cma_device(guid, idx);
 	if (!cma_dev) {
@@ -642,6 +716,7 @@ static int ucma_get_device(struct cma_id_private *id_priv, __be64 guid,
 	id_priv->cma_dev = cma_dev;
 	id_priv->id.verbs = cma_dev->verbs;
 	id_priv->id.pd = cma_dev->pd;
+	ucma_set_child_device(id_priv, cma_dev);
 out:
 	if (ret)
 		cma_dev->refcnt--;
@@ -680,22 +755,40 @@ static struct ibv_xrcd *ucma_get_xrcd(struct cma_device *cma_dev)
 	return cma_dev->xrcd;
 }
 
+static inline struct ucma_id_shard *ucma_id_shard(uint32_t handle)
+{
+	return &ucma_id_shards[handle & (UCMA_ID_SHARDS - 1)];
+}
+
 static void ucma_insert_id(struct cma_id_private *id_priv)
 {
-	fastlock_acquire(&idm_lock);
-	idm_set(&ucma_idm, id_priv->handle, id_priv);
-	fastlock_release(&idm_lock);
+	struct ucma_id_shard *shard = ucma_id_shard(id_priv->handle);
+
+	fastlock_acquire(&shard->lock);
+	idm_set(&shard->idm, id_priv->handle >> UCMA_ID_SHARD_BITS, id_priv);
+	fastlock_release(&shard->lock);
 }
 
 static void ucma_remove_id(struct cma_id_private *id_priv)
 {
-	if (id_priv->handle <= IDX_MAX_INDEX)
-		idm_clear(&ucma_idm, id_priv->handle);
+	struct ucma_id_shard *shard;
+
+	if (id_priv->handle > IDM_MAX_INDEX)
+		return;
+
+	shard = ucma_id_shard(id_priv->handle);
+	fastlock_acquire(&shard->lock);
+	idm_clear(&shard->idm, id_priv->handle >> UCMA_ID_SHARD_BITS);
+	fastlock_release(&shard->lock);
 }
 
 static struct cma_id_private *ucma_lookup_id(int handle)
 {
-	return idm_lookup(&ucma_idm, handle);
+	if (handle < 0)
+		return NULL;
+
+	return idm_lookup(&ucma_id_shard(handle)->idm,
+			  handle >> UCMA_ID_SHARD_BITS);
 }
 
 static void ucma_free_id(struct cma_id_private *id_priv)
@@ -703,6 +796,8 @@ static void ucma_free_id(struct cma_id_private *id_priv)
 	ucma_remove_id(id_priv);
 	if (id_priv->cma_dev)
 		ucma_put_device(id_priv->cma_dev);
+	if (atomic_load(&id_priv->child_dev))
+		ucma_put_device(atomic_load(&id_priv->child_dev));
 	pthread_cond_destroy(&id_priv->cond);
 	pthread_mutex_destroy(&id_priv->mut);
 	if (id_priv->id.route.path_rec)
@@ -1619,6 +1714,329 @@ static int set_local_ece(struct rdma_cm_id *id, struct ibv_qp *qp)
 	return 0;
 }
 
+struct ucma_pool_qp {
+	struct ucma_pool_qp	*next;
+	struct ibv_qp		*qp;
+	struct ibv_cq		*send_cq;
+	struct ibv_cq		*recv_cq;
+	struct ibv_comp_channel	*send_cq_channel;
+	struct ibv_comp_channel	*recv_cq_channel;
+	struct ibv_qp_cap	cap;
+};
+
+struct rdma_qp_pool {
+	struct list_node	entry;
+	struct cma_device	*cma_dev;
+	struct ibv_pd		*pd;
+	struct ibv_qp_init_attr	attr;
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+	pthread_t		thread;
+	bool			running;
+	int			size;
+	int			cnt;
+	struct ucma_pool_qp	*head;
+};
+
+/* Retry delays of the pool thread after QP creation failed */
+#define UCMA_POOL_BACKOFF_MIN_MS 10
+#define UCMA_POOL_BACKOFF_MAX_MS 1000
+
+static void ucma_pool_free_qp(struct ucma_pool_qp *pqp)
+{
+	if (pqp->qp)
+		ibv_destroy_qp(pqp->qp);
+	if (pqp->send_cq)
+		ibv_destroy_cq(pqp->send_cq);
+	if (pqp->recv_cq)
+		ibv_destroy_cq(pqp->recv_cq);
+	if (pqp->send_cq_channel)
+		ibv_destroy_comp_channel(pqp->send_cq_channel);
+	if (pqp->recv_cq_channel)
+		ibv_destroy_comp_channel(pqp->recv_cq_channel);
+	free(pqp);
+}
+
+/* Mirrors the CQs and QP that rdma_create_qp_ex would create */
+static struct ucma_pool_qp *ucma_pool_alloc_qp(struct rdma_qp_pool *pool)
+{
+	struct ibv_context *verbs = pool->cma_dev->verbs;
+	struct ibv_qp_init_attr attr;
+	struct ucma_pool_qp *pqp;
+
+	pqp = calloc(1, sizeof(*pqp));
+	if (!pqp)
+		return NULL;
+
+	attr = pool->attr;
+	if (attr.cap.max_recv_wr) {
+		pqp->recv_cq_channel = ibv_create_comp_channel(verbs);
+		if (!pqp->recv_cq_channel)
+			goto err;
+
+		pqp->recv_cq = ibv_create_cq(verbs, attr.cap.max_recv_wr, NULL,
+					     pqp->recv_cq_channel, 0);
+		if (!pqp->recv_cq)
+			goto err;
+	}
+
+	if (attr.cap.max_send_wr) {
+		pqp->send_cq_channel = ibv_create_comp_channel(verbs);
+		if (!pqp->send_cq_channel)
+			goto err;
+
+		pqp->send_cq = ibv_create_cq(verbs, attr.cap.max_send_wr, NULL,
+					     pqp->send_cq_channel, 0);
+		if (!pqp->send_cq)
+			goto err;
+	}
+
+	attr.send_cq = pqp->send_cq;
+	attr.recv_cq = pqp->recv_cq;
+	pqp->qp = ibv_create_qp(pool->pd, &attr);
+	if (!pqp->qp)
+		goto err;
+
+	pqp->cap = attr.cap;
+	return pqp;
+err:
+	ucma_pool_free_qp(pqp);
+	return NULL;
+}
+
+static void ucma_pool_backoff(struct rdma_qp_pool *pool, int delay_ms)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += delay_ms / 1000;
+	ts.tv_nsec += (delay_ms % 1000) * 1000000;
+	if (ts.tv_nsec >= 1000000000) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
+	}
+	pthread_cond_timedwait(&pool->cond, &pool->lock, &ts);
+}
+
+static void *ucma_pool_thread(void *arg)
+{
+	struct rdma_qp_pool *pool = arg;
+	struct ucma_pool_qp *pqp;
+	int delay_ms = UCMA_POOL_BACKOFF_MIN_MS;
+
+	pthread_mutex_lock(&pool->lock);
+	while (pool->running) {
+		if (pool->cnt >= pool->size) {
+			pthread_cond_wait(&pool->cond, &pool->lock);
+			continue;
+		}
+
+		pthread_mutex_unlock(&pool->lock);
+		pqp = ucma_pool_alloc_qp(pool);
+		pthread_mutex_lock(&pool->lock);
+		if (!pqp) {
+			/*
+			 * Out of resources.  Nothing may ever be taken from an
+			 * empty pool to signal us, so retry with a growing delay.
+			 */
+			if (pool->running)
+				ucma_pool_backoff(pool, delay_ms);
+			delay_ms = min(delay_ms * 2, UCMA_POOL_BACKOFF_MAX_MS);
+			continue;
+		}
+
+		delay_ms = UCMA_POOL_BACKOFF_MIN_MS;
+		pqp->next = pool->head;
+		pool->head = pqp;
+		pool->cnt++;
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+static bool ucma_pool_match(struct rdma_qp_pool *pool,
+			    struct ibv_qp_init_attr_ex *attr)
+{
+	return pool->pd == attr->pd &&
+	       pool->attr.qp_type == attr->qp_type &&
+	       pool->attr.sq_sig_all == attr->sq_sig_all &&
+	       pool->attr.cap.max_send_wr == attr->cap.max_send_wr &&
+	       pool->attr.cap.max_recv_wr == attr->cap.max_recv_wr &&
+	       pool->attr.cap.max_send_sge == attr->cap.max_send_sge &&
+	       pool->attr.cap.max_recv_sge == attr->cap.max_recv_sge &&
+	       pool->attr.cap.max_inline_data == attr->cap.max_inline_data;
+}
+
+/*
+ * Take a pre-allocated QP and its CQs for the rdma_cm_id, if a pool
+ * matching the requested attributes exists.  Returns NULL when the QP
+ * must be created directly.
+ */
+static struct ibv_qp *ucma_pool_get_qp(struct cma_id_private *id_priv,
+				       struct ibv_qp_init_attr_ex *attr)
+{
+	struct rdma_cm_id *id = &id_priv->id;
+	struct ucma_pool_qp *pqp = NULL;
+	struct rdma_qp_pool *pool;
+	struct ibv_qp *qp;
+
+	if (!id_priv->cma_dev || attr->comp_mask != IBV_QP_INIT_ATTR_PD ||
+	    attr->send_cq || attr->recv_cq || attr->srq ||
+	    id->send_cq || id->recv_cq || id->srq)
+		return NULL;
+
+	pthread_mutex_lock(&id_priv->cma_dev->qp_pools_lock);
+	list_for_each(&id_priv->cma_dev->qp_pools, pool, entry) {
+		if (!ucma_pool_match(pool, attr))
+			continue;
+
+		pthread_mutex_lock(&pool->lock);
+		pqp = pool->head;
+		if (pqp) {
+			pool->head = pqp->next;
+			pool->cnt--;
+			pthread_cond_signal(&pool->cond);
+		}
+		pthread_mutex_unlock(&pool->lock);
+		if (pqp)
+			break;
+	}
+	pthread_mutex_unlock(&id_priv->cma_dev->qp_pools_lock);
+	if (!pqp)
+		return NULL;
+
+	id->send_cq = pqp->send_cq;
+	id->recv_cq = pqp->recv_cq;
+	id->send_cq_channel = pqp->send_cq_channel;
+	id->recv_cq_channel = pqp->recv_cq_channel;
+	if (id->send_cq)
+		id->send_cq->cq_context = id;
+	if (id->recv_cq)
+		id->recv_cq->cq_context = id;
+
+	qp = pqp->qp;
+	qp->qp_context = attr->qp_context;
+	attr->send_cq = id->send_cq;
+	attr->recv_cq = id->recv_cq;
+	attr->cap = pqp->cap;
+	free(pqp);
+	return qp;
+}
+
+struct rdma_qp_pool *rdma_create_qp_pool(struct ibv_context *verbs,
+					 struct ibv_pd *pd,
+					 struct ibv_qp_init_attr *qp_init_attr,
+					 int size)
+{
+	struct cma_device *cma_dev, *dev;
+	struct rdma_qp_pool *pool;
+	struct ucma_pool_qp *pqp;
+	int ret;
+
+	if (!verbs || size <= 0 || (pd && pd->context != verbs) ||
+	    qp_init_attr->send_cq || qp_init_attr->recv_cq ||
+	    qp_init_attr->srq || qp_init_attr->qp_type == IBV_QPT_XRC_SEND ||
+	    qp_init_attr->qp_type == IBV_QPT_XRC_RECV) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if (ucma_init())
+		return NULL;
+
+	pool = calloc(1, sizeof(*pool));
+	if (!pool) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	cma_dev = NULL;
+	pthread_mutex_lock(&mut);
+	list_for_each(&cma_dev_list, dev, entry) {
+		if (!dev->is_device_dead && dev->verbs == verbs) {
+			cma_dev = dev;
+			break;
+		}
+	}
+	if (!cma_dev) {
+		pthread_mutex_unlock(&mut);
+		errno = ENODEV;
+		goto err1;
+	}
+
+	if (!cma_dev->pd)
+		cma_dev->pd = ibv_alloc_pd(cma_dev->verbs);
+	if (!cma_dev->pd) {
+		pthread_mutex_unlock(&mut);
+		goto err1;
+	}
+	cma_dev->refcnt++;
+	pthread_mutex_unlock(&mut);
+
+	pool->cma_dev = cma_dev;
+	pool->pd = pd ? pd : cma_dev->pd;
+	pool->attr = *qp_init_attr;
+	pool->attr.qp_context = NULL;
+	pool->size = size;
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->cond, NULL);
+
+	/* Allocate the first QP now, to report errors and the actual caps */
+	pqp = ucma_pool_alloc_qp(pool);
+	if (!pqp)
+		goto err2;
+
+	qp_init_attr->cap = pqp->cap;
+	pool->head = pqp;
+	pool->cnt = 1;
+	pool->running = true;
+	ret = pthread_create(&pool->thread, NULL, ucma_pool_thread, pool);
+	if (ret) {
+		errno = ret;
+		goto err3;
+	}
+
+	pthread_mutex_lock(&cma_dev->qp_pools_lock);
+	list_add_tail(&cma_dev->qp_pools, &pool->entry);
+	pthread_mutex_unlock(&cma_dev->qp_pools_lock);
+	return pool;
+
+err3:
+	ucma_pool_free_qp(pqp);
+err2:
+	pthread_cond_destroy(&pool->cond);
+	pthread_mutex_destroy(&pool->lock);
+	ucma_put_device(cma_dev);
+err1:
+	free(pool);
+	return NULL;
+}
+
+void rdma_destroy_qp_pool(struct rdma_qp_pool *pool)
+{
+	struct ucma_pool_qp *pqp;
+
+	pthread_mutex_lock(&pool->cma_dev->qp_pools_lock);
+	list_del_from(&pool->cma_dev->qp_pools, &pool->entry);
+	pthread_mutex_unlock(&pool->cma_dev->qp_pools_lock);
+
+	pthread_mutex_lock(&pool->lock);
+	pool->running = false;
+	pthread_cond_signal(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+	pthread_join(pool->thread, NULL);
+
+	while ((pqp = pool->head)) {
+		pool->head = pqp->next;
+		ucma_pool_free_qp(pqp);
+	}
+
+	pthread_cond_destroy(&pool->cond);
+	pthread_mutex_destroy(&pool->lock);
+	ucma_put_device(pool->cma_dev);
+	free(pool);
+}
+
 int rdma_create_qp_ex(struct rdma_cm_id *id,
 		      struct ibv_qp_init_attr_ex *attr)
 {
@@ -1649,21 +2067,24 @@ int rdma_create_qp_ex(struct rdma_cm_id *id,
 		}
 	}
 
-	ret = ucma_create_cqs(id, attr->send_cq || id->send_cq ? 0 : attr->cap.max_send_wr,
-				  attr->recv_cq || id->recv_cq ? 0 : attr->cap.max_recv_wr);
-	if (ret)
-		return ret;
-
-	if (!attr->send_cq)
-		attr->send_cq = id->send_cq;
-	if (!attr->recv_cq)
-		attr->recv_cq = id->recv_cq;
-	if (id->srq && !attr->srq)
-		attr->srq = id->srq;
-	qp = ibv_create_qp_ex(id->verbs, attr);
+	qp = ucma_pool_get_qp(id_priv, attr);
 	if (!qp) {
-		ret = -1;
-		goto err1;
+		ret = ucma_create_cqs(id, attr->send_cq || id->send_cq ? 0 : attr->cap.max_send_wr,
+					  attr->recv_cq || id->recv_cq ? 0 : attr->cap.max_recv_wr);
+		if (ret)
+			return ret;
+
+		if (!attr->send_cq)
+			attr->send_cq = id->send_cq;
+		if (!attr->recv_cq)
+			attr->recv_cq = id->recv_cq;
+		if (id->srq && !attr->srq)
+			attr->srq = id->srq;
+		qp = ibv_create_qp_ex(id->verbs, attr);
+		if (!qp) {
+			ret = -1;
+			goto err1;
+		}
 	}
 
 	ret = init_ece(id, qp);
@@ -2344,7 +2765,9 @@ static int ucma_process_conn_req(struct cma_event *evt, uint32_t handle,
 			goto err2;
 	}
 
+	id_priv->listen = evt->id_priv;
 	ret = ucma_query_req_info(&id_priv->id);
+	id_priv->listen = NULL;
 	if (ret)
 		goto err2;
 
@@ -2625,6 +3048,11 @@ retry:
 		evt->event.id = &evt->id_priv->id;
 		evt->event.param.ud.private_data = evt->mc->context;
 		break;
+	case RDMA_CM_EVENT_UNREACHABLE:
+	case RDMA_CM_EVENT_DEVICE_REMOVAL:
+	case RDMA_CM_EVENT_ADDR_CHANGE:
+		ucma_ib_flush_cache();
+		SWITCH_FALLTHROUGH;
 	default:
 		evt->id_priv = (void *) (uintptr_t) resp.uid;
 		evt->event.id = &evt->id_priv->id;
@@ -2867,6 +3295,171 @@ void rdma_destroy_ep(struct rdma_cm_id *id)
 	rdma_destroy_id(id);
 }
 
+static void ucma_batch_done(struct rdma_connect_req *req, int status,
+			    struct rdma_event_channel *channel)
+{
+	struct rdma_cm_id *id = req->id;
+
+	/* set the context first, events may arrive on channel once migrated */
+	id->context = req->context;
+	if (!status && rdma_migrate_id(id, channel))
+		status = -errno;
+
+	if (status) {
+		rdma_destroy_ep(id);
+		req->id = NULL;
+	}
+	req->status = status;
+}
+
+/* Returns 0 if the request moved on to its next step, else the error */
+static int ucma_batch_event(struct rdma_cm_event *event, struct ibv_pd *pd,
+			    struct ibv_qp_init_attr *qp_init_attr,
+			    struct rdma_conn_param *conn_param, int timeout_ms)
+{
+	struct rdma_connect_req *req = event->id->context;
+	struct rdma_addrinfo *res = req->res;
+	struct ibv_qp_init_attr attr;
+	struct cma_id_private *id_priv;
+
+	switch (event->event) {
+	case RDMA_CM_EVENT_ADDR_RESOLVED:
+		if (res->ai_route_len)
+			return rdma_set_option(event->id, RDMA_OPTION_IB,
+					       RDMA_OPTION_IB_PATH,
+					       res->ai_route,
+					       res->ai_route_len) ? -errno : 0;
+		return rdma_resolve_route(event->id, timeout_ms) ? -errno : 0;
+	case RDMA_CM_EVENT_ROUTE_RESOLVED:
+		/* rdma_create_qp may fill in the CQs, so use a copy */
+		attr = *qp_init_attr;
+		attr.qp_type = res->ai_qp_type;
+		if (rdma_create_qp(event->id, pd, &attr))
+			return -errno;
+
+		if (res->ai_connect_len) {
+			id_priv = container_of(event->id, struct cma_id_private, id);
+			id_priv->connect = malloc(res->ai_connect_len);
+			if (!id_priv->connect)
+				return -ENOMEM;
+			memcpy(id_priv->connect, res->ai_connect,
+			       res->ai_connect_len);
+			id_priv->connect_len = res->ai_connect_len;
+		}
+		return rdma_connect(event->id, conn_param) ? -errno : 0;
+	case RDMA_CM_EVENT_REJECTED:
+		return -ECONNREFUSED;
+	default:
+		return event->status ? event->status : -ECONNABORTED;
+	}
+}
+
+int rdma_connect_batch(struct rdma_connect_req *req, int cnt,
+		       struct ibv_pd *pd, struct ibv_qp_init_attr *qp_init_attr,
+		       struct rdma_conn_param *conn_param,
+		       struct rdma_event_channel *channel, int timeout_ms)
+{
+	struct rdma_event_channel *batch_channel;
+	struct rdma_connect_req *cur;
+	struct rdma_cm_event *event;
+	enum rdma_cm_event_type type;
+	struct pollfd fds;
+	struct timespec start, now;
+	int i, ret, status, pending = 0, connected = 0, wait_ms;
+	int err = -ETIMEDOUT;
+
+	if (!req || cnt <= 0 || !qp_init_attr || timeout_ms <= 0)
+		return ERR(EINVAL);
+
+	batch_channel = rdma_create_event_channel();
+	if (!batch_channel)
+		return -1;
+	if (set_fd_nonblock(batch_channel->fd, true)) {
+		rdma_destroy_event_channel(batch_channel);
+		return -1;
+	}
+
+	/* start every address resolution before waiting on any of them */
+	for (i = 0; i < cnt; i++) {
+		cur = &req[i];
+		cur->id = NULL;
+		ret = rdma_create_id2(batch_channel, &cur->id, cur,
+				      cur->res->ai_port_space,
+				      cur->res->ai_qp_type);
+		if (ret) {
+			cur->id = NULL;
+			cur->status = -errno;
+			continue;
+		}
+
+		if (af_ib_support)
+			ret = rdma_resolve_addr2(cur->id, cur->res->ai_src_addr,
+						 cur->res->ai_src_len,
+						 cur->res->ai_dst_addr,
+						 cur->res->ai_dst_len, timeout_ms);
+		else
+			ret = rdma_resolve_addr(cur->id, cur->res->ai_src_addr,
+						cur->res->ai_dst_addr, timeout_ms);
+		if (ret) {
+			ucma_batch_done(cur, -errno, channel);
+			continue;
+		}
+		cur->status = -EINPROGRESS;
+		pending++;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	fds.fd = batch_channel->fd;
+	fds.events = POLLIN;
+	while (pending) {
+		ret = rdma_get_cm_event(batch_channel, &event);
+		if (ret) {
+			if (errno != EAGAIN) {
+				err = -errno;
+				break;
+			}
+
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			wait_ms = timeout_ms -
+				  ((now.tv_sec - start.tv_sec) * 1000 +
+				   (now.tv_nsec - start.tv_nsec) / 1000000);
+			if (wait_ms <= 0)
+				break;
+			if (poll(&fds, 1, wait_ms) < 0 && errno != EINTR) {
+				err = -errno;
+				break;
+			}
+			continue;
+		}
+
+		cur = event->id->context;
+		type = event->event;
+		if (type == RDMA_CM_EVENT_ESTABLISHED)
+			status = 0;
+		else
+			status = ucma_batch_event(event, pd, qp_init_attr,
+						  conn_param, timeout_ms);
+		rdma_ack_cm_event(event);
+		if (!status && type != RDMA_CM_EVENT_ESTABLISHED)
+			continue;
+
+		/* established ids leave the channel before their next event */
+		ucma_batch_done(cur, status, channel);
+		pending--;
+		if (!cur->status)
+			connected++;
+	}
+
+	/* anything still outstanding has run out of time, or hit err */
+	for (i = 0; i < cnt; i++) {
+		if (req[i].status == -EINPROGRESS)
+			ucma_batch_done(&req[i], err, channel);
+	}
+
+	rdma_destroy_event_channel(batch_channel);
+	return connected;
+}
+
 int ucma_max_qpsize(struct rdma_cm_id *id)
 {
 	struct cma_id_private *id_priv;
@@ -2888,6 +3481,14 @@ int ucma_max_qpsize(struct rdma_cm_id *id)
 	return max_size;
 }
 
+int ucma_max_sge(struct rdma_cm_id *id)
+{
+	struct cma_id_private *id_priv;
+
+	id_priv = container_of(id, struct cma_id_private, id);
+	return id_priv->cma_dev ? id_priv->cma_dev->max_sge : 0;
+}
+
 __be16 ucma_get_port(struct sockaddr *addr)
 {
 	switch (addr->sa_family) {
@@ -83,6 +83,7 @@ int ucma_addrlen(struct sockaddr *addr);
 void ucma_set_sid(enum rdma_port_space ps, struct sockaddr *addr,
 		  struct sockaddr_ib *sib);
 int ucma_max_qpsize(struct rdma_cm_id *id);
+int ucma_max_sge(struct rdma_cm_id *id);
 int ucma_complete(struct rdma_cm_id *id);
 int ucma_shutdown(struct rdma_cm_id *id);
 
@@ -101,6 +102,9 @@ void ucma_ib_init(void);
 void ucma_ib_cleanup(void);
 void ucma_ib_resolve(struct rdma_addrinfo **rai,
 		     const struct rdma_addrinfo *hints);
+void ucma_ib_resolve_batch(struct rdma_addrinfo **rai[], int cnt,
+			   const struct rdma_addrinfo *hints);
+void ucma_ib_flush_cache(void);
 
 struct ib_connect_hdr {
 	uint8_t  cma_version;
@@ -53,10 +53,13 @@
 #include "common.h"
 
 #define SRV_MAX_DISCONNECT_TIME_US 60000000
+#define RATE_BUCKETS 20
 
 static struct rdma_addrinfo hints, *rai;
 static struct addrinfo *ai;
-static struct rdma_event_channel *channel;
+static struct rdma_event_channel **channels;
+static int num_channels = 1;
+static int max_channels;
 static struct oob_root oob_root;
 static int oob_up = -1;
 static const char *oob_port = "7471";
@@ -148,6 +151,29 @@ static int conn_index;
 static uint64_t times[STEP_CNT][2];
 static uint32_t num_conns = 100;
 static int num_threads = 1;
+static uint32_t default_conns = 100;
+static uint32_t default_threads = 1;
+static uint32_t *conn_list = &default_conns;
+static int conn_list_cnt = 1;
+static uint32_t *thread_list = &default_threads;
+static int thread_list_cnt = 1;
+static uint32_t default_channels = 1;
+static uint32_t *channel_list = &default_channels;
+static int channel_list_cnt = 1;
+static _Atomic(uint64_t) cm_events;
+static uint64_t test_start, test_end;
+static uint32_t conn_scale = 1;
+static uint32_t rate_interval;
+
+enum out_format {
+	format_text,
+	format_json,
+	format_csv,
+};
+
+static enum out_format format = format_text;
+static FILE *out;
+static bool out_first = true;
 static _Atomic(int) disc_events;
 
 static _Atomic(int) completed[STEP_CNT];
@@ -161,49 +187,253 @@ static struct ibv_cq *cq;
 #define end_time(s)		do { times[s][1] = gettime_us(); } while (0)
 
 
-static void show_perf(void)
+struct step_stats {
+	uint64_t total;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t min;
+	uint64_t p50;
+	uint64_t p99;
+	uint64_t p999;
+};
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a;
+	uint64_t y = *(const uint64_t *) b;
+
+	return (x > y) - (x < y);
+}
+
+/* Nearest-rank percentile over a sorted array, permille = 500 for p50 */
+static uint64_t percentile(const uint64_t *val, uint32_t cnt, uint32_t permille)
 {
-	uint64_t c, diff, max[STEP_CNT], min[STEP_CNT], sum[STEP_CNT];
+	uint64_t rank;
+
+	if (!cnt)
+		return 0;
+
+	rank = ((uint64_t) cnt * permille + 999) / 1000;
+	return val[rank ? rank - 1 : 0];
+}
+
+static void calc_stats(struct step_stats *st, uint64_t *val)
+{
+	uint32_t c, cnt;
+	uint64_t diff;
 	int i;
 
 	for (i = 0; i < STEP_CNT; i++) {
-		sum[i] = 0;
-		max[i] = 0;
-		min[i] = UINT32_MAX;
-		for (c = 0; c < num_conns; c++) {
+		memset(&st[i], 0, sizeof(st[i]));
+		st[i].total = (uint64_t) (times[i][1] - times[i][0]);
+		st[i].min = UINT32_MAX;
+		for (c = 0, cnt = 0; c < num_conns; c++) {
 			if (conns[c].times[i][0] && conns[c].times[i][1]) {
 				diff = (uint32_t) (conns[c].times[i][1] -
 						   conns[c].times[i][0]);
-				sum[i] += diff;
-				if (diff > max[i])
-					max[i] = diff;
-				if (diff < min[i])
-					min[i] = diff;
+				st[i].sum += diff;
+				if (diff > st[i].max)
+					st[i].max = diff;
+				if (diff < st[i].min)
+					st[i].min = diff;
+				val[cnt++] = diff;
 			}
 		}
 		/* Print 0 if we have no data */
-		if (min[i] == UINT32_MAX)
-			min[i] = 0;
+		if (st[i].min == UINT32_MAX)
+			st[i].min = 0;
+
+		qsort(val, cnt, sizeof(*val), cmp_u64);
+		st[i].p50 = percentile(val, cnt, 500);
+		st[i].p99 = percentile(val, cnt, 990);
+		st[i].p999 = percentile(val, cnt, 999);
 	}
 
 	/* Reporting the 'sum' of the full connect is meaningless */
-	sum[STEP_FULL_CONNECT] = 0;
+	st[STEP_FULL_CONNECT].sum = 0;
+}
 
-	if (atomic_load(&cur_qpn) == 0)
-		printf("qp_conn        %10u\n", num_conns);
-	else
-		printf("cm_conn        %10u\n", num_conns);
-	printf("threads        %10d\n", num_threads);
+/*
+ * Bucket the time at which each connection completed the connect step,
+ * relative to the start of that step, to show the connect rate over time.
+ */
+static uint32_t calc_rate(uint32_t **bucket, uint64_t *interval)
+{
+	uint64_t origin, span, t;
+	uint32_t c, b, cnt;
+
+	origin = times[STEP_CONNECT][0];
+	if (!origin || times[STEP_CONNECT][1] < origin)
+		return 0;
+
+	span = times[STEP_CONNECT][1] - origin;
+	*interval = rate_interval ? rate_interval : span / RATE_BUCKETS;
+	if (!*interval)
+		*interval = 1;
+
+	cnt = (uint32_t) (span / *interval) + 1;
+	*bucket = calloc(cnt, sizeof(**bucket));
+	if (!*bucket)
+		return 0;
+
+	for (c = 0; c < num_conns; c++) {
+		t = conns[c].times[STEP_CONNECT][1];
+		if (t < origin)
+			continue;
+		b = (uint32_t) ((t - origin) / *interval);
+		(*bucket)[b < cnt ? b : cnt - 1]++;
+	}
+	return cnt;
+}
 
-	printf("step             avg/conn  total(us)    us/conn    sum(us)    max(us)    min(us)\n");
+static uint64_t events_per_sec(void)
+{
+	if (test_end <= test_start)
+		return 0;
+
+	return atomic_load(&cm_events) * 1000000 / (test_end - test_start);
+}
+
+static void show_perf_text(const char *test, struct step_stats *st,
+			   uint32_t *bucket, uint32_t bucket_cnt,
+			   uint64_t interval)
+{
+	uint32_t b;
+	int i;
+
+	fprintf(out, "%-14s %10u\n", test, num_conns);
+	fprintf(out, "threads        %10d\n", num_threads);
+	fprintf(out, "event threads  %10d\n", num_channels);
+	fprintf(out, "cm events      %10" PRIu64 "\n", atomic_load(&cm_events));
+	fprintf(out, "events/sec     %10" PRIu64 "\n", events_per_sec());
+
+	fprintf(out, "step             avg/conn  total(us)    us/conn    sum(us)    max(us)    min(us)    p50(us)    p99(us)  p99.9(us)\n");
 	for (i = 0; i < STEP_CNT; i++) {
-		diff = (uint64_t) (times[i][1] - times[i][0]);
+		fprintf(out, "%-13s  %10" PRIu64 " %10" PRIu64 " %10" PRIu64
+			" %10" PRIu64 " %10" PRIu64 " %10" PRIu64 " %10" PRIu64
+			" %10" PRIu64 " %10" PRIu64 "\n",
+			step_str[i], st[i].total / num_conns, st[i].total,
+			st[i].sum / num_conns, st[i].sum, st[i].max, st[i].min,
+			st[i].p50, st[i].p99, st[i].p999);
+	}
+
+	if (!bucket_cnt)
+		return;
+
+	fprintf(out, "connect rate (interval %" PRIu64 " us)\n", interval);
+	fprintf(out, "%10s %10s %10s\n", "time(us)", "conns", "conns/sec");
+	for (b = 0; b < bucket_cnt; b++)
+		fprintf(out, "%10" PRIu64 " %10u %10" PRIu64 "\n",
+			(b + 1) * interval, bucket[b],
+			(uint64_t) bucket[b] * 1000000 / interval);
+}
 
-		printf("%-13s  %10" PRIu64 " %10" PRIu64 " %10" PRIu64
-		       " %10" PRIu64 " %10" PRIu64 " %10" PRIu64 "\n",
-		       step_str[i], diff / num_conns, diff,
-		       sum[i] / num_conns, sum[i], max[i], min[i]);
+static void show_perf_json(const char *test, struct step_stats *st,
+			   uint32_t *bucket, uint32_t bucket_cnt,
+			   uint64_t interval)
+{
+	uint32_t b;
+	int i;
+
+	fprintf(out, "%s  {\"role\": \"%s\", \"test\": \"%s\", "
+		"\"conns\": %u, \"threads\": %d, \"event_threads\": %d, "
+		"\"cm_events\": %" PRIu64 ", \"events_per_sec\": %" PRIu64
+		",\n   \"steps\": [",
+		out_first ? "" : ",\n",
+		role == role_connect ? "client" : "server", test,
+		num_conns, num_threads, num_channels,
+		atomic_load(&cm_events), events_per_sec());
+	for (i = 0; i < STEP_CNT; i++) {
+		fprintf(out, "%s\n    {\"step\": \"%s\", \"avg_us\": %" PRIu64
+			", \"total_us\": %" PRIu64 ", \"us_per_conn\": %" PRIu64
+			", \"sum_us\": %" PRIu64 ", \"max_us\": %" PRIu64
+			", \"min_us\": %" PRIu64 ", \"p50_us\": %" PRIu64
+			", \"p99_us\": %" PRIu64 ", \"p999_us\": %" PRIu64 "}",
+			i ? "," : "", step_str[i],
+			st[i].total / num_conns, st[i].total,
+			st[i].sum / num_conns, st[i].sum, st[i].max, st[i].min,
+			st[i].p50, st[i].p99, st[i].p999);
+	}
+	fprintf(out, "],\n   \"connect_rate\": {\"interval_us\": %" PRIu64
+		", \"samples\": [", bucket_cnt ? interval : 0);
+	for (b = 0; b < bucket_cnt; b++) {
+		fprintf(out, "%s\n    {\"time_us\": %" PRIu64
+			", \"conns\": %u, \"conns_per_sec\": %" PRIu64 "}",
+			b ? "," : "", (b + 1) * interval, bucket[b],
+			(uint64_t) bucket[b] * 1000000 / interval);
 	}
+	fprintf(out, "]}}");
+}
+
+static void show_perf_csv(const char *test, struct step_stats *st,
+			  uint32_t *bucket, uint32_t bucket_cnt,
+			  uint64_t interval)
+{
+	const char *peer = role == role_connect ? "client" : "server";
+	uint32_t b;
+	int i;
+
+	if (out_first)
+		fprintf(out, "record,role,test,conns,threads,event_threads,"
+			"cm_events,events_per_sec,step,avg_us,"
+			"total_us,us_per_conn,sum_us,max_us,min_us,p50_us,"
+			"p99_us,p999_us,time_us,connected,conns_per_sec\n");
+
+	for (i = 0; i < STEP_CNT; i++) {
+		fprintf(out, "step,%s,%s,%u,%d,%d,%" PRIu64 ",%" PRIu64
+			",%s,%" PRIu64 ",%" PRIu64
+			",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64
+			",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",,,\n",
+			peer, test, num_conns, num_threads, num_channels,
+			atomic_load(&cm_events), events_per_sec(), step_str[i],
+			st[i].total / num_conns, st[i].total,
+			st[i].sum / num_conns, st[i].sum, st[i].max, st[i].min,
+			st[i].p50, st[i].p99, st[i].p999);
+	}
+
+	for (b = 0; b < bucket_cnt; b++) {
+		fprintf(out, "rate,%s,%s,%u,%d,%d,%" PRIu64 ",%" PRIu64
+			",,,,,,,,,,,%" PRIu64 ",%u,%" PRIu64 "\n",
+			peer, test, num_conns, num_threads, num_channels,
+			atomic_load(&cm_events), events_per_sec(),
+			(b + 1) * interval, bucket[b],
+			(uint64_t) bucket[b] * 1000000 / interval);
+	}
+}
+
+static void show_perf(void)
+{
+	struct step_stats st[STEP_CNT];
+	uint32_t *bucket = NULL, bucket_cnt;
+	uint64_t interval = 0, *val;
+	const char *test;
+
+	val = calloc(num_conns, sizeof(*val));
+	if (!val) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+
+	calc_stats(st, val);
+	bucket_cnt = calc_rate(&bucket, &interval);
+	test = atomic_load(&cur_qpn) == 0 ? "qp_conn" : "cm_conn";
+
+	switch (format) {
+	case format_json:
+		show_perf_json(test, st, bucket, bucket_cnt, interval);
+		break;
+	case format_csv:
+		show_perf_csv(test, st, bucket, bucket_cnt, interval);
+		break;
+	default:
+		show_perf_text(test, st, bucket, bucket_cnt, interval);
+		break;
+	}
+	fflush(out);
+	out_first = false;
+
+	free(bucket);
+	free(val);
 }
 
 static void sock_listen(int *listen_sock, int backlog)
@@ -533,6 +763,16 @@ static void req_handler(struct work_item *item)
 	struct rdma_conn_param conn_param;
 	int ret;
 
+	/* Spread the events of accepted connections over all channels */
+	if (num_channels > 1) {
+		ret = rdma_migrate_id(c->id,
+				      channels[(c - conns) % num_channels]);
+		if (ret) {
+			perror("rdma_migrate_id");
+			exit(EXIT_FAILURE);
+		}
+	}
+
 	create_qp(&c->work);
 	modify_qp(c, IBV_QPS_INIT, STEP_INIT_QP_ATTR);
 	modify_qp(c, IBV_QPS_RTR, STEP_RTR_QP_ATTR);
@@ -575,6 +815,7 @@ static void cma_handler(struct rdma_cm_id *id, struct rdma_cm_event *event)
 {
 	struct conn *c = id->context;
 
+	atomic_fetch_add(&cm_events, 1);
 	switch (event->event) {
 	case RDMA_CM_EVENT_ADDR_RESOLVED:
 		end_perf(c, STEP_RESOLVE_ADDR);
@@ -593,12 +834,14 @@ static void cma_handler(struct rdma_cm_id *id, struct rdma_cm_event *event)
 		c->id = id;
 		c->server_disconnected = false;
 		id->context = c;
+		start_perf(c, STEP_CONNECT);
 		wq_insert(&wq, &c->work, req_handler);
 		break;
 	case RDMA_CM_EVENT_CONNECT_RESPONSE:
 		wq_insert(&wq, &c->work, connect_response);
 		break;
 	case RDMA_CM_EVENT_ESTABLISHED:
+		end_perf(c, STEP_CONNECT);
 		if (atomic_fetch_add(&completed[STEP_CONNECT], 1) >=
 		    num_conns - 1)
 			end_time(STEP_CONNECT);
@@ -666,7 +909,8 @@ static void create_ids(void)
 	for (i = 0; i < num_conns; i++) {
 		start_perf(&conns[i], STEP_FULL_CONNECT);
 		start_perf(&conns[i], STEP_CREATE_ID);
-		ret = rdma_create_id(channel, &conns[i].id, &conns[i],
+		ret = rdma_create_id(channels[i % num_channels], &conns[i].id,
+				     &conns[i],
 					hints.ai_port_space);
 		if (ret) {
 			perror("rdma_create_id");
@@ -707,6 +951,7 @@ static void destroy_qps(void)
 
 static void *process_events(void *arg)
 {
+	struct rdma_event_channel *channel = arg;
 	struct rdma_cm_event *event;
 	int ret;
 
@@ -727,7 +972,7 @@ static void server_listen(struct rdma_cm_id **listen_id)
 {
 	int ret;
 
-	ret = rdma_create_id(channel, listen_id, NULL, hints.ai_port_space);
+	ret = rdma_create_id(channels[0], listen_id, NULL, hints.ai_port_space);
 	if (ret) {
 		perror("rdma_create_id");
 		exit(EXIT_FAILURE);
@@ -816,6 +1061,18 @@ static void assign_listeners(void)
 	}
 }
 
+static uint32_t list_max(const uint32_t *list, int cnt)
+{
+	uint32_t max = 0;
+	int i;
+
+	for (i = 0; i < cnt; i++) {
+		if (list[i] > max)
+			max = list[i];
+	}
+	return max;
+}
+
 static int setup_mesh(void)
 {
 	int ret;
@@ -838,11 +1095,12 @@ static int setup_mesh(void)
 
 	count_listeners();
 	if (role == role_connect)
-		num_conns = num_conns * num_listeners;
+		conn_scale = num_listeners;
 	else
-		num_conns = num_conns * (num_peers - num_listeners);
+		conn_scale = num_peers - num_listeners;
 
-	conns = calloc(num_conns, sizeof *conns);
+	conns = calloc(list_max(conn_list, conn_list_cnt) * conn_scale,
+		       sizeof *conns);
 	if (!conns)
 		return -ENOMEM;
 
@@ -866,6 +1124,8 @@ static void reset_test(void)
 		atomic_store(&completed[i], 0);
 
 	do_sync(0);
+	atomic_store(&cm_events, 0);
+	test_start = gettime_us();
 }
 
 static void server_disconnect_timeout(void)
@@ -902,6 +1162,7 @@ static void server_connect(void)
 	}
 
 	do_sync(STEP_DISCONNECT);
+	test_end = gettime_us();
 
 	destroy_qps();
 	destroy_ids();
@@ -991,6 +1252,7 @@ static void client_connect(void)
 	end_time(STEP_DISCONNECT);
 
 	do_sync(STEP_DISCONNECT);
+	test_end = gettime_us();
 
 	/* Wait for event threads to exit before destroying resources */
 	printf("\tDestroying QPs\n");
@@ -999,45 +1261,87 @@ static void client_connect(void)
 	destroy_ids();
 }
 
-static void run_client(void)
+static void set_threads(int cnt)
 {
-	uint32_t save_num_conn;
-	int ret;
+	if (cnt == num_threads)
+		return;
 
-	peers[0].role = role_connect;
-	ret = setup_mesh();
-	if (ret)
+	wq_cleanup(&wq);
+	free(wq.thread);
+	num_threads = cnt;
+	if (wq_init(&wq, num_threads))
 		exit(EXIT_FAILURE);
+}
 
-	printf("Client warmup\n");
-	save_num_conn = num_conns;
-	num_conns = num_listeners;
-	client_connect();
-	num_conns = save_num_conn;
-
+static void run_config(const char *name, void (*run_test)(void),
+		       uint32_t qp_delay)
+{
+	mimic_qp_delay = qp_delay;
 	if (!mimic) {
-		printf("Connect (%d) QPs test\n", num_conns);
+		printf("%s (%d) QPs test, %d threads, %d event threads\n",
+		       name, num_conns, num_threads, num_channels);
+		atomic_store(&cur_qpn, 0);
 	} else {
-		printf("Connect (%d) simulated QPs test (delay %d us)\n",
-			num_conns, mimic_qp_delay);
+		printf("%s (%d) simulated QPs test (delay %d us), %d threads, %d event threads\n",
+		       name, num_conns, mimic_qp_delay, num_threads,
+		       num_channels);
 		atomic_store(&cur_qpn, base_qpn);
 	}
-	client_connect();
+	run_test();
 	show_perf();
 
 	if (num_peers == 2) {
-		printf("Connect (%d) test - no QPs\n", num_conns);
+		printf("%s (%d) test - no QPs, %d threads, %d event threads\n",
+		       name, num_conns, num_threads, num_channels);
 		atomic_store(&cur_qpn, base_qpn);
 		mimic_qp_delay = 0;
-		client_connect();
+		run_test();
 		show_perf();
 	}
 }
 
+/*
+ * Run the QP test, plus the no QP test for 2 peers, for each event thread,
+ * worker thread and connection count requested.  All peers must be given
+ * the same lists, as every test is synchronized through the OOB
+ * connections.
+ */
+static void run_sweep(const char *name, void (*run_test)(void))
+{
+	uint32_t qp_delay = mimic_qp_delay;
+	int e, t, c;
+
+	for (e = 0; e < channel_list_cnt; e++) {
+		num_channels = (int) channel_list[e];
+		for (t = 0; t < thread_list_cnt; t++) {
+			set_threads((int) thread_list[t]);
+			for (c = 0; c < conn_list_cnt; c++) {
+				num_conns = conn_list[c] * conn_scale;
+				run_config(name, run_test, qp_delay);
+			}
+		}
+	}
+}
+
+static void run_client(void)
+{
+	int ret;
+
+	peers[0].role = role_connect;
+	ret = setup_mesh();
+	if (ret)
+		exit(EXIT_FAILURE);
+
+	printf("Client warmup\n");
+	num_conns = num_listeners;
+	client_connect();
+
+	run_sweep("Connect", client_connect);
+}
+
 static void run_server(void)
 {
 	struct rdma_cm_id *listen_id;
-	uint32_t save_num_conn;
 	int ret;
 
 	/* Configure RDMA prior to setting up the mesh */
@@ -1050,28 +1354,10 @@ static void run_server(void)
 		exit(EXIT_FAILURE);
 
 	printf("Server warmup\n");
-	save_num_conn = num_conns;
 	num_conns = num_peers - num_listeners;
 	server_connect();
-	num_conns = save_num_conn;
 
-	if (!mimic) {
-		printf("Accept (%d) QPs test\n", num_conns);
-	} else {
-		printf("Accept (%d) simulated QPs test (delay %d us)\n",
-			num_conns, mimic_qp_delay);
-		atomic_store(&cur_qpn, base_qpn);
-	}
-	server_connect();
-	show_perf();
-
-	if (num_peers == 2) {
-		printf("Accept (%d) test - no QPs\n", num_conns);
-		atomic_store(&cur_qpn, base_qpn);
-		mimic_qp_delay = 0;
-		server_connect();
-		show_perf();
-	}
+	run_sweep("Accept", server_connect);
 
 	rdma_destroy_id(listen_id);
 }
@@ -1129,13 +1415,113 @@ static char *get_src_addr(char *ifa_name)
 	return strdup(ip);
 }
 
-int main(int argc, char **argv)
+static int parse_list(const char *arg, uint32_t **list, int *cnt)
+{
+	char *str, *tok, *end, *save;
+	uint32_t *val = NULL, *tmp;
+	int n = 0;
+
+	str = strdup(arg);
+	if (!str)
+		return -ENOMEM;
+
+	for (tok = strtok_r(str, ",", &save); tok;
+	     tok = strtok_r(NULL, ",", &save)) {
+		tmp = realloc(val, sizeof(*val) * (n + 1));
+		if (!tmp)
+			goto err;
+		val = tmp;
+		val[n] = (uint32_t) strtoul(tok, &end, 0);
+		if (*end || !val[n])
+			goto err;
+		n++;
+	}
+	free(str);
+
+	if (!n)
+		return -EINVAL;
+
+	*list = val;
+	*cnt = n;
+	return 0;
+err:
+	free(val);
+	free(str);
+	return -EINVAL;
+}
+
+static int setup_output(void)
+{
+	int fd;
+
+	if (format == format_text) {
+		out = stdout;
+		return 0;
+	}
+
+	/*
+	 * Keep stdout for the machine readable results only, and send
+	 * progress messages to stderr.
+	 */
+	fflush(stdout);
+	fd = dup(STDOUT_FILENO);
+	if (fd < 0)
+		return -errno;
+
+	out = fdopen(fd, "w");
+	if (!out) {
+		close(fd);
+		return -errno;
+	}
+
+	if (dup2(STDERR_FILENO, STDOUT_FILENO) < 0)
+		return -errno;
+
+	if (format == format_json)
+		fprintf(out, "[\n");
+	return 0;
+}
+
+static void cleanup_output(void)
+{
+	if (format == format_json)
+		fprintf(out, "%s]\n", out_first ? "" : "\n");
+	if (out != stdout)
+		fclose(out);
+}
+
+/* Each event channel is serviced by its own thread */
+static void create_channels(int cnt)
 {
 	pthread_t event_thread;
+	int i, ret;
+
+	channels = calloc(cnt, sizeof *channels);
+	if (!channels)
+		exit(EXIT_FAILURE);
+
+	for (i = 0; i < cnt; i++) {
+		channels[i] = create_event_channel();
+		if (!channels[i]) {
+			perror("create_event_channel");
+			exit(EXIT_FAILURE);
+		}
+
+		ret = pthread_create(&event_thread, NULL, process_events,
+				     channels[i]);
+		if (ret) {
+			perror("pthread_create");
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+int main(int argc, char **argv)
+{
 	bool socktest = false;
-	int op, ret;
+	int i, op, ret;
 
-	while ((op = getopt(argc, argv, "B:b:C:c:Lm:n:P:p:q:r:Ss:t:")) != -1) {
+	while ((op = getopt(argc, argv, "B:b:C:c:E:f:i:Lm:n:P:p:q:r:Ss:t:")) != -1) {
 		switch (op) {
 		case 'B':
 			if (src_addr)
@@ -1151,7 +1537,26 @@ int main(int argc, char **argv)
 			ctrl_addr = optarg;
 			break;
 		case 'c':
-			num_conns = (uint32_t) atoi(optarg);
+			if (parse_list(optarg, &conn_list, &conn_list_cnt))
+				goto usage;
+			break;
+		case 'E':
+			if (parse_list(optarg, &channel_list,
+				       &channel_list_cnt))
+				goto usage;
+			break;
+		case 'f':
+			if (!strcasecmp(optarg, "text"))
+				format = format_text;
+			else if (!strcasecmp(optarg, "json"))
+				format = format_json;
+			else if (!strcasecmp(optarg, "csv"))
+				format = format_csv;
+			else
+				goto usage;
+			break;
+		case 'i':
+			rate_interval = (uint32_t) atoi(optarg);
 			break;
 		case 'L':
 			role = role_listen;
@@ -1161,7 +1566,8 @@ int main(int argc, char **argv)
 			mimic = true;
 			break;
 		case 'n':
-			num_threads = (uint32_t) atoi(optarg);
+			if (parse_list(optarg, &thread_list, &thread_list_cnt))
+				goto usage;
 			break;
 		case 'P':
 			num_peers = (uint32_t) atoi(optarg);
@@ -1190,10 +1596,13 @@ usage:
 			printf("\t-B bind_interface (only one of -B or -b accepted)\n");
 			printf("\t-b bind_address (only one of -B or -b accepted)\n");
 			printf("\t-C controller_address\n");
-			printf("\t[-c num_conns] connections per listener\n");
+			printf("\t[-c num_conns[,num_conns...]] connections per listener\n");
+			printf("\t[-E num_event_threads[,num_event_threads...]]\n");
+			printf("\t[-f text|json|csv] results format\n");
+			printf("\t[-i rate_interval_us] connect rate sample interval\n");
 			printf("\t[-L] run as listening server\n");
 			printf("\t[-m mimic_qp_delay_us]\n");
-			printf("\t[-n num_threads]\n");
+			printf("\t[-n num_threads[,num_threads...]]\n");
 			printf("\t[-P num_peers] total number of peers\n");
 			printf("\t[-p oob_port]\n");
 			printf("\t[-q base_qpn]\n");
@@ -1207,6 +1616,12 @@ usage:
 	if (!src_addr || !ctrl_addr || (socktest && num_peers > 2))
 		goto usage;
 
+	ret = setup_output();
+	if (ret) {
+		perror("setup_output");
+		exit(EXIT_FAILURE);
+	}
+
 	hints.ai_port_space = RDMA_PS_TCP;
 	hints.ai_qp_type = IBV_QPT_RC;
 	hints.ai_flags = RAI_PASSIVE;
@@ -1216,22 +1631,14 @@ usage:
 		exit(EXIT_FAILURE);
 	}
 
-	channel = create_event_channel();
-	if (!channel) {
-		perror("create_event_channel");
-		exit(EXIT_FAILURE);
-	}
-
-	ret = pthread_create(&event_thread, NULL, process_events, NULL);
-	if (ret) {
-		perror("pthread_create");
-		exit(EXIT_FAILURE);
-	}
+	max_channels = (int) list_max(channel_list, channel_list_cnt);
+	create_channels(max_channels);
 
 	peers = calloc(num_peers, sizeof *peers);
 	if (!peers)
 		exit(EXIT_FAILURE);
 
+	num_threads = (int) thread_list[0];
 	ret = wq_init(&wq, num_threads);
 	if (ret)
 		exit(EXIT_FAILURE);
@@ -1240,6 +1647,14 @@ usage:
 	if (ret)
 		exit(EXIT_FAILURE);
 
+	if (socktest) {
+		/* The socket baseline runs only the first configuration */
+		num_conns = conn_list[0];
+		conns = calloc(num_conns, sizeof *conns);
+		if (!conns)
+			exit(EXIT_FAILURE);
+	}
+
 	if (role == role_connect) {
 		if (socktest)
 			sock_client();
@@ -1253,10 +1668,13 @@ usage:
 	}
 
 	cleanup_oob();
+	cleanup_output();
 	wq_cleanup(&wq);
 	free(peers);
 	free(conns);
-	rdma_destroy_event_channel(channel);
+	for (i = 0; i < max_channels; i++)
+		rdma_destroy_event_channel(channels[i]);
+	free(channels);
 	rdma_freeaddrinfo(rai);
 	return 0;
 }
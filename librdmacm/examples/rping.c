@@ -46,6 +46,7 @@
 #include <pthread.h>
 #include <inttypes.h>
 #include <rdma/rdma_cma.h>
+#include <ccan/minmax.h>
 #include "common.h"
 
 static int debug = 0;
@@ -96,6 +97,8 @@ struct rping_rdma_info {
  */
 #define RPING_BUFSIZE 64*1024
 #define RPING_SQ_DEPTH 16
+#define RPING_STREAM_COUNT 100000
+#define RPING_STREAM_WC 16
 
 /* Default string for print data and
  * minimum buffer size
@@ -153,6 +156,14 @@ struct rping_cb {
 	int size;			/* ping data size */
 	int validate;			/* validate ping data */
 
+	/* throughput mode */
+	int stream;			/* stream RDMA ops instead of ping */
+	enum ibv_wr_opcode stream_op;	/* RDMA read or write */
+	int sq_depth;			/* outstanding RDMA ops per QP */
+	int batch;			/* RDMA ops per signaled completion */
+	int qps;			/* number of connections */
+	int threads;			/* worker threads */
+
 	/* CM stuff */
 	int eventfd;
 	pthread_t cmthread;
@@ -162,6 +173,43 @@ struct rping_cb {
 	struct rdma_cm_id *child_cm_id;	/* connection on server side */
 };
 
+/*
+ * rping throughput mode (-T read|write):
+ *	server advertises its rdma buffer rkey/addr/len on each connection
+ *	client keeps up to sq_depth RDMA reads or writes outstanding per QP,
+ *	posting them in chains of batch WRs with only the last one signaled
+ *	client disconnects after count RDMA ops have completed on every QP
+ *
+ * Each QP is driven by exactly one worker thread, which busy polls the
+ * CQs of all QPs that it owns.
+ */
+struct rping_chain {
+	uint64_t post_ns;
+	int nwr;
+};
+
+struct rping_stream {
+	struct rping_cb *cb;		/* connection, cloned from main cb */
+	struct ibv_send_wr *wr;		/* batch WRs, linked into one chain */
+	struct rping_chain *chain;	/* outstanding chains, by wr_id */
+	uint64_t posted;
+	uint64_t completed;
+	uint64_t signaled;
+	uint64_t start_ns;
+	uint64_t end_ns;
+	uint64_t *lat;			/* completion latency per chain */
+	int nlat;
+};
+
+struct rping_worker {
+	pthread_t thread;
+	struct rping_cb *cb;
+	struct rping_stream *streams;
+	pthread_barrier_t *barrier;
+	int index;
+	int ret;
+};
+
 static int rping_cma_event_handler(struct rdma_cm_id *cma_id,
 				    struct rdma_cm_event *event)
 {
@@ -363,8 +411,13 @@ static void rping_init_conn_param(struct rping_cb *cb,
 				  struct rdma_conn_param *conn_param)
 {
 	memset(conn_param, 0, sizeof(*conn_param));
-	conn_param->responder_resources = 1;
-	conn_param->initiator_depth = 1;
+	if (cb->stream) {
+		conn_param->responder_resources = RDMA_MAX_RESP_RES;
+		conn_param->initiator_depth = RDMA_MAX_INIT_DEPTH;
+	} else {
+		conn_param->responder_resources = 1;
+		conn_param->initiator_depth = 1;
+	}
 	conn_param->retry_count = 7;
 	conn_param->rnr_retry_count = 7;
 	if (cb->self_create_qp)
@@ -565,7 +618,7 @@ static int rping_create_qp(struct rping_cb *cb)
 	int ret;
 
 	memset(&init_attr, 0, sizeof(init_attr));
-	init_attr.cap.max_send_wr = RPING_SQ_DEPTH;
+	init_attr.cap.max_send_wr = cb->sq_depth;
 	init_attr.cap.max_recv_wr = 2;
 	init_attr.cap.max_recv_sge = 1;
 	init_attr.cap.max_send_sge = 1;
@@ -634,7 +687,7 @@ static int rping_setup_qp(struct rping_cb *cb, struct rdma_cm_id *cm_id)
 	}
 	DEBUG_LOG("created channel %p\n", cb->channel);
 
-	cb->cq = ibv_create_cq(cm_id->verbs, RPING_SQ_DEPTH * 2, cb,
+	cb->cq = ibv_create_cq(cm_id->verbs, cb->sq_depth * 2, cb,
 				cb->channel, 0);
 	if (!cb->cq) {
 		fprintf(stderr, "ibv_create_cq failed\n");
@@ -865,7 +918,7 @@ static int rping_bind_server(struct rping_cb *cb)
 	DEBUG_LOG("rdma_bind_addr successful\n");
 
 	DEBUG_LOG("rdma_listen\n");
-	ret = rdma_listen(cb->cm_id, 3);
+	ret = rdma_listen(cb->cm_id, cb->qps > 3 ? cb->qps : 3);
 	if (ret) {
 		perror("rdma_listen");
 		return ret;
@@ -1253,6 +1306,477 @@ err1:
 	return ret;
 }
 
+static int rping_stream_connect(struct rping_cb *listening_cb,
+				struct rping_stream *s)
+{
+	struct ibv_recv_wr *bad_wr;
+	struct rping_cb *cb;
+	int ret;
+
+	cb = malloc(sizeof *cb);
+	if (!cb)
+		return -ENOMEM;
+	*cb = *listening_cb;
+	sem_init(&cb->sem, 0, 0);
+
+	ret = rdma_create_id(cb->cm_channel, &cb->cm_id, cb, RDMA_PS_TCP);
+	if (ret) {
+		perror("rdma_create_id");
+		goto err0;
+	}
+
+	ret = rping_bind_client(cb);
+	if (ret)
+		goto err1;
+
+	ret = rping_setup_qp(cb, cb->cm_id);
+	if (ret) {
+		fprintf(stderr, "setup_qp failed: %d\n", ret);
+		goto err1;
+	}
+
+	ret = rping_setup_buffers(cb);
+	if (ret) {
+		fprintf(stderr, "rping_setup_buffers failed: %d\n", ret);
+		goto err2;
+	}
+
+	ret = ibv_post_recv(cb->qp, &cb->rq_wr, &bad_wr);
+	if (ret) {
+		fprintf(stderr, "ibv_post_recv failed: %d\n", ret);
+		goto err3;
+	}
+
+	ret = rping_connect_client(cb);
+	if (ret) {
+		fprintf(stderr, "connect error %d\n", ret);
+		goto err3;
+	}
+
+	s->cb = cb;
+	return 0;
+
+err3:
+	rping_free_buffers(cb);
+err2:
+	rping_free_qp(cb);
+err1:
+	rdma_destroy_id(cb->cm_id);
+err0:
+	sem_destroy(&cb->sem);
+	free(cb);
+	return ret;
+}
+
+static void rping_stream_disconnect(struct rping_stream *s)
+{
+	struct rping_cb *cb = s->cb;
+
+	free(s->wr);
+	free(s->chain);
+	free(s->lat);
+	if (!cb)
+		return;
+
+	rping_disconnect(cb, cb->cm_id);
+	rping_free_buffers(cb);
+	rping_free_qp(cb);
+	rdma_destroy_id(cb->cm_id);
+	sem_destroy(&cb->sem);
+	free(cb);
+}
+
+static int rping_stream_alloc(struct rping_stream *s)
+{
+	struct rping_cb *cb = s->cb;
+	int i;
+
+	s->wr = calloc(cb->batch, sizeof(*s->wr));
+	s->chain = calloc(cb->sq_depth, sizeof(*s->chain));
+	s->lat = calloc(cb->count, sizeof(*s->lat));
+	if (!s->wr || !s->chain || !s->lat)
+		return -ENOMEM;
+
+	cb->rdma_sgl.length = cb->size;
+	for (i = 0; i < cb->batch; i++) {
+		s->wr[i].opcode = cb->stream_op;
+		s->wr[i].sg_list = &cb->rdma_sgl;
+		s->wr[i].num_sge = 1;
+		s->wr[i].next = &s->wr[i + 1];
+	}
+	s->wr[cb->batch - 1].next = NULL;
+	s->wr[cb->batch - 1].send_flags = IBV_SEND_SIGNALED;
+	return 0;
+}
+
+/* Wait for the server's buffer advertisement */
+static int rping_stream_wait_adv(struct rping_stream *s)
+{
+	struct rping_cb *cb = s->cb;
+	struct ibv_wc wc;
+	int i, ret;
+
+	do {
+		ret = ibv_poll_cq(cb->cq, 1, &wc);
+	} while (!ret);
+
+	if (ret < 0) {
+		fprintf(stderr, "poll error %d\n", ret);
+		return ret;
+	}
+
+	if (wc.status || wc.opcode != IBV_WC_RECV) {
+		fprintf(stderr, "cq completion failed status %d\n", wc.status);
+		return -1;
+	}
+
+	ret = server_recv(cb, &wc);
+	if (ret)
+		return ret;
+
+	if (cb->remote_len < cb->size) {
+		fprintf(stderr, "server buffer too small: %d\n",
+			cb->remote_len);
+		return -1;
+	}
+
+	for (i = 0; i < cb->batch; i++) {
+		s->wr[i].wr.rdma.rkey = cb->remote_rkey;
+		s->wr[i].wr.rdma.remote_addr = cb->remote_addr;
+	}
+	return 0;
+}
+
+static int rping_stream_post(struct rping_stream *s)
+{
+	struct rping_cb *cb = s->cb;
+	struct ibv_send_wr *bad_wr;
+	struct rping_chain *chain;
+	uint64_t nwr;
+	int ret;
+
+	while (s->posted < cb->count &&
+	       s->posted - s->completed < cb->sq_depth) {
+		nwr = min(cb->count - s->posted,
+			  cb->sq_depth - (s->posted - s->completed));
+		nwr = min(nwr, (uint64_t) cb->batch);
+
+		/* At most sq_depth chains can be outstanding */
+		chain = &s->chain[s->signaled % cb->sq_depth];
+		chain->nwr = nwr;
+		s->wr[cb->batch - 1].wr_id = s->signaled;
+
+		chain->post_ns = gettime_ns();
+		ret = ibv_post_send(cb->qp, &s->wr[cb->batch - nwr], &bad_wr);
+		if (ret) {
+			fprintf(stderr, "post send error %d\n", ret);
+			return ret;
+		}
+		s->posted += nwr;
+		s->signaled++;
+	}
+	return 0;
+}
+
+static int rping_stream_poll(struct rping_stream *s)
+{
+	struct ibv_wc wc[RPING_STREAM_WC];
+	struct rping_cb *cb = s->cb;
+	struct rping_chain *chain;
+	uint64_t now;
+	int i, ret;
+
+	ret = ibv_poll_cq(cb->cq, RPING_STREAM_WC, wc);
+	if (ret < 0) {
+		fprintf(stderr, "poll error %d\n", ret);
+		return ret;
+	}
+
+	now = gettime_ns();
+	for (i = 0; i < ret; i++) {
+		if (wc[i].status) {
+			fprintf(stderr, "cq completion failed status %d\n",
+				wc[i].status);
+			return -1;
+		}
+
+		chain = &s->chain[wc[i].wr_id % cb->sq_depth];
+		s->completed += chain->nwr;
+		s->lat[s->nlat++] = now - chain->post_ns;
+	}
+	return 0;
+}
+
+static void *rping_stream_thread(void *arg)
+{
+	struct rping_worker *w = arg;
+	struct rping_cb *cb = w->cb;
+	struct rping_stream *s;
+	int i, active = 0;
+
+	for (i = w->index; i < cb->qps; i += cb->threads) {
+		w->ret = rping_stream_wait_adv(&w->streams[i]);
+		if (w->ret)
+			break;
+		active++;
+	}
+
+	/* Start all QPs together, even if this worker already failed */
+	pthread_barrier_wait(w->barrier);
+	if (w->ret)
+		return NULL;
+
+	for (i = w->index; i < cb->qps; i += cb->threads)
+		w->streams[i].start_ns = gettime_ns();
+
+	while (active) {
+		for (i = w->index; i < cb->qps; i += cb->threads) {
+			s = &w->streams[i];
+			if (s->completed == cb->count)
+				continue;
+
+			w->ret = rping_stream_post(s);
+			if (w->ret)
+				return NULL;
+
+			w->ret = rping_stream_poll(s);
+			if (w->ret)
+				return NULL;
+
+			if (s->completed == cb->count) {
+				s->end_ns = gettime_ns();
+				active--;
+			}
+		}
+	}
+	return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a;
+	uint64_t y = *(const uint64_t *) b;
+
+	return (x > y) - (x < y);
+}
+
+/* Nearest-rank percentile over a sorted array, permille = 500 for p50 */
+static double percentile_us(const uint64_t *val, int cnt, int permille)
+{
+	uint64_t rank;
+
+	if (!cnt)
+		return 0;
+
+	rank = ((uint64_t) cnt * permille + 999) / 1000;
+	return val[rank ? rank - 1 : 0] / 1000.0;
+}
+
+static void rping_stream_show(struct rping_cb *cb, const char *name,
+			      uint64_t ops, uint64_t ns,
+			      uint64_t *lat, int nlat)
+{
+	qsort(lat, nlat, sizeof(*lat), cmp_u64);
+	printf("%-4s %10" PRIu64 " %14" PRIu64 " %8.2f %10.2f "
+	       "%9.2f %9.2f %9.2f\n", name, ops, ops * cb->size,
+	       ns ? 8.0 * ops * cb->size / ns : 0.0,
+	       ns ? 1000000.0 * ops / ns : 0.0,
+	       percentile_us(lat, nlat, 500), percentile_us(lat, nlat, 990),
+	       percentile_us(lat, nlat, 999));
+}
+
+static void rping_stream_results(struct rping_cb *cb,
+				 struct rping_stream *streams)
+{
+	uint64_t start = UINT64_MAX, end = 0, ops = 0;
+	uint64_t *lat;
+	char name[16];
+	int i, nlat = 0;
+
+	printf("%-4s %10s %14s %8s %10s %9s %9s %9s\n", "qp", "ops", "bytes",
+	       "Gb/sec", "Kops/sec", "p50 usec", "p99 usec", "p99.9 us");
+	for (i = 0; i < cb->qps; i++) {
+		snprintf(name, sizeof name, "%d", i);
+		rping_stream_show(cb, name, streams[i].completed,
+				  streams[i].end_ns - streams[i].start_ns,
+				  streams[i].lat, streams[i].nlat);
+		start = min(start, streams[i].start_ns);
+		end = max(end, streams[i].end_ns);
+		ops += streams[i].completed;
+		nlat += streams[i].nlat;
+	}
+
+	lat = malloc(sizeof(*lat) * nlat);
+	if (!lat)
+		return;
+
+	for (i = 0, nlat = 0; i < cb->qps; i++) {
+		memcpy(&lat[nlat], streams[i].lat,
+		       sizeof(*lat) * streams[i].nlat);
+		nlat += streams[i].nlat;
+	}
+	rping_stream_show(cb, "all", ops, end - start, lat, nlat);
+	free(lat);
+}
+
+static int rping_run_stream_client(struct rping_cb *cb)
+{
+	struct rping_stream *streams;
+	struct rping_worker *workers;
+	pthread_barrier_t barrier;
+	int i, ret = 0;
+
+	streams = calloc(cb->qps, sizeof(*streams));
+	workers = calloc(cb->threads, sizeof(*workers));
+	if (!streams || !workers) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < cb->qps; i++) {
+		ret = rping_stream_connect(cb, &streams[i]);
+		if (ret)
+			goto disconnect;
+
+		ret = rping_stream_alloc(&streams[i]);
+		if (ret) {
+			fprintf(stderr, "stream allocation failed\n");
+			goto disconnect;
+		}
+	}
+
+	pthread_barrier_init(&barrier, NULL, cb->threads);
+	for (i = 0; i < cb->threads; i++) {
+		workers[i].cb = cb;
+		workers[i].streams = streams;
+		workers[i].barrier = &barrier;
+		workers[i].index = i;
+		ret = pthread_create(&workers[i].thread, NULL,
+				     rping_stream_thread, &workers[i]);
+		if (ret) {
+			perror("pthread_create");
+			exit(ret);
+		}
+	}
+
+	for (i = 0; i < cb->threads; i++) {
+		pthread_join(workers[i].thread, NULL);
+		if (workers[i].ret)
+			ret = workers[i].ret;
+	}
+	pthread_barrier_destroy(&barrier);
+
+	if (ret)
+		fprintf(stderr, "rping client failed: %d\n", ret);
+	else
+		rping_stream_results(cb, streams);
+
+disconnect:
+	for (i = 0; i < cb->qps; i++)
+		rping_stream_disconnect(&streams[i]);
+out:
+	free(workers);
+	free(streams);
+	return ret;
+}
+
+static struct rping_cb *rping_stream_accept(struct rping_cb *listening_cb)
+{
+	struct ibv_send_wr *bad_wr;
+	struct rping_cb *cb;
+	int ret;
+
+	sem_wait(&listening_cb->sem);
+	if (listening_cb->state != CONNECT_REQUEST) {
+		fprintf(stderr, "wait for CONNECT_REQUEST state %d\n",
+			listening_cb->state);
+		return NULL;
+	}
+
+	cb = clone_cb(listening_cb);
+	if (!cb)
+		return NULL;
+	sem_init(&cb->sem, 0, 0);
+	sem_post(&listening_cb->accept_ready);
+
+	ret = rping_setup_qp(cb, cb->child_cm_id);
+	if (ret) {
+		fprintf(stderr, "setup_qp failed: %d\n", ret);
+		goto err1;
+	}
+
+	ret = rping_setup_buffers(cb);
+	if (ret) {
+		fprintf(stderr, "rping_setup_buffers failed: %d\n", ret);
+		goto err2;
+	}
+
+	ret = rping_accept(cb);
+	if (ret) {
+		fprintf(stderr, "connect error %d\n", ret);
+		goto err3;
+	}
+
+	rping_format_send(cb, cb->rdma_buf, cb->rdma_mr);
+	ret = ibv_post_send(cb->qp, &cb->sq_wr, &bad_wr);
+	if (ret) {
+		fprintf(stderr, "post send error %d\n", ret);
+		rping_disconnect(cb, cb->child_cm_id);
+		goto err3;
+	}
+	return cb;
+
+err3:
+	rping_free_buffers(cb);
+err2:
+	rping_free_qp(cb);
+err1:
+	rdma_destroy_id(cb->child_cm_id);
+	sem_destroy(&cb->sem);
+	free_cb(cb);
+	return NULL;
+}
+
+static int rping_run_stream_server(struct rping_cb *listening_cb)
+{
+	struct rping_cb **cbs, *cb;
+	int i, n, ret;
+
+	ret = rping_bind_server(listening_cb);
+	if (ret)
+		return ret;
+
+	cbs = calloc(listening_cb->qps, sizeof(*cbs));
+	if (!cbs)
+		return -ENOMEM;
+
+	for (n = 0; n < listening_cb->qps; n++) {
+		cbs[n] = rping_stream_accept(listening_cb);
+		if (!cbs[n]) {
+			ret = -1;
+			for (i = 0; i < n; i++)
+				rping_disconnect(cbs[i], cbs[i]->child_cm_id);
+			break;
+		}
+	}
+
+	/* The client drives all transfers; wait for it to disconnect */
+	for (i = 0; i < n; i++) {
+		cb = cbs[i];
+		while (cb->state != DISCONNECTED && cb->state != ERROR)
+			sem_wait(&cb->sem);
+
+		rping_disconnect(cb, cb->child_cm_id);
+		rping_free_buffers(cb);
+		rping_free_qp(cb);
+		rdma_destroy_id(cb->child_cm_id);
+		sem_destroy(&cb->sem);
+		free_cb(cb);
+	}
+	free(cbs);
+	return ret;
+}
+
 static int get_addr(char *dst, struct sockaddr *addr)
 {
 	struct addrinfo *res;
@@ -1293,6 +1817,12 @@ static void usage(const char *name)
 	printf("\t-p port\t\tport\n");
 	printf("\t-P\t\tpersistent server mode allowing multiple connections\n");
 	printf("\t-q\t\tuse self-created, self-modified QP\n");
+	printf("\t-T read|write\tthroughput test using pipelined RDMA reads or writes\n");
+	printf("\t-Q depth\toutstanding RDMA ops per QP (throughput test, default %d)\n",
+	       RPING_SQ_DEPTH);
+	printf("\t-b batch\tRDMA ops per signaled completion (throughput test, default 1)\n");
+	printf("\t-n qps\t\tnumber of QPs (throughput test, default 1)\n");
+	printf("\t-w threads\tclient worker threads (throughput test, default 1)\n");
 }
 
 int main(int argc, char *argv[])
@@ -1313,11 +1843,15 @@ int main(int argc, char *argv[])
 	cb->size = 64;
 	cb->sin.ss_family = PF_INET;
 	cb->port = htobe16(7174);
+	cb->sq_depth = RPING_SQ_DEPTH;
+	cb->batch = 1;
+	cb->qps = 1;
+	cb->threads = 1;
 	sem_init(&cb->sem, 0, 0);
 	sem_init(&cb->accept_ready, 0, 1);
 
 	opterr = 0;
-	while ((op = getopt(argc, argv, "a:I:Pp:C:S:t:scvVdq")) != -1) {
+	while ((op = getopt(argc, argv, "a:I:Pp:C:S:t:scvVdqT:Q:b:n:w:")) != -1) {
 		switch (op) {
 		case 'a':
 			ret = get_addr(optarg, (struct sockaddr *) &cb->sin);
@@ -1374,6 +1908,49 @@ int main(int argc, char *argv[])
 		case 'q':
 			cb->self_create_qp = 1;
 			break;
+		case 'T':
+			cb->stream = 1;
+			if (!strcmp(optarg, "read")) {
+				cb->stream_op = IBV_WR_RDMA_READ;
+			} else if (!strcmp(optarg, "write")) {
+				cb->stream_op = IBV_WR_RDMA_WRITE;
+			} else {
+				fprintf(stderr, "Invalid test %s\n", optarg);
+				ret = EINVAL;
+			}
+			break;
+		case 'Q':
+			cb->sq_depth = atoi(optarg);
+			if (cb->sq_depth < 1) {
+				fprintf(stderr, "Invalid depth %d\n",
+					cb->sq_depth);
+				ret = EINVAL;
+			}
+			break;
+		case 'b':
+			cb->batch = atoi(optarg);
+			if (cb->batch < 1) {
+				fprintf(stderr, "Invalid batch %d\n",
+					cb->batch);
+				ret = EINVAL;
+			}
+			break;
+		case 'n':
+			cb->qps = atoi(optarg);
+			if (cb->qps < 1) {
+				fprintf(stderr, "Invalid QP count %d\n",
+					cb->qps);
+				ret = EINVAL;
+			}
+			break;
+		case 'w':
+			cb->threads = atoi(optarg);
+			if (cb->threads < 1) {
+				fprintf(stderr, "Invalid thread count %d\n",
+					cb->threads);
+				ret = EINVAL;
+			}
+			break;
 		default:
 			usage("rping");
 			ret = EINVAL;
@@ -1389,6 +1966,21 @@ int main(int argc, char *argv[])
 		goto out;
 	}
 
+	if (cb->stream) {
+		if (persistent_server) {
+			fprintf(stderr, "-T cannot be used with -P\n");
+			ret = EINVAL;
+			goto out;
+		}
+		if (!cb->count)
+			cb->count = RPING_STREAM_COUNT;
+		cb->batch = min(cb->batch, cb->sq_depth);
+		cb->threads = min(cb->threads, cb->qps);
+	} else {
+		cb->sq_depth = RPING_SQ_DEPTH;
+		cb->qps = 1;
+	}
+
 	cb->eventfd = eventfd(0, EFD_NONBLOCK);
 	if (cb->eventfd == -1) {
 		perror("Could not create event FD");
@@ -1418,10 +2010,15 @@ int main(int argc, char *argv[])
 	if (cb->server) {
 		if (persistent_server)
 			ret = rping_run_persistent_server(cb);
+		else if (cb->stream)
+			ret = rping_run_stream_server(cb);
 		else
 			ret = rping_run_server(cb);
 	} else {
-		ret = rping_run_client(cb);
+		if (cb->stream)
+			ret = rping_run_stream_client(cb);
+		else
+			ret = rping_run_client(cb);
 	}
 
 	DEBUG_LOG("destroy cm_id %p\n", cb->cm_id);
@@ -42,10 +42,15 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <netinet/tcp.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <inttypes.h>
+#include <pthread.h>
 
 #include <rdma/rdma_cma.h>
 #include <rdma/rsocket.h>
 #include <util/compiler.h>
+#include <ccan/minmax.h>
 #include "common.h"
 
 struct test_size_param {
@@ -74,9 +79,21 @@ static struct test_size_param test_size[] = {
 };
 #define TEST_CNT (sizeof test_size / sizeof test_size[0])
 
-static int rs, lrs;
+struct rs_conn {
+	int rs;
+	void *buf;
+	pthread_t thread;
+	struct timeval start, end;
+	uint64_t *lat;
+	int ret;
+};
+
+static struct rs_conn *conns;
+static int num_conns = 1;
+static int lrs;
 static int use_async;
 static int use_rgai;
+static int use_iomap;
 static int verify;
 static int flags = MSG_DONTWAIT;
 static int poll_timeout = 0;
@@ -88,25 +105,86 @@ static int size_option;
 static int iterations = 1;
 static int transfer_size = 1000;
 static int transfer_count = 1000;
+static int resp_size;
 static int buffer_size, inline_size = 64;
 static char test_name[10] = "custom";
 static const char *port = "7471";
 static int keepalive;
 static char *dst_addr;
 static char *src_addr;
-static struct timeval start, end;
-static void *buf;
+static struct rusage ru_start, ru_end;
 static struct rdma_addrinfo rai_hints;
 static struct addrinfo ai_hints;
 
+/* The size of the reply to each transfer */
+static inline int reply_size(void)
+{
+	return resp_size ? resp_size : transfer_size;
+}
+
+static uint64_t tv_us(struct timeval *tv)
+{
+	return (uint64_t) tv->tv_sec * 1000000 + tv->tv_usec;
+}
+
+static uint64_t cpu_us(void)
+{
+	struct timeval user, sys;
+
+	timersub(&ru_end.ru_utime, &ru_start.ru_utime, &user);
+	timersub(&ru_end.ru_stime, &ru_start.ru_stime, &sys);
+	return tv_us(&user) + tv_us(&sys);
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a;
+	uint64_t y = *(const uint64_t *) b;
+
+	return (x > y) - (x < y);
+}
+
+/* Nearest-rank percentile over a sorted array, permille = 500 for p50 */
+static uint64_t percentile(const uint64_t *val, int cnt, int permille)
+{
+	long long rank;
+
+	if (!cnt)
+		return 0;
+
+	rank = ((long long) cnt * permille + 999) / 1000;
+	return val[rank ? rank - 1 : 0];
+}
+
 static void show_perf(void)
 {
+	uint64_t first = UINT64_MAX, last = 0, *lat;
+	long long bytes;
 	char str[32];
 	float usec;
-	long long bytes;
+	int i, cnt;
 
-	usec = (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_usec - start.tv_usec);
-	bytes = (long long) iterations * transfer_count * transfer_size * 2;
+	for (i = 0; i < num_conns; i++) {
+		if (tv_us(&conns[i].start) < first)
+			first = tv_us(&conns[i].start);
+		if (tv_us(&conns[i].end) > last)
+			last = tv_us(&conns[i].end);
+	}
+	usec = last - first;
+	bytes = (long long) iterations * transfer_count *
+		(transfer_size + reply_size()) * num_conns;
+
+	/* Round trip time of each iteration, over all connections */
+	cnt = iterations * num_conns;
+	lat = malloc(sizeof(*lat) * cnt);
+	if (lat) {
+		for (i = 0; i < num_conns; i++)
+			memcpy(lat + i * iterations, conns[i].lat,
+			       sizeof(*lat) * iterations);
+		qsort(lat, cnt, sizeof(*lat), cmp_u64);
+	} else {
+		cnt = 0;
+	}
 
 	/* name size transfers iterations bytes seconds Gb/sec usec/xfer */
 	printf("%-10s", test_name);
@@ -118,9 +196,15 @@ static void show_perf(void)
 	printf("%-8s", str);
 	size_str(str, sizeof str, bytes);
 	printf("%-8s", str);
-	printf("%8.2fs%10.2f%11.2f\n",
+	printf("%8.2fs%10.2f%11.2f",
 		usec / 1000000., (bytes * 8) / (1000. * usec),
 		(usec / iterations) / (transfer_count * 2));
+
+	/* p50 p99 p99.9 usec/iter, CPU time per byte */
+	printf("%9" PRIu64 "%9" PRIu64 "%9" PRIu64 "%9.2f\n",
+	       percentile(lat, cnt, 500), percentile(lat, cnt, 990),
+	       percentile(lat, cnt, 999), cpu_us() * 1000. / bytes);
+	free(lat);
 }
 
 static void init_latency_test(int size)
@@ -128,7 +212,8 @@ static void init_latency_test(int size)
 	char sstr[5];
 
 	size_str(sstr, sizeof sstr, size);
-	snprintf(test_name, sizeof test_name, "%s_lat", sstr);
+	snprintf(test_name, sizeof test_name, "%s_%s", sstr,
+		 resp_size ? "rpc" : "lat");
 	transfer_count = 1;
 	transfer_size = size;
 	iterations = size_to_count(transfer_size);
@@ -145,16 +230,13 @@ static void init_bandwidth_test(int size)
 	transfer_count = size_to_count(transfer_size);
 }
 
-static int send_xfer(int size)
+static int send_msg(struct rs_conn *c, int size)
 {
 	struct pollfd fds;
 	int offset, ret;
 
-	if (verify)
-		format_buf(buf, size);
-
 	if (use_async) {
-		fds.fd = rs;
+		fds.fd = c->rs;
 		fds.events = POLLOUT;
 	}
 
@@ -165,7 +247,7 @@ static int send_xfer(int size)
 				return ret;
 		}
 
-		ret = rs_send(rs, buf + offset, size - offset, flags);
+		ret = rs_send(c->rs, c->buf + offset, size - offset, flags);
 		if (ret > 0) {
 			offset += ret;
 		} else if (errno != EWOULDBLOCK && errno != EAGAIN) {
@@ -177,13 +259,13 @@ static int send_xfer(int size)
 	return 0;
 }
 
-static int recv_xfer(int size)
+static int recv_msg(struct rs_conn *c, int size)
 {
 	struct pollfd fds;
 	int offset, ret;
 
 	if (use_async) {
-		fds.fd = rs;
+		fds.fd = c->rs;
 		fds.events = POLLIN;
 	}
 
@@ -194,7 +276,7 @@ static int recv_xfer(int size)
 				return ret;
 		}
 
-		ret = rs_recv(rs, buf + offset, size - offset, flags);
+		ret = rs_recv(c->rs, c->buf + offset, size - offset, flags);
 		if (ret > 0) {
 			offset += ret;
 		} else if (errno != EWOULDBLOCK && errno != EAGAIN) {
@@ -203,58 +285,196 @@ static int recv_xfer(int size)
 		}
 	}
 
-	if (verify) {
-		ret = verify_buf(buf, size);
+	return 0;
+}
+
+/* Writes directly into the buffer the peer mapped at offset 0 */
+static int write_msg(struct rs_conn *c, int size)
+{
+	struct pollfd fds;
+	int offset, ret;
+
+	if (use_async) {
+		fds.fd = c->rs;
+		fds.events = POLLOUT;
+	}
+
+	for (offset = 0; offset < size; ) {
+		if (use_async) {
+			ret = do_poll(&fds, poll_timeout);
+			if (ret)
+				return ret;
+		}
+
+		ret = riowrite(c->rs, c->buf + offset, size - offset, offset,
+			       flags);
+		if (ret > 0) {
+			offset += ret;
+		} else if (errno != EWOULDBLOCK && errno != EAGAIN) {
+			perror("riowrite");
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * With iomap, the data is written with riowrite, followed by a one byte
+ * message.  rsockets orders the message after the writes, so receiving
+ * it indicates that all data has been placed.
+ */
+static int send_xfer(struct rs_conn *c, int size, int cnt)
+{
+	int ret, t;
+
+	for (t = 0; t < cnt; t++) {
+		if (verify)
+			format_buf(c->buf, size);
+
+		ret = use_iomap ? write_msg(c, size) : send_msg(c, size);
+		if (ret)
+			return ret;
+	}
+
+	return use_iomap ? send_msg(c, 1) : 0;
+}
+
+static int recv_xfer(struct rs_conn *c, int size, int cnt)
+{
+	int ret, t;
+
+	if (use_iomap) {
+		ret = recv_msg(c, 1);
 		if (ret)
 			return ret;
+
+		return verify ? verify_buf(c->buf, size) : 0;
+	}
+
+	for (t = 0; t < cnt; t++) {
+		ret = recv_msg(c, size);
+		if (ret)
+			return ret;
+
+		if (verify) {
+			ret = verify_buf(c->buf, size);
+			if (ret)
+				return ret;
+		}
 	}
 
 	return 0;
 }
 
-static int sync_test(void)
+static int sync_test(struct rs_conn *c)
 {
 	int ret;
 
-	ret = dst_addr ? send_xfer(16) : recv_xfer(16);
+	ret = dst_addr ? send_msg(c, 16) : recv_msg(c, 16);
 	if (ret)
 		return ret;
 
-	return dst_addr ? recv_xfer(16) : send_xfer(16);
+	return dst_addr ? recv_msg(c, 16) : send_msg(c, 16);
 }
 
-static int run_test(void)
+static int run_conn_test(struct rs_conn *c)
 {
-	int ret, i, t;
+	int ret, i, size;
+	uint64_t iter_start;
+	off_t offset;
+
+	size = max(transfer_size, reply_size());
+	if (use_iomap) {
+		offset = riomap(c->rs, c->buf, size, PROT_WRITE, 0, 0);
+		if (offset == -1) {
+			perror("riomap");
+			return -1;
+		}
+	}
 
-	ret = sync_test();
+	ret = sync_test(c);
 	if (ret)
 		goto out;
 
-	gettimeofday(&start, NULL);
+	gettimeofday(&c->start, NULL);
 	for (i = 0; i < iterations; i++) {
-		for (t = 0; t < transfer_count; t++) {
-			ret = dst_addr ? send_xfer(transfer_size) :
-					 recv_xfer(transfer_size);
+		iter_start = gettime_us();
+		if (dst_addr) {
+			ret = send_xfer(c, transfer_size, transfer_count);
 			if (ret)
 				goto out;
-		}
 
-		for (t = 0; t < transfer_count; t++) {
-			ret = dst_addr ? recv_xfer(transfer_size) :
-					 send_xfer(transfer_size);
+			ret = recv_xfer(c, reply_size(), transfer_count);
+			if (ret)
+				goto out;
+		} else {
+			ret = recv_xfer(c, transfer_size, transfer_count);
+			if (ret)
+				goto out;
+
+			ret = send_xfer(c, reply_size(), transfer_count);
 			if (ret)
 				goto out;
 		}
+		c->lat[i] = gettime_us() - iter_start;
 	}
-	gettimeofday(&end, NULL);
-	show_perf();
-	ret = 0;
+	gettimeofday(&c->end, NULL);
 
 out:
+	if (use_iomap)
+		riounmap(c->rs, c->buf, size);
 	return ret;
 }
 
+static void *conn_thread(void *arg)
+{
+	struct rs_conn *c = arg;
+
+	c->ret = run_conn_test(c);
+	return NULL;
+}
+
+/* Runs the test over every connection at once, one thread per connection */
+static int run_test(void)
+{
+	int i, ret;
+
+	for (i = 0; i < num_conns; i++) {
+		free(conns[i].lat);
+		conns[i].lat = calloc(iterations, sizeof(*conns[i].lat));
+		if (!conns[i].lat) {
+			perror("calloc");
+			return -1;
+		}
+	}
+
+	getrusage(RUSAGE_SELF, &ru_start);
+	if (num_conns == 1) {
+		conn_thread(&conns[0]);
+	} else {
+		for (i = 0; i < num_conns; i++) {
+			ret = pthread_create(&conns[i].thread, NULL,
+					     conn_thread, &conns[i]);
+			if (ret) {
+				perror("pthread_create");
+				exit(EXIT_FAILURE);
+			}
+		}
+		for (i = 0; i < num_conns; i++)
+			pthread_join(conns[i].thread, NULL);
+	}
+	getrusage(RUSAGE_SELF, &ru_end);
+
+	for (i = 0; i < num_conns; i++) {
+		if (conns[i].ret)
+			return conns[i].ret;
+	}
+
+	show_perf();
+	return 0;
+}
+
 static void set_keepalive(int fd)
 {
 	int optval;
@@ -298,6 +518,11 @@ static void set_options(int fd)
 	if (flags & MSG_DONTWAIT)
 		rs_fcntl(fd, F_SETFL, O_NONBLOCK);
 
+	if (use_iomap) {
+		val = 1;
+		rs_setsockopt(fd, SOL_RDMA, RDMA_IOMAPSIZE, &val, sizeof val);
+	}
+
 	if (use_rs) {
 		/* Inline size based on experimental data */
 		if (optimization == opt_latency) {
@@ -352,7 +577,7 @@ static int server_listen(void)
 		goto close;
 	}
 
-	ret = rs_listen(lrs, 1);
+	ret = rs_listen(lrs, num_conns);
 	if (ret)
 		perror("rlisten");
 
@@ -367,7 +592,7 @@ free:
 	return ret;
 }
 
-static int server_connect(void)
+static int server_connect(struct rs_conn *c)
 {
 	struct pollfd fds;
 	int ret = 0;
@@ -385,21 +610,21 @@ static int server_connect(void)
 			}
 		}
 
-		rs = rs_accept(lrs, NULL, NULL);
-	} while (rs < 0 && (errno == EAGAIN || errno == EWOULDBLOCK));
-	if (rs < 0) {
+		c->rs = rs_accept(lrs, NULL, NULL);
+	} while (c->rs < 0 && (errno == EAGAIN || errno == EWOULDBLOCK));
+	if (c->rs < 0) {
 		perror("raccept");
-		return rs;
+		return c->rs;
 	}
 
 	if (use_fork)
 		fork_pid = fork();
 	if (!fork_pid)
-		set_options(rs);
+		set_options(c->rs);
 	return ret;
 }
 
-static int client_connect(void)
+static int client_connect(struct rs_conn *c)
 {
 	struct rdma_addrinfo *rai = NULL, *rai_src = NULL;
 	struct addrinfo *ai = NULL, *ai_src = NULL;
@@ -429,18 +654,18 @@ static int client_connect(void)
 		}
 	}
 
-	rs = rai ? rs_socket(rai->ai_family, SOCK_STREAM, 0) :
+	c->rs = rai ? rs_socket(rai->ai_family, SOCK_STREAM, 0) :
 		   rs_socket(ai->ai_family, SOCK_STREAM, 0);
-	if (rs < 0) {
-		ret = rs;
+	if (c->rs < 0) {
+		ret = c->rs;
 		goto free;
 	}
 
-	set_options(rs);
+	set_options(c->rs);
 
 	if (src_addr) {
-		ret = rai ? rs_bind(rs, rai_src->ai_src_addr, rai_src->ai_src_len) :
-			    rs_bind(rs, ai_src->ai_addr, ai_src->ai_addrlen);
+		ret = rai ? rs_bind(c->rs, rai_src->ai_src_addr, rai_src->ai_src_len) :
+			    rs_bind(c->rs, ai_src->ai_addr, ai_src->ai_addrlen);
 		if (ret) {
 			perror("rbind");
 			goto close;
@@ -448,7 +673,7 @@ static int client_connect(void)
 	}
 
 	if (rai && rai->ai_route) {
-		ret = rs_setsockopt(rs, SOL_RDMA, RDMA_ROUTE, rai->ai_route,
+		ret = rs_setsockopt(c->rs, SOL_RDMA, RDMA_ROUTE, rai->ai_route,
 				    rai->ai_route_len);
 		if (ret) {
 			perror("rsetsockopt RDMA_ROUTE");
@@ -456,15 +681,15 @@ static int client_connect(void)
 		}
 	}
 
-	ret = rai ? rs_connect(rs, rai->ai_dst_addr, rai->ai_dst_len) :
-		    rs_connect(rs, ai->ai_addr, ai->ai_addrlen);
+	ret = rai ? rs_connect(c->rs, rai->ai_dst_addr, rai->ai_dst_len) :
+		    rs_connect(c->rs, ai->ai_addr, ai->ai_addrlen);
 	if (ret && (errno != EINPROGRESS)) {
 		perror("rconnect");
 		goto close;
 	}
 
 	if (ret && (errno == EINPROGRESS)) {
-		fds.fd = rs;
+		fds.fd = c->rs;
 		fds.events = POLLOUT;
 		ret = do_poll(&fds, poll_timeout);
 		if (ret) {
@@ -473,7 +698,7 @@ static int client_connect(void)
 		}
 
 		len = sizeof err;
-		ret = rs_getsockopt(rs, SOL_SOCKET, SO_ERROR, &err, &len);
+		ret = rs_getsockopt(c->rs, SOL_SOCKET, SO_ERROR, &err, &len);
 		if (ret)
 			goto close;
 		if (err) {
@@ -485,7 +710,7 @@ static int client_connect(void)
 
 close:
 	if (ret)
-		rs_close(rs);
+		rs_close(c->rs);
 free:
 	rdma_freeaddrinfo(rai);
 	if (ai)
@@ -496,27 +721,66 @@ free:
 	return ret;
 }
 
+static int connect_all(void)
+{
+	int i, ret;
+
+	for (i = 0; i < num_conns; i++) {
+		ret = dst_addr ? client_connect(&conns[i]) :
+				 server_connect(&conns[i]);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+static void disconnect_all(void)
+{
+	int i;
+
+	if (fork_pid)
+		waitpid(fork_pid, NULL, 0);
+
+	for (i = 0; i < num_conns; i++) {
+		if (!fork_pid)
+			rs_shutdown(conns[i].rs, SHUT_RDWR);
+		rs_close(conns[i].rs);
+	}
+}
+
 static int run(void)
 {
-	int i, ret = 0;
+	int i, ret = 0, size;
 
-	buf = malloc(!custom ? test_size[TEST_CNT - 1].size : transfer_size);
-	if (!buf) {
-		perror("malloc");
+	conns = calloc(num_conns, sizeof(*conns));
+	if (!conns) {
+		perror("calloc");
 		return -1;
 	}
 
+	size = !custom ? test_size[TEST_CNT - 1].size : transfer_size;
+	size = max(size, resp_size);
+	for (i = 0; i < num_conns; i++) {
+		conns[i].buf = malloc(size);
+		if (!conns[i].buf) {
+			perror("malloc");
+			ret = -1;
+			goto free;
+		}
+	}
+
 	if (!dst_addr) {
 		ret = server_listen();
 		if (ret)
 			goto free;
 	}
 
-	printf("%-10s%-8s%-8s%-8s%-8s%8s %10s%13s\n",
-	       "name", "bytes", "xfers", "iters", "total", "time", "Gb/sec", "usec/xfer");
+	printf("%-10s%-8s%-8s%-8s%-8s%8s %10s%13s%9s%9s%9s%9s\n",
+	       "name", "bytes", "xfers", "iters", "total", "time", "Gb/sec",
+	       "usec/xfer", "p50", "p99", "p99.9", "cpu ns/B");
 	if (!custom) {
 		optimization = opt_latency;
-		ret = dst_addr ? client_connect() : server_connect();
+		ret = connect_all();
 		if (ret)
 			goto free;
 
@@ -526,17 +790,13 @@ static int run(void)
 			init_latency_test(test_size[i].size);
 			run_test();
 		}
-		if (fork_pid)
-			waitpid(fork_pid, NULL, 0);
-		else
-			rs_shutdown(rs, SHUT_RDWR);
-		rs_close(rs);
+		disconnect_all();
 
-		if (!dst_addr && use_fork && !fork_pid)
+		if ((!dst_addr && use_fork && !fork_pid) || resp_size)
 			goto free;
 
 		optimization = opt_bandwidth;
-		ret = dst_addr ? client_connect() : server_connect();
+		ret = connect_all();
 		if (ret)
 			goto free;
 		for (i = 0; i < TEST_CNT && !fork_pid; i++) {
@@ -546,7 +806,7 @@ static int run(void)
 			run_test();
 		}
 	} else {
-		ret = dst_addr ? client_connect() : server_connect();
+		ret = connect_all();
 		if (ret)
 			goto free;
 
@@ -554,13 +814,13 @@ static int run(void)
 			ret = run_test();
 	}
 
-	if (fork_pid)
-		waitpid(fork_pid, NULL, 0);
-	else
-		rs_shutdown(rs, SHUT_RDWR);
-	rs_close(rs);
+	disconnect_all();
 free:
-	free(buf);
+	for (i = 0; i < num_conns; i++) {
+		free(conns[i].buf);
+		free(conns[i].lat);
+	}
+	free(conns);
 	return ret;
 }
 
@@ -581,6 +841,9 @@ static int set_test_opt(const char *arg)
 			use_fork = 1;
 			use_rs = 0;
 			break;
+		case 'i':
+			use_iomap = 1;
+			break;
 		case 'n':
 			flags |= MSG_DONTWAIT;
 			break;
@@ -609,6 +872,8 @@ static int set_test_opt(const char *arg)
 		} else if (!strncasecmp("fork", arg, 4)) {
 			use_fork = 1;
 			use_rs = 0;
+		} else if (!strncasecmp("iomap", arg, 5)) {
+			use_iomap = 1;
 		} else {
 			return -1;
 		}
@@ -622,7 +887,7 @@ int main(int argc, char **argv)
 
 	ai_hints.ai_socktype = SOCK_STREAM;
 	rai_hints.ai_port_space = RDMA_PS_TCP;
-	while ((op = getopt(argc, argv, "s:b:f:B:i:I:C:S:p:k:T:")) != -1) {
+	while ((op = getopt(argc, argv, "s:b:f:B:c:i:I:C:S:R:p:k:T:")) != -1) {
 		switch (op) {
 		case 's':
 			dst_addr = optarg;
@@ -644,6 +909,11 @@ int main(int argc, char **argv)
 		case 'B':
 			buffer_size = atoi(optarg);
 			break;
+		case 'c':
+			num_conns = atoi(optarg);
+			if (num_conns < 1)
+				goto usage;
+			break;
 		case 'i':
 			inline_size = atoi(optarg);
 			break;
@@ -663,6 +933,11 @@ int main(int argc, char **argv)
 				transfer_size = atoi(optarg);
 			}
 			break;
+		case 'R':
+			resp_size = atoi(optarg);
+			if (resp_size < 1)
+				goto usage;
+			break;
 		case 'p':
 			port = optarg;
 			break;
@@ -675,16 +950,19 @@ int main(int argc, char **argv)
 			/* invalid option - fall through */
 			SWITCH_FALLTHROUGH;
 		default:
+usage:
 			printf("usage: %s\n", argv[0]);
 			printf("\t[-s server_address]\n");
 			printf("\t[-b bind_address]\n");
 			printf("\t[-f address_format]\n");
 			printf("\t    name, ip, ipv6, or gid\n");
 			printf("\t[-B buffer_size]\n");
+			printf("\t[-c num_connections]\n");
 			printf("\t[-i inline_size]\n");
 			printf("\t[-I iterations]\n");
 			printf("\t[-C transfer_count]\n");
 			printf("\t[-S transfer_size or all]\n");
+			printf("\t[-R response_size] request/response test\n");
 			printf("\t[-p port_number]\n");
 			printf("\t[-k keepalive_time]\n");
 			printf("\t[-T test_option]\n");
@@ -692,6 +970,7 @@ int main(int argc, char **argv)
 			printf("\t    a|async - asynchronous operation (use poll)\n");
 			printf("\t    b|blocking - use blocking calls\n");
 			printf("\t    f|fork - fork server processing\n");
+			printf("\t    i|iomap - transfer data using riowrite\n");
 			printf("\t    n|nonblocking - use nonblocking calls\n");
 			printf("\t    r|resolve - use rdma cm to resolve address\n");
 			printf("\t    v|verify - verify data\n");
@@ -699,6 +978,9 @@ int main(int argc, char **argv)
 		}
 	}
 
+	if ((num_conns > 1 && (use_fork || verify)) || (use_iomap && !use_rs))
+		goto usage;
+
 	if (!(flags & MSG_DONTWAIT))
 		poll_timeout = -1;
 
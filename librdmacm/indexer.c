@@ -36,6 +36,7 @@
 #include <errno.h>
 #include <sys/types.h>
 #include <stdlib.h>
+#include <stdbool.h>
 
 #include "indexer.h"
 
@@ -120,45 +121,158 @@ void idx_replace(struct indexer *idx, int index, void *item)
 }
 
 
-static int idm_grow(struct index_map *idm, int index)
+/*
+ * Index map - the upper bits of the index select an entry array from a
+ * top level array.  Indexes up to IDM_FIXED_MAX use the fixed array in
+ * the map itself.  Higher ones use the ext array, which doubles in size
+ * as higher indexes are set.
+ *
+ * Lookups do not take a lock, so a reader may still be using an ext
+ * array after it has been replaced.  Replaced arrays are kept on the
+ * prev list until the map is freed.  Since each array is twice the size
+ * of the one before it, they never use more memory than the current
+ * array.  Entry arrays are not released before then either.
+ */
+
+#define IDM_EXT_MIN_SIZE 64
+
+static struct idm_array *idm_grow(struct index_map *idm, int i)
 {
-	idm->array[idx_array_index(index)] = calloc(IDX_ENTRY_SIZE, sizeof(void *));
-	if (!idm->array[idx_array_index(index)])
-		goto nomem;
+	struct idm_array *array, *old;
+	int j, size;
 
-	return index;
+	old = atomic_load_explicit(&idm->ext, memory_order_relaxed);
+	size = old ? old->size << 1 : IDM_EXT_MIN_SIZE;
+	while (size <= i)
+		size <<= 1;
 
-nomem:
-	errno = ENOMEM;
-	return -1;
+	array = calloc(1, sizeof(*array) + sizeof(array->entry[0]) * size);
+	if (!array) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	array->size = size;
+	array->prev = old;
+	for (j = 0; old && j < old->size; j++)
+		atomic_init(&array->entry[j],
+			    atomic_load_explicit(&old->entry[j],
+						 memory_order_relaxed));
+
+	atomic_store_explicit(&idm->ext, array, memory_order_release);
+	return array;
+}
+
+/* Top level slot for a non-negative index, growing ext if asked to */
+static _Atomic(_Atomic(void *) *) *idm_slot(struct index_map *idm, int index,
+					     bool grow)
+{
+	struct idm_array *ext;
+	int i = idm_array_index(index);
+
+	if (index <= IDM_FIXED_MAX)
+		return &idm->array[i];
+
+	i -= IDM_FIXED_SIZE;
+	ext = atomic_load_explicit(&idm->ext, memory_order_relaxed);
+	if (!ext || i >= ext->size) {
+		if (!grow)
+			return NULL;
+		ext = idm_grow(idm, i);
+		if (!ext)
+			return NULL;
+	}
+	return &ext->entry[i];
 }
 
 int idm_set(struct index_map *idm, int index, void *item)
 {
-	void **entry;
+	_Atomic(_Atomic(void *) *) *slot;
+	_Atomic(void *) *entry;
 
-	if (index > IDX_MAX_INDEX) {
+	if (index < 0) {
 		errno = ENOMEM;
 		return -1;
 	}
 
-	if (!idm->array[idx_array_index(index)]) {
-		if (idm_grow(idm, index) < 0)
+	slot = idm_slot(idm, index, true);
+	if (!slot)
+		return -1;
+
+	entry = atomic_load_explicit(slot, memory_order_relaxed);
+	if (!entry) {
+		entry = calloc(IDM_ENTRY_SIZE, sizeof(*entry));
+		if (!entry) {
+			errno = ENOMEM;
 			return -1;
+		}
+		atomic_store_explicit(slot, entry, memory_order_release);
 	}
 
-	entry = idm->array[idx_array_index(index)];
-	entry[idx_entry_index(index)] = item;
+	atomic_store_explicit(&entry[idm_entry_index(index)], item,
+			      memory_order_release);
 	return index;
 }
 
 void *idm_clear(struct index_map *idm, int index)
 {
-	void **entry;
+	_Atomic(_Atomic(void *) *) *slot;
+	_Atomic(void *) *entry;
+
+	if (index < 0)
+		return NULL;
+
+	slot = idm_slot(idm, index, false);
+	if (!slot)
+		return NULL;
+
+	entry = atomic_load_explicit(slot, memory_order_relaxed);
+	if (!entry)
+		return NULL;
+
+	return atomic_exchange_explicit(&entry[idm_entry_index(index)], NULL,
+					memory_order_release);
+}
+
+static void idm_free_entry(_Atomic(_Atomic(void *) *) *slot,
+			   void (*free_item)(void *item))
+{
+	_Atomic(void *) *entry;
 	void *item;
+	int i;
 
-	entry = idm->array[idx_array_index(index)];
-	item = entry[idx_entry_index(index)];
-	entry[idx_entry_index(index)] = NULL;
-	return item;
+	entry = atomic_load_explicit(slot, memory_order_relaxed);
+	if (!entry)
+		return;
+
+	for (i = 0; free_item && i < IDM_ENTRY_SIZE; i++) {
+		item = atomic_load_explicit(&entry[i], memory_order_relaxed);
+		if (item)
+			free_item(item);
+	}
+	free(entry);
+	atomic_store_explicit(slot, NULL, memory_order_relaxed);
+}
+
+/*
+ * Releases all memory used by the map.  There must be no concurrent
+ * users.  If free_item is given, it is called for each item still set.
+ */
+void idm_free(struct index_map *idm, void (*free_item)(void *item))
+{
+	struct idm_array *array, *prev;
+	int i;
+
+	for (i = 0; i < IDM_FIXED_SIZE; i++)
+		idm_free_entry(&idm->array[i], free_item);
+
+	array = atomic_load_explicit(&idm->ext, memory_order_relaxed);
+	for (i = 0; array && i < array->size; i++)
+		idm_free_entry(&array->entry[i], free_item);
+
+	for (; array; array = prev) {
+		prev = array->prev;
+		free(array);
+	}
+	atomic_store_explicit(&idm->ext, NULL, memory_order_relaxed);
 }
@@ -36,6 +36,8 @@
 
 #include <config.h>
 #include <stddef.h>
+#include <limits.h>
+#include <stdatomic.h>
 #include <sys/types.h>
 
 /*
@@ -75,30 +77,96 @@ static inline void *idx_at(struct indexer *idx, int index)
 }
 
 /*
- * Index map - associates a structure with an index.  Synchronization
- * must be provided by the caller.  Caller must initialize the
- * index map by setting it to 0.
+ * Index map - associates a structure with an index.  Updates must be
+ * serialized by the caller, but lookups may run concurrently with them
+ * without locking.  Any non-negative int may be used as an index.
+ * Caller must initialize the index map by setting it to 0.
+ *
+ * Indexes below IDM_FIXED_MAX, which covers nearly all users, are found
+ * through a fixed top level array.  Higher indexes go through a second
+ * top level array, which grows as needed.
  */
 
+#define IDM_ENTRY_BITS 10
+#define IDM_ENTRY_SIZE (1 << IDM_ENTRY_BITS)
+#define IDM_FIXED_BITS 16
+#define IDM_FIXED_SIZE (1 << (IDM_FIXED_BITS - IDM_ENTRY_BITS))
+#define IDM_FIXED_MAX  ((1 << IDM_FIXED_BITS) - 1)
+#define IDM_MAX_INDEX  INT_MAX
+
+#define idm_array_index(index) ((index) >> IDM_ENTRY_BITS)
+#define idm_entry_index(index) ((index) & (IDM_ENTRY_SIZE - 1))
+
+struct idm_array
+{
+	int		 size;
+	struct idm_array *prev;
+	_Atomic(_Atomic(void *) *) entry[];
+};
+
 struct index_map
 {
-	void **array[IDX_ARRAY_SIZE];
+	_Atomic(_Atomic(void *) *) array[IDM_FIXED_SIZE];
+	_Atomic(struct idm_array *) ext;	/* indexes above IDM_FIXED_MAX */
 };
 
 int idm_set(struct index_map *idm, int index, void *item);
 void *idm_clear(struct index_map *idm, int index);
+void idm_free(struct index_map *idm, void (*free_item)(void *item));
+
+/* Entry array holding a non-negative index, or NULL */
+static inline _Atomic(void *) *idm_entry(struct index_map *idm, int index)
+{
+	struct idm_array *ext;
+	int i = idm_array_index(index);
+
+	if (index <= IDM_FIXED_MAX)
+		return atomic_load_explicit(&idm->array[i],
+					    memory_order_acquire);
+
+	ext = atomic_load_explicit(&idm->ext, memory_order_acquire);
+	if (!ext || i - IDM_FIXED_SIZE >= ext->size)
+		return NULL;
 
+	return atomic_load_explicit(&ext->entry[i - IDM_FIXED_SIZE],
+				    memory_order_acquire);
+}
+
+/* The index must have been set in the map */
 static inline void *idm_at(struct index_map *idm, int index)
 {
-	void **entry;
-	entry = idm->array[idx_array_index(index)];
-	return entry[idx_entry_index(index)];
+	_Atomic(void *) *entry = idm_entry(idm, index);
+
+	return atomic_load_explicit(&entry[idm_entry_index(index)],
+				    memory_order_acquire);
+}
+
+/* One past the highest index that may currently be set in the map */
+static inline int idm_end(struct index_map *idm)
+{
+	struct idm_array *ext;
+
+	ext = atomic_load_explicit(&idm->ext, memory_order_acquire);
+	if (!ext)
+		return IDM_FIXED_MAX + 1;
+
+	return ext->size > idm_array_index(INT_MAX) - IDM_FIXED_SIZE ?
+		INT_MAX : (ext->size + IDM_FIXED_SIZE) << IDM_ENTRY_BITS;
 }
 
 static inline void *idm_lookup(struct index_map *idm, int index)
 {
-	return ((index <= IDX_MAX_INDEX) && idm->array[idx_array_index(index)]) ?
-		idm_at(idm, index) : NULL;
+	_Atomic(void *) *entry;
+
+	if (index < 0)
+		return NULL;
+
+	entry = idm_entry(idm, index);
+	if (!entry)
+		return NULL;
+
+	return atomic_load_explicit(&entry[idm_entry_index(index)],
+				    memory_order_acquire);
 }
 
 typedef struct _dlist_entry {
@@ -36,7 +36,7 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
-#include <sys/mman.h>
+#include <sys/epoll.h>
 #include <sys/sendfile.h>
 #include <stdarg.h>
 #include <dlfcn.h>
@@ -50,6 +50,8 @@
 #include <ctype.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <signal.h>
+#include <limits.h>
 
 #include <sys/uio.h>
 
@@ -69,12 +71,16 @@ struct socket_calls {
 	ssize_t (*recvfrom)(int socket, void *buf, size_t len, int flags,
 			    struct sockaddr *src_addr, socklen_t *addrlen);
 	ssize_t (*recvmsg)(int socket, struct msghdr *msg, int flags);
+	int (*recvmmsg)(int socket, struct mmsghdr *msgvec, unsigned int vlen,
+			int flags, struct timespec *timeout);
 	ssize_t (*read)(int socket, void *buf, size_t count);
 	ssize_t (*readv)(int socket, const struct iovec *iov, int iovcnt);
 	ssize_t (*send)(int socket, const void *buf, size_t len, int flags);
 	ssize_t (*sendto)(int socket, const void *buf, size_t len, int flags,
 			  const struct sockaddr *dest_addr, socklen_t addrlen);
 	ssize_t (*sendmsg)(int socket, const struct msghdr *msg, int flags);
+	int (*sendmmsg)(int socket, struct mmsghdr *msgvec, unsigned int vlen,
+			int flags);
 	ssize_t (*write)(int socket, const void *buf, size_t count);
 	ssize_t (*writev)(int socket, const struct iovec *iov, int iovcnt);
 	int (*poll)(struct pollfd *fds, nfds_t nfds, int timeout);
@@ -90,6 +96,18 @@ struct socket_calls {
 	int (*dup2)(int oldfd, int newfd);
 	ssize_t (*sendfile)(int out_fd, int in_fd, off_t *offset, size_t count);
 	int (*fxstat)(int ver, int fd, struct stat *buf);
+	int (*epoll_create)(int size);
+	int (*epoll_create1)(int flags);
+	int (*epoll_ctl)(int epfd, int op, int fd, struct epoll_event *event);
+	int (*epoll_wait)(int epfd, struct epoll_event *events,
+			  int maxevents, int timeout);
+	int (*epoll_pwait)(int epfd, struct epoll_event *events,
+			   int maxevents, int timeout, const sigset_t *sigmask);
+#ifdef HAVE_EPOLL_PWAIT2
+	int (*epoll_pwait2)(int epfd, struct epoll_event *events,
+			    int maxevents, const struct timespec *timeout,
+			    const sigset_t *sigmask);
+#endif
 };
 
 static struct socket_calls real;
@@ -98,6 +116,13 @@ static struct socket_calls rs;
 static struct index_map idm;
 static pthread_mutex_t mut = PTHREAD_MUTEX_INITIALIZER;
 
+/*
+ * Set while calling into librdmacm to create rsockets or repoll
+ * instances, so that calls made internally by the library are passed
+ * through to the real implementation.
+ */
+static __thread int recursive;
+
 static int sq_size;
 static int rq_size;
 static int sq_inline;
@@ -105,7 +130,8 @@ static int fork_support;
 
 enum fd_type {
 	fd_normal,
-	fd_rsocket
+	fd_rsocket,
+	fd_repoll
 };
 
 enum fd_fork_state {
@@ -393,11 +419,13 @@ static void init_preload(void)
 	real.recv = dlsym(RTLD_NEXT, "recv");
 	real.recvfrom = dlsym(RTLD_NEXT, "recvfrom");
 	real.recvmsg = dlsym(RTLD_NEXT, "recvmsg");
+	real.recvmmsg = dlsym(RTLD_NEXT, "recvmmsg");
 	real.read = dlsym(RTLD_NEXT, "read");
 	real.readv = dlsym(RTLD_NEXT, "readv");
 	real.send = dlsym(RTLD_NEXT, "send");
 	real.sendto = dlsym(RTLD_NEXT, "sendto");
 	real.sendmsg = dlsym(RTLD_NEXT, "sendmsg");
+	real.sendmmsg = dlsym(RTLD_NEXT, "sendmmsg");
 	real.write = dlsym(RTLD_NEXT, "write");
 	real.writev = dlsym(RTLD_NEXT, "writev");
 	real.poll = dlsym(RTLD_NEXT, "poll");
@@ -411,6 +439,14 @@ static void init_preload(void)
 	real.dup2 = dlsym(RTLD_NEXT, "dup2");
 	real.sendfile = dlsym(RTLD_NEXT, "sendfile");
 	real.fxstat = dlsym(RTLD_NEXT, "__fxstat");
+	real.epoll_create = dlsym(RTLD_NEXT, "epoll_create");
+	real.epoll_create1 = dlsym(RTLD_NEXT, "epoll_create1");
+	real.epoll_ctl = dlsym(RTLD_NEXT, "epoll_ctl");
+	real.epoll_wait = dlsym(RTLD_NEXT, "epoll_wait");
+	real.epoll_pwait = dlsym(RTLD_NEXT, "epoll_pwait");
+#ifdef HAVE_EPOLL_PWAIT2
+	real.epoll_pwait2 = dlsym(RTLD_NEXT, "epoll_pwait2");
+#endif
 
 	rs.socket = dlsym(RTLD_DEFAULT, "rsocket");
 	rs.bind = dlsym(RTLD_DEFAULT, "rbind");
@@ -420,11 +456,13 @@ static void init_preload(void)
 	rs.recv = dlsym(RTLD_DEFAULT, "rrecv");
 	rs.recvfrom = dlsym(RTLD_DEFAULT, "rrecvfrom");
 	rs.recvmsg = dlsym(RTLD_DEFAULT, "rrecvmsg");
+	rs.recvmmsg = dlsym(RTLD_DEFAULT, "rrecvmmsg");
 	rs.read = dlsym(RTLD_DEFAULT, "rread");
 	rs.readv = dlsym(RTLD_DEFAULT, "rreadv");
 	rs.send = dlsym(RTLD_DEFAULT, "rsend");
 	rs.sendto = dlsym(RTLD_DEFAULT, "rsendto");
 	rs.sendmsg = dlsym(RTLD_DEFAULT, "rsendmsg");
+	rs.sendmmsg = dlsym(RTLD_DEFAULT, "rsendmmsg");
 	rs.write = dlsym(RTLD_DEFAULT, "rwrite");
 	rs.writev = dlsym(RTLD_DEFAULT, "rwritev");
 	rs.poll = dlsym(RTLD_DEFAULT, "rpoll");
@@ -531,7 +569,6 @@ static void set_rsocket_options(int rsocket)
 
 int socket(int domain, int type, int protocol)
 {
-	static __thread int recursive;
 	int index, ret;
 
 	init_preload();
@@ -818,6 +855,15 @@ ssize_t recvmsg(int socket, struct msghdr *msg, int flags)
 		rrecvmsg(fd, msg, flags) : real.recvmsg(fd, msg, flags);
 }
 
+int recvmmsg(int socket, struct mmsghdr *msgvec, unsigned int vlen,
+	     int flags, struct timespec *timeout)
+{
+	int fd;
+	return (fd_fork_get(socket, &fd) == fd_rsocket) ?
+		rrecvmmsg(fd, msgvec, vlen, flags, timeout) :
+		real.recvmmsg(fd, msgvec, vlen, flags, timeout);
+}
+
 ssize_t read(int socket, void *buf, size_t count)
 {
 	int fd;
@@ -857,6 +903,14 @@ ssize_t sendmsg(int socket, const struct msghdr *msg, int flags)
 		rsendmsg(fd, msg, flags) : real.sendmsg(fd, msg, flags);
 }
 
+int sendmmsg(int socket, struct mmsghdr *msgvec, unsigned int vlen, int flags)
+{
+	int fd;
+	return (fd_fork_get(socket, &fd) == fd_rsocket) ?
+		rsendmmsg(fd, msgvec, vlen, flags) :
+		real.sendmmsg(fd, msgvec, vlen, flags);
+}
+
 ssize_t write(int socket, const void *buf, size_t count)
 {
 	int fd;
@@ -1029,11 +1083,140 @@ int close(int socket)
 
 	idm_clear(&idm, socket);
 	real.close(socket);
-	ret = (fdi->type == fd_rsocket) ? rclose(fdi->fd) : real.close(fdi->fd);
+	ret = (fdi->type != fd_normal) ? rclose(fdi->fd) : real.close(fdi->fd);
 	free(fdi);
 	return ret;
 }
 
+/*
+ * epoll instances are backed by repoll, which handles both rsockets
+ * and normal fd's.
+ */
+static int epoll_open(int size, int flags)
+{
+	int index, ret;
+
+	index = fd_open();
+	if (index < 0)
+		return index;
+
+	recursive = 1;
+	ret = size ? repoll_create(size) : repoll_create1(flags);
+	recursive = 0;
+	if (ret < 0) {
+		fd_close(index, &ret);
+		return -1;
+	}
+
+	fd_store(index, ret, fd_repoll, fd_ready);
+	return index;
+}
+
+int epoll_create(int size)
+{
+	init_preload();
+	if (recursive)
+		return real.epoll_create(size);
+
+	if (size <= 0)
+		return ERR(EINVAL);
+
+	return epoll_open(size, 0);
+}
+
+int epoll_create1(int flags)
+{
+	init_preload();
+	if (recursive)
+		return real.epoll_create1(flags);
+
+	return epoll_open(0, flags);
+}
+
+int epoll_ctl(int epfd, int op, int fd, struct epoll_event *event)
+{
+	int rfd, sfd;
+
+	init_preload();
+	if (fd_get(epfd, &rfd) != fd_repoll)
+		return real.epoll_ctl(rfd, op, fd, event);
+
+	fd_fork_get(fd, &sfd);
+	return repoll_ctl(rfd, op, sfd, event);
+}
+
+int epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout)
+{
+	int rfd;
+
+	init_preload();
+	return (fd_get(epfd, &rfd) == fd_repoll) ?
+		repoll_wait(rfd, events, maxevents, timeout) :
+		real.epoll_wait(rfd, events, maxevents, timeout);
+}
+
+/*
+ * repoll_wait has no signal mask argument, so the mask is swapped in
+ * around it.  Unlike the real call, this is not atomic with respect to
+ * signals that arrive right before the wait starts.
+ */
+static int repoll_pwait(int epfd, struct epoll_event *events, int maxevents,
+			int timeout, const sigset_t *sigmask)
+{
+	sigset_t origmask;
+	int ret, err;
+
+	if (sigmask && pthread_sigmask(SIG_SETMASK, sigmask, &origmask))
+		return ERR(EINVAL);
+
+	ret = repoll_wait(epfd, events, maxevents, timeout);
+
+	if (sigmask) {
+		err = errno;
+		pthread_sigmask(SIG_SETMASK, &origmask, NULL);
+		errno = err;
+	}
+	return ret;
+}
+
+int epoll_pwait(int epfd, struct epoll_event *events, int maxevents,
+		int timeout, const sigset_t *sigmask)
+{
+	int rfd;
+
+	init_preload();
+	return (fd_get(epfd, &rfd) == fd_repoll) ?
+		repoll_pwait(rfd, events, maxevents, timeout, sigmask) :
+		real.epoll_pwait(rfd, events, maxevents, timeout, sigmask);
+}
+
+#ifdef HAVE_EPOLL_PWAIT2
+int epoll_pwait2(int epfd, struct epoll_event *events, int maxevents,
+		 const struct timespec *timeout, const sigset_t *sigmask)
+{
+	int rfd, ms;
+
+	init_preload();
+	if (fd_get(epfd, &rfd) != fd_repoll)
+		return real.epoll_pwait2(rfd, events, maxevents, timeout,
+					 sigmask);
+
+	if (!timeout) {
+		ms = -1;
+	} else if (timeout->tv_sec < 0 || timeout->tv_nsec < 0 ||
+		   timeout->tv_nsec >= 1000000000) {
+		return ERR(EINVAL);
+	} else if (timeout->tv_sec >= INT_MAX / 1000) {
+		ms = INT_MAX;
+	} else {
+		/* Round up, so a short timeout does not turn into a poll */
+		ms = timeout->tv_sec * 1000 +
+		     (timeout->tv_nsec + 999999) / 1000000;
+	}
+	return repoll_pwait(rfd, events, maxevents, ms, sigmask);
+}
+#endif
+
 int getpeername(int socket, struct sockaddr *addr, socklen_t *addrlen)
 {
 	int fd;
@@ -1163,22 +1346,12 @@ int dup2(int oldfd, int newfd)
 
 ssize_t sendfile(int out_fd, int in_fd, off_t *offset, size_t count)
 {
-	void *file_addr;
 	int fd;
-	size_t ret;
 
 	if (fd_get(out_fd, &fd) != fd_rsocket)
 		return real.sendfile(fd, in_fd, offset, count);
 
-	file_addr = mmap(NULL, count, PROT_READ, 0, in_fd, offset ? *offset : 0);
-	if (file_addr == (void *) -1)
-		return -1;
-
-	ret = rwrite(fd, file_addr, count);
-	if ((ret > 0) && offset)
-		lseek(in_fd, ret, SEEK_CUR);
-	munmap(file_addr, count);
-	return ret;
+	return rsendfile(fd, in_fd, offset, count);
 }
 
 int __fxstat(int ver, int socket, struct stat *buf)
@@ -310,6 +310,40 @@ int rdma_create_ep(struct rdma_cm_id **id, struct rdma_addrinfo *res,
  */
 void rdma_destroy_ep(struct rdma_cm_id *id);
 
+struct rdma_connect_req {
+	struct rdma_addrinfo	*res;
+	void			*context;
+	struct rdma_cm_id	*id;
+	int			status;
+};
+
+/**
+ * rdma_connect_batch - Establish a set of connections concurrently.
+ * @req: Array of connection requests.  res and context are set by the
+ *   caller, id and status are returned.
+ * @cnt: Number of entries in req.
+ * @pd: Optional protection domain for the QPs.
+ * @qp_init_attr: Attributes for the QP created on each rdma_cm_id.
+ * @conn_param: Optional connection parameters, as for rdma_connect.
+ * @channel: Event channel that connected rdma_cm_ids are migrated to, or
+ *   NULL to set them to synchronous operation.
+ * @timeout_ms: Time allowed for the whole batch.
+ * Description:
+ *   Resolves, creates QPs for and connects every request at once, on a
+ *   single internal event channel, so that the steps of one connection
+ *   overlap with those of the others.  status is set to 0 for each
+ *   connection that was established, and its id references the new
+ *   rdma_cm_id.  Otherwise, status is set to a negative errno value and
+ *   id is NULL.  Returns the number of connections established, or -1
+ *   if the batch could not be started.
+ * See also:
+ *   rdma_create_ep, rdma_getaddrinfo_batch, rdma_migrate_id
+ */
+int rdma_connect_batch(struct rdma_connect_req *req, int cnt,
+		       struct ibv_pd *pd, struct ibv_qp_init_attr *qp_init_attr,
+		       struct rdma_conn_param *conn_param,
+		       struct rdma_event_channel *channel, int timeout_ms);
+
 /**
  * rdma_destroy_id - Release a communication identifier.
  * @id: The communication identifier to destroy.
@@ -423,6 +457,44 @@ int rdma_create_qp_ex(struct rdma_cm_id *id,
  */
 void rdma_destroy_qp(struct rdma_cm_id *id);
 
+struct rdma_qp_pool;
+
+/**
+ * rdma_create_qp_pool - Pre-allocate QPs for rdma_create_qp.
+ * @verbs: RDMA device the QPs are allocated on.
+ * @pd: Optional protection domain for the QPs.
+ * @qp_init_attr: Initial QP attributes.
+ * @size: Number of QPs to keep allocated.
+ * Description:
+ *   Keeps up to size QPs, each with its own send and receive CQ, created
+ *   in the RESET state.  A call to rdma_create_qp on an rdma_cm_id bound
+ *   to the same device, with the same protection domain and attributes,
+ *   and without user supplied CQs or SRQ, takes a QP from the pool
+ *   instead of creating one.  The pool is refilled by a background thread.
+ * Notes:
+ *   If pd is NULL, the default protection domain of the device is used,
+ *   matching rdma_cm_ids that are not given a protection domain.  On
+ *   return, the cap field of qp_init_attr holds the actual capabilities
+ *   of the pooled QPs.
+ * See also:
+ *   rdma_create_qp, rdma_get_request, rdma_get_devices, rdma_destroy_qp_pool
+ */
+struct rdma_qp_pool *rdma_create_qp_pool(struct ibv_context *verbs,
+					 struct ibv_pd *pd,
+					 struct ibv_qp_init_attr *qp_init_attr,
+					 int size);
+
+/**
+ * rdma_destroy_qp_pool - Release a QP pool.
+ * @pool: Pool to destroy.
+ * Description:
+ *   Stops refilling the pool and frees the QPs it still holds.  QPs
+ *   already taken from the pool are not affected.
+ * See also:
+ *   rdma_create_qp_pool
+ */
+void rdma_destroy_qp_pool(struct rdma_qp_pool *pool);
+
 /**
  * rdma_connect - Initiate an active connection request.
  * @id: RDMA identifier.
@@ -749,6 +821,19 @@ int rdma_getaddrinfo(const char *node, const char *service,
 		     const struct rdma_addrinfo *hints,
 		     struct rdma_addrinfo **res);
 
+/**
+ * rdma_getaddrinfo_batch - Resolve several nodes with one call.
+ * @node: Array of cnt node names.
+ * @res: Array of cnt results.  Entries for nodes that fail are set to NULL.
+ * Description:
+ *   Equivalent to calling rdma_getaddrinfo for each node, but route queries
+ *   to ibacm are issued concurrently.  Returns 0 if every node resolved,
+ *   otherwise the error reported for the first node that failed.
+ */
+int rdma_getaddrinfo_batch(const char *node[], const char *service,
+			   const struct rdma_addrinfo *hints,
+			   struct rdma_addrinfo *res[], int cnt);
+
 void rdma_freeaddrinfo(struct rdma_addrinfo *res);
 
 /**
@@ -36,6 +36,8 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <endian.h>
 #include <stdarg.h>
 #include <netdb.h>
@@ -43,6 +45,7 @@
 #include <fcntl.h>
 #include <stdio.h>
 #include <stddef.h>
+#include <inttypes.h>
 #include <string.h>
 #include <netinet/tcp.h>
 #include <sys/epoll.h>
@@ -59,6 +62,7 @@
 #include <rdma/rsocket.h>
 #include "cma.h"
 #include "indexer.h"
+#include "rsocket_trace.h"
 
 #define RS_OLAP_START_SIZE 2048
 #define RS_MAX_TRANSFER 65536
@@ -68,6 +72,12 @@
 #define RS_QP_CTRL_SIZE 4	/* must be power of 2 */
 #define RS_CONN_RETRIES 6
 #define RS_SGL_SIZE 2
+#define RS_MAX_SEND_SGE 8
+#define RS_MAX_ZCOPY_IOV 64
+#define RS_SENDFILE_CHUNK (1 << 20)
+#define RS_SENDFILE_WINDOW 4
+#define RS_SENDFILE_ZCOPY_MIN 65536
+#define RS_DS_BATCH 16
 static struct index_map idm;
 static pthread_mutex_t mut = PTHREAD_MUTEX_INITIALIZER;
 static pthread_mutex_t svc_mut = PTHREAD_MUTEX_INITIALIZER;
@@ -136,6 +146,33 @@ static uint32_t def_mem = (1 << 17);
 static uint32_t def_wmem = (1 << 17);
 static uint32_t polling_time = 10;
 static int wake_up_interval = 5000;
+static uint32_t def_zcopy_threshold = 0;
+static int zcopy_mr_cache_size = 0;
+static int def_shared_cq = 0;
+static uint32_t shared_srq_size = 4096;
+static int def_mem_autotune = 0;
+static uint32_t mem_max = (1 << 22);
+static uint64_t mem_budget = 0;
+static _Atomic(uint64_t) mem_used;
+
+/*
+ * Buffer autotuning: a buffer doubles once it has turned over in less
+ * than RS_TUNE_FAST_US several times in a row (receive), or once sends
+ * have repeatedly waited on buffer space (send).  It halves, down to its
+ * initial size, once it has gone RS_TUNE_IDLE_US without being needed.
+ */
+#define RS_TUNE_FAST_US  1000
+#define RS_TUNE_FAST_CNT 4
+#define RS_TUNE_STALLS   8
+#define RS_TUNE_IDLE_US  1000000
+
+/*
+ * Adaptive polling spins for twice the average time spent waiting for
+ * an event, up to the rsocket's poll_time, provided that the average is
+ * no more than RS_POLL_ADAPTIVE_MAX.
+ */
+#define RS_POLL_ADAPTIVE_MAX 200
+#define RS_POLL_WAIT_MAX     (RS_POLL_ADAPTIVE_MAX << 2)
 
 /*
  * Immediate data format is determined by the upper bits
@@ -272,6 +309,9 @@ enum rs_state {
 #define RS_OPT_UDP_SVC    (1 << 2)
 #define RS_OPT_KEEPALIVE  (1 << 3)
 #define RS_OPT_CM_SVC	  (1 << 4)
+#define RS_OPT_SHARED_CQ  (1 << 5)
+#define RS_OPT_RBUF_AUTO  (1 << 6)
+#define RS_OPT_SBUF_AUTO  (1 << 7)
 
 union socket_addr {
 	struct sockaddr		sa;
@@ -361,6 +401,32 @@ struct rsocket {
 			int		  sbuf_bytes_avail;
 			struct ibv_mr	  *smr;
 			struct ibv_sge	  ssgl[2];
+
+			/* RS_OP_DATA writes posted / completed, see rs_zcopy_done */
+			unsigned int	  sdata_seqno;
+			unsigned int	  sdata_comp;
+			unsigned int	  zcopy_seqno;
+
+			/* see rs_join_scq, scq_qpn is the key for scq->qp_map */
+			struct rs_scq	  *scq;
+			uint32_t	  scq_qpn;
+			dlist_entry	  scq_pending;
+			uint32_t	  wcq_head;
+			uint32_t	  wcq_tail;
+			uint32_t	  wcq_size;
+			int		  wcq_overflow;
+			struct rs_wc	  *wcq;
+
+			/* see rs_tune_rbuf, rbuf_next replaces rbuf on wrap */
+			uint8_t		  *rbuf_next;
+			struct ibv_mr	  *rmr_next;
+			uint32_t	  rbuf_next_size;
+			uint32_t	  rbuf_min;
+			uint32_t	  sbuf_min;
+			int		  rbuf_fast;
+			int		  sbuf_stalls;
+			uint64_t	  rbuf_tune_time;
+			uint64_t	  sbuf_tune_time;
 		};
 		/* datagram */
 		struct {
@@ -386,10 +452,18 @@ struct rsocket {
 	int		  retries;
 	int		  err;
 
+	/* see rs_poll_budget */
+	int		  poll_policy;
+	uint32_t	  poll_time;
+	uint32_t	  poll_wait_avg;
+	struct rsocket_stats stats;
+
 	int		  sqe_avail;
 	uint32_t	  sbuf_size;
 	uint16_t	  sq_size;
 	uint16_t	  sq_inline;
+	uint16_t	  sq_sge;
+	uint32_t	  zcopy_threshold;
 
 	uint32_t	  rbuf_size;
 	uint16_t	  rq_size;
@@ -406,6 +480,7 @@ struct rsocket {
 	dlist_entry	  iomap_queue;
 	int		  iomap_pending;
 	int		  unack_cqe;
+	dlist_entry	  repoll_list;	/* repoll sets holding this rsocket */
 };
 
 #define DS_UDP_TAG 0x55555555
@@ -469,6 +544,22 @@ static uint64_t rs_time_us(void)
 	return now.tv_sec * 1000000 + now.tv_nsec / 1000;
 }
 
+/*
+ * Accounts for buffer growth against mem_budget.  Shrinking a buffer
+ * temporarily needs both copies, so it is always allowed.
+ */
+static bool rs_mem_charge(uint32_t size, bool force)
+{
+	uint64_t used;
+
+	used = atomic_fetch_add(&mem_used, size) + size;
+	if (!force && mem_budget && used > mem_budget) {
+		atomic_fetch_sub(&mem_used, size);
+		return false;
+	}
+	return true;
+}
+
 static void ds_insert_qp(struct rsocket *rs, struct ds_qp *qp)
 {
 	if (!rs->qp_list)
@@ -622,6 +713,45 @@ static void rs_configure(void)
 		def_iomap_size = (uint8_t) rs_value_to_scale(
 			(uint16_t) rs_scale_to_value(def_iomap_size, 8), 8);
 	}
+
+	if ((f = fopen(RS_CONF_DIR "/zcopy_threshold", "r"))) {
+		failable_fscanf(f, "%u", &def_zcopy_threshold);
+		fclose(f);
+	}
+
+	if ((f = fopen(RS_CONF_DIR "/zcopy_mr_cache", "r"))) {
+		failable_fscanf(f, "%d", &zcopy_mr_cache_size);
+		fclose(f);
+	}
+
+	if ((f = fopen(RS_CONF_DIR "/shared_cq", "r"))) {
+		failable_fscanf(f, "%d", &def_shared_cq);
+		fclose(f);
+	}
+
+	if ((f = fopen(RS_CONF_DIR "/shared_srq_size", "r"))) {
+		failable_fscanf(f, "%u", &shared_srq_size);
+		fclose(f);
+		if (shared_srq_size < RS_QP_MIN_SIZE)
+			shared_srq_size = RS_QP_MIN_SIZE;
+	}
+
+	if ((f = fopen(RS_CONF_DIR "/mem_autotune", "r"))) {
+		failable_fscanf(f, "%d", &def_mem_autotune);
+		fclose(f);
+	}
+
+	if ((f = fopen(RS_CONF_DIR "/mem_max", "r"))) {
+		failable_fscanf(f, "%u", &mem_max);
+		fclose(f);
+		if (mem_max > (1 << 28))
+			mem_max = 1 << 28;
+	}
+
+	if ((f = fopen(RS_CONF_DIR "/mem_budget", "r"))) {
+		failable_fscanf(f, "%" SCNu64, &mem_budget);
+		fclose(f);
+	}
 	init = 1;
 out:
 	pthread_mutex_unlock(&mut);
@@ -664,9 +794,15 @@ static struct rsocket *rs_alloc(struct rsocket *inherited_rs, int type)
 		rs->sq_inline = inherited_rs->sq_inline;
 		rs->sq_size = inherited_rs->sq_size;
 		rs->rq_size = inherited_rs->rq_size;
+		rs->zcopy_threshold = inherited_rs->zcopy_threshold;
+		rs->poll_policy = inherited_rs->poll_policy;
+		rs->poll_time = inherited_rs->poll_time;
 		if (type == SOCK_STREAM) {
 			rs->ctrl_max_seqno = inherited_rs->ctrl_max_seqno;
 			rs->target_iomap_size = inherited_rs->target_iomap_size;
+			rs->opts |= inherited_rs->opts &
+				    (RS_OPT_SHARED_CQ | RS_OPT_RBUF_AUTO |
+				     RS_OPT_SBUF_AUTO);
 		}
 	} else {
 		rs->sbuf_size = def_wmem;
@@ -674,9 +810,15 @@ static struct rsocket *rs_alloc(struct rsocket *inherited_rs, int type)
 		rs->sq_inline = def_inline;
 		rs->sq_size = def_sqsize;
 		rs->rq_size = def_rqsize;
+		rs->zcopy_threshold = def_zcopy_threshold;
+		rs->poll_time = polling_time;
 		if (type == SOCK_STREAM) {
 			rs->ctrl_max_seqno = RS_QP_CTRL_SIZE;
 			rs->target_iomap_size = def_iomap_size;
+			if (def_shared_cq)
+				rs->opts |= RS_OPT_SHARED_CQ;
+			if (def_mem_autotune)
+				rs->opts |= RS_OPT_RBUF_AUTO | RS_OPT_SBUF_AUTO;
 		}
 	}
 	fastlock_init(&rs->slock);
@@ -686,6 +828,7 @@ static struct rsocket *rs_alloc(struct rsocket *inherited_rs, int type)
 	fastlock_init(&rs->map_lock);
 	dlist_init(&rs->iomap_list);
 	dlist_init(&rs->iomap_queue);
+	dlist_init(&rs->repoll_list);
 	return rs;
 }
 
@@ -695,7 +838,8 @@ static int rs_set_nonblocking(struct rsocket *rs, int arg)
 	int ret = 0;
 
 	if (rs->type == SOCK_STREAM) {
-		if (rs->cm_id->recv_cq_channel)
+		/* the shared CQ channel is always nonblocking */
+		if (rs->cm_id->recv_cq_channel && !rs->scq)
 			ret = fcntl(rs->cm_id->recv_cq_channel->fd, F_SETFL, arg);
 
 		if (rs->state == rs_listening)
@@ -809,6 +953,11 @@ static int rs_init_bufs(struct rsocket *rs)
 	rs->rbuf_bytes_avail = rs->rbuf_size >> 1;
 	rs->sqe_avail = rs->sq_size - rs->ctrl_max_seqno;
 	rs->rseq_comp = rs->rq_size >> 1;
+
+	/* autotuned buffers never shrink below their initial size */
+	rs->rbuf_min = rs->rbuf_size;
+	rs->sbuf_min = rs->sbuf_size;
+	atomic_fetch_add(&mem_used, rs->rbuf_size + rs->sbuf_size);
 	return 0;
 }
 
@@ -865,6 +1014,395 @@ err1:
 	return -1;
 }
 
+/*
+ * Shared CQ mode: stream rsockets using the same protection domain share
+ * a single CQ, completion channel, and SRQ.  Receives carry no data, only
+ * immediate data, so any thread may replenish the SRQ.  Completions are
+ * steered to the owning rsocket by QP number and queued on the rsocket
+ * until it processes them.  All state in struct rs_scq, and the
+ * completion queues of member rsockets, are protected by rs_scq.lock.
+ */
+struct rs_wc {
+	uint64_t	  wr_id;
+	__be32		  imm_data;
+	uint8_t		  status;
+	uint8_t		  with_imm;
+};
+
+struct rs_scq {
+	dlist_entry	  entry;
+	struct ibv_pd	  *pd;
+	struct ibv_comp_channel *channel;
+	struct ibv_cq	  *cq;
+	struct ibv_srq	  *srq;
+	int		  cqe;
+	int		  refcnt;
+	/* receive credits granted by members, at most shared_srq_size */
+	uint32_t	  credits;
+	void		  *qp_map;
+	/* members given completions, see repoll_scq_ready */
+	dlist_entry	  pending;
+	fastlock_t	  lock;
+
+	/* serializes threads blocking on the completion channel */
+	pthread_mutex_t	  wait_mut;
+	pthread_cond_t	  wait_cond;
+	int		  waiting;
+	unsigned int	  wait_gen;
+	int		  wake_fd;	/* eventfd to interrupt the waiter */
+};
+
+static dlist_entry scq_list = { &scq_list, &scq_list };
+
+static int rs_compare_qpn(const void *qpn1, const void *qpn2)
+{
+	return *(const uint32_t *) qpn1 < *(const uint32_t *) qpn2 ? -1 :
+	       *(const uint32_t *) qpn1 > *(const uint32_t *) qpn2;
+}
+
+static int rs_scq_post_recv(struct rs_scq *scq)
+{
+	struct ibv_recv_wr wr, *bad;
+
+	wr.wr_id = rs_recv_wr_id(0);
+	wr.next = NULL;
+	wr.sg_list = NULL;
+	wr.num_sge = 0;
+	return rdma_seterrno(ibv_post_srq_recv(scq->srq, &wr, &bad));
+}
+
+static void rs_free_scq(struct rs_scq *scq)
+{
+	if (scq->srq)
+		ibv_destroy_srq(scq->srq);
+	if (scq->cq)
+		ibv_destroy_cq(scq->cq);
+	if (scq->channel)
+		ibv_destroy_comp_channel(scq->channel);
+	if (scq->wake_fd >= 0)
+		close(scq->wake_fd);
+	pthread_cond_destroy(&scq->wait_cond);
+	pthread_mutex_destroy(&scq->wait_mut);
+	fastlock_destroy(&scq->lock);
+	free(scq);
+}
+
+static struct rs_scq *rs_alloc_scq(struct ibv_pd *pd)
+{
+	struct ibv_srq_init_attr srq_attr;
+	struct rs_scq *scq;
+	uint32_t i;
+
+	scq = calloc(1, sizeof(*scq));
+	if (!scq)
+		return NULL;
+
+	scq->pd = pd;
+	dlist_init(&scq->pending);
+	fastlock_init(&scq->lock);
+	pthread_mutex_init(&scq->wait_mut, NULL);
+	pthread_cond_init(&scq->wait_cond, NULL);
+
+	/* Threads blocking on the channel use poll, see rs_scq_wait */
+	scq->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (scq->wake_fd < 0)
+		goto err;
+	scq->channel = ibv_create_comp_channel(pd->context);
+	if (!scq->channel || set_fd_nonblock(scq->channel->fd, true))
+		goto err;
+
+	scq->cqe = shared_srq_size;
+	scq->cq = ibv_create_cq(pd->context, scq->cqe, NULL, scq->channel, 0);
+	if (!scq->cq)
+		goto err;
+
+	memset(&srq_attr, 0, sizeof srq_attr);
+	srq_attr.attr.max_wr = shared_srq_size;
+	srq_attr.attr.max_sge = 1;
+	scq->srq = ibv_create_srq(pd, &srq_attr);
+	if (!scq->srq)
+		goto err;
+
+	for (i = 0; i < shared_srq_size; i++) {
+		if (rs_scq_post_recv(scq))
+			goto err;
+	}
+	return scq;
+
+err:
+	rs_free_scq(scq);
+	return NULL;
+}
+
+/* Must be called with scq->lock held */
+static void rs_scq_deliver(struct rs_scq *scq, struct ibv_wc *wc)
+{
+	struct rsocket *rs;
+	struct rs_wc *rwc;
+	void **node;
+
+	if (rs_wr_is_recv(wc->wr_id) && wc->status != IBV_WC_WR_FLUSH_ERR)
+		rs_scq_post_recv(scq);
+
+	node = tfind(&wc->qp_num, &scq->qp_map, rs_compare_qpn);
+	if (!node)
+		return;
+
+	rs = container_of(*node, struct rsocket, scq_qpn);
+	if (dlist_empty(&rs->scq_pending))
+		dlist_insert_tail(&rs->scq_pending, &scq->pending);
+	if ((rs->wcq_tail + 1) % rs->wcq_size == rs->wcq_head) {
+		rs->wcq_overflow = 1;
+		return;
+	}
+
+	rwc = &rs->wcq[rs->wcq_tail];
+	rwc->wr_id = wc->wr_id;
+	rwc->status = (uint8_t) wc->status;
+	rwc->with_imm = !!(wc->wc_flags & IBV_WC_WITH_IMM);
+	rwc->imm_data = wc->imm_data;
+	rs->wcq_tail = (rs->wcq_tail + 1) % rs->wcq_size;
+}
+
+/* Must be called with scq->lock held */
+static int rs_scq_poll(struct rs_scq *scq)
+{
+	struct ibv_wc wc[16];
+	int i, ret;
+
+	ret = ibv_poll_cq(scq->cq, 16, wc);
+	for (i = 0; i < ret; i++)
+		rs_scq_deliver(scq, &wc[i]);
+	return ret;
+}
+
+/*
+ * Join the shared CQ for the rsocket's PD, growing the CQ to cover the
+ * rsocket's send queue.  The peer may post up to rq_size messages, which
+ * land on the SRQ, so the credits of all members together must not exceed
+ * the receives posted to it.  Failure leaves the rsocket to use a private
+ * CQ.
+ */
+static int rs_join_scq(struct rsocket *rs)
+{
+	struct rs_scq *scq;
+	dlist_entry *cur;
+	int ret;
+
+	dlist_init(&rs->scq_pending);
+	rs->wcq_size = rs->sq_size + rs->rq_size + RS_QP_CTRL_SIZE + 1;
+	rs->wcq = calloc(rs->wcq_size, sizeof(*rs->wcq));
+	if (!rs->wcq)
+		return ERR(ENOMEM);
+
+	pthread_mutex_lock(&mut);
+	for (cur = scq_list.next; cur != &scq_list; cur = cur->next) {
+		scq = container_of(cur, struct rs_scq, entry);
+		if (scq->pd == rs->cm_id->pd)
+			goto found;
+	}
+
+	scq = rs_alloc_scq(rs->cm_id->pd);
+	if (!scq) {
+		ret = -1;
+		goto err;
+	}
+	dlist_insert_tail(&scq->entry, &scq_list);
+found:
+	fastlock_acquire(&scq->lock);
+	if (scq->credits + rs->rq_size > shared_srq_size) {
+		ret = ENOSPC;
+	} else {
+		ret = ibv_resize_cq(scq->cq, scq->cqe + rs->sq_size);
+		if (!ret) {
+			scq->cqe += rs->sq_size;
+			scq->credits += rs->rq_size;
+		}
+	}
+	fastlock_release(&scq->lock);
+	if (ret) {
+		if (!scq->refcnt) {
+			dlist_remove(&scq->entry);
+			rs_free_scq(scq);
+		}
+		ret = ERR(ret);
+		goto err;
+	}
+
+	scq->refcnt++;
+	pthread_mutex_unlock(&mut);
+
+	rs->scq = scq;
+	rs->cm_id->recv_cq_channel = scq->channel;
+	rs->cm_id->send_cq_channel = scq->channel;
+	rs->cm_id->recv_cq = scq->cq;
+	rs->cm_id->send_cq = scq->cq;
+	return 0;
+
+err:
+	pthread_mutex_unlock(&mut);
+	free(rs->wcq);
+	rs->wcq = NULL;
+	return ret;
+}
+
+/*
+ * Destroy the rsocket's QP and leave the shared CQ.  Once the QP is
+ * destroyed, no new completions are generated for it, so we drain the
+ * CQ before removing the QP number.  That prevents stale completions from
+ * being steered to a new QP which reuses the number.
+ */
+static void rs_leave_scq(struct rsocket *rs)
+{
+	struct rs_scq *scq = rs->scq;
+
+	rs->cm_id->recv_cq_channel = NULL;
+	rs->cm_id->send_cq_channel = NULL;
+	rs->cm_id->recv_cq = NULL;
+	rs->cm_id->send_cq = NULL;
+
+	fastlock_acquire(&scq->lock);
+	if (rs->cm_id->qp) {
+		rdma_destroy_qp(rs->cm_id);
+		while (rs_scq_poll(scq) > 0)
+			;
+		tdelete(&rs->scq_qpn, &scq->qp_map, rs_compare_qpn);
+	}
+	dlist_remove(&rs->scq_pending);
+	if (!ibv_resize_cq(scq->cq, scq->cqe - rs->sq_size))
+		scq->cqe -= rs->sq_size;
+	scq->credits -= rs->rq_size;
+	fastlock_release(&scq->lock);
+
+	pthread_mutex_lock(&mut);
+	if (!--scq->refcnt) {
+		dlist_remove(&scq->entry);
+		rs_free_scq(scq);
+	}
+	pthread_mutex_unlock(&mut);
+	rs->scq = NULL;
+}
+
+static int rs_poll_wc(struct rsocket *rs, struct ibv_wc *wc)
+{
+	struct rs_scq *scq = rs->scq;
+	struct rs_wc *rwc;
+	int ret = 0;
+
+	if (!scq)
+		return ibv_poll_cq(rs->cm_id->recv_cq, 1, wc);
+
+	fastlock_acquire(&scq->lock);
+	while (rs->wcq_head == rs->wcq_tail && !rs->wcq_overflow) {
+		ret = rs_scq_poll(scq);
+		if (ret <= 0)
+			break;
+	}
+
+	if (rs->wcq_head != rs->wcq_tail) {
+		rwc = &rs->wcq[rs->wcq_head];
+		wc->wr_id = rwc->wr_id;
+		wc->status = rwc->status;
+		wc->wc_flags = rwc->with_imm ? IBV_WC_WITH_IMM : 0;
+		wc->imm_data = rwc->imm_data;
+		rs->wcq_head = (rs->wcq_head + 1) % rs->wcq_size;
+		ret = 1;
+	} else if (rs->wcq_overflow) {
+		rs->state = rs_error;
+		rs->err = EOVERFLOW;
+		ret = ERR(EOVERFLOW);
+	}
+	fastlock_release(&scq->lock);
+	return ret;
+}
+
+/*
+ * The shared CQ is always re-armed.  Events on its channel are consumed
+ * by any thread, so a flag saying that it is still armed could be stale
+ * by the time a caller relies on it and sleeps on an unarmed CQ.
+ */
+static void rs_arm_cq(struct rsocket *rs)
+{
+	if (rs->scq) {
+		fastlock_acquire(&rs->scq->lock);
+		ibv_req_notify_cq(rs->scq->cq, 0);
+		fastlock_release(&rs->scq->lock);
+	} else {
+		ibv_req_notify_cq(rs->cm_id->recv_cq, 0);
+	}
+	rs->cq_armed = 1;
+	rs->stats.cq_arms++;
+}
+
+/* The channel is nonblocking, so this may be called by any thread */
+static void rs_scq_get_event(struct rs_scq *scq)
+{
+	struct ibv_cq *cq;
+	void *context;
+
+	if (!ibv_get_cq_event(scq->channel, &cq, &context))
+		ibv_ack_cq_events(cq, 1);
+}
+
+/* Wake every thread blocked on the shared channel to recheck its rsocket */
+static void rs_scq_wakeup(struct rs_scq *scq)
+{
+	uint64_t c = 1;
+	/* can only fail if the counter is already set, which is enough */
+	ssize_t __attribute__((unused)) ret = write(scq->wake_fd, &c, sizeof(c));
+
+	pthread_mutex_lock(&scq->wait_mut);
+	scq->wait_gen++;
+	pthread_cond_broadcast(&scq->wait_cond);
+	pthread_mutex_unlock(&scq->wait_mut);
+}
+
+/*
+ * Only one thread blocks on the shared channel at a time.  Other threads
+ * wait until that thread has read an event, then recheck their rsockets.
+ */
+static int rs_scq_wait(struct rsocket *rs)
+{
+	struct rs_scq *scq = rs->scq;
+	struct pollfd fds[2];
+	unsigned int gen;
+	uint64_t c;
+	ssize_t __attribute__((unused)) rc;
+	int ret;
+
+	rs->cq_armed = 0;
+	pthread_mutex_lock(&scq->wait_mut);
+	if (scq->waiting) {
+		gen = scq->wait_gen;
+		while (scq->waiting && gen == scq->wait_gen)
+			pthread_cond_wait(&scq->wait_cond, &scq->wait_mut);
+		pthread_mutex_unlock(&scq->wait_mut);
+		return 0;
+	}
+	scq->waiting = 1;
+	pthread_mutex_unlock(&scq->wait_mut);
+
+	fds[0].fd = scq->channel->fd;
+	fds[0].events = POLLIN;
+	fds[1].fd = scq->wake_fd;
+	fds[1].events = POLLIN;
+	ret = poll(fds, 2, wake_up_interval);
+	if (ret > 0) {
+		if (fds[0].revents)
+			rs_scq_get_event(scq);
+		if (fds[1].revents)
+			rc = read(scq->wake_fd, &c, sizeof(c));
+	}
+
+	pthread_mutex_lock(&scq->wait_mut);
+	scq->waiting = 0;
+	scq->wait_gen++;
+	pthread_cond_broadcast(&scq->wait_cond);
+	pthread_mutex_unlock(&scq->wait_mut);
+
+	return (ret < 0 && errno != EINTR) ? ret : 0;
+}
+
 static inline int rs_post_recv(struct rsocket *rs)
 {
 	struct ibv_recv_wr wr, *bad;
@@ -914,18 +1452,26 @@ static inline int ds_post_recv(struct rsocket *rs, struct ds_qp *qp, uint32_t of
 static int rs_create_ep(struct rsocket *rs)
 {
 	struct ibv_qp_init_attr qp_attr;
-	int i, ret;
+	int i, max_sge, ret;
 
 	rs_set_qp_size(rs);
 	if (rs->cm_id->verbs->device->transport_type == IBV_TRANSPORT_IWARP) {
+		/* the message area follows rbuf, which must stay in place */
 		rs->opts |= RS_OPT_MSG_SEND;
+		rs->opts &= ~RS_OPT_RBUF_AUTO;
 
 		if (rs->sq_inline < RS_MSG_SIZE)
 			rs->sq_inline = RS_MSG_SIZE;
 	}
-	ret = rs_create_cq(rs, rs->cm_id);
-	if (ret)
-		return ret;
+	/* Shared CQ mode relies on receives without buffers */
+	if ((rs->opts & RS_OPT_SHARED_CQ) && !(rs->opts & RS_OPT_MSG_SEND))
+		rs_join_scq(rs);
+
+	if (!rs->scq) {
+		ret = rs_create_cq(rs, rs->cm_id);
+		if (ret)
+			return ret;
+	}
 
 	memset(&qp_attr, 0, sizeof qp_attr);
 	qp_attr.qp_context = rs;
@@ -934,16 +1480,34 @@ static int rs_create_ep(struct rsocket *rs)
 	qp_attr.qp_type = IBV_QPT_RC;
 	qp_attr.sq_sig_all = 1;
 	qp_attr.cap.max_send_wr = rs->sq_size;
-	qp_attr.cap.max_recv_wr = rs->rq_size;
 	qp_attr.cap.max_send_sge = 2;
-	qp_attr.cap.max_recv_sge = 1;
+	/* zero-copy rsendv posts one SGE per iovec */
+	if (rs->zcopy_threshold) {
+		max_sge = min(ucma_max_sge(rs->cm_id), RS_MAX_SEND_SGE);
+		if (max_sge > 2)
+			qp_attr.cap.max_send_sge = max_sge;
+	}
 	qp_attr.cap.max_inline_data = rs->sq_inline;
+	if (rs->scq) {
+		qp_attr.srq = rs->scq->srq;
+	} else {
+		qp_attr.cap.max_recv_wr = rs->rq_size;
+		qp_attr.cap.max_recv_sge = 1;
+	}
 
 	ret = rdma_create_qp(rs->cm_id, NULL, &qp_attr);
 	if (ret)
 		return ret;
 
+	if (rs->scq) {
+		rs->scq_qpn = rs->cm_id->qp->qp_num;
+		fastlock_acquire(&rs->scq->lock);
+		tsearch(&rs->scq_qpn, &rs->scq->qp_map, rs_compare_qpn);
+		fastlock_release(&rs->scq->lock);
+	}
+
 	rs->sq_inline = qp_attr.cap.max_inline_data;
+	rs->sq_sge = min_t(uint32_t, qp_attr.cap.max_send_sge, RS_MAX_SEND_SGE);
 	if ((rs->opts & RS_OPT_MSG_SEND) && (rs->sq_inline < RS_MSG_SIZE))
 		return ERR(ENOTSUP);
 
@@ -951,7 +1515,7 @@ static int rs_create_ep(struct rsocket *rs)
 	if (ret)
 		return ret;
 
-	for (i = 0; i < rs->rq_size; i++) {
+	for (i = 0; !rs->scq && i < rs->rq_size; i++) {
 		ret = rs_post_recv(rs);
 		if (ret)
 			return ret;
@@ -1055,6 +1619,15 @@ static void rs_free(struct rsocket *rs)
 	if (rs->rmsg)
 		free(rs->rmsg);
 
+	if (rs->rmr)
+		atomic_fetch_sub(&mem_used, rs->rbuf_size + rs->sbuf_size);
+
+	if (rs->rbuf_next) {
+		rdma_dereg_mr(rs->rmr_next);
+		free(rs->rbuf_next);
+		atomic_fetch_sub(&mem_used, rs->rbuf_next_size);
+	}
+
 	if (rs->sbuf) {
 		if (rs->smr)
 			rdma_dereg_mr(rs->smr);
@@ -1078,13 +1651,18 @@ static void rs_free(struct rsocket *rs)
 
 	if (rs->cm_id) {
 		rs_free_iomappings(rs);
-		if (rs->cm_id->qp) {
+		if (rs->scq) {
+			rs_leave_scq(rs);
+		} else if (rs->cm_id->qp) {
 			ibv_ack_cq_events(rs->cm_id->recv_cq, rs->unack_cqe);
 			rdma_destroy_qp(rs->cm_id);
 		}
 		rdma_destroy_id(rs->cm_id);
 	}
 
+	if (rs->wcq)
+		free(rs->wcq);
+
 	if (rs->accept_queue[0] > 0 || rs->accept_queue[1] > 0) {
 		close(rs->accept_queue[0]);
 		close(rs->accept_queue[1]);
@@ -1856,6 +2434,28 @@ static int ds_post_send(struct rsocket *rs, struct ibv_sge *sge,
 	return rdma_seterrno(ibv_post_send(rs->conn_dest->qp->cm_id->qp, &wr, &bad));
 }
 
+/* Data is copied into sbuf, sent inline, or written from the user's memory */
+static void rs_count_write(struct rsocket *rs, struct ibv_sge *sgl, int nsge,
+			   uint32_t length, int flags)
+{
+	const char __attribute__((unused)) *kind;
+
+	rs->stats.tx_bytes += length;
+	rs->stats.tx_writes++;
+	if (flags & IBV_SEND_INLINE) {
+		rs->stats.tx_inline++;
+		kind = "inline";
+	} else if (sgl[0].lkey == rs->smr->lkey) {
+		rs->stats.tx_copy++;
+		kind = "copy";
+	} else {
+		rs->stats.tx_direct++;
+		kind = "direct";
+	}
+	rdma_tracepoint(rdma_core_rsocket, post_write, rs->index, length,
+			nsge, kind);
+}
+
 /*
  * Update target SGE before sending data.  Otherwise the remote side may
  * update the entry before we do.
@@ -1867,7 +2467,9 @@ static int rs_write_data(struct rsocket *rs,
 	uint64_t addr;
 	uint32_t rkey;
 
+	rs_count_write(rs, sgl, nsge, length, flags);
 	rs->sseq_no++;
+	rs->sdata_seqno++;
 	rs->sqe_avail--;
 	if (rs->opts & RS_OPT_MSG_SEND)
 		rs->sqe_avail--;
@@ -1893,6 +2495,8 @@ static int rs_write_direct(struct rsocket *rs, struct rs_iomap *iom, uint64_t of
 {
 	uint64_t addr;
 
+	rs_count_write(rs, sgl, nsge, length, flags);
+	rs->stats.iomap_writes++;
 	rs->sqe_avail--;
 	rs->sbuf_bytes_avail -= length;
 
@@ -1923,26 +2527,128 @@ static uint32_t rs_sbuf_left(struct rsocket *rs)
 			   rs->ssgl[0].addr);
 }
 
+/* Size of the receive buffer that credits are currently granted from */
+static uint32_t rs_rbuf_adv_size(struct rsocket *rs)
+{
+	return rs->rbuf_next ? rs->rbuf_next_size : rs->rbuf_size;
+}
+
+/*
+ * Called with the cq_lock held when the start of rbuf is about to be
+ * advertised, so each call ends one full turn of the buffer.  A resized
+ * buffer is advertised in place of rbuf from now on, and replaces rbuf
+ * once the reader reaches the end of it.  The remote side fills target
+ * SGEs in order, so all data for the old buffer arrives before any data
+ * for the new one.
+ */
+static void rs_tune_rbuf(struct rsocket *rs)
+{
+	struct ibv_mr *mr;
+	uint64_t now, cycle;
+	uint32_t size;
+	uint8_t *buf;
+
+	now = rs_time_us();
+	cycle = now - rs->rbuf_tune_time;
+	rs->rbuf_tune_time = now;
+
+	if (cycle < RS_TUNE_FAST_US) {
+		if (++rs->rbuf_fast < RS_TUNE_FAST_CNT || rs->rbuf_size >= mem_max)
+			return;
+		size = min(rs->rbuf_size << 1, mem_max);
+	} else if (cycle > RS_TUNE_IDLE_US && rs->rbuf_size > rs->rbuf_min) {
+		size = max(rs->rbuf_size >> 1, rs->rbuf_min);
+		/* The first half of the new buffer is advertised immediately */
+		if (rs->rbuf_bytes_avail + (int) size - (int) rs->rbuf_size <
+		    (int) (size >> 1))
+			return;
+	} else {
+		rs->rbuf_fast = 0;
+		return;
+	}
+
+	rs->rbuf_fast = 0;
+	if (!rs_mem_charge(size, size < rs->rbuf_size))
+		return;
+
+	buf = forksafe_alloc(size);
+	if (!buf)
+		goto err;
+
+	mr = rdma_reg_write(rs->cm_id, buf, size);
+	if (!mr) {
+		free(buf);
+		goto err;
+	}
+
+	rs->rbuf_next = buf;
+	rs->rmr_next = mr;
+	rs->rbuf_next_size = size;
+	/* Unread data in the old buffer still counts against the new one */
+	rs->rbuf_bytes_avail += (int) size - (int) rs->rbuf_size;
+	return;
+err:
+	atomic_fetch_sub(&mem_used, size);
+}
+
+/* Called by the reader with the rlock held once all of rbuf is consumed */
+static void rs_swap_rbuf(struct rsocket *rs)
+{
+	struct ibv_mr *mr;
+	uint8_t *buf;
+
+	fastlock_acquire(&rs->cq_lock);
+	buf = rs->rbuf;
+	mr = rs->rmr;
+	atomic_fetch_sub(&mem_used, rs->rbuf_size);
+	rs->rbuf = rs->rbuf_next;
+	rs->rmr = rs->rmr_next;
+	rs->rbuf_size = rs->rbuf_next_size;
+	rs->rbuf_next = NULL;
+	rs->rmr_next = NULL;
+	fastlock_release(&rs->cq_lock);
+
+	rdma_dereg_mr(mr);
+	free(buf);
+}
+
 static void rs_send_credits(struct rsocket *rs)
 {
 	struct ibv_sge ibsge;
 	struct rs_sge sge, *sge_buf;
+	struct ibv_mr *rmr;
+	uint32_t size;
+	uint8_t *rbuf;
 	int flags;
 
 	rs->ctrl_seqno++;
 	rs->rseq_comp = rs->rseq_no + (rs->rq_size >> 1);
-	if (rs->rbuf_bytes_avail >= (rs->rbuf_size >> 1)) {
+	if (rs->rbuf_bytes_avail >= (rs_rbuf_adv_size(rs) >> 1)) {
 		if (rs->opts & RS_OPT_MSG_SEND)
 			rs->ctrl_seqno++;
 
+		if ((rs->opts & RS_OPT_RBUF_AUTO) && !rs->rbuf_free_offset &&
+		    !rs->rbuf_next)
+			rs_tune_rbuf(rs);
+
+		if (rs->rbuf_next) {
+			rbuf = rs->rbuf_next;
+			rmr = rs->rmr_next;
+			size = rs->rbuf_next_size;
+		} else {
+			rbuf = rs->rbuf;
+			rmr = rs->rmr;
+			size = rs->rbuf_size;
+		}
+
 		if (!(rs->opts & RS_OPT_SWAP_SGL)) {
-			sge.addr = (uintptr_t) &rs->rbuf[rs->rbuf_free_offset];
-			sge.key = rs->rmr->rkey;
-			sge.length = rs->rbuf_size >> 1;
+			sge.addr = (uintptr_t) &rbuf[rs->rbuf_free_offset];
+			sge.key = rmr->rkey;
+			sge.length = size >> 1;
 		} else {
-			sge.addr = bswap_64((uintptr_t) &rs->rbuf[rs->rbuf_free_offset]);
-			sge.key = bswap_32(rs->rmr->rkey);
-			sge.length = bswap_32(rs->rbuf_size >> 1);
+			sge.addr = bswap_64((uintptr_t) &rbuf[rs->rbuf_free_offset]);
+			sge.key = bswap_32(rmr->rkey);
+			sge.length = bswap_32(size >> 1);
 		}
 
 		if (rs->sq_inline < sizeof sge) {
@@ -1962,10 +2668,13 @@ static void rs_send_credits(struct rsocket *rs)
 			rs_msg_set(RS_OP_SGL, rs->rseq_no + rs->rq_size), flags,
 			rs->remote_sgl.addr + rs->remote_sge * sizeof(struct rs_sge),
 			rs->remote_sgl.key);
+		rs->stats.credit_updates++;
+		rdma_tracepoint(rdma_core_rsocket, send_credits, rs->index,
+				rs->rq_size, size >> 1);
 
-		rs->rbuf_bytes_avail -= rs->rbuf_size >> 1;
-		rs->rbuf_free_offset += rs->rbuf_size >> 1;
-		if (rs->rbuf_free_offset >= rs->rbuf_size)
+		rs->rbuf_bytes_avail -= size >> 1;
+		rs->rbuf_free_offset += size >> 1;
+		if (rs->rbuf_free_offset >= size)
 			rs->rbuf_free_offset = 0;
 		if (++rs->remote_sge == rs->remote_sgl.length)
 			rs->remote_sge = 0;
@@ -1988,7 +2697,7 @@ static inline int rs_2ctrl_avail(struct rsocket *rs)
 static int rs_give_credits(struct rsocket *rs)
 {
 	if (!(rs->opts & RS_OPT_MSG_SEND)) {
-		return ((rs->rbuf_bytes_avail >= (rs->rbuf_size >> 1)) ||
+		return ((rs->rbuf_bytes_avail >= (rs_rbuf_adv_size(rs) >> 1)) ||
 			((short) ((short) rs->rseq_no - (short) rs->rseq_comp) >= 0)) &&
 		       rs_ctrl_avail(rs) && (rs->state & rs_connected);
 	} else {
@@ -2010,11 +2719,12 @@ static int rs_poll_cq(struct rsocket *rs)
 	uint32_t msg;
 	int ret, rcnt = 0;
 
-	while ((ret = ibv_poll_cq(rs->cm_id->recv_cq, 1, &wc)) > 0) {
+	while ((ret = rs_poll_wc(rs, &wc)) > 0) {
 		if (rs_wr_is_recv(wc.wr_id)) {
 			if (wc.status != IBV_WC_SUCCESS)
 				continue;
-			rcnt++;
+			if (!rs->scq)
+				rcnt++;
 
 			if (wc.wc_flags & IBV_WC_WITH_IMM) {
 				msg = be32toh(wc.imm_data);
@@ -2047,6 +2757,7 @@ static int rs_poll_cq(struct rsocket *rs)
 				/* We really shouldn't be here. */
 				break;
 			default:
+				rs->stats.rx_writes++;
 				rs->rmsg[rs->rmsg_tail].op = rs_msg_op(msg);
 				rs->rmsg[rs->rmsg_tail].data = rs_msg_data(msg);
 				if (++rs->rmsg_tail == rs->rq_size + 1)
@@ -2071,6 +2782,9 @@ static int rs_poll_cq(struct rsocket *rs)
 			default:
 				rs->sqe_avail++;
 				rs->sbuf_bytes_avail += rs_msg_data(rs_wr_data(wc.wr_id));
+				if (rs_msg_op(rs_wr_data(wc.wr_id)) == RS_OP_DATA &&
+				    !rs_wr_is_msg_send(wc.wr_id))
+					rs->sdata_comp++;
 				break;
 			}
 			if (wc.status != IBV_WC_SUCCESS && (rs->state & rs_connected)) {
@@ -2098,6 +2812,14 @@ static int rs_get_cq_event(struct rsocket *rs)
 	void *context;
 	int ret;
 
+	/* The shared channel may have been armed through another rsocket */
+	if (rs->scq) {
+		rs_scq_get_event(rs->scq);
+		rs->cq_armed = 0;
+		rs->stats.cq_events++;
+		return 0;
+	}
+
 	if (!rs->cq_armed)
 		return 0;
 
@@ -2108,6 +2830,7 @@ static int rs_get_cq_event(struct rsocket *rs)
 			rs->unack_cqe = 0;
 		}
 		rs->cq_armed = 0;
+		rs->stats.cq_events++;
 	} else if (!(errno == EAGAIN || errno == EINTR)) {
 		rs->state = rs_error;
 	}
@@ -2145,14 +2868,13 @@ static int rs_process_cq(struct rsocket *rs, int nonblock, int (*test)(struct rs
 		} else if (nonblock) {
 			ret = ERR(EWOULDBLOCK);
 		} else if (!rs->cq_armed) {
-			ibv_req_notify_cq(rs->cm_id->recv_cq, 0);
-			rs->cq_armed = 1;
+			rs_arm_cq(rs);
 		} else {
 			rs_update_credits(rs);
 			fastlock_acquire(&rs->cq_wait_lock);
 			fastlock_release(&rs->cq_lock);
 
-			ret = rs_get_cq_event(rs);
+			ret = rs->scq ? rs_scq_wait(rs) : rs_get_cq_event(rs);
 			fastlock_release(&rs->cq_wait_lock);
 			fastlock_acquire(&rs->cq_lock);
 		}
@@ -2163,24 +2885,70 @@ static int rs_process_cq(struct rsocket *rs, int nonblock, int (*test)(struct rs
 	return ret;
 }
 
-static int rs_get_comp(struct rsocket *rs, int nonblock, int (*test)(struct rsocket *rs))
+/* Microseconds to spin before blocking, UINT32_MAX spins indefinitely */
+static uint32_t rs_poll_budget(struct rsocket *rs)
 {
-	uint64_t start_time = 0;
-	uint32_t poll_time;
-	int ret;
+	switch (rs->poll_policy) {
+	case RDMA_POLL_BUSY:
+		return UINT32_MAX;
+	case RDMA_POLL_SLEEP:
+		return 0;
+	case RDMA_POLL_ADAPTIVE:
+		if (rs->poll_wait_avg > RS_POLL_ADAPTIVE_MAX)
+			return 0;
+		return min(rs->poll_wait_avg << 1, rs->poll_time);
+	default:
+		return rs->poll_time;
+	}
+}
 
-	do {
+/*
+ * Record how long we waited for an event, and whether we had to block.
+ * This runs from rsend, rrecv and rpoll at the same time, so the counters
+ * are updated under cq_lock, like the other CQ counters.
+ */
+static void rs_poll_wakeup(struct rsocket *rs, uint64_t wait_time, int slept)
+{
+	rdma_tracepoint(rdma_core_rsocket, wakeup, rs->index,
+			(uint32_t) min_t(uint64_t, wait_time, UINT32_MAX), slept);
+
+	if (wait_time > RS_POLL_WAIT_MAX)
+		wait_time = RS_POLL_WAIT_MAX;
+
+	fastlock_acquire(&rs->cq_lock);
+	if (slept)
+		rs->stats.poll_sleep_wakeups++;
+	else
+		rs->stats.poll_spin_wakeups++;
+	rs->poll_wait_avg = (rs->poll_wait_avg * 7 + (uint32_t) wait_time) >> 3;
+	fastlock_release(&rs->cq_lock);
+}
+
+static int rs_get_comp(struct rsocket *rs, int nonblock, int (*test)(struct rsocket *rs))
+{
+	uint64_t start_time = 0;
+	uint32_t poll_time, budget = 0;
+	int ret;
+
+	do {
 		ret = rs_process_cq(rs, 1, test);
-		if (!ret || nonblock || errno != EWOULDBLOCK)
+		if (!ret || nonblock || errno != EWOULDBLOCK) {
+			if (!ret && start_time)
+				rs_poll_wakeup(rs, rs_time_us() - start_time, 0);
 			return ret;
+		}
 
-		if (!start_time)
+		if (!start_time) {
 			start_time = rs_time_us();
+			budget = rs_poll_budget(rs);
+		}
 
 		poll_time = (uint32_t) (rs_time_us() - start_time);
-	} while (poll_time <= polling_time);
+	} while (budget && poll_time <= budget);
 
 	ret = rs_process_cq(rs, 0, test);
+	if (!ret)
+		rs_poll_wakeup(rs, rs_time_us() - start_time, 1);
 	return ret;
 }
 
@@ -2198,16 +2966,17 @@ static int ds_valid_recv(struct ds_qp *qp, struct ibv_wc *wc)
  * Poll all CQs associated with a datagram rsocket.  We need to drop any
  * received messages that we do not have room to store.  To limit drops,
  * we only poll if we have room to store the receive or we need a send
- * buffer.  To ensure fairness, we poll the CQs round robin, remembering
- * where we left off.
+ * buffer, and never reap more completions at once than we have room for.
+ * To ensure fairness, we poll the CQs round robin, remembering where we
+ * left off.
  */
 static void ds_poll_cqs(struct rsocket *rs)
 {
 	struct ds_qp *qp;
 	struct ds_smsg *smsg;
 	struct ds_rmsg *rmsg;
-	struct ibv_wc wc;
-	int ret, cnt;
+	struct ibv_wc wc[RS_DS_BATCH];
+	int i, ret, cnt, batch;
 
 	if (!(qp = rs->qp_list))
 		return;
@@ -2215,30 +2984,37 @@ static void ds_poll_cqs(struct rsocket *rs)
 	do {
 		cnt = 0;
 		do {
-			ret = ibv_poll_cq(qp->cm_id->recv_cq, 1, &wc);
+			batch = rs->rqe_avail ? min(rs->rqe_avail, RS_DS_BATCH) : 1;
+			ret = ibv_poll_cq(qp->cm_id->recv_cq, batch, wc);
 			if (ret <= 0) {
 				qp = ds_next_qp(qp);
 				continue;
 			}
 
-			if (rs_wr_is_recv(wc.wr_id)) {
-				if (rs->rqe_avail && wc.status == IBV_WC_SUCCESS &&
-				    ds_valid_recv(qp, &wc)) {
-					rs->rqe_avail--;
-					rmsg = &rs->dmsg[rs->rmsg_tail];
-					rmsg->qp = qp;
-					rmsg->offset = rs_wr_data(wc.wr_id);
-					rmsg->length = wc.byte_len - sizeof(struct ibv_grh);
-					if (++rs->rmsg_tail == rs->rq_size + 1)
-						rs->rmsg_tail = 0;
+			for (i = 0; i < ret; i++) {
+				if (rs_wr_is_recv(wc[i].wr_id)) {
+					if (rs->rqe_avail &&
+					    wc[i].status == IBV_WC_SUCCESS &&
+					    ds_valid_recv(qp, &wc[i])) {
+						rs->rqe_avail--;
+						rmsg = &rs->dmsg[rs->rmsg_tail];
+						rmsg->qp = qp;
+						rmsg->offset = rs_wr_data(wc[i].wr_id);
+						rmsg->length = wc[i].byte_len -
+							       sizeof(struct ibv_grh);
+						if (++rs->rmsg_tail == rs->rq_size + 1)
+							rs->rmsg_tail = 0;
+					} else {
+						ds_post_recv(rs, qp,
+							     rs_wr_data(wc[i].wr_id));
+					}
 				} else {
-					ds_post_recv(rs, qp, rs_wr_data(wc.wr_id));
+					smsg = (struct ds_smsg *)
+					       (rs->sbuf + rs_wr_data(wc[i].wr_id));
+					smsg->next = rs->smsg_free;
+					rs->smsg_free = smsg;
+					rs->sqe_avail++;
 				}
-			} else {
-				smsg = (struct ds_smsg *) (rs->sbuf + rs_wr_data(wc.wr_id));
-				smsg->next = rs->smsg_free;
-				rs->smsg_free = smsg;
-				rs->sqe_avail++;
 			}
 
 			qp = ds_next_qp(qp);
@@ -2246,7 +3022,7 @@ static void ds_poll_cqs(struct rsocket *rs)
 				rs->qp_list = qp;
 				return;
 			}
-			cnt++;
+			cnt += ret;
 		} while (qp != rs->qp_list);
 	} while (cnt);
 }
@@ -2325,21 +3101,28 @@ static int ds_process_cqs(struct rsocket *rs, int nonblock, int (*test)(struct r
 static int ds_get_comp(struct rsocket *rs, int nonblock, int (*test)(struct rsocket *rs))
 {
 	uint64_t start_time = 0;
-	uint32_t poll_time;
+	uint32_t poll_time, budget = 0;
 	int ret;
 
 	do {
 		ret = ds_process_cqs(rs, 1, test);
-		if (!ret || nonblock || errno != EWOULDBLOCK)
+		if (!ret || nonblock || errno != EWOULDBLOCK) {
+			if (!ret && start_time)
+				rs_poll_wakeup(rs, rs_time_us() - start_time, 0);
 			return ret;
+		}
 
-		if (!start_time)
+		if (!start_time) {
 			start_time = rs_time_us();
+			budget = rs_poll_budget(rs);
+		}
 
 		poll_time = (uint32_t) (rs_time_us() - start_time);
-	} while (poll_time <= polling_time);
+	} while (budget && poll_time <= budget);
 
 	ret = ds_process_cqs(rs, 0, test);
+	if (!ret)
+		rs_poll_wakeup(rs, rs_time_us() - start_time, 1);
 	return ret;
 }
 
@@ -2410,6 +3193,13 @@ static int rs_conn_have_rdata(struct rsocket *rs)
 	return rs_have_rdata(rs) || !(rs->state & rs_readable);
 }
 
+/* All RS_OP_DATA writes up to zcopy_seqno have completed */
+static int rs_zcopy_done(struct rsocket *rs)
+{
+	return ((int) (rs->sdata_comp - rs->zcopy_seqno)) >= 0 ||
+	       !(rs->state & rs_connected);
+}
+
 static int rs_conn_all_sends_done(struct rsocket *rs)
 {
 	return ((((int) rs->ctrl_max_seqno) - ((int) rs->ctrl_seqno)) +
@@ -2478,14 +3268,152 @@ static ssize_t ds_recvfrom(struct rsocket *rs, void *buf, size_t len, int flags,
 	return len;
 }
 
-static ssize_t rs_peek(struct rsocket *rs, void *buf, size_t len)
+static void rs_copy_to_iov(const struct iovec **iov, size_t *offset,
+			   const void *src, size_t len)
 {
-	size_t left = len;
-	uint32_t end_size, rsize;
+	size_t size;
+
+	while (len) {
+		size = (*iov)->iov_len - *offset;
+		if (size > len) {
+			memcpy((*iov)->iov_base + *offset, src, len);
+			*offset += len;
+			break;
+		}
+
+		memcpy((*iov)->iov_base + *offset, src, size);
+		len -= size;
+		src += size;
+		(*iov)++;
+		*offset = 0;
+	}
+}
+
+/*
+ * Receive buffers released by a batch receive are reposted together, one
+ * chain per QP, rather than one ibv_post_recv call per datagram.
+ */
+struct ds_recv_batch {
+	struct ds_qp	   *qp;
+	struct ibv_recv_wr wr[RS_DS_BATCH];
+	struct ibv_sge	   sge[RS_DS_BATCH][2];
+	int		   cnt;
+};
+
+static int ds_post_recv_batch(struct rsocket *rs, struct ds_recv_batch *batch)
+{
+	struct ibv_recv_wr *bad;
+	int ret;
+
+	if (!batch->cnt)
+		return 0;
+
+	batch->wr[batch->cnt - 1].next = NULL;
+	ret = rdma_seterrno(ibv_post_recv(batch->qp->cm_id->qp, batch->wr, &bad));
+	batch->cnt = 0;
+	return ret;
+}
+
+static int ds_add_recv_batch(struct rsocket *rs, struct ds_recv_batch *batch,
+			     struct ds_qp *qp, uint32_t offset)
+{
+	struct ibv_recv_wr *wr;
+	struct ibv_sge *sge;
+	int ret;
+
+	if (batch->cnt && (batch->qp != qp || batch->cnt == RS_DS_BATCH)) {
+		ret = ds_post_recv_batch(rs, batch);
+		if (ret)
+			return ret;
+	}
+
+	batch->qp = qp;
+	sge = batch->sge[batch->cnt];
+	sge[0].addr = (uintptr_t) qp->rbuf + rs->rbuf_size;
+	sge[0].length = sizeof(struct ibv_grh);
+	sge[0].lkey = qp->rmr->lkey;
+	sge[1].addr = (uintptr_t) qp->rbuf + offset;
+	sge[1].length = RS_SNDLOWAT;
+	sge[1].lkey = qp->rmr->lkey;
+
+	wr = &batch->wr[batch->cnt];
+	wr->wr_id = rs_recv_wr_id(offset);
+	wr->next = wr + 1;
+	wr->sg_list = sge;
+	wr->num_sge = 2;
+	batch->cnt++;
+	return 0;
+}
+
+/*
+ * Receives one datagram into msg.  The receive buffer is added to batch
+ * to be reposted by the caller, unless MSG_PEEK is set.
+ */
+static ssize_t ds_recvmsg(struct rsocket *rs, struct msghdr *msg, int flags,
+			  struct ds_recv_batch *batch)
+{
+	const struct iovec *iov = msg->msg_iov;
+	struct ds_rmsg *rmsg;
+	struct ds_header *hdr;
+	size_t len, offset = 0;
+	int i, ret;
+
+	if (!(rs->state & rs_readable))
+		return ERR(EINVAL);
+	if (msg->msg_control && msg->msg_controllen)
+		return ERR(ENOTSUP);
+
+	if (!rs_have_rdata(rs)) {
+		/* don't sleep while holding buffers the remote side needs */
+		ret = ds_post_recv_batch(rs, batch);
+		if (ret)
+			return ret;
+
+		ret = ds_get_comp(rs, rs_nonblocking(rs, flags),
+				  rs_have_rdata);
+		if (ret)
+			return ret;
+	}
+
+	rmsg = &rs->dmsg[rs->rmsg_head];
+	hdr = (struct ds_header *) (rmsg->qp->rbuf + rmsg->offset);
+	for (len = 0, i = 0; i < msg->msg_iovlen; i++)
+		len += iov[i].iov_len;
+
+	msg->msg_flags = 0;
+	if (len >= rmsg->length - hdr->length) {
+		len = rmsg->length - hdr->length;
+	} else {
+		msg->msg_flags |= MSG_TRUNC;
+	}
+
+	rs_copy_to_iov(&iov, &offset, (void *) hdr + hdr->length, len);
+	if (msg->msg_name)
+		ds_set_src(msg->msg_name, &msg->msg_namelen, hdr);
+
+	if (!(flags & MSG_PEEK)) {
+		ret = ds_add_recv_batch(rs, batch, rmsg->qp, rmsg->offset);
+		if (++rs->rmsg_head == rs->rq_size + 1)
+			rs->rmsg_head = 0;
+		rs->rqe_avail++;
+		if (ret)
+			return ret;
+	}
+
+	return len;
+}
+
+static ssize_t rs_peek(struct rsocket *rs, const struct iovec *iov, size_t len)
+{
+	size_t left = len, offset = 0;
+	uint32_t end_size, rsize, rbuf_size;
 	int rmsg_head, rbuf_offset;
+	uint8_t *rbuf;
 
 	rmsg_head = rs->rmsg_head;
 	rbuf_offset = rs->rbuf_offset;
+	rbuf = rs->rbuf;
+	rbuf_size = rs->rbuf_size;
 
 	for (; left && (rmsg_head != rs->rmsg_tail); left -= rsize) {
 		if (left < rs->rmsg[rmsg_head].data) {
@@ -2496,17 +3424,19 @@ static ssize_t rs_peek(struct rsocket *rs, void *buf, size_t len)
 				rmsg_head = 0;
 		}
 
-		end_size = rs->rbuf_size - rbuf_offset;
+		end_size = rbuf_size - rbuf_offset;
 		if (rsize > end_size) {
-			memcpy(buf, &rs->rbuf[rbuf_offset], end_size);
+			rs_copy_to_iov(&iov, &offset, &rbuf[rbuf_offset], end_size);
 			rbuf_offset = 0;
-			buf += end_size;
+			if (rs->rbuf_next) {
+				rbuf = rs->rbuf_next;
+				rbuf_size = rs->rbuf_next_size;
+			}
 			rsize -= end_size;
 			left -= end_size;
 		}
-		memcpy(buf, &rs->rbuf[rbuf_offset], rsize);
+		rs_copy_to_iov(&iov, &offset, &rbuf[rbuf_offset], rsize);
 		rbuf_offset += rsize;
-		buf += rsize;
 	}
 
 	return len - left;
@@ -2514,23 +3444,14 @@ static ssize_t rs_peek(struct rsocket *rs, void *buf, size_t len)
 
 /*
  * Continue to receive any queued data even if the remote side has disconnected.
+ * Data is copied straight from rbuf into each of the user's buffers.
  */
-ssize_t rrecv(int socket, void *buf, size_t len, int flags)
+static ssize_t rs_recvv(struct rsocket *rs, const struct iovec *iov, int iovcnt,
+			int flags)
 {
-	struct rsocket *rs;
-	size_t left = len;
+	size_t left, len, offset = 0;
 	uint32_t end_size, rsize;
-	int ret = 0;
-
-	rs = idm_at(&idm, socket);
-	if (!rs)
-		return ERR(EBADF);
-	if (rs->type == SOCK_DGRAM) {
-		fastlock_acquire(&rs->rlock);
-		ret = ds_recvfrom(rs, buf, len, flags, NULL, NULL);
-		fastlock_release(&rs->rlock);
-		return ret;
-	}
+	int i, ret = 0;
 
 	if (rs->state & rs_opening) {
 		ret = rs_do_connect(rs);
@@ -2540,6 +3461,11 @@ ssize_t rrecv(int socket, void *buf, size_t len, int flags)
 			return ret;
 		}
 	}
+
+	for (len = 0, i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+	left = len;
+
 	fastlock_acquire(&rs->rlock);
 	do {
 		if (!rs_have_rdata(rs)) {
@@ -2550,7 +3476,7 @@ ssize_t rrecv(int socket, void *buf, size_t len, int flags)
 		}
 
 		if (flags & MSG_PEEK) {
-			left = len - rs_peek(rs, buf, left);
+			left = len - rs_peek(rs, iov, left);
 			break;
 		}
 
@@ -2567,25 +3493,53 @@ ssize_t rrecv(int socket, void *buf, size_t len, int flags)
 
 			end_size = rs->rbuf_size - rs->rbuf_offset;
 			if (rsize > end_size) {
-				memcpy(buf, &rs->rbuf[rs->rbuf_offset], end_size);
+				rs_copy_to_iov(&iov, &offset,
+					       &rs->rbuf[rs->rbuf_offset], end_size);
 				rs->rbuf_offset = 0;
-				buf += end_size;
+				if (rs->rbuf_next)
+					rs_swap_rbuf(rs);
 				rsize -= end_size;
 				left -= end_size;
 				rs->rbuf_bytes_avail += end_size;
 			}
-			memcpy(buf, &rs->rbuf[rs->rbuf_offset], rsize);
+			rs_copy_to_iov(&iov, &offset,
+				       &rs->rbuf[rs->rbuf_offset], rsize);
 			rs->rbuf_offset += rsize;
-			buf += rsize;
 			rs->rbuf_bytes_avail += rsize;
 		}
 
 	} while (left && (flags & MSG_WAITALL) && (rs->state & rs_readable));
 
+	if (len - left && !(flags & MSG_PEEK)) {
+		rs->stats.rx_bytes += len - left;
+		rdma_tracepoint(rdma_core_rsocket, recv, rs->index,
+				(uint32_t) (len - left));
+	}
 	fastlock_release(&rs->rlock);
 	return (ret && left == len) ? ret : len - left;
 }
 
+ssize_t rrecv(int socket, void *buf, size_t len, int flags)
+{
+	struct rsocket *rs;
+	struct iovec iov;
+	int ret;
+
+	rs = idm_at(&idm, socket);
+	if (!rs)
+		return ERR(EBADF);
+	if (rs->type == SOCK_DGRAM) {
+		fastlock_acquire(&rs->rlock);
+		ret = ds_recvfrom(rs, buf, len, flags, NULL, NULL);
+		fastlock_release(&rs->rlock);
+		return ret;
+	}
+
+	iov.iov_base = buf;
+	iov.iov_len = len;
+	return rs_recvv(rs, &iov, 1, flags);
+}
+
 ssize_t rrecvfrom(int socket, void *buf, size_t len, int flags,
 		  struct sockaddr *src_addr, socklen_t *addrlen)
 {
@@ -2610,12 +3564,19 @@ ssize_t rrecvfrom(int socket, void *buf, size_t len, int flags,
 }
 
 /*
- * Simple, straightforward implementation for now that only tries to fill
- * in the first vector.
+ * Datagram sockets only fill in the first vector.
  */
 static ssize_t rrecvv(int socket, const struct iovec *iov, int iovcnt, int flags)
 {
-	return rrecv(socket, iov[0].iov_base, iov[0].iov_len, flags);
+	struct rsocket *rs;
+
+	rs = idm_at(&idm, socket);
+	if (!rs)
+		return ERR(EBADF);
+	if (rs->type == SOCK_DGRAM)
+		return rrecv(socket, iov[0].iov_base, iov[0].iov_len, flags);
+
+	return rs_recvv(rs, iov, iovcnt, flags);
 }
 
 ssize_t rrecvmsg(int socket, struct msghdr *msg, int flags)
@@ -2623,7 +3584,82 @@ ssize_t rrecvmsg(int socket, struct msghdr *msg, int flags)
 	if (msg->msg_control && msg->msg_controllen)
 		return ERR(ENOTSUP);
 
-	return rrecvv(socket, msg->msg_iov, (int) msg->msg_iovlen, msg->msg_flags);
+	return rrecvv(socket, msg->msg_iov, (int) msg->msg_iovlen, flags);
+}
+
+/* Like recvmmsg, the timeout is only checked after each message */
+static int rs_mmsg_timeout(uint64_t start_time, struct timespec *timeout)
+{
+	uint64_t elapsed, limit;
+
+	if (!timeout)
+		return 0;
+
+	elapsed = rs_time_us() - start_time;
+	limit = timeout->tv_sec * 1000000 + timeout->tv_nsec / 1000;
+	if (elapsed >= limit) {
+		timeout->tv_sec = 0;
+		timeout->tv_nsec = 0;
+		return 1;
+	}
+
+	limit -= elapsed;
+	timeout->tv_sec = limit / 1000000;
+	timeout->tv_nsec = (limit % 1000000) * 1000;
+	return 0;
+}
+
+/*
+ * Datagrams are received under a single acquisition of rlock, completions
+ * are reaped in batches, and receive buffers are reposted together.
+ */
+int rrecvmmsg(int socket, struct mmsghdr *msgvec, unsigned int vlen,
+	      int flags, struct timespec *timeout)
+{
+	struct ds_recv_batch batch;
+	struct rsocket *rs;
+	uint64_t start_time;
+	unsigned int i;
+	ssize_t ret = 0;
+
+	rs = idm_at(&idm, socket);
+	if (!rs)
+		return ERR(EBADF);
+	if (timeout && (timeout->tv_sec < 0 || timeout->tv_nsec < 0 ||
+			timeout->tv_nsec >= 1000000000))
+		return ERR(EINVAL);
+
+	start_time = timeout ? rs_time_us() : 0;
+	batch.cnt = 0;
+	if (rs->type == SOCK_DGRAM)
+		fastlock_acquire(&rs->rlock);
+	for (i = 0; i < vlen; i++) {
+		if (rs->type == SOCK_DGRAM) {
+			ret = ds_recvmsg(rs, &msgvec[i].msg_hdr, flags, &batch);
+		} else {
+			ret = rrecvmsg(socket, &msgvec[i].msg_hdr, flags);
+			if (ret > 0)
+				msgvec[i].msg_hdr.msg_flags = 0;
+		}
+		if (ret < 0)
+			break;
+
+		msgvec[i].msg_len = (unsigned int) ret;
+		if (flags & MSG_WAITFORONE)
+			flags |= MSG_DONTWAIT;
+		if ((!ret && rs->type == SOCK_STREAM) ||
+		    rs_mmsg_timeout(start_time, timeout)) {
+			i++;
+			break;
+		}
+	}
+	if (rs->type == SOCK_DGRAM) {
+		if (ds_post_recv_batch(rs, &batch) && !i)
+			ret = -1;
+		fastlock_release(&rs->rlock);
+	}
+
+	return i ? i : ret;
 }
 
 ssize_t rread(int socket, void *buf, size_t count)
@@ -2786,60 +3822,369 @@ static ssize_t dsend(struct rsocket *rs, const void *buf, size_t len, int flags)
 }
 
 /*
- * We overlap sending the data, by posting a small work request immediately,
- * then increasing the size of the send on each iteration.
+ * Registrations of user buffers for zero-copy sends.  Registering memory
+ * is expensive, so up to zcopy_mr_cache_size registrations are kept
+ * around after use.  A cached registration keeps the pages it was created
+ * with, so caching is only safe if the application does not unmap buffers
+ * that it has passed to rsend.  Caching is disabled by default.
  */
-ssize_t rsend(int socket, const void *buf, size_t len, int flags)
+struct rs_zcopy_mr {
+	dlist_entry	  entry;
+	struct ibv_pd	  *pd;
+	uintptr_t	  start;
+	uintptr_t	  end;
+	struct ibv_mr	  *mr;
+	int		  refcnt;
+	int		  cached;
+};
+
+static pthread_mutex_t zcopy_mr_lock = PTHREAD_MUTEX_INITIALIZER;
+static dlist_entry zcopy_mr_list = { &zcopy_mr_list, &zcopy_mr_list };
+static int zcopy_mr_cnt;
+
+static void rs_zcopy_evict(void)
 {
-	struct rsocket *rs;
-	struct ibv_sge sge;
-	size_t left = len;
-	uint32_t xfer_size, olen = RS_OLAP_START_SIZE;
-	int ret = 0;
+	struct rs_zcopy_mr *zmr;
+	dlist_entry *cur, *prev;
 
-	rs = idm_at(&idm, socket);
-	if (!rs)
-		return ERR(EBADF);
-	if (rs->type == SOCK_DGRAM) {
-		fastlock_acquire(&rs->slock);
-		ret = dsend(rs, buf, len, flags);
-		fastlock_release(&rs->slock);
-		return ret;
+	for (cur = zcopy_mr_list.prev; cur != &zcopy_mr_list &&
+	     zcopy_mr_cnt > zcopy_mr_cache_size; cur = prev) {
+		prev = cur->prev;
+		zmr = container_of(cur, struct rs_zcopy_mr, entry);
+		if (zmr->refcnt)
+			continue;
+
+		dlist_remove(&zmr->entry);
+		zcopy_mr_cnt--;
+		ibv_dereg_mr(zmr->mr);
+		free(zmr);
 	}
+}
 
-	if (rs->state & rs_opening) {
-		ret = rs_do_connect(rs);
-		if (ret) {
-			if (errno == EINPROGRESS)
-				errno = EAGAIN;
-			return ret;
+static struct rs_zcopy_mr *rs_get_zcopy_mr(struct rsocket *rs,
+					   const void *buf, size_t len)
+{
+	long pagesize = sysconf(_SC_PAGESIZE);
+	struct rs_zcopy_mr *zmr;
+	dlist_entry *cur;
+	uintptr_t start, end;
+
+	start = (uintptr_t) buf & ~(pagesize - 1);
+	end = ((uintptr_t) buf + len + pagesize - 1) & ~(pagesize - 1);
+
+	pthread_mutex_lock(&zcopy_mr_lock);
+	for (cur = zcopy_mr_list.next; cur != &zcopy_mr_list; cur = cur->next) {
+		zmr = container_of(cur, struct rs_zcopy_mr, entry);
+		if (zmr->pd == rs->cm_id->pd && zmr->start <= start &&
+		    zmr->end >= end) {
+			zmr->refcnt++;
+			dlist_remove(&zmr->entry);
+			dlist_insert_head(&zmr->entry, &zcopy_mr_list);
+			pthread_mutex_unlock(&zcopy_mr_lock);
+			return zmr;
 		}
 	}
+	pthread_mutex_unlock(&zcopy_mr_lock);
 
-	fastlock_acquire(&rs->slock);
-	if (rs->iomap_pending) {
-		ret = rs_send_iomaps(rs, flags);
-		if (ret)
-			goto out;
+	zmr = calloc(1, sizeof(*zmr));
+	if (!zmr)
+		return NULL;
+
+	/* Only local read access is needed to source an RDMA write */
+	zmr->mr = ibv_reg_mr(rs->cm_id->pd, (void *) start, end - start, 0);
+	if (!zmr->mr) {
+		free(zmr);
+		return NULL;
 	}
-	for (; left; left -= xfer_size, buf += xfer_size) {
-		if (!rs_can_send(rs)) {
-			ret = rs_get_comp(rs, rs_nonblocking(rs, flags),
-					  rs_conn_can_send);
-			if (ret)
-				break;
-			if (!(rs->state & rs_writable)) {
-				ret = ERR(ECONNRESET);
-				break;
-			}
-		}
+	zmr->pd = rs->cm_id->pd;
+	zmr->start = start;
+	zmr->end = end;
+	zmr->refcnt = 1;
 
-		if (olen < left) {
-			xfer_size = olen;
-			if (olen < RS_MAX_TRANSFER)
-				olen <<= 1;
-		} else {
-			xfer_size = left;
+	if (zcopy_mr_cache_size > 0) {
+		pthread_mutex_lock(&zcopy_mr_lock);
+		zmr->cached = 1;
+		dlist_insert_head(&zmr->entry, &zcopy_mr_list);
+		zcopy_mr_cnt++;
+		rs_zcopy_evict();
+		pthread_mutex_unlock(&zcopy_mr_lock);
+	}
+	return zmr;
+}
+
+static void rs_put_zcopy_mr(struct rs_zcopy_mr *zmr)
+{
+	pthread_mutex_lock(&zcopy_mr_lock);
+	zmr->refcnt--;
+	if (zmr->cached) {
+		rs_zcopy_evict();
+		zmr = NULL;
+	}
+	pthread_mutex_unlock(&zcopy_mr_lock);
+
+	if (zmr) {
+		ibv_dereg_mr(zmr->mr);
+		free(zmr);
+	}
+}
+
+/* Wait until every RS_OP_DATA write up to seqno has completed */
+static int rs_zcopy_wait_seqno(struct rsocket *rs, unsigned int seqno)
+{
+	rs->zcopy_seqno = seqno;
+	if (rs_get_comp(rs, 0, rs_zcopy_done) ||
+	    (((int) (rs->sdata_comp - rs->zcopy_seqno)) < 0))
+		return -1;
+	return 0;
+}
+
+/* Wait until every RS_OP_DATA write sourced from the user's buffer is done */
+static int rs_zcopy_wait(struct rsocket *rs)
+{
+	return rs_zcopy_wait_seqno(rs, rs->sdata_seqno);
+}
+
+static void rs_put_zcopy_iov(struct rs_zcopy_mr **zmr, int iovcnt)
+{
+	int i;
+
+	for (i = 0; i < iovcnt; i++) {
+		if (zmr[i])
+			rs_put_zcopy_mr(zmr[i]);
+	}
+}
+
+static int rs_get_zcopy_iov(struct rsocket *rs, const struct iovec *iov,
+			    int iovcnt, struct rs_zcopy_mr **zmr)
+{
+	int i;
+
+	for (i = 0; i < iovcnt; i++) {
+		zmr[i] = NULL;
+		if (!iov[i].iov_len)
+			continue;
+
+		zmr[i] = rs_get_zcopy_mr(rs, iov[i].iov_base, iov[i].iov_len);
+		if (!zmr[i]) {
+			rs_put_zcopy_iov(zmr, i);
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/*
+ * Builds an SGL referencing the next len bytes of the user's iovecs.  len
+ * is reduced if the iovecs need more SGEs than the QP supports.
+ */
+static int rs_zcopy_sgl(struct rsocket *rs, struct ibv_sge *sgl,
+			const struct iovec *iov, struct rs_zcopy_mr **zmr,
+			int *iov_index, size_t *offset, uint32_t *len)
+{
+	uint32_t left = *len;
+	size_t size;
+	int nsge = 0;
+
+	while (left && nsge < rs->sq_sge) {
+		size = min(iov[*iov_index].iov_len - *offset, (size_t) left);
+		if (size) {
+			sgl[nsge].addr = (uintptr_t) iov[*iov_index].iov_base +
+					 *offset;
+			sgl[nsge].length = (uint32_t) size;
+			sgl[nsge].lkey = zmr[*iov_index]->mr->lkey;
+			nsge++;
+			left -= size;
+			*offset += size;
+		}
+		if (*offset == iov[*iov_index].iov_len) {
+			(*iov_index)++;
+			*offset = 0;
+		}
+	}
+
+	*len -= left;
+	return nsge;
+}
+
+/* A send had to wait for space in sbuf while the remote side had room */
+static void rs_sbuf_stalled(struct rsocket *rs)
+{
+	uint64_t now;
+
+	if (!(rs->opts & RS_OPT_SBUF_AUTO) ||
+	    rs->sbuf_bytes_avail >= RS_SNDLOWAT ||
+	    !rs->target_sgl[rs->target_sge].length)
+		return;
+
+	now = rs_time_us();
+	if (now - rs->sbuf_tune_time > RS_TUNE_IDLE_US)
+		rs->sbuf_stalls = 0;
+	rs->sbuf_stalls++;
+	rs->sbuf_tune_time = now;
+}
+
+/* Called when a send cannot proceed, to record what it is waiting for */
+static void rs_send_stalled(struct rsocket *rs)
+{
+	const char __attribute__((unused)) *reason;
+
+	if (rs->sseq_no == rs->sseq_comp ||
+	    !rs->target_sgl[rs->target_sge].length) {
+		rs->stats.credit_stalls++;
+		reason = "credits";
+	} else if (rs->sbuf_bytes_avail < RS_SNDLOWAT) {
+		rs->stats.sbuf_stalls++;
+		reason = "sbuf";
+	} else {
+		rs->stats.sq_stalls++;
+		reason = "sq";
+	}
+	rdma_tracepoint(rdma_core_rsocket, send_stall, rs->index, reason);
+	rs_sbuf_stalled(rs);
+}
+
+/*
+ * Called with the slock held at the start of a send.  sbuf, including the
+ * control message area at its tail, can only be replaced once every send
+ * from it has completed.  Blocking sends wait for that point when growing
+ * the buffer, nonblocking sends retry on a later call.
+ */
+static void rs_tune_sbuf(struct rsocket *rs, int nonblock)
+{
+	struct ibv_mr *mr, *old_mr;
+	uint8_t *buf, *old_buf;
+	uint32_t size, total;
+	uint64_t now = 0;
+
+	if (rs->sbuf_stalls >= RS_TUNE_STALLS && rs->sbuf_size < mem_max) {
+		if (!rs_conn_all_sends_done(rs) &&
+		    (nonblock || rs_get_comp(rs, 0, rs_conn_all_sends_done)))
+			return;
+		size = min(rs->sbuf_size << 1, mem_max);
+	} else if (rs->sbuf_size > rs->sbuf_min && rs_conn_all_sends_done(rs)) {
+		now = rs_time_us();
+		if (now - rs->sbuf_tune_time < RS_TUNE_IDLE_US)
+			return;
+		size = max(rs->sbuf_size >> 1, rs->sbuf_min);
+	} else {
+		return;
+	}
+
+	rs->sbuf_stalls = 0;
+	if (!(rs->state & rs_connected) ||
+	    !rs_mem_charge(size, size < rs->sbuf_size))
+		return;
+
+	total = size;
+	if (rs->sq_inline < RS_MAX_CTRL_MSG)
+		total += RS_MAX_CTRL_MSG * RS_QP_CTRL_SIZE;
+	buf = forksafe_alloc(total);
+	if (!buf)
+		goto err1;
+
+	mr = rdma_reg_msgs(rs->cm_id, buf, total);
+	if (!mr)
+		goto err2;
+
+	/* credit updates may have been posted from sbuf since we checked */
+	fastlock_acquire(&rs->cq_lock);
+	if (!rs_conn_all_sends_done(rs) || !(rs->state & rs_connected)) {
+		fastlock_release(&rs->cq_lock);
+		rdma_dereg_mr(mr);
+		goto err2;
+	}
+
+	old_buf = rs->sbuf;
+	old_mr = rs->smr;
+	atomic_fetch_sub(&mem_used, rs->sbuf_size);
+	rs->sbuf = buf;
+	rs->smr = mr;
+	rs->sbuf_size = size;
+	rs->ssgl[0].addr = rs->ssgl[1].addr = (uintptr_t) rs->sbuf;
+	rs->ssgl[0].lkey = rs->ssgl[1].lkey = rs->smr->lkey;
+	rs->sbuf_bytes_avail = size;
+	fastlock_release(&rs->cq_lock);
+
+	rdma_dereg_mr(old_mr);
+	free(old_buf);
+	if (now)
+		rs->sbuf_tune_time = now;
+	return;
+err2:
+	free(buf);
+err1:
+	atomic_fetch_sub(&mem_used, size);
+}
+
+/*
+ * We overlap sending the data, by posting a small work request immediately,
+ * then increasing the size of the send on each iteration.
+ *
+ * Blocking sends of at least zcopy_threshold bytes are written directly
+ * from the user's buffer instead.  The call then returns once all writes
+ * sourced from the buffer have completed.
+ */
+ssize_t rsend(int socket, const void *buf, size_t len, int flags)
+{
+	struct rsocket *rs;
+	struct rs_zcopy_mr *zmr = NULL;
+	struct ibv_sge sge;
+	size_t left = len;
+	uint32_t xfer_size, olen = RS_OLAP_START_SIZE;
+	int ret = 0;
+
+	rs = idm_at(&idm, socket);
+	if (!rs)
+		return ERR(EBADF);
+	if (rs->type == SOCK_DGRAM) {
+		fastlock_acquire(&rs->slock);
+		ret = dsend(rs, buf, len, flags);
+		fastlock_release(&rs->slock);
+		return ret;
+	}
+
+	if (rs->state & rs_opening) {
+		ret = rs_do_connect(rs);
+		if (ret) {
+			if (errno == EINPROGRESS)
+				errno = EAGAIN;
+			return ret;
+		}
+	}
+
+	fastlock_acquire(&rs->slock);
+	if (rs->iomap_pending) {
+		ret = rs_send_iomaps(rs, flags);
+		if (ret)
+			goto out;
+	}
+	if (rs->opts & RS_OPT_SBUF_AUTO)
+		rs_tune_sbuf(rs, rs_nonblocking(rs, flags));
+	if (rs->zcopy_threshold && len >= rs->zcopy_threshold &&
+	    !rs_nonblocking(rs, flags)) {
+		zmr = rs_get_zcopy_mr(rs, buf, len);
+		if (zmr)
+			olen = RS_MAX_TRANSFER;
+	}
+	for (; left; left -= xfer_size, buf += xfer_size) {
+		if (!rs_can_send(rs)) {
+			rs_send_stalled(rs);
+			ret = rs_get_comp(rs, rs_nonblocking(rs, flags),
+					  rs_conn_can_send);
+			if (ret)
+				break;
+			if (!(rs->state & rs_writable)) {
+				ret = ERR(ECONNRESET);
+				break;
+			}
+		}
+
+		if (olen < left) {
+			xfer_size = olen;
+			if (olen < RS_MAX_TRANSFER)
+				olen <<= 1;
+		} else {
+			xfer_size = left;
 		}
 
 		if (xfer_size > rs->sbuf_bytes_avail)
@@ -2847,7 +4192,12 @@ ssize_t rsend(int socket, const void *buf, size_t len, int flags)
 		if (xfer_size > rs->target_sgl[rs->target_sge].length)
 			xfer_size = rs->target_sgl[rs->target_sge].length;
 
-		if (xfer_size <= rs->sq_inline) {
+		if (zmr) {
+			sge.addr = (uintptr_t) buf;
+			sge.length = xfer_size;
+			sge.lkey = zmr->mr->lkey;
+			ret = rs_write_data(rs, &sge, 1, xfer_size, 0);
+		} else if (xfer_size <= rs->sq_inline) {
 			sge.addr = (uintptr_t) buf;
 			sge.length = xfer_size;
 			sge.lkey = 0;
@@ -2872,6 +4222,16 @@ ssize_t rsend(int socket, const void *buf, size_t len, int flags)
 		if (ret)
 			break;
 	}
+
+	if (zmr) {
+		/* the buffer belongs to the hardware until the writes complete */
+		if (rs_zcopy_wait(rs)) {
+			if (!ret)
+				ret = ERR(ECONNRESET);
+			left = len;
+		}
+		rs_put_zcopy_mr(zmr);
+	}
 out:
 	fastlock_release(&rs->slock);
 
@@ -2937,9 +4297,11 @@ static ssize_t rsendv(int socket, const struct iovec *iov, int iovcnt, int flags
 {
 	struct rsocket *rs;
 	const struct iovec *cur_iov;
+	struct rs_zcopy_mr *zmr[RS_MAX_ZCOPY_IOV];
+	struct ibv_sge sgl[RS_MAX_SEND_SGE];
 	size_t left, len, offset = 0;
 	uint32_t xfer_size, olen = RS_OLAP_START_SIZE;
-	int i, ret = 0;
+	int i, nsge, zcopy = 0, ret = 0;
 
 	rs = idm_at(&idm, socket);
 	if (!rs)
@@ -2965,8 +4327,18 @@ static ssize_t rsendv(int socket, const struct iovec *iov, int iovcnt, int flags
 		if (ret)
 			goto out;
 	}
+	if (rs->opts & RS_OPT_SBUF_AUTO)
+		rs_tune_sbuf(rs, rs_nonblocking(rs, flags));
+	if (rs->zcopy_threshold && len >= rs->zcopy_threshold &&
+	    iovcnt <= RS_MAX_ZCOPY_IOV && !rs_nonblocking(rs, flags)) {
+		zcopy = rs_get_zcopy_iov(rs, iov, iovcnt, zmr);
+		if (zcopy)
+			olen = RS_MAX_TRANSFER;
+	}
+	i = 0;
 	for (; left; left -= xfer_size) {
 		if (!rs_can_send(rs)) {
+			rs_send_stalled(rs);
 			ret = rs_get_comp(rs, rs_nonblocking(rs, flags),
 					  rs_conn_can_send);
 			if (ret)
@@ -2990,7 +4362,11 @@ static ssize_t rsendv(int socket, const struct iovec *iov, int iovcnt, int flags
 		if (xfer_size > rs->target_sgl[rs->target_sge].length)
 			xfer_size = rs->target_sgl[rs->target_sge].length;
 
-		if (xfer_size <= rs_sbuf_left(rs)) {
+		if (zcopy) {
+			nsge = rs_zcopy_sgl(rs, sgl, iov, zmr, &i, &offset,
+					    &xfer_size);
+			ret = rs_write_data(rs, sgl, nsge, xfer_size, 0);
+		} else if (xfer_size <= rs_sbuf_left(rs)) {
 			rs_copy_iov((void *) (uintptr_t) rs->ssgl[0].addr,
 				    &cur_iov, &offset, xfer_size);
 			rs->ssgl[0].length = xfer_size;
@@ -3013,6 +4389,15 @@ static ssize_t rsendv(int socket, const struct iovec *iov, int iovcnt, int flags
 		if (ret)
 			break;
 	}
+
+	if (zcopy) {
+		if (rs_zcopy_wait(rs)) {
+			if (!ret)
+				ret = ERR(ECONNRESET);
+			left = len;
+		}
+		rs_put_zcopy_iov(zmr, iovcnt);
+	}
 out:
 	fastlock_release(&rs->slock);
 
@@ -3027,91 +4412,504 @@ ssize_t rsendmsg(int socket, const struct msghdr *msg, int flags)
 	return rsendv(socket, msg->msg_iov, (int) msg->msg_iovlen, flags);
 }
 
-ssize_t rwrite(int socket, const void *buf, size_t count)
-{
-	return rsend(socket, buf, count, 0);
-}
-
-ssize_t rwritev(int socket, const struct iovec *iov, int iovcnt)
-{
-	return rsendv(socket, iov, iovcnt, 0);
-}
+/*
+ * Datagram sends queued by rsendmmsg are posted to the QP as a single
+ * chain, so that the device is notified once per batch.
+ */
+struct ds_send_batch {
+	struct ds_qp	   *qp;
+	struct ibv_send_wr wr[RS_DS_BATCH];
+	struct ibv_sge	   sge[RS_DS_BATCH];
+	unsigned int	   first;	/* msgvec index of wr[0] */
+	int		   cnt;
+	int		   err;
+};
 
-/* When mapping rpoll to poll, the events reported on the RDMA
- * fd are independent from the events rpoll may be looking for.
- * To avoid threads hanging in poll, whenever any event occurs,
- * we need to wakeup all threads in poll, so that they can check
- * if there has been a change on the rsockets they are monitoring.
- * To support this, we 'gate' threads entering and leaving rpoll.
+/*
+ * On failure, the buffers of the sends that were not posted are released,
+ * and first is set to the index of the first message that was not sent.
  */
-static int rs_pollinit(void)
+static int ds_post_send_batch(struct rsocket *rs, struct ds_send_batch *batch)
 {
-	int ret = 0;
+	struct ibv_send_wr *bad;
+	struct ds_smsg *smsg;
+	int i, ret;
 
-	pthread_mutex_lock(&mut);
-	if (pollsignal >= 0)
-		goto unlock;
+	if (!batch->cnt)
+		return 0;
 
-	pollsignal = eventfd(0, EFD_NONBLOCK | EFD_SEMAPHORE);
-	if (pollsignal < 0)
-		ret = -errno;
+	batch->wr[batch->cnt - 1].next = NULL;
+	ret = ibv_post_send(batch->qp->cm_id->qp, batch->wr, &bad);
+	if (ret) {
+		for (i = bad - batch->wr; i < batch->cnt; i++) {
+			smsg = (struct ds_smsg *) (rs->sbuf +
+				rs_wr_data(batch->wr[i].wr_id));
+			smsg->next = rs->smsg_free;
+			rs->smsg_free = smsg;
+			rs->sqe_avail++;
+		}
+		batch->first += bad - batch->wr;
+		batch->err = 1;
+		ret = ERR(ret);
+	}
 
-unlock:
-	pthread_mutex_unlock(&mut);
+	batch->cnt = 0;
 	return ret;
 }
 
-/* When an event occurs, we must wait until the state of all rsockets
- * has settled.  Then we need to re-check the rsocket state prior to
- * blocking on poll().
- */
-static int rs_poll_enter(void)
+static ssize_t ds_add_send_batch(struct rsocket *rs, struct ds_send_batch *batch,
+				 const struct msghdr *msg, unsigned int index,
+				 int flags)
 {
-	pthread_mutex_lock(&mut);
-	if (suspendpoll) {
-		pthread_mutex_unlock(&mut);
-		sched_yield();
-		return -EBUSY;
+	const struct iovec *iov = msg->msg_iov;
+	struct ibv_send_wr *wr;
+	struct ds_smsg *smsg;
+	struct ds_qp *qp = rs->conn_dest->qp;
+	size_t len, offset = 0;
+	uint64_t wr_data;
+	int i, ret;
+
+	for (len = 0, i = 0; i < msg->msg_iovlen; i++)
+		len += iov[i].iov_len;
+	if (len + qp->hdr.length > RS_SNDLOWAT)
+		return ERR(EMSGSIZE);
+
+	if (batch->cnt && (batch->qp != qp || batch->cnt == RS_DS_BATCH)) {
+		ret = ds_post_send_batch(rs, batch);
+		if (ret)
+			return ret;
 	}
 
-	pollcnt++;
-	pthread_mutex_unlock(&mut);
-	return 0;
+	if (!ds_can_send(rs)) {
+		ret = ds_post_send_batch(rs, batch);
+		if (ret)
+			return ret;
+
+		ret = ds_get_comp(rs, rs_nonblocking(rs, flags), ds_can_send);
+		if (ret)
+			return ret;
+	}
+
+	smsg = rs->smsg_free;
+	rs->smsg_free = smsg->next;
+	rs->sqe_avail--;
+
+	memcpy((void *) smsg, &qp->hdr, qp->hdr.length);
+	rs_copy_iov((void *) smsg + qp->hdr.length, &iov, &offset, len);
+	wr_data = (uint8_t *) smsg - rs->sbuf;
+
+	if (!batch->cnt) {
+		batch->qp = qp;
+		batch->first = index;
+	}
+	batch->sge[batch->cnt].addr = (uintptr_t) smsg;
+	batch->sge[batch->cnt].length = qp->hdr.length + len;
+	batch->sge[batch->cnt].lkey = qp->smr->lkey;
+
+	wr = &batch->wr[batch->cnt];
+	wr->wr_id = rs_send_wr_id(wr_data);
+	wr->next = wr + 1;
+	wr->sg_list = &batch->sge[batch->cnt];
+	wr->num_sge = 1;
+	wr->opcode = IBV_WR_SEND;
+	wr->send_flags = (wr->sg_list->length <= rs->sq_inline) ?
+			 IBV_SEND_INLINE : 0;
+	wr->wr.ud.ah = rs->conn_dest->ah;
+	wr->wr.ud.remote_qpn = rs->conn_dest->qpn;
+	wr->wr.ud.remote_qkey = RDMA_UDP_QKEY;
+	batch->cnt++;
+	return len;
 }
 
-static void rs_poll_exit(void)
+/*
+ * Datagrams are sent under a single acquisition of slock, and sends to
+ * the same destination QP are posted together.  Messages to destinations
+ * that are still being resolved are sent over UDP, one at a time.
+ */
+static int ds_sendmmsg(struct rsocket *rs, struct mmsghdr *msgvec,
+		       unsigned int vlen, int flags)
 {
-	uint64_t c;
-	int save_errno;
-	ssize_t ret;
+	struct ds_send_batch batch;
+	struct msghdr *msg;
+	unsigned int i;
+	ssize_t ret = 0;
 
-	pthread_mutex_lock(&mut);
-	if (!--pollcnt) {
-		/* Keep errno value from poll() call.  We try to clear
-		 * a single signal.  But there's no guarantee that we'll
-		 * find one.  Additional signals indicate that a change
-		 * occurred on an rsocket, which requires all threads to
-		 * re-check before blocking on poll.
-		 */
-		save_errno = errno;
-		ret = read(pollsignal, &c, sizeof(c));
-		if (ret != sizeof(c))
-			errno = save_errno;
-		suspendpoll = 0;
+	if (rs->state == rs_init) {
+		ret = ds_init_ep(rs);
+		if (ret)
+			return ret;
 	}
-	pthread_mutex_unlock(&mut);
-}
 
-/* When an event occurs, it's possible for a single thread blocked in
- * poll to return from the kernel, read the event, and update the state
- * of an rsocket.  However, that can leave threads blocked in the kernel
- * on poll (trying to read the CQ fd), which have had their rsocket
- * state set.  To avoid those threads remaining blocked in the kernel,
- * we must wake them up and ensure that they all return to user space,
- * in order to re-check the state of their rsockets.
- *
- * Because poll is racy wrt updating the rsocket states, we need to
- * signal state checks whenever a thread updates the state of a
+	batch.cnt = 0;
+	batch.err = 0;
+	fastlock_acquire(&rs->slock);
+	for (i = 0; i < vlen; i++) {
+		msg = &msgvec[i].msg_hdr;
+		if (msg->msg_control && msg->msg_controllen) {
+			ret = ERR(ENOTSUP);
+			break;
+		}
+
+		if (msg->msg_name) {
+			if (!rs->conn_dest ||
+			    ds_compare_addr(msg->msg_name, &rs->conn_dest->addr)) {
+				ret = ds_get_dest(rs, msg->msg_name,
+						  msg->msg_namelen, &rs->conn_dest);
+				if (ret)
+					break;
+			}
+		} else if (!rs->conn_dest) {
+			ret = ERR(EDESTADDRREQ);
+			break;
+		}
+
+		if (rs->conn_dest->ah) {
+			ret = ds_add_send_batch(rs, &batch, msg, i, flags);
+		} else {
+			ret = ds_post_send_batch(rs, &batch);
+			if (!ret)
+				ret = ds_sendv_udp(rs, msg->msg_iov,
+						   msg->msg_iovlen, flags,
+						   RS_OP_DATA);
+		}
+		if (ret < 0)
+			break;
+
+		msgvec[i].msg_len = (unsigned int) ret;
+	}
+
+	if (ds_post_send_batch(rs, &batch) || batch.err) {
+		i = batch.first;
+		ret = -1;
+	}
+	fastlock_release(&rs->slock);
+
+	return i ? i : ret;
+}
+
+int rsendmmsg(int socket, struct mmsghdr *msgvec, unsigned int vlen, int flags)
+{
+	struct rsocket *rs;
+	unsigned int i;
+	ssize_t ret = 0;
+
+	rs = idm_at(&idm, socket);
+	if (!rs)
+		return ERR(EBADF);
+	if (rs->type == SOCK_DGRAM)
+		return ds_sendmmsg(rs, msgvec, vlen, flags);
+
+	for (i = 0; i < vlen; i++) {
+		ret = rsendmsg(socket, &msgvec[i].msg_hdr, flags);
+		if (ret < 0)
+			break;
+		msgvec[i].msg_len = (unsigned int) ret;
+	}
+
+	return i ? i : ret;
+}
+
+ssize_t rwrite(int socket, const void *buf, size_t count)
+{
+	return rsend(socket, buf, count, 0);
+}
+
+ssize_t rwritev(int socket, const struct iovec *iov, int iovcnt)
+{
+	return rsendv(socket, iov, iovcnt, 0);
+}
+
+/*
+ * rsendfile maps the file RS_SENDFILE_CHUNK bytes at a time.  On a
+ * blocking rsocket each chunk is registered and written directly from the
+ * page cache, and up to RS_SENDFILE_WINDOW chunks stay mapped while their
+ * writes are outstanding, so that setting up the next chunk overlaps the
+ * transfer of the previous ones.  Chunks that are too small to be worth
+ * registering, or that cannot be registered, are copied through sbuf.
+ */
+struct rs_sendfile_chunk {
+	void		  *addr;
+	size_t		  map_len;
+	struct ibv_mr	  *mr;
+	size_t		  len;
+	unsigned int	  seqno;
+};
+
+/* Writes a registered chunk, returning the write's seqno once posted */
+static ssize_t rs_send_chunk(struct rsocket *rs, const void *buf, size_t len,
+			     struct ibv_mr *mr, unsigned int *seqno)
+{
+	struct ibv_sge sge;
+	size_t left = len;
+	uint32_t xfer_size;
+	int ret = 0;
+
+	fastlock_acquire(&rs->slock);
+	if (rs->iomap_pending) {
+		ret = rs_send_iomaps(rs, 0);
+		if (ret)
+			goto out;
+	}
+	for (; left; left -= xfer_size, buf += xfer_size) {
+		if (!rs_can_send(rs)) {
+			rs_send_stalled(rs);
+			ret = rs_get_comp(rs, 0, rs_conn_can_send);
+			if (ret)
+				break;
+			if (!(rs->state & rs_writable)) {
+				ret = ERR(ECONNRESET);
+				break;
+			}
+		}
+
+		xfer_size = min_t(size_t, left, RS_MAX_TRANSFER);
+		if (xfer_size > rs->sbuf_bytes_avail)
+			xfer_size = rs->sbuf_bytes_avail;
+		if (xfer_size > rs->target_sgl[rs->target_sge].length)
+			xfer_size = rs->target_sgl[rs->target_sge].length;
+
+		sge.addr = (uintptr_t) buf;
+		sge.length = xfer_size;
+		sge.lkey = mr->lkey;
+		ret = rs_write_data(rs, &sge, 1, xfer_size, 0);
+		if (ret)
+			break;
+	}
+	*seqno = rs->sdata_seqno;
+out:
+	fastlock_release(&rs->slock);
+	return (ret && left == len) ? ret : len - left;
+}
+
+/* Returns 0 once the chunk's writes have completed and it is unmapped */
+static int rs_put_chunk(struct rsocket *rs, struct rs_sendfile_chunk *chunk)
+{
+	int ret = 0;
+
+	if (chunk->mr) {
+		fastlock_acquire(&rs->slock);
+		ret = rs_zcopy_wait_seqno(rs, chunk->seqno);
+		fastlock_release(&rs->slock);
+		ibv_dereg_mr(chunk->mr);
+		chunk->mr = NULL;
+	}
+	munmap(chunk->addr, chunk->map_len);
+	chunk->addr = NULL;
+	return ret;
+}
+
+/*
+ * Puts the registered chunks in the order they were sent, starting with
+ * the chunk at first.  Chunks are added to sent only up to the first one
+ * that failed, so that the bytes reported stay contiguous.
+ */
+static int rs_put_chunks(struct rsocket *rs, struct rs_sendfile_chunk *chunk,
+			 int first, size_t *sent)
+{
+	int i, n, ret = 0;
+
+	for (n = 0; n < RS_SENDFILE_WINDOW; n++) {
+		i = (first + n) % RS_SENDFILE_WINDOW;
+		if (!chunk[i].mr)
+			continue;
+		if (rs_put_chunk(rs, &chunk[i]))
+			ret = ERR(ECONNRESET);
+		else if (sent && !ret)
+			*sent += chunk[i].len;
+	}
+	return ret;
+}
+
+ssize_t rsendfile(int socket, int in_fd, off_t *offset, size_t count)
+{
+	struct rs_sendfile_chunk chunk[RS_SENDFILE_WINDOW] = {};
+	struct rs_sendfile_chunk *cur;
+	long pagesize = sysconf(_SC_PAGESIZE);
+	struct rsocket *rs;
+	struct stat st;
+	off_t start, off, map_off;
+	size_t sent = 0, len;
+	ssize_t ret = 0;
+	int i, last = 0, zcopy, put_err = 0;
+
+	rs = idm_at(&idm, socket);
+	if (!rs)
+		return ERR(EBADF);
+	if (rs->type != SOCK_STREAM)
+		return ERR(EINVAL);
+
+	if (rs->state & rs_opening) {
+		ret = rs_do_connect(rs);
+		if (ret) {
+			if (errno == EINPROGRESS)
+				errno = EAGAIN;
+			return ret;
+		}
+	}
+
+	if (offset && *offset < 0)
+		return ERR(EINVAL);
+	start = offset ? *offset : lseek(in_fd, 0, SEEK_CUR);
+	if (start < 0)
+		return -1;
+	if (fstat(in_fd, &st))
+		return -1;
+	if (!S_ISREG(st.st_mode))
+		return ERR(EINVAL);
+
+	/* pages past the end of the file cannot be mapped */
+	if (start >= st.st_size)
+		return 0;
+	if (count > (uint64_t) (st.st_size - start))
+		count = st.st_size - start;
+
+	zcopy = !rs_nonblocking(rs, 0);
+	posix_fadvise(in_fd, start, count, POSIX_FADV_SEQUENTIAL);
+
+	for (off = start, i = 0; off < start + (off_t) count;
+	     off += len, i = (i + 1) % RS_SENDFILE_WINDOW) {
+		cur = &chunk[i];
+		if (cur->addr) {
+			if (rs_put_chunk(rs, cur)) {
+				ret = ERR(ECONNRESET);
+				put_err = 1;
+				break;
+			}
+			sent += cur->len;
+		}
+		last = i;
+
+		map_off = off & ~((off_t) pagesize - 1);
+		len = min_t(size_t, start + count - off,
+			    RS_SENDFILE_CHUNK - (off - map_off));
+		cur->map_len = off - map_off + len;
+		cur->addr = mmap(NULL, cur->map_len, PROT_READ, MAP_SHARED,
+				 in_fd, map_off);
+		if (cur->addr == MAP_FAILED) {
+			cur->addr = NULL;
+			ret = -1;
+			break;
+		}
+
+		/* start reading the chunk that follows the window */
+		if (off + (off_t) len < start + (off_t) count)
+			posix_fadvise(in_fd, map_off + (off_t) RS_SENDFILE_CHUNK *
+				      RS_SENDFILE_WINDOW, RS_SENDFILE_CHUNK,
+				      POSIX_FADV_WILLNEED);
+
+		if (zcopy && len >= RS_SENDFILE_ZCOPY_MIN)
+			cur->mr = ibv_reg_mr(rs->cm_id->pd, cur->addr,
+					     cur->map_len, 0);
+		if (cur->mr) {
+			ret = rs_send_chunk(rs, cur->addr + (off - map_off),
+					    len, cur->mr, &cur->seqno);
+			cur->len = ret > 0 ? ret : 0;
+		} else {
+			/* copied data must follow the zero copy writes in sent */
+			if (rs_put_chunks(rs, chunk, (i + 1) % RS_SENDFILE_WINDOW,
+					  &sent)) {
+				rs_put_chunk(rs, cur);
+				ret = ERR(ECONNRESET);
+				put_err = 1;
+				break;
+			}
+			ret = rsend(socket, cur->addr + (off - map_off), len, 0);
+			rs_put_chunk(rs, cur);
+			if (ret > 0)
+				sent += ret;
+		}
+		if (ret != (ssize_t) len)
+			break;
+	}
+
+	/* the file stays mapped until every write sourced from it is done */
+	if (rs_put_chunks(rs, chunk, (last + 1) % RS_SENDFILE_WINDOW,
+			  put_err ? NULL : &sent) && ret >= 0)
+		ret = ERR(ECONNRESET);
+
+	if (offset)
+		*offset = start + sent;
+	else if (sent)
+		lseek(in_fd, start + sent, SEEK_SET);
+
+	return (ret < 0 && !sent) ? ret : sent;
+}
+
+/* When mapping rpoll to poll, the events reported on the RDMA
+ * fd are independent from the events rpoll may be looking for.
+ * To avoid threads hanging in poll, whenever any event occurs,
+ * we need to wakeup all threads in poll, so that they can check
+ * if there has been a change on the rsockets they are monitoring.
+ * To support this, we 'gate' threads entering and leaving rpoll.
+ */
+static int rs_pollinit(void)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&mut);
+	if (pollsignal >= 0)
+		goto unlock;
+
+	pollsignal = eventfd(0, EFD_NONBLOCK | EFD_SEMAPHORE);
+	if (pollsignal < 0)
+		ret = -errno;
+
+unlock:
+	pthread_mutex_unlock(&mut);
+	return ret;
+}
+
+/* When an event occurs, we must wait until the state of all rsockets
+ * has settled.  Then we need to re-check the rsocket state prior to
+ * blocking on poll().
+ */
+static int rs_poll_enter(void)
+{
+	pthread_mutex_lock(&mut);
+	if (suspendpoll) {
+		pthread_mutex_unlock(&mut);
+		sched_yield();
+		return -EBUSY;
+	}
+
+	pollcnt++;
+	pthread_mutex_unlock(&mut);
+	return 0;
+}
+
+static void rs_poll_exit(void)
+{
+	uint64_t c;
+	int save_errno;
+	ssize_t ret;
+
+	pthread_mutex_lock(&mut);
+	if (!--pollcnt) {
+		/* Keep errno value from poll() call.  We try to clear
+		 * a single signal.  But there's no guarantee that we'll
+		 * find one.  Additional signals indicate that a change
+		 * occurred on an rsocket, which requires all threads to
+		 * re-check before blocking on poll.
+		 */
+		save_errno = errno;
+		ret = read(pollsignal, &c, sizeof(c));
+		if (ret != sizeof(c))
+			errno = save_errno;
+		suspendpoll = 0;
+	}
+	pthread_mutex_unlock(&mut);
+}
+
+/* When an event occurs, it's possible for a single thread blocked in
+ * poll to return from the kernel, read the event, and update the state
+ * of an rsocket.  However, that can leave threads blocked in the kernel
+ * on poll (trying to read the CQ fd), which have had their rsocket
+ * state set.  To avoid those threads remaining blocked in the kernel,
+ * we must wake them up and ensure that they all return to user space,
+ * in order to re-check the state of their rsockets.
+ *
+ * Because poll is racy wrt updating the rsocket states, we need to
+ * signal state checks whenever a thread updates the state of a
  * monitored rsocket, independent of whether that thread actually
  * reads an event from an fd.  In other words, we must wake up all
  * polling threads whenever poll() indicates that there is a new
@@ -3267,213 +5065,859 @@ static int rs_poll_check(struct pollfd *fds, nfds_t nfds)
 		else
 			poll(&fds[i], 1, 0);
 
-		if (fds[i].revents)
-			cnt++;
+		if (fds[i].revents)
+			cnt++;
+	}
+	return cnt;
+}
+
+static int rs_poll_arm(struct pollfd *rfds, struct pollfd *fds, nfds_t nfds)
+{
+	struct rsocket *rs;
+	int i;
+
+	for (i = 0; i < nfds; i++) {
+		rs = idm_lookup(&idm, fds[i].fd);
+		if (rs) {
+			fds[i].revents = rs_poll_rs(rs, fds[i].events, 0, rs_is_cq_armed);
+			if (fds[i].revents)
+				return 1;
+
+			if (rs->type == SOCK_STREAM) {
+				if (rs->state >= rs_connected)
+					rfds[i].fd = rs->cm_id->recv_cq_channel->fd;
+				else
+					rfds[i].fd = rs->cm_id->channel->fd;
+			} else {
+				rfds[i].fd = rs->epfd;
+			}
+			rfds[i].events = POLLIN;
+		} else {
+			rfds[i].fd = fds[i].fd;
+			rfds[i].events = fds[i].events;
+		}
+		rfds[i].revents = 0;
+	}
+	return 0;
+}
+
+static int rs_poll_events(struct pollfd *rfds, struct pollfd *fds, nfds_t nfds)
+{
+	struct rsocket *rs;
+	int i, cnt = 0;
+
+	for (i = 0; i < nfds; i++) {
+		rs = idm_lookup(&idm, fds[i].fd);
+		if (rs) {
+			if (rfds[i].revents) {
+				fastlock_acquire(&rs->cq_wait_lock);
+				if (rs->type == SOCK_STREAM)
+					rs_get_cq_event(rs);
+				else
+					ds_get_cq_event(rs);
+				fastlock_release(&rs->cq_wait_lock);
+			}
+			fds[i].revents = rs_poll_rs(rs, fds[i].events, 1, rs_poll_all);
+		} else {
+			fds[i].revents = rfds[i].revents;
+		}
+		if (fds[i].revents)
+			cnt++;
+	}
+	return cnt;
+}
+
+/*
+ * Spin for the longest budget of any polled rsocket, or for polling_time
+ * if there are none.  The spin never extends past the caller's timeout.
+ */
+static uint32_t rs_poll_fds_budget(struct pollfd *fds, nfds_t nfds, int timeout)
+{
+	struct rsocket *rs;
+	uint32_t budget = 0;
+	int i, found = 0;
+
+	for (i = 0; i < nfds; i++) {
+		rs = idm_lookup(&idm, fds[i].fd);
+		if (rs) {
+			budget = max(budget, rs_poll_budget(rs));
+			found = 1;
+		}
+	}
+
+	if (!found)
+		budget = polling_time;
+	if (timeout >= 0 && budget > (uint64_t) timeout * 1000)
+		budget = (uint32_t) timeout * 1000;
+	return budget;
+}
+
+static void rs_poll_fds_wakeup(struct pollfd *fds, nfds_t nfds,
+			       uint64_t start_time, int slept)
+{
+	struct rsocket *rs;
+	uint64_t wait_time;
+	int i;
+
+	wait_time = rs_time_us() - start_time;
+	for (i = 0; i < nfds; i++) {
+		if (!fds[i].revents)
+			continue;
+
+		rs = idm_lookup(&idm, fds[i].fd);
+		if (rs)
+			rs_poll_wakeup(rs, wait_time, slept);
+	}
+}
+
+/*
+ * We need to poll *all* fd's that the user specifies at least once.
+ * Note that we may receive events on an rsocket that may not be reported
+ * to the user (e.g. connection events or credit updates).  Process those
+ * events, then return to polling until we find ones of interest.
+ */
+int rpoll(struct pollfd *fds, nfds_t nfds, int timeout)
+{
+	struct pollfd *rfds;
+	uint64_t start_time = 0;
+	uint32_t poll_time, budget = 0;
+	int pollsleep, ret;
+
+	do {
+		ret = rs_poll_check(fds, nfds);
+		if (ret || !timeout) {
+			if (ret > 0 && start_time)
+				rs_poll_fds_wakeup(fds, nfds, start_time, 0);
+			return ret;
+		}
+
+		if (!start_time) {
+			start_time = rs_time_us();
+			budget = rs_poll_fds_budget(fds, nfds, timeout);
+		}
+
+		poll_time = (uint32_t) (rs_time_us() - start_time);
+	} while (budget && poll_time <= budget);
+
+	rfds = rs_fds_alloc(nfds);
+	if (!rfds)
+		return ERR(ENOMEM);
+
+	do {
+		ret = rs_poll_arm(rfds, fds, nfds);
+		if (ret)
+			break;
+
+		if (rs_poll_enter())
+			continue;
+
+		if (timeout >= 0) {
+			timeout -= (int) ((rs_time_us() - start_time) / 1000);
+			if (timeout <= 0)
+				return 0;
+			pollsleep = min(timeout, wake_up_interval);
+		} else {
+			pollsleep = wake_up_interval;
+		}
+
+		ret = poll(rfds, nfds + 1, pollsleep);
+		if (ret < 0) {
+			rs_poll_exit();
+			break;
+		}
+
+		ret = rs_poll_events(rfds, fds, nfds);
+		rs_poll_stop();
+	} while (!ret);
+
+	if (ret > 0)
+		rs_poll_fds_wakeup(fds, nfds, start_time, 1);
+	return ret;
+}
+
+static struct pollfd *
+rs_select_to_poll(int *nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds)
+{
+	struct pollfd *fds;
+	int fd, i = 0;
+
+	fds = calloc(*nfds, sizeof(*fds));
+	if (!fds)
+		return NULL;
+
+	for (fd = 0; fd < *nfds; fd++) {
+		if (readfds && FD_ISSET(fd, readfds)) {
+			fds[i].fd = fd;
+			fds[i].events = POLLIN;
+		}
+
+		if (writefds && FD_ISSET(fd, writefds)) {
+			fds[i].fd = fd;
+			fds[i].events |= POLLOUT;
+		}
+
+		if (exceptfds && FD_ISSET(fd, exceptfds))
+			fds[i].fd = fd;
+
+		if (fds[i].fd)
+			i++;
+	}
+
+	*nfds = i;
+	return fds;
+}
+
+static int
+rs_poll_to_select(int nfds, struct pollfd *fds, fd_set *readfds,
+		  fd_set *writefds, fd_set *exceptfds)
+{
+	int i, cnt = 0;
+
+	for (i = 0; i < nfds; i++) {
+		if (readfds && (fds[i].revents & (POLLIN | POLLHUP))) {
+			FD_SET(fds[i].fd, readfds);
+			cnt++;
+		}
+
+		if (writefds && (fds[i].revents & POLLOUT)) {
+			FD_SET(fds[i].fd, writefds);
+			cnt++;
+		}
+
+		if (exceptfds && (fds[i].revents & ~(POLLIN | POLLOUT))) {
+			FD_SET(fds[i].fd, exceptfds);
+			cnt++;
+		}
+	}
+	return cnt;
+}
+
+static int rs_convert_timeout(struct timeval *timeout)
+{
+	return !timeout ? -1 :
+		timeout->tv_sec * 1000 + timeout->tv_usec / 1000;
+}
+
+int rselect(int nfds, fd_set *readfds, fd_set *writefds,
+	    fd_set *exceptfds, struct timeval *timeout)
+{
+	struct pollfd *fds;
+	int ret;
+
+	fds = rs_select_to_poll(&nfds, readfds, writefds, exceptfds);
+	if (!fds)
+		return ERR(ENOMEM);
+
+	ret = rpoll(fds, nfds, rs_convert_timeout(timeout));
+
+	if (readfds)
+		FD_ZERO(readfds);
+	if (writefds)
+		FD_ZERO(writefds);
+	if (exceptfds)
+		FD_ZERO(exceptfds);
+
+	if (ret > 0)
+		ret = rs_poll_to_select(nfds, fds, readfds, writefds, exceptfds);
+
+	free(fds);
+	return ret;
+}
+
+/*
+ * repoll provides an epoll-like interface over rsockets.  Each repoll
+ * instance is backed by a kernel epoll fd.  Normal fd's are added to
+ * the kernel epoll set directly.  For rsockets, we add the fd that
+ * signals progress on the rsocket (CQ channel, CM channel, or accept
+ * queue) and keep the rsocket on a ready list after an event is seen.
+ * Only rsockets on the ready list are checked by repoll_wait, so the
+ * cost of a wait scales with the number of ready rsockets, rather than
+ * with the size of the interest set.
+ *
+ * Like the kernel, closing an rsocket removes it from every repoll set
+ * holding it.  Each rsocket keeps a list of its entries for this, which
+ * is protected by repoll_rs_lock.  Locks are taken in the order mut,
+ * repoll lock, rs_scq lock, repoll_rs_lock.
+ */
+struct repoll;
+
+struct repoll_entry {
+	dlist_entry	  entry;
+	dlist_entry	  ready_entry;
+	dlist_entry	  rs_entry;
+	struct repoll	  *rep;
+	int		  fd;
+	int		  rfd;
+	int		  rsocket;
+	int		  shared;
+	int		  ready;
+	uint32_t	  events;
+	epoll_data_t	  data;
+};
+
+struct repoll {
+	int		  epfd;
+	pthread_mutex_t	  lock;
+	struct index_map  entries;
+	dlist_entry	  rs_list;
+	dlist_entry	  ready_list;
+	int		  ready_cnt;
+};
+
+static struct index_map repoll_idm;
+static pthread_mutex_t repoll_rs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define REPOLL_EVENTS (EPOLLIN | EPOLLOUT | EPOLLERR | EPOLLHUP)
+
+int repoll_create1(int flags)
+{
+	struct repoll *rep;
+	struct epoll_event event;
+	int ret;
+
+	ret = rs_pollinit();
+	if (ret)
+		return ERR(-ret);
+
+	rep = calloc(1, sizeof(*rep));
+	if (!rep)
+		return ERR(ENOMEM);
+
+	rep->epfd = epoll_create1(flags);
+	if (rep->epfd < 0)
+		goto err1;
+
+	event.events = EPOLLIN;
+	event.data.fd = pollsignal;
+	if (epoll_ctl(rep->epfd, EPOLL_CTL_ADD, pollsignal, &event))
+		goto err2;
+
+	pthread_mutex_init(&rep->lock, NULL);
+	dlist_init(&rep->rs_list);
+	dlist_init(&rep->ready_list);
+
+	pthread_mutex_lock(&mut);
+	ret = idm_set(&repoll_idm, rep->epfd, rep);
+	pthread_mutex_unlock(&mut);
+	if (ret < 0)
+		goto err3;
+
+	return rep->epfd;
+
+err3:
+	pthread_mutex_destroy(&rep->lock);
+err2:
+	close(rep->epfd);
+err1:
+	free(rep);
+	return -1;
+}
+
+int repoll_create(int size)
+{
+	if (size <= 0)
+		return ERR(EINVAL);
+
+	return repoll_create1(0);
+}
+
+static void repoll_set_ready(struct repoll *rep, struct repoll_entry *entry)
+{
+	if (!entry->ready) {
+		dlist_insert_tail(&entry->ready_entry, &rep->ready_list);
+		rep->ready_cnt++;
+		entry->ready = 1;
+	}
+}
+
+static void repoll_clear_ready(struct repoll *rep, struct repoll_entry *entry)
+{
+	if (entry->ready) {
+		dlist_remove(&entry->ready_entry);
+		rep->ready_cnt--;
+		entry->ready = 0;
+	}
+}
+
+static void repoll_free_entry(struct repoll *rep, struct repoll_entry *entry)
+{
+	idm_clear(&rep->entries, entry->fd);
+	repoll_clear_ready(rep, entry);
+	dlist_remove(&entry->entry);
+	pthread_mutex_lock(&repoll_rs_lock);
+	dlist_remove(&entry->rs_entry);
+	pthread_mutex_unlock(&repoll_rs_lock);
+	free(entry);
+}
+
+/*
+ * Rsockets using a shared CQ share the same channel fd, which can only be
+ * added to the kernel epoll set once.  Events on it are reported against
+ * one of the rsockets, so if that rsocket is removed, hand the fd over
+ * to another rsocket using it.
+ */
+static void repoll_del_fd(struct repoll *rep, struct repoll_entry *entry)
+{
+	struct repoll_entry *other;
+	struct epoll_event event;
+	dlist_entry *cur;
+
+	if (entry->rfd < 0)
+		return;
+
+	epoll_ctl(rep->epfd, EPOLL_CTL_DEL, entry->rfd, NULL);
+	for (cur = rep->rs_list.next; entry->shared && cur != &rep->rs_list;
+	     cur = cur->next) {
+		other = container_of(cur, struct repoll_entry, entry);
+		if (other != entry && other->rfd == entry->rfd) {
+			event.events = EPOLLIN | EPOLLET;
+			event.data.fd = other->fd;
+			epoll_ctl(rep->epfd, EPOLL_CTL_ADD, other->rfd, &event);
+			break;
+		}
+	}
+	entry->rfd = -1;
+}
+
+/*
+ * An event on a shared channel only says that the shared CQ has work.
+ * Drain it, and mark ready just the rsockets of this set which received
+ * completions.  Threads waiting on other members of the CQ are woken to
+ * check their own rsockets, since this call consumed the channel event.
+ */
+static void repoll_scq_ready(struct repoll *rep, struct rs_scq *scq)
+{
+	struct repoll_entry *entry;
+	struct rsocket *rs;
+	dlist_entry *cur;
+	int others = 0, found;
+
+	/*
+	 * The event was consumed, so re-arm here in case no member of this
+	 * set gets checked, and catch completions that raced with the arm.
+	 */
+	fastlock_acquire(&scq->lock);
+	while (rs_scq_poll(scq) > 0)
+		;
+	ibv_req_notify_cq(scq->cq, 0);
+	while (rs_scq_poll(scq) > 0)
+		;
+
+	pthread_mutex_lock(&repoll_rs_lock);
+	while (!dlist_empty(&scq->pending)) {
+		rs = container_of(scq->pending.next, struct rsocket,
+				  scq_pending);
+		dlist_remove(&rs->scq_pending);
+		dlist_init(&rs->scq_pending);
+
+		found = 0;
+		for (cur = rs->repoll_list.next; cur != &rs->repoll_list;
+		     cur = cur->next) {
+			entry = container_of(cur, struct repoll_entry,
+					     rs_entry);
+			if (entry->rep == rep) {
+				repoll_set_ready(rep, entry);
+				found = 1;
+			}
+		}
+		others |= !found;
+	}
+	pthread_mutex_unlock(&repoll_rs_lock);
+	fastlock_release(&scq->lock);
+
+	if (others)
+		rs_scq_wakeup(scq);
+}
+
+/*
+ * Returns the fd that reports progress on an rsocket.  Rsockets that are
+ * still being set up may switch fd's as their state changes, so are not
+ * considered stable, and remain on the ready list.
+ */
+static int repoll_rs_fd(struct rsocket *rs, int *stable)
+{
+	*stable = 1;
+	if (rs->type == SOCK_DGRAM)
+		return rs->epfd;
+
+	if (rs->state == rs_listening)
+		return rs->accept_queue[0];
+
+	if (rs->state >= rs_connected && rs->cm_id->recv_cq_channel)
+		return rs->cm_id->recv_cq_channel->fd;
+
+	*stable = 0;
+	return rs->cm_id->channel ? rs->cm_id->channel->fd : -1;
+}
+
+static int repoll_update_fd(struct repoll *rep, struct repoll_entry *entry,
+			    struct rsocket *rs)
+{
+	struct epoll_event event;
+	int fd, stable;
+
+	fd = repoll_rs_fd(rs, &stable);
+	if (fd == entry->rfd)
+		return stable;
+
+	repoll_del_fd(rep, entry);
+
+	/* Level triggered events are tracked using the ready list */
+	entry->rfd = fd;
+	entry->shared = rs->type == SOCK_STREAM && rs->scq &&
+			fd == rs->scq->channel->fd;
+	if (fd >= 0) {
+		event.events = EPOLLIN | EPOLLET;
+		event.data.fd = entry->fd;
+		if (epoll_ctl(rep->epfd, EPOLL_CTL_ADD, fd, &event) &&
+		    !(entry->shared && errno == EEXIST)) {
+			entry->rfd = -1;
+			stable = 0;
+		}
+	}
+	return stable;
+}
+
+int repoll_ctl(int epfd, int op, int fd, struct epoll_event *event)
+{
+	struct repoll *rep;
+	struct repoll_entry *entry;
+	struct epoll_event kevent;
+	struct rsocket *rs;
+	int ret = 0;
+
+	rep = idm_lookup(&repoll_idm, epfd);
+	if (!rep)
+		return ERR(EBADF);
+
+	if (op != EPOLL_CTL_DEL && !event)
+		return ERR(EFAULT);
+
+	/* Kernel events are mapped back to our entries using the fd */
+	if (event) {
+		kevent.events = event->events;
+		kevent.data.fd = fd;
+	}
+
+	pthread_mutex_lock(&rep->lock);
+	entry = idm_lookup(&rep->entries, fd);
+	rs = idm_lookup(&idm, fd);
+
+	switch (op) {
+	case EPOLL_CTL_ADD:
+		if (entry) {
+			ret = ERR(EEXIST);
+			break;
+		}
+
+		entry = calloc(1, sizeof(*entry));
+		if (!entry) {
+			ret = ERR(ENOMEM);
+			break;
+		}
+
+		entry->fd = fd;
+		entry->rfd = -1;
+		entry->rep = rep;
+		entry->events = event->events;
+		entry->data = event->data;
+		dlist_init(&entry->rs_entry);
+		if (rs) {
+			entry->rsocket = 1;
+			ret = idm_set(&rep->entries, fd, entry);
+			if (ret < 0) {
+				free(entry);
+				break;
+			}
+			dlist_insert_tail(&entry->entry, &rep->rs_list);
+			pthread_mutex_lock(&repoll_rs_lock);
+			dlist_insert_tail(&entry->rs_entry, &rs->repoll_list);
+			pthread_mutex_unlock(&repoll_rs_lock);
+			repoll_update_fd(rep, entry, rs);
+			repoll_set_ready(rep, entry);
+			ret = 0;
+		} else {
+			dlist_init(&entry->entry);
+			ret = epoll_ctl(rep->epfd, op, fd, &kevent);
+			if (ret || idm_set(&rep->entries, fd, entry) < 0) {
+				if (!ret)
+					epoll_ctl(rep->epfd, EPOLL_CTL_DEL, fd, NULL);
+				free(entry);
+				ret = -1;
+			}
+		}
+		break;
+	case EPOLL_CTL_MOD:
+		if (!entry) {
+			ret = ERR(ENOENT);
+			break;
+		}
+
+		if (!entry->rsocket) {
+			ret = epoll_ctl(rep->epfd, op, fd, &kevent);
+			if (ret)
+				break;
+		}
+		entry->events = event->events;
+		entry->data = event->data;
+		if (entry->rsocket)
+			repoll_set_ready(rep, entry);
+		break;
+	case EPOLL_CTL_DEL:
+		if (!entry) {
+			ret = ERR(ENOENT);
+			break;
+		}
+
+		if (!entry->rsocket)
+			epoll_ctl(rep->epfd, op, fd, NULL);
+		else
+			repoll_del_fd(rep, entry);
+		repoll_free_entry(rep, entry);
+		break;
+	default:
+		ret = ERR(EINVAL);
+		break;
 	}
-	return cnt;
+	pthread_mutex_unlock(&rep->lock);
+	return ret;
 }
 
-static int rs_poll_arm(struct pollfd *rfds, struct pollfd *fds, nfds_t nfds)
+/*
+ * Check the rsockets on the ready list, reporting the ones with pending
+ * events.  Rsockets without events have their CQ armed and are removed
+ * from the list, until the kernel reports a new event.  Reported
+ * rsockets are moved to the end of the list, so that all ready rsockets
+ * are eventually reported when the caller's event array is small.
+ */
+static int repoll_check(struct repoll *rep, struct epoll_event *events,
+			int maxevents)
 {
+	struct repoll_entry *entry;
 	struct rsocket *rs;
-	int i;
+	int i, cnt, revents, stable, armed;
+
+	for (i = rep->ready_cnt, cnt = 0; i && cnt < maxevents; i--) {
+		entry = container_of(rep->ready_list.next, struct repoll_entry,
+				     ready_entry);
+		repoll_clear_ready(rep, entry);
+
+		rs = idm_lookup(&idm, entry->fd);
+		if (!rs) {
+			/* rsocket was closed, which removed the kernel fd */
+			if (entry->shared)
+				repoll_del_fd(rep, entry);
+			repoll_free_entry(rep, entry);
+			continue;
+		}
 
-	for (i = 0; i < nfds; i++) {
-		rs = idm_lookup(&idm, fds[i].fd);
-		if (rs) {
-			fds[i].revents = rs_poll_rs(rs, fds[i].events, 0, rs_is_cq_armed);
-			if (fds[i].revents)
-				return 1;
+		if (!(entry->events & REPOLL_EVENTS))
+			continue;
 
-			if (rs->type == SOCK_STREAM) {
-				if (rs->state >= rs_connected)
-					rfds[i].fd = rs->cm_id->recv_cq_channel->fd;
-				else
-					rfds[i].fd = rs->cm_id->channel->fd;
-			} else {
-				rfds[i].fd = rs->epfd;
-			}
-			rfds[i].events = POLLIN;
-		} else {
-			rfds[i].fd = fds[i].fd;
-			rfds[i].events = fds[i].events;
+		revents = rs_poll_rs(rs, entry->events & (EPOLLIN | EPOLLOUT),
+				     1, rs_poll_all);
+		stable = repoll_update_fd(rep, entry, rs);
+
+		armed = 0;
+		if (stable && (!revents ||
+		    (entry->events & (EPOLLET | EPOLLONESHOT)))) {
+			armed = rs_poll_rs(rs, entry->events & (EPOLLIN | EPOLLOUT),
+					   0, rs_is_cq_armed);
+			if (!revents)
+				revents = armed;
+		}
+
+		revents &= entry->events | EPOLLERR | EPOLLHUP;
+		if (revents) {
+			events[cnt].events = revents;
+			events[cnt++].data = entry->data;
+			if (entry->events & EPOLLONESHOT)
+				entry->events &= ~REPOLL_EVENTS;
+			else if (!(entry->events & EPOLLET) || !stable)
+				repoll_set_ready(rep, entry);
+		} else if (!stable) {
+			repoll_set_ready(rep, entry);
 		}
-		rfds[i].revents = 0;
 	}
-	return 0;
+	return cnt;
 }
 
-static int rs_poll_events(struct pollfd *rfds, struct pollfd *fds, nfds_t nfds)
+/*
+ * Convert the events returned by the kernel.  Events on normal fd's are
+ * reported to the caller in place.  Events on rsockets are consumed, and
+ * the rsocket added to the ready list.
+ */
+static int repoll_events(struct repoll *rep, struct epoll_event *events,
+			 int nevents)
 {
+	struct repoll_entry *entry;
+	struct epoll_event event;
 	struct rsocket *rs;
 	int i, cnt = 0;
 
-	for (i = 0; i < nfds; i++) {
-		rs = idm_lookup(&idm, fds[i].fd);
+	for (i = 0; i < nevents; i++) {
+		event = events[i];
+		if (event.data.fd == pollsignal)
+			continue;
+
+		entry = idm_lookup(&rep->entries, event.data.fd);
+		if (!entry)
+			continue;
+
+		if (!entry->rsocket) {
+			events[cnt].events = event.events;
+			events[cnt++].data = entry->data;
+			continue;
+		}
+
+		rs = idm_lookup(&idm, entry->fd);
 		if (rs) {
-			if (rfds[i].revents) {
-				fastlock_acquire(&rs->cq_wait_lock);
-				if (rs->type == SOCK_STREAM)
-					rs_get_cq_event(rs);
-				else
-					ds_get_cq_event(rs);
-				fastlock_release(&rs->cq_wait_lock);
-			}
-			fds[i].revents = rs_poll_rs(rs, fds[i].events, 1, rs_poll_all);
-		} else {
-			fds[i].revents = rfds[i].revents;
+			fastlock_acquire(&rs->cq_wait_lock);
+			if (rs->type == SOCK_DGRAM)
+				ds_get_cq_event(rs);
+			else if (rs->cm_id->recv_cq_channel &&
+				 entry->rfd == rs->cm_id->recv_cq_channel->fd)
+				rs_get_cq_event(rs);
+			fastlock_release(&rs->cq_wait_lock);
 		}
-		if (fds[i].revents)
-			cnt++;
+		if (entry->shared && rs && rs->scq)
+			repoll_scq_ready(rep, rs->scq);
+		else
+			repoll_set_ready(rep, entry);
 	}
 	return cnt;
 }
 
 /*
- * We need to poll *all* fd's that the user specifies at least once.
- * Note that we may receive events on an rsocket that may not be reported
- * to the user (e.g. connection events or credit updates).  Process those
- * events, then return to polling until we find ones of interest.
+ * If we block for wake_up_interval without seeing an event, recheck
+ * all rsockets.  This guards against missing events that were consumed
+ * outside of repoll, similar to rpoll.
  */
-int rpoll(struct pollfd *fds, nfds_t nfds, int timeout)
+static void repoll_rescan(struct repoll *rep)
 {
-	struct pollfd *rfds;
-	uint64_t start_time = 0;
-	uint32_t poll_time;
-	int pollsleep, ret;
+	struct repoll_entry *entry;
+	dlist_entry *cur;
 
-	do {
-		ret = rs_poll_check(fds, nfds);
-		if (ret || !timeout)
-			return ret;
+	for (cur = rep->rs_list.next; cur != &rep->rs_list; cur = cur->next) {
+		entry = container_of(cur, struct repoll_entry, entry);
+		repoll_set_ready(rep, entry);
+	}
+}
 
-		if (!start_time)
-			start_time = rs_time_us();
+int repoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout)
+{
+	struct repoll *rep;
+	uint64_t start_time;
+	int pollsleep, ret;
 
-		poll_time = (uint32_t) (rs_time_us() - start_time);
-	} while (poll_time <= polling_time);
+	rep = idm_lookup(&repoll_idm, epfd);
+	if (!rep)
+		return ERR(EBADF);
 
-	rfds = rs_fds_alloc(nfds);
-	if (!rfds)
-		return ERR(ENOMEM);
+	if (maxevents <= 0)
+		return ERR(EINVAL);
 
+	start_time = rs_time_us();
 	do {
-		ret = rs_poll_arm(rfds, fds, nfds);
-		if (ret)
-			break;
+		pthread_mutex_lock(&rep->lock);
+		ret = repoll_check(rep, events, maxevents);
+		pthread_mutex_unlock(&rep->lock);
+		if (ret || !timeout)
+			return ret;
 
 		if (rs_poll_enter())
 			continue;
 
 		if (timeout >= 0) {
-			timeout -= (int) ((rs_time_us() - start_time) / 1000);
-			if (timeout <= 0)
+			pollsleep = timeout -
+				    (int) ((rs_time_us() - start_time) / 1000);
+			if (pollsleep <= 0) {
+				rs_poll_exit();
 				return 0;
-			pollsleep = min(timeout, wake_up_interval);
+			}
+			pollsleep = min(pollsleep, wake_up_interval);
 		} else {
 			pollsleep = wake_up_interval;
 		}
 
-		ret = poll(rfds, nfds + 1, pollsleep);
+		ret = epoll_wait(rep->epfd, events, maxevents, pollsleep);
 		if (ret < 0) {
 			rs_poll_exit();
 			break;
 		}
 
-		ret = rs_poll_events(rfds, fds, nfds);
+		pthread_mutex_lock(&rep->lock);
+		if (!ret && pollsleep == wake_up_interval)
+			repoll_rescan(rep);
+		ret = repoll_events(rep, events, ret);
+		ret += repoll_check(rep, events + ret, maxevents - ret);
+		pthread_mutex_unlock(&rep->lock);
 		rs_poll_stop();
 	} while (!ret);
 
 	return ret;
 }
 
-static struct pollfd *
-rs_select_to_poll(int *nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds)
+/* Remove a closing rsocket from every repoll set holding it */
+static void repoll_remove_rs(struct rsocket *rs)
 {
-	struct pollfd *fds;
-	int fd, i = 0;
-
-	fds = calloc(*nfds, sizeof(*fds));
-	if (!fds)
-		return NULL;
+	struct repoll_entry *entry;
+	struct repoll *rep;
 
-	for (fd = 0; fd < *nfds; fd++) {
-		if (readfds && FD_ISSET(fd, readfds)) {
-			fds[i].fd = fd;
-			fds[i].events = POLLIN;
+	/* mut keeps repoll_close from freeing the sets */
+	pthread_mutex_lock(&mut);
+	for (;;) {
+		pthread_mutex_lock(&repoll_rs_lock);
+		if (dlist_empty(&rs->repoll_list)) {
+			pthread_mutex_unlock(&repoll_rs_lock);
+			break;
 		}
-
-		if (writefds && FD_ISSET(fd, writefds)) {
-			fds[i].fd = fd;
-			fds[i].events |= POLLOUT;
+		entry = container_of(rs->repoll_list.next, struct repoll_entry,
+				     rs_entry);
+		rep = entry->rep;
+		pthread_mutex_unlock(&repoll_rs_lock);
+
+		/* The entry may be deleted before we get the lock */
+		pthread_mutex_lock(&rep->lock);
+		entry = idm_lookup(&rep->entries, rs->index);
+		if (entry && entry->rsocket) {
+			repoll_del_fd(rep, entry);
+			repoll_free_entry(rep, entry);
 		}
-
-		if (exceptfds && FD_ISSET(fd, exceptfds))
-			fds[i].fd = fd;
-
-		if (fds[i].fd)
-			i++;
+		pthread_mutex_unlock(&rep->lock);
 	}
-
-	*nfds = i;
-	return fds;
+	pthread_mutex_unlock(&mut);
 }
 
-static int
-rs_poll_to_select(int nfds, struct pollfd *fds, fd_set *readfds,
-		  fd_set *writefds, fd_set *exceptfds)
+static int repoll_close(int epfd)
 {
-	int i, cnt = 0;
-
-	for (i = 0; i < nfds; i++) {
-		if (readfds && (fds[i].revents & (POLLIN | POLLHUP))) {
-			FD_SET(fds[i].fd, readfds);
-			cnt++;
-		}
-
-		if (writefds && (fds[i].revents & POLLOUT)) {
-			FD_SET(fds[i].fd, writefds);
-			cnt++;
-		}
+	struct repoll_entry *entry;
+	struct repoll *rep;
+	dlist_entry *cur;
 
-		if (exceptfds && (fds[i].revents & ~(POLLIN | POLLOUT))) {
-			FD_SET(fds[i].fd, exceptfds);
-			cnt++;
+	pthread_mutex_lock(&mut);
+	rep = idm_lookup(&repoll_idm, epfd);
+	if (rep) {
+		idm_clear(&repoll_idm, epfd);
+		pthread_mutex_lock(&rep->lock);
+		pthread_mutex_lock(&repoll_rs_lock);
+		for (cur = rep->rs_list.next; cur != &rep->rs_list;
+		     cur = cur->next) {
+			entry = container_of(cur, struct repoll_entry, entry);
+			dlist_remove(&entry->rs_entry);
 		}
+		pthread_mutex_unlock(&repoll_rs_lock);
+		pthread_mutex_unlock(&rep->lock);
 	}
-	return cnt;
-}
-
-static int rs_convert_timeout(struct timeval *timeout)
-{
-	return !timeout ? -1 :
-		timeout->tv_sec * 1000 + timeout->tv_usec / 1000;
-}
-
-int rselect(int nfds, fd_set *readfds, fd_set *writefds,
-	    fd_set *exceptfds, struct timeval *timeout)
-{
-	struct pollfd *fds;
-	int ret;
-
-	fds = rs_select_to_poll(&nfds, readfds, writefds, exceptfds);
-	if (!fds)
-		return ERR(ENOMEM);
-
-	ret = rpoll(fds, nfds, rs_convert_timeout(timeout));
-
-	if (readfds)
-		FD_ZERO(readfds);
-	if (writefds)
-		FD_ZERO(writefds);
-	if (exceptfds)
-		FD_ZERO(exceptfds);
-
-	if (ret > 0)
-		ret = rs_poll_to_select(nfds, fds, readfds, writefds, exceptfds);
+	pthread_mutex_unlock(&mut);
+	if (!rep)
+		return EBADF;
 
-	free(fds);
-	return ret;
+	idm_free(&rep->entries, free);
+	close(rep->epfd);
+	pthread_mutex_destroy(&rep->lock);
+	free(rep);
+	return 0;
 }
 
 /*
@@ -3532,8 +5976,16 @@ out:
 		/* Generate event by flushing receives to unblock rpoll */
 		ibv_req_notify_cq(rs->cm_id->recv_cq, 0);
 		ucma_shutdown(rs->cm_id);
+
+		/* Receives on the SRQ are not flushed, wake pollers directly */
+		if (rs->scq)
+			rs_poll_signal();
 	}
 
+	/* Threads blocked on the shared channel recheck the new state */
+	if (rs->scq)
+		rs_scq_wakeup(rs->scq);
+
 	return ret;
 }
 
@@ -3558,7 +6010,7 @@ int rclose(int socket)
 
 	rs = idm_lookup(&idm, socket);
 	if (!rs)
-		return EBADF;
+		return repoll_close(socket);
 	if (rs->type == SOCK_STREAM) {
 		if (rs->state & rs_connected)
 			rshutdown(socket, SHUT_RDWR);
@@ -3572,6 +6024,7 @@ int rclose(int socket)
 		ds_shutdown(rs);
 	}
 
+	repoll_remove_rs(rs);
 	rs_free(rs);
 	return 0;
 }
@@ -3647,6 +6100,35 @@ static int rs_set_keepalive(struct rsocket *rs, int on)
 	return ret;
 }
 
+/*
+ * Each counter is cleared under the lock that is held while updating it,
+ * so a concurrent send, receive or CQ poll does not lose the reset.
+ */
+static void rs_clear_stats(struct rsocket *rs)
+{
+	struct rsocket_stats *st = &rs->stats;
+
+	fastlock_acquire(&rs->slock);
+	st->tx_bytes = st->tx_writes = 0;
+	st->tx_inline = st->tx_copy = st->tx_direct = 0;
+	st->iomap_writes = 0;
+	st->credit_stalls = st->sbuf_stalls = st->sq_stalls = 0;
+	fastlock_release(&rs->slock);
+
+	fastlock_acquire(&rs->rlock);
+	st->rx_bytes = 0;
+	fastlock_release(&rs->rlock);
+
+	fastlock_acquire(&rs->cq_lock);
+	st->rx_writes = st->credit_updates = st->cq_arms = 0;
+	st->poll_spin_wakeups = st->poll_sleep_wakeups = 0;
+	fastlock_release(&rs->cq_lock);
+
+	fastlock_acquire(&rs->cq_wait_lock);
+	st->cq_events = 0;
+	fastlock_release(&rs->cq_wait_lock);
+}
+
 int rsetsockopt(int socket, int level, int optname,
 		const void *optval, socklen_t optlen)
 {
@@ -3682,13 +6164,17 @@ int rsetsockopt(int socket, int level, int optname,
 			break;
 		case SO_RCVBUF:
 			if ((rs->type == SOCK_STREAM && !rs->rbuf) ||
-			    (rs->type == SOCK_DGRAM && !rs->qp_list))
+			    (rs->type == SOCK_DGRAM && !rs->qp_list)) {
 				rs->rbuf_size = (*(uint32_t *) optval) << 1;
+				rs->opts &= ~RS_OPT_RBUF_AUTO;
+			}
 			ret = 0;
 			break;
 		case SO_SNDBUF:
-			if (!rs->sbuf)
+			if (!rs->sbuf) {
 				rs->sbuf_size = (*(uint32_t *) optval) << 1;
+				rs->opts &= ~RS_OPT_SBUF_AUTO;
+			}
 			if (rs->sbuf_size < RS_SNDLOWAT)
 				rs->sbuf_size = RS_SNDLOWAT << 1;
 			ret = 0;
@@ -3706,6 +6192,16 @@ int rsetsockopt(int socket, int level, int optname,
 			opt_on = *(int *) optval;
 			ret = 0;
 			break;
+		case SO_BUSY_POLL:
+			if (*(int *) optval < 0) {
+				ret = ERR(EINVAL);
+				break;
+			}
+			rs->poll_time = *(int *) optval;
+			rs->poll_policy = RDMA_POLL_DEFAULT;
+			opts = NULL;	/* no so_opts bit, see poll_time */
+			ret = 0;
+			break;
 		default:
 			break;
 		}
@@ -3753,7 +6249,8 @@ int rsetsockopt(int socket, int level, int optname,
 		}
 		break;
 	case SOL_RDMA:
-		if (rs->state >= rs_opening) {
+		if (rs->state >= rs_opening && optname != RDMA_ZCOPY_THRESHOLD &&
+		    optname != RDMA_POLL_POLICY && optname != RDMA_STATS) {
 			ret = ERR(EINVAL);
 			break;
 		}
@@ -3788,6 +6285,38 @@ int rsetsockopt(int socket, int level, int optname,
 				ret = ERR(ENOMEM);
 			}
 			break;
+		case RDMA_ZCOPY_THRESHOLD:
+			if (rs->type != SOCK_STREAM) {
+				ret = ERR(EINVAL);
+				break;
+			}
+			rs->zcopy_threshold = *(uint32_t *) optval;
+			ret = 0;
+			break;
+		case RDMA_SHARED_CQ:
+			if (rs->type != SOCK_STREAM) {
+				ret = ERR(EINVAL);
+				break;
+			}
+			if (*(int *) optval)
+				rs->opts |= RS_OPT_SHARED_CQ;
+			else
+				rs->opts &= ~RS_OPT_SHARED_CQ;
+			ret = 0;
+			break;
+		case RDMA_POLL_POLICY:
+			if (*(int *) optval < RDMA_POLL_DEFAULT ||
+			    *(int *) optval > RDMA_POLL_ADAPTIVE) {
+				ret = ERR(EINVAL);
+				break;
+			}
+			rs->poll_policy = *(int *) optval;
+			ret = 0;
+			break;
+		case RDMA_STATS:
+			rs_clear_stats(rs);
+			ret = 0;
+			break;
 		default:
 			break;
 		}
@@ -3835,6 +6364,7 @@ int rgetsockopt(int socket, int level, int optname,
 	void *opt;
 	struct ibv_sa_path_rec *path_rec;
 	struct ibv_path_data path_data;
+	struct rpoll_stats *stats;
 	socklen_t len;
 	int ret = 0;
 	int num_paths;
@@ -3859,6 +6389,10 @@ int rgetsockopt(int socket, int level, int optname,
 			*((int *) optval) = rs->sbuf_size;
 			*optlen = sizeof(int);
 			break;
+		case SO_BUSY_POLL:
+			*((int *) optval) = rs->poll_time;
+			*optlen = sizeof(int);
+			break;
 		case SO_LINGER:
 			/* Value is inverted so default so_opt = 0 is on */
 			((struct linger *) optval)->l_onoff =
@@ -3960,6 +6494,40 @@ int rgetsockopt(int socket, int level, int optname,
 				}
 			}
 			break;
+		case RDMA_ZCOPY_THRESHOLD:
+			*((int *) optval) = rs->zcopy_threshold;
+			*optlen = sizeof(int);
+			break;
+		case RDMA_SHARED_CQ:
+			*((int *) optval) = rs->type == SOCK_STREAM && rs->scq;
+			*optlen = sizeof(int);
+			break;
+		case RDMA_POLL_POLICY:
+			*((int *) optval) = rs->poll_policy;
+			*optlen = sizeof(int);
+			break;
+		case RDMA_POLL_STATS:
+			if (*optlen < sizeof(struct rpoll_stats)) {
+				ret = EINVAL;
+				break;
+			}
+			stats = optval;
+			fastlock_acquire(&rs->cq_lock);
+			stats->spin_wakeups = rs->stats.poll_spin_wakeups;
+			stats->sleep_wakeups = rs->stats.poll_sleep_wakeups;
+			stats->spin_budget = rs_poll_budget(rs);
+			stats->wait_avg = rs->poll_wait_avg;
+			fastlock_release(&rs->cq_lock);
+			*optlen = sizeof(struct rpoll_stats);
+			break;
+		case RDMA_STATS:
+			if (*optlen < sizeof(rs->stats)) {
+				ret = EINVAL;
+				break;
+			}
+			memcpy(optval, &rs->stats, sizeof(rs->stats));
+			*optlen = sizeof(rs->stats);
+			break;
 		default:
 			ret = ENOTSUP;
 			break;
@@ -3973,6 +6541,44 @@ int rgetsockopt(int socket, int level, int optname,
 	return rdma_seterrno(ret);
 }
 
+/*
+ * Writes one line of counters for each open rsocket to the given fd.
+ */
+int rstats_dump(int fd)
+{
+	struct rsocket_stats *st;
+	struct rsocket *rs;
+	int i, end, ret = 0;
+
+	pthread_mutex_lock(&mut);
+	end = idm_end(&idm);
+	for (i = 0; i < end && ret >= 0; i++) {
+		rs = idm_lookup(&idm, i);
+		if (!rs)
+			continue;
+
+		st = &rs->stats;
+		ret = dprintf(fd, "rsocket %d type %s state 0x%x "
+			"tx_bytes %" PRIu64 " rx_bytes %" PRIu64 " "
+			"tx_writes %" PRIu64 " rx_writes %" PRIu64 " "
+			"tx_inline %" PRIu64 " tx_copy %" PRIu64 " "
+			"tx_direct %" PRIu64 " iomap_writes %" PRIu64 " "
+			"credit_updates %" PRIu64 " credit_stalls %" PRIu64 " "
+			"sbuf_stalls %" PRIu64 " sq_stalls %" PRIu64 " "
+			"cq_arms %" PRIu64 " cq_events %" PRIu64 " "
+			"poll_spin_wakeups %" PRIu64 " poll_sleep_wakeups %" PRIu64
+			"\n", i, rs->type == SOCK_STREAM ? "stream" : "dgram",
+			rs->state, st->tx_bytes, st->rx_bytes, st->tx_writes,
+			st->rx_writes, st->tx_inline, st->tx_copy, st->tx_direct,
+			st->iomap_writes, st->credit_updates, st->credit_stalls,
+			st->sbuf_stalls, st->sq_stalls, st->cq_arms,
+			st->cq_events, st->poll_spin_wakeups,
+			st->poll_sleep_wakeups);
+	}
+	pthread_mutex_unlock(&mut);
+	return ret < 0 ? ret : 0;
+}
+
 int rfcntl(int socket, int cmd, ... /* arg */ )
 {
 	struct rsocket *rs;
@@ -4152,6 +6758,7 @@ size_t riowrite(int socket, const void *buf, size_t count, off_t offset, int fla
 		}
 
 		if (!rs_can_send(rs)) {
+			rs_send_stalled(rs);
 			ret = rs_get_comp(rs, rs_nonblocking(rs, flags),
 					  rs_conn_can_send);
 			if (ret)
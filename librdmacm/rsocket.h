@@ -39,6 +39,7 @@
 #include <errno.h>
 #include <poll.h>
 #include <sys/select.h>
+#include <sys/epoll.h>
 #include <sys/mman.h>
 
 #ifdef __cplusplus
@@ -70,6 +71,11 @@ int rpoll(struct pollfd *fds, nfds_t nfds, int timeout);
 int rselect(int nfds, fd_set *readfds, fd_set *writefds,
 	    fd_set *exceptfds, struct timeval *timeout);
 
+int repoll_create(int size);
+int repoll_create1(int flags);
+int repoll_ctl(int epfd, int op, int fd, struct epoll_event *event);
+int repoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout);
+
 int rgetpeername(int socket, struct sockaddr *addr, socklen_t *addrlen);
 int rgetsockname(int socket, struct sockaddr *addr, socklen_t *addrlen);
 
@@ -79,7 +85,48 @@ enum {
 	RDMA_RQSIZE,
 	RDMA_INLINE,
 	RDMA_IOMAPSIZE,
-	RDMA_ROUTE
+	RDMA_ROUTE,
+	RDMA_ZCOPY_THRESHOLD,
+	RDMA_SHARED_CQ,
+	RDMA_POLL_POLICY,
+	RDMA_POLL_STATS,
+	RDMA_STATS
+};
+
+/* RDMA_POLL_POLICY values */
+enum {
+	RDMA_POLL_DEFAULT,	/* spin for polling_time or SO_BUSY_POLL usec */
+	RDMA_POLL_BUSY,		/* spin until an event arrives or timeout */
+	RDMA_POLL_SLEEP,	/* block without spinning */
+	RDMA_POLL_ADAPTIVE	/* spin based on recent wait times */
+};
+
+/* RDMA_POLL_STATS */
+struct rpoll_stats {
+	uint64_t spin_wakeups;
+	uint64_t sleep_wakeups;
+	uint32_t spin_budget;	/* usec */
+	uint32_t wait_avg;	/* usec */
+};
+
+/* RDMA_STATS, counters are cleared by setting the option */
+struct rsocket_stats {
+	uint64_t tx_bytes;
+	uint64_t rx_bytes;
+	uint64_t tx_writes;		/* RDMA writes of data */
+	uint64_t rx_writes;
+	uint64_t tx_inline;		/* writes sent inline */
+	uint64_t tx_copy;		/* writes copied through the send buffer */
+	uint64_t tx_direct;		/* writes from user or iomapped memory */
+	uint64_t iomap_writes;
+	uint64_t credit_updates;	/* receive buffer space advertised */
+	uint64_t credit_stalls;		/* sends waiting on remote credits */
+	uint64_t sbuf_stalls;		/* sends waiting on send buffer space */
+	uint64_t sq_stalls;		/* sends waiting on send queue entries */
+	uint64_t cq_arms;
+	uint64_t cq_events;
+	uint64_t poll_spin_wakeups;
+	uint64_t poll_sleep_wakeups;
 };
 
 int rsetsockopt(int socket, int level, int optname,
@@ -88,10 +135,20 @@ int rgetsockopt(int socket, int level, int optname,
 		void *optval, socklen_t *optlen);
 int rfcntl(int socket, int cmd, ... /* arg */ );
 
+int rstats_dump(int fd);
+
 off_t riomap(int socket, void *buf, size_t len, int prot, int flags, off_t offset);
 int riounmap(int socket, void *buf, size_t len);
 size_t riowrite(int socket, const void *buf, size_t count, off_t offset, int flags);
 
+ssize_t rsendfile(int socket, int in_fd, off_t *offset, size_t count);
+
+struct mmsghdr;
+struct timespec;
+int rsendmmsg(int socket, struct mmsghdr *msgvec, unsigned int vlen, int flags);
+int rrecvmmsg(int socket, struct mmsghdr *msgvec, unsigned int vlen,
+	      int flags, struct timespec *timeout);
+
 #ifdef __cplusplus
 }
 #endif
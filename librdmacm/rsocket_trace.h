@@ -0,0 +1,143 @@
+/* SPDX-License-Identifier: GPL-2.0 OR Linux-OpenIB */
+
+#if defined(LTTNG_ENABLED)
+
+#undef LTTNG_UST_TRACEPOINT_PROVIDER
+#define LTTNG_UST_TRACEPOINT_PROVIDER rdma_core_rsocket
+
+#undef LTTNG_UST_TRACEPOINT_INCLUDE
+#define LTTNG_UST_TRACEPOINT_INCLUDE "rsocket_trace.h"
+
+#if !defined(__RSOCKET_TRACE_H__) || defined(LTTNG_UST_TRACEPOINT_HEADER_MULTI_READ)
+#define __RSOCKET_TRACE_H__
+
+#include <lttng/tracepoint.h>
+#include <stdint.h>
+
+/* An RDMA write of user data, kind is "inline", "copy" or "direct" */
+LTTNG_UST_TRACEPOINT_EVENT(
+	/* Tracepoint provider name */
+	rdma_core_rsocket,
+
+	/* Tracepoint name */
+	post_write,
+
+	/* Input arguments */
+	LTTNG_UST_TP_ARGS(
+		int, socket,
+		uint32_t, bytes,
+		int, nsge,
+		const char *, kind
+	),
+
+	/* Output event fields */
+	LTTNG_UST_TP_FIELDS(
+		lttng_ust_field_integer(int, socket, socket)
+		lttng_ust_field_integer(uint32_t, bytes, bytes)
+		lttng_ust_field_integer(int, nsge, nsge)
+		lttng_ust_field_string(kind, kind)
+	)
+)
+
+LTTNG_UST_TRACEPOINT_EVENT(
+	/* Tracepoint provider name */
+	rdma_core_rsocket,
+
+	/* Tracepoint name */
+	recv,
+
+	/* Input arguments */
+	LTTNG_UST_TP_ARGS(
+		int, socket,
+		uint32_t, bytes
+	),
+
+	/* Output event fields */
+	LTTNG_UST_TP_FIELDS(
+		lttng_ust_field_integer(int, socket, socket)
+		lttng_ust_field_integer(uint32_t, bytes, bytes)
+	)
+)
+
+/* A send could not proceed, reason is "credits", "sbuf" or "sq" */
+LTTNG_UST_TRACEPOINT_EVENT(
+	/* Tracepoint provider name */
+	rdma_core_rsocket,
+
+	/* Tracepoint name */
+	send_stall,
+
+	/* Input arguments */
+	LTTNG_UST_TP_ARGS(
+		int, socket,
+		const char *, reason
+	),
+
+	/* Output event fields */
+	LTTNG_UST_TP_FIELDS(
+		lttng_ust_field_integer(int, socket, socket)
+		lttng_ust_field_string(reason, reason)
+	)
+)
+
+LTTNG_UST_TRACEPOINT_EVENT(
+	/* Tracepoint provider name */
+	rdma_core_rsocket,
+
+	/* Tracepoint name */
+	send_credits,
+
+	/* Input arguments */
+	LTTNG_UST_TP_ARGS(
+		int, socket,
+		uint32_t, credits,
+		uint32_t, bytes
+	),
+
+	/* Output event fields */
+	LTTNG_UST_TP_FIELDS(
+		lttng_ust_field_integer(int, socket, socket)
+		lttng_ust_field_integer(uint32_t, credits, credits)
+		lttng_ust_field_integer(uint32_t, bytes, bytes)
+	)
+)
+
+/* A blocking call or rpoll found an event, after spinning or sleeping */
+LTTNG_UST_TRACEPOINT_EVENT(
+	/* Tracepoint provider name */
+	rdma_core_rsocket,
+
+	/* Tracepoint name */
+	wakeup,
+
+	/* Input arguments */
+	LTTNG_UST_TP_ARGS(
+		int, socket,
+		uint32_t, wait_us,
+		int, slept
+	),
+
+	/* Output event fields */
+	LTTNG_UST_TP_FIELDS(
+		lttng_ust_field_integer(int, socket, socket)
+		lttng_ust_field_integer(uint32_t, wait_us, wait_us)
+		lttng_ust_field_integer(int, slept, slept)
+	)
+)
+
+#define rdma_tracepoint(arg...) lttng_ust_tracepoint(arg)
+
+#endif /* __RSOCKET_TRACE_H__*/
+
+#include <lttng/tracepoint-event.h>
+
+#else
+
+#ifndef __RSOCKET_TRACE_H__
+#define __RSOCKET_TRACE_H__
+
+#define rdma_tracepoint(arg...)
+
+#endif /* __RSOCKET_TRACE_H__*/
+
+#endif /* defined(LTTNG_ENABLED) */
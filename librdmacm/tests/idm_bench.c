@@ -0,0 +1,202 @@
+// SPDX-License-Identifier: (GPL-2.0 OR Linux-OpenIB)
+/*
+ * Measures concurrent index map lookups, as done by rsend/rrecv/rpoll to
+ * find the rsocket for a socket number, from a list of thread counts.
+ * An optional writer thread sets and clears indexes meanwhile, standing
+ * in for sockets being opened and closed.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include "../indexer.h"
+
+#define MAX_THREAD_COUNTS 32
+
+static struct index_map idm;
+static int base;
+static int count = 60000;
+static unsigned long iters = 10000000;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static int go;
+static atomic_int stop;
+
+static uint64_t gettime_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void wait_go(void)
+{
+	pthread_mutex_lock(&lock);
+	while (!go)
+		pthread_cond_wait(&cond, &lock);
+	pthread_mutex_unlock(&lock);
+}
+
+static void *reader(void *arg)
+{
+	uint32_t x = (uintptr_t) arg * 2654435761U + 1;
+	unsigned long i, found = 0;
+
+	wait_go();
+	for (i = 0; i < iters; i++) {
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		found += idm_lookup(&idm, base + x % count) != NULL;
+	}
+	return (void *) found;
+}
+
+/* Cycles indexes through clear and set, always leaving most of them set */
+static void *writer(void *arg)
+{
+	int index = base;
+
+	wait_go();
+	while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+		idm_clear(&idm, index);
+		idm_set(&idm, index, &idm);
+		if (++index == base + count)
+			index = base;
+	}
+	return NULL;
+}
+
+static int run(unsigned int nthreads, int use_writer)
+{
+	pthread_t *threads, wthread;
+	uint64_t start, elapsed, ops;
+	unsigned int i, started;
+	int ret = 1;
+
+	threads = calloc(nthreads, sizeof(*threads));
+	if (!threads)
+		return 1;
+
+	go = 0;
+	atomic_store(&stop, 0);
+	for (started = 0; started < nthreads; started++)
+		if (pthread_create(&threads[started], NULL, reader,
+				   (void *) (uintptr_t) started))
+			break;
+	if (use_writer && pthread_create(&wthread, NULL, writer, NULL))
+		use_writer = 0;
+
+	pthread_mutex_lock(&lock);
+	go = 1;
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&lock);
+
+	start = gettime_ns();
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	elapsed = gettime_ns() - start;
+
+	if (use_writer) {
+		atomic_store(&stop, 1);
+		pthread_join(wthread, NULL);
+	}
+
+	if (started == nthreads) {
+		ops = (uint64_t) iters * nthreads;
+		printf("%7u %16.0f %10.2f\n", nthreads,
+		       ops * 1e9 / (elapsed ? elapsed : 1),
+		       (double) elapsed / iters);
+		ret = 0;
+	} else {
+		fprintf(stderr, "Couldn't create thread\n");
+	}
+	free(threads);
+	return ret;
+}
+
+static int parse_threads(char *str, unsigned int *counts)
+{
+	char *tok, *save, *end;
+	unsigned long val;
+	int num = 0;
+
+	for (tok = strtok_r(str, ",", &save); tok;
+	     tok = strtok_r(NULL, ",", &save)) {
+		val = strtoul(tok, &end, 0);
+		if (*end || !val || val > 4096 || num == MAX_THREAD_COUNTS)
+			return -1;
+		counts[num++] = val;
+	}
+	return num;
+}
+
+static void usage(const char *argv0)
+{
+	printf("Usage: %s [options]\n", argv0);
+	printf("\t[-b base]     first index to set (default 0)\n");
+	printf("\t[-n count]    number of indexes set (default 60000)\n");
+	printf("\t[-i iters]    lookups per thread (default 10000000)\n");
+	printf("\t[-t list]     comma separated thread counts (default 1,2,4,8)\n");
+	printf("\t[-w]          set and clear indexes from a writer thread\n");
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int counts[MAX_THREAD_COUNTS] = { 1, 2, 4, 8 };
+	int num_counts = 4, use_writer = 0;
+	int i, op, ret = 0;
+
+	while ((op = getopt(argc, argv, "b:n:i:t:w")) != -1) {
+		switch (op) {
+		case 'b':
+			base = atoi(optarg);
+			break;
+		case 'n':
+			count = atoi(optarg);
+			break;
+		case 'i':
+			iters = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			num_counts = parse_threads(optarg, counts);
+			if (num_counts <= 0) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'w':
+			use_writer = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (base < 0 || count <= 0 || count > IDM_MAX_INDEX - base || !iters) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (idm_set(&idm, base + i, &idm) < 0) {
+			perror("idm_set");
+			return 1;
+		}
+	}
+
+	printf("%7s %16s %10s\n", "threads", "lookups/sec", "ns/lookup");
+	for (i = 0; i < num_counts && !ret; i++)
+		ret = run(counts[i], use_writer);
+
+	idm_free(&idm, NULL);
+	return ret;
+}
@@ -645,6 +645,13 @@ cdef extern from 'infiniband/verbs.h':
         ibv_wq   **ind_tbl
         uint32_t comp_mask
 
+    cdef struct ibv_mr_cache
+
+    cdef struct ibv_mr_cache_init_attr:
+        uint32_t        comp_mask
+        unsigned int    access
+        size_t          max_bytes
+
     ibv_device **ibv_get_device_list(int *n)
     int ibv_get_device_index(ibv_device *device);
     void ibv_free_device_list(ibv_device **list)
@@ -669,6 +676,13 @@ cdef extern from 'infiniband/verbs.h':
     int ibv_rereg_mr(ibv_mr *mr, int flags, ibv_pd *pd, void *addr,
                      size_t length, int access)
     int ibv_dereg_mr(ibv_mr *mr)
+    ibv_mr_cache *ibv_create_mr_cache(ibv_pd *pd,
+                                      ibv_mr_cache_init_attr *attr)
+    int ibv_destroy_mr_cache(ibv_mr_cache *cache)
+    ibv_mr *ibv_mr_cache_get(ibv_mr_cache *cache, void *addr, size_t length)
+    int ibv_mr_cache_put(ibv_mr_cache *cache, ibv_mr *mr)
+    int ibv_mr_cache_invalidate(ibv_mr_cache *cache, void *addr,
+                                size_t length)
     int ibv_advise_mr(ibv_pd *pd, uint32_t advice, uint32_t flags,
                       ibv_sge *sg_list, uint32_t num_sge)
     ibv_mw *ibv_alloc_mw(ibv_pd *pd, ibv_mw_type type)
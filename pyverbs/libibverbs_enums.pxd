@@ -485,6 +485,9 @@ cdef extern from '<infiniband/verbs.h>':
         IBV_PARENT_DOMAIN_INIT_ATTR_ALLOCATORS
         IBV_PARENT_DOMAIN_INIT_ATTR_PD_CONTEXT
 
+    cpdef enum ibv_mr_cache_init_attr_mask:
+        IBV_MR_CACHE_INIT_ATTR_MAX_BYTES
+
     cdef void *IBV_ALLOCATOR_USE_DEFAULT
 
     cpdef enum ibv_gid_type:
@@ -39,3 +39,13 @@ cdef class DmaBufMR(MR):
     cdef object dmabuf
     cdef unsigned long offset
     cdef object is_dmabuf_internal
+
+cdef class MRCache(PyverbsCM):
+    cdef object pd
+    cdef v.ibv_mr_cache *cache
+    cdef object cached_mrs
+    cdef put(self, cmr)
+
+cdef class CachedMR(PyverbsCM):
+    cdef MRCache cache
+    cdef v.ibv_mr *mr
@@ -4,6 +4,7 @@
 
 import resource
 import logging
+import weakref
 
 from posix.mman cimport mmap, munmap, MAP_PRIVATE, PROT_READ, PROT_WRITE, \
     MAP_ANONYMOUS, MAP_HUGETLB, MAP_SHARED
@@ -12,6 +13,7 @@ from pyverbs.pyverbs_error import PyverbsError, PyverbsRDMAError, \
 from libc.stdint cimport uintptr_t, SIZE_MAX
 from pyverbs.utils import rereg_error_to_str
 from pyverbs.base import PyverbsRDMAErrno
+from pyverbs.base cimport close_weakrefs
 from posix.stdlib cimport posix_memalign
 from libc.string cimport memcpy, memset
 cimport pyverbs.libibverbs_enums as e
@@ -490,6 +492,138 @@ cdef class DmaBufMR(MR):
         return res
 
 
+cdef class MRCache(PyverbsCM):
+    """
+    MRCache class represents ibv_mr_cache, a registration cache on a PD.
+    MRs are taken from the cache with get() and released by closing the
+    returned CachedMR object.
+    """
+    def __init__(self, PD pd not None, access=0, max_bytes=None):
+        """
+        Creates a memory registration cache on the given PD.
+        :param pd: A PD object
+        :param access: Access flags of every cached MR, see ibv_access_flags
+        :param max_bytes: Budget of registered bytes (Optional). Idle MRs are
+                          evicted in LRU order once the budget is exceeded.
+        :return: None
+        """
+        super().__init__()
+        cdef v.ibv_mr_cache_init_attr attr
+        memset(&attr, 0, sizeof(attr))
+        attr.access = access
+        if max_bytes is not None:
+            attr.comp_mask = e.IBV_MR_CACHE_INIT_ATTR_MAX_BYTES
+            attr.max_bytes = max_bytes
+        self.cache = v.ibv_create_mr_cache(pd.pd, &attr)
+        if self.cache == NULL:
+            raise PyverbsRDMAErrno('Failed to create MR cache')
+        self.pd = pd
+        self.cached_mrs = weakref.WeakSet()
+        pd.add_ref(self)
+        self.logger.debug(f'Created MR cache, access flags {access}')
+
+    def __dealloc__(self):
+        self.close()
+
+    cpdef close(self):
+        """
+        Releases the outstanding cached MRs and destroys the underlying C
+        MR cache.
+        :return: None
+        """
+        if self.cache != NULL:
+            if self.logger:
+                self.logger.debug('Closing MR cache')
+            close_weakrefs([self.cached_mrs])
+            rc = v.ibv_destroy_mr_cache(self.cache)
+            if rc != 0:
+                raise PyverbsRDMAError('Failed to destroy MR cache', rc)
+            self.cache = NULL
+            self.pd = None
+
+    def get(self, address, length):
+        """
+        Gets a cached MR covering [address, address + length). The MR may be
+        larger than the requested range.
+        :param address: Start address of the range
+        :param length: Length of the range
+        :return: A CachedMR object, which must be closed to release the MR
+        """
+        return CachedMR(self, address, length)
+
+    def invalidate(self, address, length):
+        """
+        Drops the cached MRs overlapping [address, address + length). MRs that
+        are still in use are deregistered once they are released.
+        :param address: Start address of the range
+        :param length: Length of the range
+        :return: None
+        """
+        rc = v.ibv_mr_cache_invalidate(self.cache, <void*><uintptr_t>address,
+                                       length)
+        if rc != 0:
+            raise PyverbsRDMAError('Failed to invalidate MR cache range', rc)
+
+    cdef put(self, cmr):
+        rc = v.ibv_mr_cache_put(self.cache, (<CachedMR>cmr).mr)
+        if rc != 0:
+            raise PyverbsRDMAError('Failed to put a cached MR', rc)
+        self.cached_mrs.discard(cmr)
+
+
+cdef class CachedMR(PyverbsCM):
+    """
+    CachedMR represents an ibv_mr taken from an MRCache. Closing it returns
+    the MR to the cache.
+    """
+    def __init__(self, MRCache cache not None, address, length):
+        """
+        Gets an MR covering [address, address + length) from the given cache.
+        :param cache: The MRCache to take the MR from
+        :param address: Start address of the range
+        :param length: Length of the range
+        :return: None
+        """
+        super().__init__()
+        self.mr = v.ibv_mr_cache_get(cache.cache, <void*><uintptr_t>address,
+                                     length)
+        if self.mr == NULL:
+            raise PyverbsRDMAErrno(f'Failed to get a cached MR. length: {length}')
+        self.cache = cache
+        cache.cached_mrs.add(self)
+
+    def __dealloc__(self):
+        self.close()
+
+    cpdef close(self):
+        """
+        Returns the MR to its cache.
+        :return: None
+        """
+        if self.mr != NULL:
+            if self.logger:
+                self.logger.debug('Putting cached MR')
+            self.cache.put(self)
+            self.mr = NULL
+            self.cache = None
+
+    @property
+    def addr(self):
+        return <uintptr_t>self.mr.addr
+
+    @property
+    def length(self):
+        return self.mr.length
+
+    @property
+    def lkey(self):
+        return self.mr.lkey
+
+    @property
+    def rkey(self):
+        return self.mr.rkey
+
+
 def mwtype2str(mw_type):
     mw_types = {1:'IBV_MW_TYPE_1', 2:'IBV_MW_TYPE_2'}
     try:
@@ -15,7 +15,7 @@ from pyverbs.base cimport close_weakrefs
 from pyverbs.wr cimport copy_sg_array
 from pyverbs.device cimport Context
 from pyverbs.cmid cimport CMID
-from .mr cimport MR, MW, DMMR
+from .mr cimport MR, MW, DMMR, MRCache
 from pyverbs.srq cimport SRQ
 from pyverbs.addr cimport AH
 from pyverbs.cq cimport CQEX
@@ -122,7 +122,8 @@ cdef class PD(PyverbsCM):
             self.ctx = None
 
     cdef add_ref(self, obj):
-        if isinstance(obj, MR) or isinstance(obj, DMMR):
+        if isinstance(obj, MR) or isinstance(obj, DMMR) or \
+           isinstance(obj, MRCache):
             self.mrs.add(obj)
         elif isinstance(obj, MW):
             self.mws.add(obj)
@@ -795,6 +795,8 @@ done
 %{_mandir}/man8/ibcacheedit*
 %{_sbindir}/ibccquery
 %{_mandir}/man8/ibccquery*
+%{_sbindir}/ibdiagd
+%{_mandir}/man8/ibdiagd*
 %{_sbindir}/ibccconfig
 %{_mandir}/man8/ibccconfig*
 %{_sbindir}/dump_fts
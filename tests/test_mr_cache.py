@@ -0,0 +1,98 @@
+# SPDX-License-Identifier: (GPL-2.0 OR Linux-OpenIB)
+"""
+Test module for pyverbs' MR cache.
+"""
+import resource
+
+from pyverbs.libibverbs_enums import ibv_access_flags
+from pyverbs.mem_alloc import posix_memalign, free
+from tests.base import PyverbsAPITestCase
+from pyverbs.mr import MRCache
+from pyverbs.pd import PD
+
+
+class MRCacheTest(PyverbsAPITestCase):
+    """
+    Test the lookup, merge, eviction and invalidation of the MR cache.
+    """
+    def setUp(self):
+        super().setUp()
+        self.page_size = resource.getpagesize()
+        self.buf_len = 8 * self.page_size
+        self.buf = posix_memalign(self.buf_len, self.page_size)
+        self.pd = PD(self.ctx)
+
+    def tearDown(self):
+        self.pd.close()
+        free(self.buf)
+        super().tearDown()
+
+    def create_cache(self, max_bytes=None):
+        return MRCache(self.pd, ibv_access_flags.IBV_ACCESS_LOCAL_WRITE,
+                       max_bytes)
+
+    def test_mr_cache_hit(self):
+        """
+        Get a range contained in a cached MR and verify that the same MR is
+        returned.
+        """
+        with self.create_cache() as cache:
+            mr1 = cache.get(self.buf, self.page_size)
+            mr2 = cache.get(self.buf + 100, 200)
+            self.assertEqual(mr1.lkey, mr2.lkey)
+            self.assertEqual(mr1.addr, mr2.addr)
+            self.assertEqual(mr1.length, mr2.length)
+            mr2.close()
+            mr1.close()
+            with cache.get(self.buf + self.page_size - 1, 1) as mr3:
+                self.assertEqual(mr3.addr, self.buf)
+                self.assertEqual(mr3.length, self.page_size)
+
+    def test_mr_cache_merge(self):
+        """
+        Get ranges overlapping and adjacent to cached MRs and verify that a
+        single MR covering their union is registered.
+        """
+        p = self.page_size
+        with self.create_cache() as cache:
+            cache.get(self.buf, 2 * p).close()
+            mr = cache.get(self.buf + p, 2 * p)
+            self.assertEqual(mr.addr, self.buf)
+            self.assertEqual(mr.length, 3 * p)
+            with cache.get(self.buf, p) as hit:
+                self.assertEqual(hit.lkey, mr.lkey)
+            mr.close()
+
+            cache.get(self.buf + 4 * p, p).close()
+            with cache.get(self.buf + 5 * p, p) as adj:
+                self.assertEqual(adj.addr, self.buf + 4 * p)
+                self.assertEqual(adj.length, 2 * p)
+
+    def test_mr_cache_lru_eviction(self):
+        """
+        Exceed the cache budget and verify that the least recently used idle
+        MR is evicted while the others stay cached.
+        """
+        p = self.page_size
+        with self.create_cache(max_bytes=3 * p) as cache:
+            for off in [0, 2 * p, 4 * p, 6 * p]:
+                cache.get(self.buf + off, p).close()
+            # [0, p) was evicted, so only [2p, 3p) is merged with [p, 2p)
+            with cache.get(self.buf + p, p) as mr:
+                self.assertEqual(mr.addr, self.buf + p)
+                self.assertEqual(mr.length, 2 * p)
+
+    def test_mr_cache_put_stale(self):
+        """
+        Invalidate a range while its MR is in use, verify that a new MR is
+        registered for it and that the old one can still be put.
+        """
+        with self.create_cache() as cache:
+            old = cache.get(self.buf, self.page_size)
+            cache.invalidate(self.buf, self.buf_len)
+            new = cache.get(self.buf, self.page_size)
+            self.assertNotEqual(old.lkey, new.lkey)
+            old.close()
+            with cache.get(self.buf, self.page_size) as hit:
+                self.assertEqual(hit.lkey, new.lkey)
+            new.close()